@@ -28,9 +28,14 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #endif
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "config.h"
 #include "monitor.h"
 #include "sysemu.h"
+#include "cpus.h"
 #include "arch_init.h"
 #include "audio/audio.h"
 #include "hw/pc.h"
@@ -38,6 +43,12 @@
 #include "hw/audiodev.h"
 #include "kvm.h"
 #include "migration.h"
+#include "bitmap.h"
+#include "page_cache.h"
+#include "xbzrle.h"
+#include "qemu-thread.h"
+#include "postcopy-ram.h"
+#include "multifd-ram.h"
 #include "net.h"
 #include "gdbstub.h"
 #include "hw/smbios.h"
@@ -91,15 +102,56 @@ const uint32_t arch_type = QEMU_ARCH;
 #define RAM_SAVE_FLAG_PAGE     0x08
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
+#define RAM_SAVE_FLAG_XBZRLE   0x40
+#define RAM_SAVE_FLAG_COMPRESS_PAGE 0x80
+#define RAM_SAVE_FLAG_POSTCOPY 0x100
+#define RAM_SAVE_FLAG_MULTIFD  0x200  /* targets have 1k pages at least */
+
+/* Ends the ranges that follow RAM_SAVE_FLAG_POSTCOPY */
+#define POSTCOPY_DISCARD_END   0xffffffff
+
+/* Pages sent in one go after the switch, between looking for requests */
+#define POSTCOPY_BATCH_PAGES   64
+
+/* How an RAM_SAVE_FLAG_XBZRLE page is encoded */
+#define ENCODING_FLAG_XBZRLE   0x1
+
+/*
+ * Pages are compared with a byte value a vector at a time.  The
+ * differences are gathered over a cache line before they are looked at,
+ * which keeps the loop free of branches for most of the page.
+ */
+#ifdef __SSE2__
+#define VECTYPE             __m128i
+#define VEC_SPLAT(ch)       _mm_set1_epi8(ch)
+#define VEC_DIFF(v1, v2)    _mm_xor_si128(v1, v2)
+#define VEC_OR(v1, v2)      _mm_or_si128(v1, v2)
+#define VEC_IS_ZERO(v)      \
+    (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) == 0xffff)
+#else
+#define VECTYPE             unsigned long
+#define VEC_SPLAT(ch)       ((ch) * (~0UL / 0xff))
+#define VEC_DIFF(v1, v2)    ((v1) ^ (v2))
+#define VEC_OR(v1, v2)      ((v1) | (v2))
+#define VEC_IS_ZERO(v)      ((v) == 0)
+#endif
+
+#define VECS_PER_LINE       (64 / sizeof(VECTYPE))
 
+/* Returns 1 if every byte of the page is ch */
 static int is_dup_page(uint8_t *page, uint8_t ch)
 {
-    uint32_t val = ch << 24 | ch << 16 | ch << 8 | ch;
-    uint32_t *array = (uint32_t *)page;
-    int i;
+    VECTYPE *p = (VECTYPE *)page;
+    VECTYPE val = VEC_SPLAT(ch);
+    int i, j;
+
+    for (i = 0; i < TARGET_PAGE_SIZE / sizeof(VECTYPE); i += VECS_PER_LINE) {
+        VECTYPE diff = VEC_DIFF(p[i], val);
 
-    for (i = 0; i < (TARGET_PAGE_SIZE / 4); i++) {
-        if (array[i] != val) {
+        for (j = 1; j < VECS_PER_LINE; j++) {
+            diff = VEC_OR(diff, VEC_DIFF(p[i + j], val));
+        }
+        if (!VEC_IS_ZERO(diff)) {
             return 0;
         }
     }
@@ -107,96 +159,634 @@ static int is_dup_page(uint8_t *page, uint8_t ch)
     return 1;
 }
 
-static RAMBlock *last_block;
-static ram_addr_t last_offset;
+/*
+ * The pages that still need to be sent are tracked in a bitmap of our own,
+ * indexed by ram_addr_t like the dirty memory bitmap.  That way, the pages
+ * can be looked up and sent without holding the global mutex, which is
+ * only taken to move newly dirtied pages over.
+ */
+static unsigned long *migration_bitmap;
+static unsigned long migration_bitmap_pages;
+static uint64_t migration_dirty_pages;
 
-static int ram_save_block(QEMUFile *f)
+/* The RAM blocks sorted by offset, ram_list may be reordered meanwhile */
+static RAMBlock **migration_blocks;
+static int nr_migration_blocks;
+
+static int last_block;
+static unsigned long last_page;
+
+/* The block of the page that was last written to the stream */
+static RAMBlock *last_sent_block;
+
+/* Whether this is the first pass over RAM, where every page is sent */
+static int ram_bulk_stage;
+
+/* Pages that were put to the stream without copying them */
+static uint64_t zero_copy_pages;
+
+uint64_t ram_zero_copy_pages(void)
 {
-    RAMBlock *block = last_block;
-    ram_addr_t offset = last_offset;
-    ram_addr_t current_addr;
-    int bytes_sent = 0;
+    return zero_copy_pages;
+}
 
-    if (!block)
-        block = QLIST_FIRST(&ram_list.blocks);
+/*
+ * With the xbzrle capability, the pages that are sent after the first pass
+ * are kept in a cache, so that only what changed in them has to be sent
+ * when they are dirtied again.
+ */
+static struct {
+    PageCache *cache;
+    uint8_t *current_buf;
+    uint8_t *encoded_buf;
+    uint64_t bytes;
+    uint64_t pages;
+    uint64_t cache_miss;
+    uint64_t overflow;
+} XBZRLE;
+
+static int64_t xbzrle_cache_size = 64 << 20;
+
+int64_t xbzrle_cache_resize(int64_t new_size)
+{
+    int64_t pages = 1;
 
-    current_addr = block->offset + offset;
+    if (new_size < TARGET_PAGE_SIZE) {
+        return -1;
+    }
+    while (pages <= new_size / TARGET_PAGE_SIZE / 2) {
+        pages *= 2;
+    }
 
-    do {
-        if (cpu_physical_memory_get_dirty(current_addr, MIGRATION_DIRTY_FLAG)) {
-            uint8_t *p;
-            int cont = (block == last_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
-
-            cpu_physical_memory_reset_dirty(current_addr,
-                                            current_addr + TARGET_PAGE_SIZE,
-                                            MIGRATION_DIRTY_FLAG);
-
-            p = block->host + offset;
-
-            if (is_dup_page(p, *p)) {
-                qemu_put_be64(f, offset | cont | RAM_SAVE_FLAG_COMPRESS);
-                if (!cont) {
-                    qemu_put_byte(f, strlen(block->idstr));
-                    qemu_put_buffer(f, (uint8_t *)block->idstr,
-                                    strlen(block->idstr));
-                }
-                qemu_put_byte(f, *p);
-                bytes_sent = 1;
-            } else {
-                qemu_put_be64(f, offset | cont | RAM_SAVE_FLAG_PAGE);
-                if (!cont) {
-                    qemu_put_byte(f, strlen(block->idstr));
-                    qemu_put_buffer(f, (uint8_t *)block->idstr,
-                                    strlen(block->idstr));
-                }
-                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-                bytes_sent = TARGET_PAGE_SIZE;
-            }
+    /* A running migration picks the new size up when it iterates next */
+    xbzrle_cache_size = pages * TARGET_PAGE_SIZE;
+    return xbzrle_cache_size;
+}
+
+int64_t xbzrle_get_cache_size(void)
+{
+    return xbzrle_cache_size;
+}
+
+uint64_t xbzrle_mig_bytes_transferred(void)
+{
+    return XBZRLE.bytes;
+}
+
+uint64_t xbzrle_mig_pages_transferred(void)
+{
+    return XBZRLE.pages;
+}
+
+uint64_t xbzrle_mig_pages_cache_miss(void)
+{
+    return XBZRLE.cache_miss;
+}
+
+uint64_t xbzrle_mig_pages_overflow(void)
+{
+    return XBZRLE.overflow;
+}
+
+static void ram_put_header(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                           int flags)
+{
+    if (block == last_sent_block) {
+        qemu_put_be64(f, offset | flags | RAM_SAVE_FLAG_CONTINUE);
+        return;
+    }
+
+    qemu_put_be64(f, offset | flags);
+    qemu_put_byte(f, strlen(block->idstr));
+    qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+    last_sent_block = block;
+}
+
+/*
+ * With the compress capability, pages are deflated by a pool of threads.
+ * The threads are handed pages in turn and each one works on a single page
+ * at a time, so writing out their results in the same turn keeps the
+ * compressed pages in the order in which they were picked.
+ */
+typedef struct CompressParam {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    z_stream stream;
+    uint8_t *page;
+    uint8_t *buf;
+
+    /* Protected by mutex */
+    int busy;           /* page was handed over and not written out yet */
+    int done;           /* buf holds the result */
+    int quit;
+    RAMBlock *block;
+    ram_addr_t offset;
+    int len;            /* compressed size, -1 if page must be sent as is */
+} CompressParam;
+
+static CompressParam *comp_param;
+static int comp_threads;
+static int comp_next;
+static uint64_t comp_pages;
+static uint64_t comp_bytes;
+
+uint64_t compress_mig_pages_transferred(void)
+{
+    return comp_pages;
+}
 
+uint64_t compress_mig_bytes_transferred(void)
+{
+    return comp_bytes;
+}
+
+/* Returns the compressed size, or -1 if it isn't smaller than a page */
+static int compress_page_buffer(z_stream *stream, uint8_t *dst,
+                                const uint8_t *src)
+{
+    if (deflateReset(stream) != Z_OK) {
+        return -1;
+    }
+
+    stream->next_in = (Bytef *)src;
+    stream->avail_in = TARGET_PAGE_SIZE;
+    stream->next_out = dst;
+    stream->avail_out = TARGET_PAGE_SIZE;
+
+    if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    return stream->total_out;
+}
+
+static void *compress_thread(void *opaque)
+{
+    CompressParam *p = opaque;
+    int len;
+
+    qemu_mutex_lock(&p->mutex);
+    for (;;) {
+        while (!p->quit && (!p->busy || p->done)) {
+            qemu_cond_wait(&p->cond, &p->mutex);
+        }
+        if (p->quit) {
             break;
         }
+        qemu_mutex_unlock(&p->mutex);
+
+        len = compress_page_buffer(&p->stream, p->buf, p->page);
 
-        offset += TARGET_PAGE_SIZE;
-        if (offset >= block->length) {
-            offset = 0;
-            block = QLIST_NEXT(block, next);
-            if (!block)
-                block = QLIST_FIRST(&ram_list.blocks);
+        qemu_mutex_lock(&p->mutex);
+        p->len = len;
+        p->done = 1;
+        qemu_cond_signal(&p->cond);
+    }
+    qemu_mutex_unlock(&p->mutex);
+
+    return NULL;
+}
+
+static int compress_threads_init(void)
+{
+    int i;
+
+    comp_threads = migrate_compress_threads();
+    comp_next = 0;
+    comp_pages = 0;
+    comp_bytes = 0;
+    comp_param = qemu_mallocz(comp_threads * sizeof(*comp_param));
+
+    for (i = 0; i < comp_threads; i++) {
+        CompressParam *p = &comp_param[i];
+
+        if (deflateInit(&p->stream, migrate_compress_level()) != Z_OK) {
+            fprintf(stderr, "Failed to initialize page compression\n");
+            comp_threads = i;
+            return -1;
         }
+        p->page = qemu_malloc(TARGET_PAGE_SIZE);
+        p->buf = qemu_malloc(TARGET_PAGE_SIZE);
+        qemu_mutex_init(&p->mutex);
+        qemu_cond_init(&p->cond);
+        qemu_thread_create(&p->thread, compress_thread, p);
+    }
+    return 0;
+}
+
+static void compress_threads_fini(void)
+{
+    int i;
+
+    for (i = 0; i < comp_threads; i++) {
+        CompressParam *p = &comp_param[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = 1;
+        qemu_cond_signal(&p->cond);
+        qemu_mutex_unlock(&p->mutex);
+        qemu_thread_join(&p->thread);
+
+        qemu_cond_destroy(&p->cond);
+        qemu_mutex_destroy(&p->mutex);
+        deflateEnd(&p->stream);
+        qemu_free(p->page);
+        qemu_free(p->buf);
+    }
+
+    qemu_free(comp_param);
+    comp_param = NULL;
+    comp_threads = 0;
+}
+
+/* Writes out the page that p was handed last, returns the bytes sent */
+static int compress_flush_one(QEMUFile *f, CompressParam *p)
+{
+    int bytes_sent;
+
+    qemu_mutex_lock(&p->mutex);
+    while (p->busy && !p->done) {
+        qemu_cond_wait(&p->cond, &p->mutex);
+    }
+    qemu_mutex_unlock(&p->mutex);
 
-        current_addr = block->offset + offset;
+    /* The thread leaves the page alone until it is handed the next one */
+    if (!p->busy) {
+        return 0;
+    }
 
-    } while (current_addr != last_block->offset + last_offset);
+    if (p->len < 0) {
+        ram_put_header(f, p->block, p->offset, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, p->page, TARGET_PAGE_SIZE);
+        bytes_sent = TARGET_PAGE_SIZE;
+    } else {
+        ram_put_header(f, p->block, p->offset, RAM_SAVE_FLAG_COMPRESS_PAGE);
+        qemu_put_be32(f, p->len);
+        qemu_put_buffer(f, p->buf, p->len);
+        comp_pages++;
+        comp_bytes += p->len;
+        bytes_sent = p->len;
+    }
 
-    last_block = block;
-    last_offset = offset;
+    qemu_mutex_lock(&p->mutex);
+    p->busy = 0;
+    p->done = 0;
+    qemu_mutex_unlock(&p->mutex);
+
+    return bytes_sent;
+}
+
+/* Writes out all compressed pages, in the order in which they were picked */
+static int compress_flush_all(QEMUFile *f)
+{
+    int i, bytes_sent = 0;
+
+    for (i = 0; i < comp_threads; i++) {
+        bytes_sent += compress_flush_one(f, &comp_param[comp_next]);
+        comp_next = (comp_next + 1) % comp_threads;
+    }
+    return bytes_sent;
+}
+
+/*
+ * Hands a copy of the page to the next compression thread, after writing
+ * out what that thread compressed before.  Returns the bytes sent.
+ */
+static int compress_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                         const uint8_t *src)
+{
+    CompressParam *p = &comp_param[comp_next];
+    int bytes_sent;
+
+    comp_next = (comp_next + 1) % comp_threads;
+    bytes_sent = compress_flush_one(f, p);
+
+    memcpy(p->page, src, TARGET_PAGE_SIZE);
+
+    qemu_mutex_lock(&p->mutex);
+    p->block = block;
+    p->offset = offset;
+    p->busy = 1;
+    qemu_cond_signal(&p->cond);
+    qemu_mutex_unlock(&p->mutex);
+
+    return bytes_sent;
+}
+
+/*
+ * Sends the page as a delta to its cached copy.  Returns the number of bytes
+ * sent, which is 0 if the page didn't change, or -1 if the page must be sent
+ * in full from XBZRLE.current_buf.
+ */
+static int save_xbzrle_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
+{
+    ram_addr_t addr = block->offset + offset;
+    uint8_t *cached;
+    int encoded_len;
+
+    /* The guest may write to the page meanwhile, work on a copy */
+    memcpy(XBZRLE.current_buf, block->host + offset, TARGET_PAGE_SIZE);
+
+    cached = page_cache_lookup(XBZRLE.cache, addr);
+    if (!cached) {
+        XBZRLE.cache_miss++;
+        page_cache_insert(XBZRLE.cache, addr, XBZRLE.current_buf);
+        return -1;
+    }
+
+    encoded_len = xbzrle_encode_buffer(cached, XBZRLE.current_buf,
+                                       TARGET_PAGE_SIZE, XBZRLE.encoded_buf,
+                                       TARGET_PAGE_SIZE);
+    memcpy(cached, XBZRLE.current_buf, TARGET_PAGE_SIZE);
+    if (encoded_len < 0) {
+        XBZRLE.overflow++;
+        return -1;
+    } else if (encoded_len == 0) {
+        return 0;
+    }
+
+    ram_put_header(f, block, offset, RAM_SAVE_FLAG_XBZRLE);
+    qemu_put_byte(f, ENCODING_FLAG_XBZRLE);
+    qemu_put_be16(f, encoded_len);
+    qemu_put_buffer(f, XBZRLE.encoded_buf, encoded_len);
+
+    XBZRLE.pages++;
+    XBZRLE.bytes += encoded_len;
+    return encoded_len;
+}
+
+static int ram_save_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
+{
+    uint8_t *p = block->host + offset;
+    int bytes_sent, ret;
+    uint8_t ch;
+
+    /*
+     * The guest may be writing to the page, so read the byte that we send
+     * only once and check the page against it.
+     */
+    ch = *p;
+    if (is_dup_page(p, ch)) {
+        if (XBZRLE.cache) {
+            /* The cached copy must stay what the destination has */
+            uint8_t *cached = page_cache_lookup(XBZRLE.cache,
+                                                block->offset + offset);
+            if (cached) {
+                memset(cached, ch, TARGET_PAGE_SIZE);
+            }
+        }
+
+        ram_put_header(f, block, offset, RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, ch);
+        return 1;
+    }
+
+    if (XBZRLE.cache && !ram_bulk_stage) {
+        bytes_sent = save_xbzrle_page(f, block, offset);
+        if (bytes_sent >= 0) {
+            return bytes_sent;
+        }
+        /* Send what went into the cache */
+        p = XBZRLE.current_buf;
+    }
+
+    if (comp_param) {
+        return compress_page(f, block, offset, p);
+    }
+
+    if (multifd_send_active() && p == block->host + offset) {
+        /* Only ram_save_block() sends pages with multifd, block is current */
+        ret = multifd_send_page(last_block, offset, p);
+        if (ret < 0) {
+            qemu_file_set_error(f);
+        }
+        if (ret != 0) {
+            qemu_file_credit_transfer(f, TARGET_PAGE_SIZE);
+            return TARGET_PAGE_SIZE;
+        }
+    }
+
+    ram_put_header(f, block, offset, RAM_SAVE_FLAG_PAGE);
+    if (p == block->host + offset) {
+        /*
+         * Should the guest change the page before it is actually sent, it
+         * is dirty and will be sent again anyway.  What went into the
+         * XBZRLE cache must be what is sent, so it is copied.
+         */
+        qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+        zero_copy_pages++;
+    } else {
+        qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+    }
+    return TARGET_PAGE_SIZE;
+}
+
+static int ram_save_block(QEMUFile *f)
+{
+    RAMBlock *block = migration_blocks[last_block];
+    unsigned long page;
+    ram_addr_t addr;
+    int bytes_sent;
+
+    do {
+        if (migration_dirty_pages == 0) {
+            return 0;
+        }
+
+        /* Carry on after the last page that was sent, wrapping around */
+        page = find_next_bit(migration_bitmap, migration_bitmap_pages,
+                             last_page);
+        if (page >= migration_bitmap_pages) {
+            page = find_next_bit(migration_bitmap, migration_bitmap_pages, 0);
+            ram_bulk_stage = 0;
+        }
+        addr = (ram_addr_t)page << TARGET_PAGE_BITS;
+        while (addr < block->offset || addr >= block->offset + block->length) {
+            last_block = (last_block + 1) % nr_migration_blocks;
+            block = migration_blocks[last_block];
+        }
+
+        clear_bit(page, migration_bitmap);
+        migration_dirty_pages--;
+        last_page = page;
+
+        bytes_sent = ram_save_page(f, block, addr - block->offset);
+    } while (bytes_sent == 0); /* unchanged or queued pages aren't sent yet */
 
     return bytes_sent;
 }
 
 static uint64_t bytes_transferred;
 
-static ram_addr_t ram_save_remaining(void)
+/*
+ * With the auto-converge capability, the guest is measured over periods of
+ * at least a second.  If it dirties more than half of what could be sent
+ * in two periods, its vCPUs are throttled, and more so every two periods
+ * that this is still the case.
+ */
+static int64_t period_start;
+static uint64_t period_dirty_pages;
+static uint64_t period_bytes_transferred;
+static int dirty_rate_high_cnt;
+
+static void migration_throttle_reset(void)
 {
-    RAMBlock *block;
-    ram_addr_t count = 0;
+    period_start = qemu_get_clock_ms(rt_clock);
+    period_dirty_pages = 0;
+    period_bytes_transferred = bytes_transferred;
+    dirty_rate_high_cnt = 0;
+}
 
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        ram_addr_t addr;
-        for (addr = block->offset; addr < block->offset + block->length;
-             addr += TARGET_PAGE_SIZE) {
-            if (cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG)) {
-                count++;
+static void migration_throttle_check(void)
+{
+    int64_t now = qemu_get_clock_ms(rt_clock);
+    uint64_t sent;
+
+    if (now < period_start + 1000) {
+        return;
+    }
+
+    sent = bytes_transferred - period_bytes_transferred;
+    if (migrate_auto_converge() && !ram_bulk_stage &&
+        period_dirty_pages * TARGET_PAGE_SIZE > sent / 2 &&
+        ++dirty_rate_high_cnt >= 2) {
+        if (cpu_throttle_get_percentage() == 0) {
+            cpu_throttle_set(migrate_cpu_throttle_initial());
+        } else {
+            cpu_throttle_set(cpu_throttle_get_percentage() +
+                             migrate_cpu_throttle_increment());
+        }
+        dirty_rate_high_cnt = 0;
+    }
+
+    period_start = now;
+    period_dirty_pages = 0;
+    period_bytes_transferred = bytes_transferred;
+}
+
+/*
+ * The dirty memory map has a byte of flags per page.  It is looked at 64
+ * pages at a time, and the chunks where no page has MIGRATION_DIRTY_FLAG
+ * are skipped without looking at their pages one by one.
+ */
+#define DIRTY_CHUNK_PAGES   64
+#define DIRTY_CHUNK_WORDS   (DIRTY_CHUNK_PAGES / sizeof(unsigned long))
+#define MIGRATION_DIRTY_WORD (~0UL / 0xff * MIGRATION_DIRTY_FLAG)
+
+static int dirty_chunk_is_clean(const uint8_t *dirty)
+{
+    const unsigned long *p = (const unsigned long *)dirty;
+    unsigned long w = 0;
+    int i;
+
+    for (i = 0; i < DIRTY_CHUNK_WORDS; i++) {
+        w |= p[i];
+    }
+    return (w & MIGRATION_DIRTY_WORD) == 0;
+}
+
+/* Returns how many pages of the block were dirtied */
+static uint64_t migration_bitmap_sync_block(RAMBlock *block)
+{
+    const uint8_t *dirty = ram_list.phys_dirty;
+    unsigned long page = block->offset >> TARGET_PAGE_BITS;
+    unsigned long end = (block->offset + block->length) >> TARGET_PAGE_BITS;
+    uint64_t found = 0;
+
+    while (page < end) {
+        /* The map is allocated with malloc, aligned chunks are aligned */
+        if (page % DIRTY_CHUNK_PAGES == 0 && end - page >= DIRTY_CHUNK_PAGES &&
+            dirty_chunk_is_clean(dirty + page)) {
+            page += DIRTY_CHUNK_PAGES;
+            continue;
+        }
+        if (dirty[page] & MIGRATION_DIRTY_FLAG) {
+            found++;
+            if (!test_and_set_bit(page, migration_bitmap)) {
+                migration_dirty_pages++;
             }
         }
+        page++;
     }
 
-    return count;
+    return found;
+}
+
+/* How long moving the dirtied pages over took, times are in ns */
+static struct {
+    uint64_t count;
+    int64_t last_time;
+    int64_t max_time;
+    uint64_t last_pages;
+} dirty_sync;
+
+/* Moves the pages that were dirtied since the last call to our bitmap */
+static int migration_bitmap_sync(void)
+{
+    int64_t start;
+    int i, ret;
+
+    migrate_lock_iothread();
+
+    ret = cpu_physical_sync_dirty_bitmap(0, TARGET_PHYS_ADDR_MAX);
+    if (ret == 0) {
+        start = qemu_get_clock_ns(rt_clock);
+        dirty_sync.last_pages = 0;
+
+        for (i = 0; i < nr_migration_blocks; i++) {
+            RAMBlock *block = migration_blocks[i];
+            uint64_t found = migration_bitmap_sync_block(block);
+
+            /*
+             * A block without dirty pages has no page whose TLB entries
+             * could bypass the dirty map, there is nothing to reset.
+             */
+            if (found) {
+                period_dirty_pages += found;
+                cpu_physical_memory_reset_dirty(block->offset,
+                                                block->offset + block->length,
+                                                MIGRATION_DIRTY_FLAG);
+            }
+            dirty_sync.last_pages += block->length >> TARGET_PAGE_BITS;
+        }
+
+        dirty_sync.count++;
+        dirty_sync.last_time = qemu_get_clock_ns(rt_clock) - start;
+        dirty_sync.max_time = MAX(dirty_sync.max_time, dirty_sync.last_time);
+        migration_throttle_check();
+    }
+
+    migrate_unlock_iothread();
+    return ret;
+}
+
+uint64_t ram_dirty_sync_count(void)
+{
+    return dirty_sync.count;
+}
+
+int64_t ram_dirty_sync_last_time(void)
+{
+    return dirty_sync.last_time;
+}
+
+int64_t ram_dirty_sync_max_time(void)
+{
+    return dirty_sync.max_time;
+}
+
+/* How fast the last pass went over the dirty memory map, in pages/s */
+uint64_t ram_dirty_sync_rate(void)
+{
+    if (dirty_sync.last_time <= 0) {
+        return 0;
+    }
+    return dirty_sync.last_pages * 1000000000ULL / dirty_sync.last_time;
 }
 
 uint64_t ram_bytes_remaining(void)
 {
-    return ram_save_remaining() * TARGET_PAGE_SIZE;
+    return migration_dirty_pages * TARGET_PAGE_SIZE;
 }
 
 uint64_t ram_bytes_transferred(void)
@@ -242,45 +832,144 @@ static void sort_ram_list(void)
         QLIST_REMOVE(block, next);
     }
     qsort(blocks, n, sizeof *blocks, block_compar);
+    nr_migration_blocks = n;
     while (--n >= 0) {
         QLIST_INSERT_HEAD(&ram_list.blocks, blocks[n], next);
     }
-    qemu_free(blocks);
+    migration_blocks = blocks;
+}
+
+/* Pages are sent as they are from now on */
+static void ram_encoding_fini(void)
+{
+    if (XBZRLE.cache) {
+        page_cache_fini(XBZRLE.cache);
+        XBZRLE.cache = NULL;
+        qemu_free(XBZRLE.current_buf);
+        qemu_free(XBZRLE.encoded_buf);
+    }
+
+    if (comp_param) {
+        compress_threads_fini();
+    }
+}
+
+static void migration_end(void)
+{
+    cpu_physical_memory_set_dirty_tracking(0);
+    cpu_throttle_stop();
+
+    qemu_free(migration_bitmap);
+    migration_bitmap = NULL;
+    qemu_free(migration_blocks);
+    migration_blocks = NULL;
+    migration_dirty_pages = 0;
+
+    ram_encoding_fini();
+}
+
+/*
+ * Ends the section on the channels.  The destination is told to wait for
+ * all of them before the next section, and they stall until it got there,
+ * so that nothing they carry can overtake the pages of this section that
+ * went on the migration stream.
+ */
+static int ram_save_multifd_sync(QEMUFile *f)
+{
+    if (multifd_send_sync() < 0) {
+        return -1;
+    }
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD);
+    qemu_put_be32(f, 0);
+    qemu_fflush(f);
+    return 0;
+}
+
+/*
+ * Post-copy: the pages that are still dirty are all that the destination
+ * lacks.  It drops its copies of them and runs the guest, and they are sent
+ * after the devices, as plain pages.
+ */
+static void ram_postcopy_switch(QEMUFile *f)
+{
+    int i;
+
+    ram_encoding_fini();
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_POSTCOPY);
+
+    for (i = 0; i < nr_migration_blocks; i++) {
+        RAMBlock *block = migration_blocks[i];
+        unsigned long first = block->offset >> TARGET_PAGE_BITS;
+        unsigned long end = first + (block->length >> TARGET_PAGE_BITS);
+        unsigned long page, run_end;
+
+        page = find_next_bit(migration_bitmap, end, first);
+        while (page < end) {
+            run_end = find_next_zero_bit(migration_bitmap, end, page);
+
+            qemu_put_be32(f, i);
+            qemu_put_be64(f, (uint64_t)(page - first) << TARGET_PAGE_BITS);
+            qemu_put_be64(f, (uint64_t)(run_end - page) << TARGET_PAGE_BITS);
+
+            page = find_next_bit(migration_bitmap, end, run_end);
+        }
+    }
+    qemu_put_be32(f, POSTCOPY_DISCARD_END);
 }
 
 int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
 {
-    ram_addr_t addr;
     uint64_t bytes_transferred_last;
     double bwidth = 0;
     uint64_t expected_time = 0;
 
     if (stage < 0) {
-        cpu_physical_memory_set_dirty_tracking(0);
-        return 0;
-    }
-
-    if (cpu_physical_sync_dirty_bitmap(0, TARGET_PHYS_ADDR_MAX) != 0) {
-        qemu_file_set_error(f);
+        migration_end();
         return 0;
     }
 
     if (stage == 1) {
         RAMBlock *block;
+
         bytes_transferred = 0;
-        last_block = NULL;
-        last_offset = 0;
+        zero_copy_pages = 0;
+        last_block = 0;
+        last_sent_block = NULL;
+        last_page = 0;
+        ram_bulk_stage = 1;
+        memset(&dirty_sync, 0, sizeof(dirty_sync));
+        migration_throttle_reset();
         sort_ram_list();
 
-        /* Make sure all dirty bits are set */
-        QLIST_FOREACH(block, &ram_list.blocks, next) {
-            for (addr = block->offset; addr < block->offset + block->length;
-                 addr += TARGET_PAGE_SIZE) {
-                if (!cpu_physical_memory_get_dirty(addr,
-                                                   MIGRATION_DIRTY_FLAG)) {
-                    cpu_physical_memory_set_dirty(addr);
-                }
-            }
+        if (migrate_use_xbzrle()) {
+            XBZRLE.cache = page_cache_init(xbzrle_cache_size /
+                                           TARGET_PAGE_SIZE,
+                                           TARGET_PAGE_SIZE);
+            XBZRLE.current_buf = qemu_malloc(TARGET_PAGE_SIZE);
+            XBZRLE.encoded_buf = qemu_malloc(TARGET_PAGE_SIZE);
+            XBZRLE.bytes = 0;
+            XBZRLE.pages = 0;
+            XBZRLE.cache_miss = 0;
+            XBZRLE.overflow = 0;
+        }
+
+        if (migrate_use_compression() && compress_threads_init() < 0) {
+            qemu_file_set_error(f);
+            return 0;
+        }
+
+        /* Every page is sent at least once */
+        block = migration_blocks[nr_migration_blocks - 1];
+        migration_bitmap_pages = (block->offset + block->length) >>
+                                 TARGET_PAGE_BITS;
+        migration_bitmap = bitmap_new(migration_bitmap_pages);
+        migration_dirty_pages = 0;
+        for (block = QLIST_FIRST(&ram_list.blocks); block;
+             block = QLIST_NEXT(block, next)) {
+            bitmap_set(migration_bitmap, block->offset >> TARGET_PAGE_BITS,
+                       block->length >> TARGET_PAGE_BITS);
+            migration_dirty_pages += block->length >> TARGET_PAGE_BITS;
         }
 
         /* Enable dirty memory tracking */
@@ -293,6 +982,27 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
             qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
             qemu_put_be64(f, block->length);
         }
+
+        if (multifd_send_active()) {
+            qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD);
+            qemu_put_be32(f, multifd_send_channels());
+        }
+
+        if (migrate_use_postcopy()) {
+            /* No ranges yet, the destination only checks that it can */
+            qemu_put_be64(f, RAM_SAVE_FLAG_POSTCOPY);
+            qemu_put_be32(f, POSTCOPY_DISCARD_END);
+        }
+    }
+
+    if (migration_bitmap_sync() != 0) {
+        qemu_file_set_error(f);
+        return 0;
+    }
+
+    if (XBZRLE.cache && page_cache_size(XBZRLE.cache) != xbzrle_cache_size) {
+        XBZRLE.cache = page_cache_resize(XBZRLE.cache,
+                                         xbzrle_cache_size / TARGET_PAGE_SIZE);
     }
 
     bytes_transferred_last = bytes_transferred;
@@ -308,6 +1018,10 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
         }
     }
 
+    if (comp_param) {
+        bytes_transferred += compress_flush_all(f);
+    }
+
     bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
     bwidth = (bytes_transferred - bytes_transferred_last) / bwidth;
 
@@ -318,21 +1032,115 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
     }
 
     /* try transferring iterative blocks of memory */
-    if (stage == 3) {
+    if (stage == 3 && migrate_postcopy_switching()) {
+        ram_postcopy_switch(f);
+    } else if (stage == 3) {
         int bytes_sent;
 
         /* flush all remaining blocks regardless of rate limiting */
         while ((bytes_sent = ram_save_block(f)) != 0) {
             bytes_transferred += bytes_sent;
         }
-        cpu_physical_memory_set_dirty_tracking(0);
+        if (comp_param) {
+            bytes_transferred += compress_flush_all(f);
+        }
+        migration_end();
+    }
+
+    if (multifd_send_active() && ram_save_multifd_sync(f) < 0) {
+        qemu_file_set_error(f);
     }
 
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
-    expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
+    expected_time = ram_bytes_remaining() / bwidth;
 
-    return (stage == 2) && (expected_time <= migrate_max_downtime());
+    /* With post-copy, the destination takes over after the first pass */
+    return (stage == 2) && (expected_time <= migrate_max_downtime() ||
+                            (migrate_use_postcopy() && !ram_bulk_stage));
+}
+
+/* Sends a page that the destination asked for, if it wasn't sent yet */
+int ram_postcopy_request(QEMUFile *f, uint32_t block_idx, uint32_t page)
+{
+    RAMBlock *block;
+    ram_addr_t offset = (ram_addr_t)page << TARGET_PAGE_BITS;
+
+    if (block_idx >= nr_migration_blocks ||
+        offset >= migration_blocks[block_idx]->length) {
+        fprintf(stderr, "Invalid post-copy page request %u:%u\n",
+                block_idx, page);
+        return -EINVAL;
+    }
+    block = migration_blocks[block_idx];
+
+    if (test_and_clear_bit((block->offset + offset) >> TARGET_PAGE_BITS,
+                           migration_bitmap)) {
+        migration_dirty_pages--;
+        bytes_transferred += ram_save_page(f, block, offset);
+    }
+    return 0;
+}
+
+/* Sends the next pages in the background, returns 1 once all were sent */
+int ram_postcopy_iterate(QEMUFile *f)
+{
+    int i, bytes_sent;
+
+    for (i = 0; i < POSTCOPY_BATCH_PAGES && !qemu_file_rate_limit(f); i++) {
+        bytes_sent = ram_save_block(f);
+        if (bytes_sent == 0) {
+            qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+            migrate_lock_iothread();
+            migration_end();
+            migrate_unlock_iothread();
+            return 1;
+        }
+        bytes_transferred += bytes_sent;
+    }
+
+    return qemu_file_has_error(f) ? -EIO : 0;
+}
+
+/*
+ * The RAM blocks in the order of RAM_SAVE_FLAG_MEM_SIZE.  Looking blocks up
+ * here is safe in any thread, unlike ram_list which qemu_get_ram_ptr()
+ * reorders.
+ */
+static RAMBlock **incoming_blocks;
+static int nr_incoming_blocks;
+
+/* What the pages that were loaded since the last reset turned out to be */
+static struct {
+    uint64_t pages;
+    uint64_t zero_pages;
+    uint64_t zero_pages_skipped;
+} load_stats;
+
+void ram_load_reset_stats(void)
+{
+    memset(&load_stats, 0, sizeof(load_stats));
+}
+
+uint64_t ram_load_pages(void)
+{
+    return load_stats.pages;
+}
+
+uint64_t ram_load_bytes(void)
+{
+    return load_stats.pages * TARGET_PAGE_SIZE;
+}
+
+uint64_t ram_load_zero_pages(void)
+{
+    return load_stats.zero_pages;
+}
+
+uint64_t ram_load_zero_pages_skipped(void)
+{
+    return load_stats.zero_pages_skipped;
 }
 
 static inline void *host_from_stream_offset(QEMUFile *f,
@@ -342,6 +1150,7 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     static RAMBlock *block = NULL;
     char id[256];
     uint8_t len;
+    int i;
 
     if (flags & RAM_SAVE_FLAG_CONTINUE) {
         if (!block) {
@@ -356,16 +1165,285 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     qemu_get_buffer(f, (uint8_t *)id, len);
     id[len] = 0;
 
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
+    for (i = 0; i < nr_incoming_blocks; i++) {
+        block = incoming_blocks[i];
         if (!strncmp(id, block->idstr, sizeof(id)))
             return block->host + offset;
     }
 
+    block = NULL;
     fprintf(stderr, "Can't find block %s!\n", id);
     return NULL;
 }
 
-int ram_load(QEMUFile *f, void *opaque, int version_id)
+static int load_xbzrle(QEMUFile *f, void *host)
+{
+    uint8_t data[TARGET_PAGE_SIZE];
+    uint8_t *buf = data;
+    int encoding, len;
+
+    encoding = qemu_get_byte(f);
+    if (encoding != ENCODING_FLAG_XBZRLE) {
+        fprintf(stderr, "Unknown page encoding %d\n", encoding);
+        return -1;
+    }
+
+    len = qemu_get_be16(f);
+    if (len > TARGET_PAGE_SIZE) {
+        fprintf(stderr, "Invalid XBZRLE page length %d\n", len);
+        return -1;
+    }
+    qemu_get_buffer_in_place(f, &buf, len);
+
+    if (xbzrle_decode_buffer(buf, len, host, TARGET_PAGE_SIZE) < 0) {
+        fprintf(stderr, "Failed to decode XBZRLE page\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Compressed pages are inflated by a pool of threads, straight into guest
+ * memory.  A page appears at most once between two RAM_SAVE_FLAG_EOS, so
+ * the pages only need to be waited for at the end of each section.
+ */
+typedef struct DecompressParam {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    z_stream stream;
+    uint8_t *buf;
+
+    /* Protected by mutex */
+    int busy;
+    int quit;
+    int ret;
+    void *host;
+    int len;
+} DecompressParam;
+
+static DecompressParam *decomp_param;
+static int decomp_threads;
+static int decomp_next;
+
+static int decompress_page_buffer(z_stream *stream, void *host,
+                                  const uint8_t *src, int len)
+{
+    if (inflateReset(stream) != Z_OK) {
+        return -1;
+    }
+
+    stream->next_in = (Bytef *)src;
+    stream->avail_in = len;
+    stream->next_out = host;
+    stream->avail_out = TARGET_PAGE_SIZE;
+
+    if (inflate(stream, Z_FINISH) != Z_STREAM_END ||
+        stream->total_out != TARGET_PAGE_SIZE) {
+        return -1;
+    }
+    return 0;
+}
+
+static void *decompress_thread(void *opaque)
+{
+    DecompressParam *p = opaque;
+    int ret;
+
+    qemu_mutex_lock(&p->mutex);
+    for (;;) {
+        while (!p->quit && !p->busy) {
+            qemu_cond_wait(&p->cond, &p->mutex);
+        }
+        if (p->quit) {
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+
+        ret = decompress_page_buffer(&p->stream, p->host, p->buf, p->len);
+
+        qemu_mutex_lock(&p->mutex);
+        if (ret < 0) {
+            p->ret = ret;
+        }
+        p->busy = 0;
+        qemu_cond_signal(&p->cond);
+    }
+    qemu_mutex_unlock(&p->mutex);
+
+    return NULL;
+}
+
+static int decompress_threads_init(void)
+{
+    int i;
+
+    decomp_threads = migrate_decompress_threads();
+    decomp_next = 0;
+    decomp_param = qemu_mallocz(decomp_threads * sizeof(*decomp_param));
+
+    for (i = 0; i < decomp_threads; i++) {
+        DecompressParam *p = &decomp_param[i];
+
+        if (inflateInit(&p->stream) != Z_OK) {
+            fprintf(stderr, "Failed to initialize page decompression\n");
+            decomp_threads = i;
+            return -1;
+        }
+        p->buf = qemu_malloc(TARGET_PAGE_SIZE);
+        qemu_mutex_init(&p->mutex);
+        qemu_cond_init(&p->cond);
+        qemu_thread_create(&p->thread, decompress_thread, p);
+    }
+    return 0;
+}
+
+/* Waits for p to become idle, returns -1 if a page failed to decompress */
+static int decompress_wait(DecompressParam *p)
+{
+    int ret;
+
+    qemu_mutex_lock(&p->mutex);
+    while (p->busy) {
+        qemu_cond_wait(&p->cond, &p->mutex);
+    }
+    ret = p->ret;
+    qemu_mutex_unlock(&p->mutex);
+
+    if (ret < 0) {
+        fprintf(stderr, "Failed to decompress page\n");
+    }
+    return ret;
+}
+
+static int decompress_wait_all(void)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < decomp_threads; i++) {
+        if (decompress_wait(&decomp_param[i]) < 0) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+void ram_load_cleanup(void)
+{
+    int i;
+
+    for (i = 0; i < decomp_threads; i++) {
+        DecompressParam *p = &decomp_param[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = 1;
+        qemu_cond_signal(&p->cond);
+        qemu_mutex_unlock(&p->mutex);
+        qemu_thread_join(&p->thread);
+
+        qemu_cond_destroy(&p->cond);
+        qemu_mutex_destroy(&p->mutex);
+        inflateEnd(&p->stream);
+        qemu_free(p->buf);
+    }
+
+    qemu_free(decomp_param);
+    decomp_param = NULL;
+    decomp_threads = 0;
+
+    multifd_recv_cleanup();
+}
+
+static int load_compressed_page(QEMUFile *f, void *host)
+{
+    DecompressParam *p;
+    int len;
+
+    if (!decomp_param && decompress_threads_init() < 0) {
+        return -1;
+    }
+
+    len = qemu_get_be32(f);
+    if (len <= 0 || len > TARGET_PAGE_SIZE) {
+        fprintf(stderr, "Invalid compressed page length %d\n", len);
+        return -1;
+    }
+
+    p = &decomp_param[decomp_next];
+    decomp_next = (decomp_next + 1) % decomp_threads;
+    if (decompress_wait(p) < 0) {
+        return -1;
+    }
+
+    qemu_get_buffer(f, p->buf, len);
+
+    qemu_mutex_lock(&p->mutex);
+    p->host = host;
+    p->len = len;
+    p->busy = 1;
+    qemu_cond_signal(&p->cond);
+    qemu_mutex_unlock(&p->mutex);
+
+    return 0;
+}
+
+/*
+ * The first RAM_SAVE_FLAG_POSTCOPY comes in stage 1 without any ranges, the
+ * destination checks that it can do post-copy while the source still runs
+ * the guest.  At the switch, the destination drops the pages that were
+ * dirtied since they were sent, and they are faulted in from the source
+ * from now on.
+ */
+static int load_postcopy_discards(QEMUFile *f)
+{
+    uint64_t offset, length;
+    uint32_t idx;
+
+    if (!postcopy_ram_incoming_advised()) {
+        if (postcopy_ram_incoming_advise(qemu_socket_fd(f)) < 0 ||
+            qemu_get_be32(f) != POSTCOPY_DISCARD_END) {
+            return -1;
+        }
+        return 0;
+    }
+
+    if (postcopy_ram_incoming_init(incoming_blocks, nr_incoming_blocks,
+                                   qemu_socket_fd(f)) < 0) {
+        return -1;
+    }
+
+    while ((idx = qemu_get_be32(f)) != POSTCOPY_DISCARD_END) {
+        offset = qemu_get_be64(f);
+        length = qemu_get_be64(f);
+        if (qemu_file_has_error(f)) {
+            return -1;
+        }
+
+        if (idx >= nr_incoming_blocks ||
+            offset >= incoming_blocks[idx]->length ||
+            postcopy_ram_discard_range(incoming_blocks[idx]->host + offset,
+                                       length) < 0) {
+            fprintf(stderr, "Invalid post-copy discard range\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* After the switch to post-copy, pages must be put in place in one go */
+static int postcopy_place_dup_page(void *host, uint8_t ch)
+{
+    uint8_t buf[TARGET_PAGE_SIZE];
+
+    if (ch == 0) {
+        return postcopy_ram_place_page(host, NULL);
+    }
+
+    memset(buf, ch, TARGET_PAGE_SIZE);
+    return postcopy_ram_place_page(host, buf);
+}
+
+static int do_ram_load(QEMUFile *f, int version_id)
 {
     ram_addr_t addr;
     int flags;
@@ -391,6 +1469,10 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
                 ram_addr_t length;
                 ram_addr_t total_ram_bytes = addr;
 
+                qemu_free(incoming_blocks);
+                incoming_blocks = NULL;
+                nr_incoming_blocks = 0;
+
                 while (total_ram_bytes) {
                     RAMBlock *block;
                     uint8_t len;
@@ -414,11 +1496,48 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
                         return -EINVAL;
                     }
 
+                    incoming_blocks = qemu_realloc(incoming_blocks,
+                                                   (nr_incoming_blocks + 1) *
+                                                   sizeof(*incoming_blocks));
+                    incoming_blocks[nr_incoming_blocks++] = block;
+
                     total_ram_bytes -= length;
                 }
             }
         }
 
+        if (flags & RAM_SAVE_FLAG_MULTIFD) {
+            /* The first one gives the channels, later ones end a section */
+            uint32_t nr_channels = qemu_get_be32(f);
+            uint64_t pages;
+
+            if (!multifd_recv_active()) {
+                if (multifd_recv_init(incoming_blocks, nr_incoming_blocks,
+                                      nr_channels) < 0) {
+                    return -EINVAL;
+                }
+            } else if (nr_channels == 0) {
+                if (multifd_recv_sync(&pages) < 0) {
+                    return -EIO;
+                }
+                load_stats.pages += pages;
+            } else {
+                return -EINVAL;
+            }
+        }
+
+        if (flags & RAM_SAVE_FLAG_POSTCOPY) {
+            if (load_postcopy_discards(f) < 0) {
+                return -EINVAL;
+            }
+        }
+
+        if (postcopy_ram_incoming_active() &&
+            (flags & (RAM_SAVE_FLAG_XBZRLE | RAM_SAVE_FLAG_COMPRESS_PAGE))) {
+            fprintf(stderr, "Encoded page after the switch to post-copy\n");
+            return -EINVAL;
+        }
+
         if (flags & RAM_SAVE_FLAG_COMPRESS) {
             void *host;
             uint8_t ch;
@@ -432,13 +1551,29 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
 
             ch = qemu_get_byte(f);
-            memset(host, ch, TARGET_PAGE_SIZE);
-#ifndef _WIN32
-            if (ch == 0 &&
-                (!kvm_enabled() || kvm_has_sync_mmu())) {
-                qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
+            load_stats.pages++;
+            if (ch == 0) {
+                load_stats.zero_pages++;
             }
+            if (postcopy_ram_incoming_active()) {
+                if (postcopy_place_dup_page(host, ch) < 0) {
+                    return -EINVAL;
+                }
+            } else if (ch == 0 && is_dup_page(host, 0)) {
+                /*
+                 * Memory that the destination never touched reads as zero,
+                 * writing it would only allocate it.
+                 */
+                load_stats.zero_pages_skipped++;
+            } else {
+                memset(host, ch, TARGET_PAGE_SIZE);
+#ifndef _WIN32
+                if (ch == 0 &&
+                    (!kvm_enabled() || kvm_has_sync_mmu())) {
+                    qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
+                }
 #endif
+            }
         } else if (flags & RAM_SAVE_FLAG_PAGE) {
             void *host;
 
@@ -446,8 +1581,36 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
                 host = qemu_get_ram_ptr(addr);
             else
                 host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                return -EINVAL;
+            }
+
+            load_stats.pages++;
+            if (postcopy_ram_incoming_active()) {
+                uint8_t data[TARGET_PAGE_SIZE];
+                uint8_t *buf = data;
+
+                qemu_get_buffer_in_place(f, &buf, TARGET_PAGE_SIZE);
+                if (postcopy_ram_place_page(host, buf) < 0) {
+                    return -EINVAL;
+                }
+            } else {
+                qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            }
+        } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
+            void *host = host_from_stream_offset(f, addr, flags);
+
+            if (!host || load_xbzrle(f, host) < 0) {
+                return -EINVAL;
+            }
+            load_stats.pages++;
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+            void *host = host_from_stream_offset(f, addr, flags);
 
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            if (!host || load_compressed_page(f, host) < 0) {
+                return -EINVAL;
+            }
+            load_stats.pages++;
         }
         if (qemu_file_has_error(f)) {
             return -EIO;
@@ -457,6 +1620,25 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
     return 0;
 }
 
+int ram_load(QEMUFile *f, void *opaque, int version_id)
+{
+    int ret;
+
+    ret = do_ram_load(f, version_id);
+
+    /* The pages of this section must be in place before the next one */
+    if (decompress_wait_all() < 0 && ret == 0) {
+        ret = -EINVAL;
+    }
+    return ret;
+}
+
+/* Loads the pages that are sent after the switch to post-copy */
+int ram_load_postcopy(QEMUFile *f)
+{
+    return do_ram_load(f, 4);
+}
+
 void qemu_service_io(void)
 {
     qemu_notify_event();
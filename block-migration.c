@@ -21,15 +21,21 @@
 #include "migration.h"
 #include "blockdev.h"
 #include <assert.h>
+#include <zlib.h>
 
 #define BLOCK_SIZE (BDRV_SECTORS_PER_DIRTY_CHUNK << BDRV_SECTOR_BITS)
 
 #define BLK_MIG_FLAG_DEVICE_BLOCK       0x01
 #define BLK_MIG_FLAG_EOS                0x02
 #define BLK_MIG_FLAG_PROGRESS           0x04
+#define BLK_MIG_FLAG_ZERO_BLOCK         0x08
+#define BLK_MIG_FLAG_COMPRESSED         0x10
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
+/* Maximum number of blocks being read or waiting to be sent */
+#define MAX_INFLIGHT_IO 64
+
 //#define DEBUG_BLK_MIGRATION
 
 #ifdef DEBUG_BLK_MIGRATION
@@ -54,7 +60,7 @@ typedef struct BlkMigDevState {
 } BlkMigDevState;
 
 typedef struct BlkMigBlock {
-    uint8_t *buf;
+    uint8_t *buf;               /* NULL for blocks known to be zero */
     BlkMigDevState *bmds;
     int64_t sector;
     int nr_sectors;
@@ -79,24 +85,68 @@ typedef struct BlkMigState {
     long double total_time;
     long double prev_time_offset;
     int reads;
+    int compress;
+    uint8_t *compress_buf;
+    uint64_t zero_blocks;
+    uint64_t bytes_read;
+    uint64_t bytes_sent;
 } BlkMigState;
 
 static BlkMigState block_mig_state;
 
+static int is_zero_block(const uint8_t *buf, int len)
+{
+    const unsigned long *p = (const unsigned long *)buf;
+    int i;
+
+    for (i = 0; i < len / sizeof(unsigned long); i++) {
+        if (p[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 static void blk_send(QEMUFile *f, BlkMigBlock * blk)
 {
     int len;
+    int size = blk->nr_sectors << BDRV_SECTOR_BITS;
+    int flags = BLK_MIG_FLAG_DEVICE_BLOCK;
+    uLongf clen = 0;
+
+    /* All-zero blocks are sent without their data */
+    if (!blk->buf || is_zero_block(blk->buf, size)) {
+        flags |= BLK_MIG_FLAG_ZERO_BLOCK;
+        block_mig_state.zero_blocks++;
+    } else if (block_mig_state.compress) {
+        clen = compressBound(BLOCK_SIZE);
+        if (compress2(block_mig_state.compress_buf, &clen, blk->buf, size,
+                      Z_BEST_SPEED) == Z_OK && clen < size) {
+            flags |= BLK_MIG_FLAG_COMPRESSED;
+        }
+    }
 
     /* sector number and flags */
-    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
-                     | BLK_MIG_FLAG_DEVICE_BLOCK);
+    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS) | flags);
 
     /* device name */
     len = strlen(blk->bmds->bs->device_name);
     qemu_put_byte(f, len);
     qemu_put_buffer(f, (uint8_t *)blk->bmds->bs->device_name, len);
 
-    qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
+    block_mig_state.bytes_read += BLOCK_SIZE;
+    block_mig_state.bytes_sent += 9 + len;
+
+    if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
+        return;
+    } else if (flags & BLK_MIG_FLAG_COMPRESSED) {
+        qemu_put_be32(f, clen);
+        qemu_put_buffer(f, block_mig_state.compress_buf, clen);
+        block_mig_state.bytes_sent += 4 + clen;
+    } else {
+        qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
+        block_mig_state.bytes_sent += BLOCK_SIZE;
+    }
 }
 
 int blk_mig_active(void)
@@ -131,6 +181,32 @@ uint64_t blk_mig_bytes_total(void)
     return sum << BDRV_SECTOR_BITS;
 }
 
+uint64_t blk_mig_zero_blocks(void)
+{
+    return block_mig_state.zero_blocks;
+}
+
+uint64_t blk_mig_bytes_sent(void)
+{
+    return block_mig_state.bytes_sent;
+}
+
+/*
+ * Estimated size on the wire of the blocks that are being read or wait to be
+ * sent, taking into account how well zero elision and compression did so far.
+ */
+static uint64_t blk_mig_queued_bytes(void)
+{
+    uint64_t queued = (uint64_t)(block_mig_state.submitted +
+                                 block_mig_state.read_done) * BLOCK_SIZE;
+
+    if (block_mig_state.bytes_read) {
+        queued = queued * ((double)block_mig_state.bytes_sent /
+                           block_mig_state.bytes_read);
+    }
+    return queued;
+}
+
 static inline long double compute_read_bwidth(void)
 {
     assert(block_mig_state.total_time != 0);
@@ -202,6 +278,27 @@ static void blk_mig_read_cb(void *opaque, int ret)
     assert(block_mig_state.submitted >= 0);
 }
 
+/*
+ * Returns 1 if the whole range is known to read as zeroes, so that it can be
+ * sent without reading it.  With a shared base image, only the top image
+ * counts, since unallocated sectors aren't sent at all.
+ */
+static int blk_mig_is_zero(BlkMigDevState *bmds, int64_t sector,
+                           int nr_sectors)
+{
+    BlockDriverState *bs = bmds->bs;
+    int64_t ret;
+    int n;
+
+    if (bmds->shared_base) {
+        ret = bdrv_get_block_status(bs, sector, nr_sectors, &n);
+    } else {
+        ret = bdrv_get_block_status_above(bs, NULL, sector, nr_sectors, &n);
+    }
+
+    return ret > 0 && (ret & BDRV_BLOCK_ZERO) && n == nr_sectors;
+}
+
 static int mig_save_device_bulk(Monitor *mon, QEMUFile *f,
                                 BlkMigDevState *bmds)
 {
@@ -236,25 +333,33 @@ static int mig_save_device_bulk(Monitor *mon, QEMUFile *f,
     }
 
     blk = qemu_malloc(sizeof(BlkMigBlock));
-    blk->buf = qemu_malloc(BLOCK_SIZE);
     blk->bmds = bmds;
     blk->sector = cur_sector;
     blk->nr_sectors = nr_sectors;
 
-    blk->iov.iov_base = blk->buf;
-    blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-    qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+    if (blk_mig_is_zero(bmds, cur_sector, nr_sectors)) {
+        /* No need to read it, just queue a zero block */
+        blk->buf = NULL;
+        blk->ret = 0;
+        QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
+        block_mig_state.read_done++;
+    } else {
+        blk->buf = qemu_malloc(BLOCK_SIZE);
+        blk->iov.iov_base = blk->buf;
+        blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
 
-    if (block_mig_state.submitted == 0) {
-        block_mig_state.prev_time_offset = qemu_get_clock_ns(rt_clock);
-    }
+        if (block_mig_state.submitted == 0) {
+            block_mig_state.prev_time_offset = qemu_get_clock_ns(rt_clock);
+        }
 
-    blk->aiocb = bdrv_aio_readv(bs, cur_sector, &blk->qiov,
-                                nr_sectors, blk_mig_read_cb, blk);
-    if (!blk->aiocb) {
-        goto error;
+        blk->aiocb = bdrv_aio_readv(bs, cur_sector, &blk->qiov,
+                                    nr_sectors, blk_mig_read_cb, blk);
+        if (!blk->aiocb) {
+            goto error;
+        }
+        block_mig_state.submitted++;
     }
-    block_mig_state.submitted++;
 
     bdrv_reset_dirty(bs, cur_sector, nr_sectors);
     bmds->cur_sector = cur_sector + nr_sectors;
@@ -325,6 +430,14 @@ static void init_blk_migration(Monitor *mon, QEMUFile *f)
     block_mig_state.bulk_completed = 0;
     block_mig_state.total_time = 0;
     block_mig_state.reads = 0;
+    block_mig_state.zero_blocks = 0;
+    block_mig_state.bytes_read = 0;
+    block_mig_state.bytes_sent = 0;
+
+    block_mig_state.compress = migrate_use_block_compress();
+    if (block_mig_state.compress && !block_mig_state.compress_buf) {
+        block_mig_state.compress_buf = qemu_malloc(compressBound(BLOCK_SIZE));
+    }
 
     bdrv_iterate(init_blk_migration_it, mon);
 }
@@ -377,7 +490,7 @@ static void blk_mig_reset_dirty_cursor(void)
 }
 
 static int mig_save_device_dirty(Monitor *mon, QEMUFile *f,
-                                 BlkMigDevState *bmds, int is_async)
+                                 BlkMigDevState *bmds)
 {
     BlkMigBlock *blk;
     int64_t total_sectors = bmds->total_sectors;
@@ -386,7 +499,7 @@ static int mig_save_device_dirty(Monitor *mon, QEMUFile *f,
 
     for (sector = bmds->cur_dirty; sector < bmds->total_sectors;) {
         if (bmds_aio_inflight(bmds, sector)) {
-            qemu_aio_flush();
+            bdrv_drain_all();
         }
         if (bdrv_get_dirty(bmds->bs, sector)) {
 
@@ -401,34 +514,26 @@ static int mig_save_device_dirty(Monitor *mon, QEMUFile *f,
             blk->sector = sector;
             blk->nr_sectors = nr_sectors;
 
-            if (is_async) {
-                blk->iov.iov_base = blk->buf;
-                blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-                qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
-                if (block_mig_state.submitted == 0) {
-                    block_mig_state.prev_time_offset = qemu_get_clock_ns(rt_clock);
-                }
+            blk->iov.iov_base = blk->buf;
+            blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
 
-                blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
-                                            nr_sectors, blk_mig_read_cb, blk);
-                if (!blk->aiocb) {
-                    goto error;
-                }
-                block_mig_state.submitted++;
-                bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
-            } else {
-                if (bdrv_read(bmds->bs, sector, blk->buf,
-                              nr_sectors) < 0) {
-                    goto error;
-                }
-                blk_send(f, blk);
+            if (block_mig_state.submitted == 0) {
+                block_mig_state.prev_time_offset = qemu_get_clock_ns(rt_clock);
+            }
 
-                qemu_free(blk->buf);
-                qemu_free(blk);
+            blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
+                                        nr_sectors, blk_mig_read_cb, blk);
+            if (!blk->aiocb) {
+                goto error;
             }
+            block_mig_state.submitted++;
+            bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
 
             bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
+
+            /* continue after this block, it is in flight now */
+            bmds->cur_dirty = sector + nr_sectors;
             break;
         }
         sector += BDRV_SECTORS_PER_DIRTY_CHUNK;
@@ -445,13 +550,13 @@ error:
     return 0;
 }
 
-static int blk_mig_save_dirty_block(Monitor *mon, QEMUFile *f, int is_async)
+static int blk_mig_save_dirty_block(Monitor *mon, QEMUFile *f)
 {
     BlkMigDevState *bmds;
     int ret = 0;
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
-        if (mig_save_device_dirty(mon, f, bmds, is_async) == 0) {
+        if (mig_save_device_dirty(mon, f, bmds) == 0) {
             ret = 1;
             break;
         }
@@ -460,7 +565,7 @@ static int blk_mig_save_dirty_block(Monitor *mon, QEMUFile *f, int is_async)
     return ret;
 }
 
-static void flush_blks(QEMUFile* f)
+static void flush_blks(QEMUFile* f, int rate_limited)
 {
     BlkMigBlock *blk;
 
@@ -469,7 +574,7 @@ static void flush_blks(QEMUFile* f)
             block_mig_state.transferred);
 
     while ((blk = QSIMPLEQ_FIRST(&block_mig_state.blk_list)) != NULL) {
-        if (qemu_file_rate_limit(f)) {
+        if (rate_limited && qemu_file_rate_limit(f)) {
             break;
         }
         if (blk->ret < 0) {
@@ -507,7 +612,8 @@ static int64_t get_remaining_dirty(void)
 static int is_stage2_completed(void)
 {
     int64_t remaining_dirty;
-    long double bwidth;
+    uint64_t max_bandwidth;
+    long double bwidth, ratio, downtime;
 
     if (block_mig_state.bulk_completed == 1) {
 
@@ -517,9 +623,21 @@ static int is_stage2_completed(void)
         }
 
         bwidth = compute_read_bwidth();
+        downtime = remaining_dirty / bwidth;
+
+        /* the remaining blocks must also fit through the link in time */
+        max_bandwidth = migrate_max_bandwidth();
+        if (max_bandwidth) {
+            ratio = 1;
+            if (block_mig_state.bytes_read) {
+                ratio = (long double)block_mig_state.bytes_sent /
+                        block_mig_state.bytes_read;
+            }
+            downtime = MAX(downtime, remaining_dirty * ratio * 1e9 /
+                                     max_bandwidth);
+        }
 
-        if ((remaining_dirty / bwidth) <=
-            migrate_max_downtime()) {
+        if (downtime <= migrate_max_downtime()) {
             /* finish stage2 because we think that we can finish remaing work
                below max_downtime */
 
@@ -554,7 +672,7 @@ static void blk_mig_cleanup(Monitor *mon)
     monitor_printf(mon, "\n");
 }
 
-static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
+static int do_block_save_live(Monitor *mon, QEMUFile *f, int stage)
 {
     DPRINTF("Enter save live stage %d submitted %d transferred %d\n",
             stage, block_mig_state.submitted, block_mig_state.transferred);
@@ -577,7 +695,7 @@ static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
         set_dirty_tracking(1);
     }
 
-    flush_blks(f);
+    flush_blks(f, 1);
 
     if (qemu_file_has_error(f)) {
         blk_mig_cleanup(mon);
@@ -588,9 +706,9 @@ static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
 
     if (stage == 2) {
         /* control the rate of transfer */
-        while ((block_mig_state.submitted +
-                block_mig_state.read_done) * BLOCK_SIZE <
-               qemu_file_get_rate_limit(f)) {
+        while (block_mig_state.submitted + block_mig_state.read_done <
+               MAX_INFLIGHT_IO &&
+               blk_mig_queued_bytes() < qemu_file_get_rate_limit(f)) {
             if (block_mig_state.bulk_completed == 0) {
                 /* first finish the bulk phase */
                 if (blk_mig_save_bulked_block(mon, f) == 0) {
@@ -598,14 +716,14 @@ static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
                     block_mig_state.bulk_completed = 1;
                 }
             } else {
-                if (blk_mig_save_dirty_block(mon, f, 1) == 0) {
+                if (blk_mig_save_dirty_block(mon, f) == 0) {
                     /* no more dirty blocks */
                     break;
                 }
             }
         }
 
-        flush_blks(f);
+        flush_blks(f, 1);
 
         if (qemu_file_has_error(f)) {
             blk_mig_cleanup(mon);
@@ -614,11 +732,22 @@ static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
     }
 
     if (stage == 3) {
+        int more;
+
         /* we know for sure that save bulk is completed and
            all async read completed */
         assert(block_mig_state.submitted == 0);
 
-        while (blk_mig_save_dirty_block(mon, f, 0) != 0);
+        /* the guest is stopped, send the dirty blocks without rate limit,
+           keeping a batch of reads in flight */
+        do {
+            more = 1;
+            while (more && block_mig_state.submitted < MAX_INFLIGHT_IO) {
+                more = blk_mig_save_dirty_block(mon, f);
+            }
+            bdrv_drain_all();
+            flush_blks(f, 0);
+        } while (more && !qemu_file_has_error(f));
         blk_mig_cleanup(mon);
 
         /* report completion */
@@ -636,6 +765,63 @@ static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
     return ((stage == 2) && is_stage2_completed());
 }
 
+static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
+{
+    int ret;
+
+    /* Submitting and completing AIO requests needs the global mutex */
+    migrate_lock_iothread();
+    ret = do_block_save_live(mon, f, stage);
+    migrate_unlock_iothread();
+
+    return ret;
+}
+
+static int blk_load_zero_block(BlockDriverState *bs, int64_t sector,
+                               uint8_t *buf, int nr_sectors)
+{
+    int64_t ret;
+    int n;
+
+    /* Nothing to do if the destination already reads as zeroes there */
+    ret = bdrv_get_block_status_above(bs, NULL, sector, nr_sectors, &n);
+    if (ret > 0 && (ret & BDRV_BLOCK_ZERO) && n == nr_sectors) {
+        return 0;
+    }
+
+    memset(buf, 0, nr_sectors << BDRV_SECTOR_BITS);
+    return bdrv_write(bs, sector, buf, nr_sectors);
+}
+
+static int blk_load_compressed_block(QEMUFile *f, BlockDriverState *bs,
+                                     int64_t sector, uint8_t *buf,
+                                     int nr_sectors)
+{
+    uint8_t *cbuf;
+    uint32_t clen;
+    uLongf len = BLOCK_SIZE;
+    int ret;
+
+    clen = qemu_get_be32(f);
+    if (clen > compressBound(BLOCK_SIZE)) {
+        fprintf(stderr, "Invalid compressed block size %u\n", clen);
+        return -EINVAL;
+    }
+
+    cbuf = qemu_malloc(clen);
+    qemu_get_buffer(f, cbuf, clen);
+    ret = uncompress(buf, &len, cbuf, clen);
+    qemu_free(cbuf);
+
+    if (ret != Z_OK || len < (nr_sectors << BDRV_SECTOR_BITS)) {
+        fprintf(stderr, "Error decompressing block at sector %" PRId64 "\n",
+                sector);
+        return -EINVAL;
+    }
+
+    return bdrv_write(bs, sector, buf, nr_sectors);
+}
+
 static int block_load(QEMUFile *f, void *opaque, int version_id)
 {
     static int banner_printed;
@@ -685,8 +871,14 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
 
             buf = qemu_malloc(BLOCK_SIZE);
 
-            qemu_get_buffer(f, buf, BLOCK_SIZE);
-            ret = bdrv_write(bs, addr, buf, nr_sectors);
+            if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
+                ret = blk_load_zero_block(bs, addr, buf, nr_sectors);
+            } else if (flags & BLK_MIG_FLAG_COMPRESSED) {
+                ret = blk_load_compressed_block(f, bs, addr, buf, nr_sectors);
+            } else {
+                qemu_get_buffer(f, buf, BLOCK_SIZE);
+                ret = bdrv_write(bs, addr, buf, nr_sectors);
+            }
 
             qemu_free(buf);
             if (ret < 0) {
@@ -726,6 +918,6 @@ void blk_mig_init(void)
     QSIMPLEQ_INIT(&block_mig_state.bmds_list);
     QSIMPLEQ_INIT(&block_mig_state.blk_list);
 
-    register_savevm_live(NULL, "block", 0, 1, block_set_params,
+    register_savevm_live(NULL, "block", 0, 2, block_set_params,
                          block_save_live, NULL, block_load, &block_mig_state);
 }
@@ -19,5 +19,7 @@ int blk_mig_active(void);
 uint64_t blk_mig_bytes_transferred(void);
 uint64_t blk_mig_bytes_remaining(void);
 uint64_t blk_mig_bytes_total(void);
+uint64_t blk_mig_zero_blocks(void);
+uint64_t blk_mig_bytes_sent(void);
 
 #endif /* BLOCK_MIGRATION_H */
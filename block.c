@@ -28,6 +28,7 @@
 #include "block_int.h"
 #include "module.h"
 #include "qemu-objects.h"
+#include "host-utils.h"
 
 #ifdef CONFIG_BSD
 #include <sys/types.h>
@@ -57,6 +58,30 @@ static int bdrv_read_em(BlockDriverState *bs, int64_t sector_num,
                         uint8_t *buf, int nb_sectors);
 static int bdrv_write_em(BlockDriverState *bs, int64_t sector_num,
                          const uint8_t *buf, int nb_sectors);
+static int bdrv_flush_em(BlockDriverState *bs);
+static void bdrv_io_limits_dispatch(BlockDriverState *bs, bool force);
+static BlockDriverAIOCB *bdrv_co_aio_readv_em(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque);
+static BlockDriverAIOCB *bdrv_co_aio_writev_em(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque);
+static BlockDriverAIOCB *bdrv_co_aio_flush_em(BlockDriverState *bs,
+        BlockDriverCompletionFunc *cb, void *opaque);
+static int coroutine_fn bdrv_co_readv_em(BlockDriverState *bs,
+                                         int64_t sector_num, int nb_sectors,
+                                         QEMUIOVector *iov);
+static int coroutine_fn bdrv_co_writev_em(BlockDriverState *bs,
+                                         int64_t sector_num, int nb_sectors,
+                                         QEMUIOVector *iov);
+static int coroutine_fn bdrv_co_flush_em(BlockDriverState *bs);
+static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
+                                               int64_t sector_num,
+                                               QEMUIOVector *qiov,
+                                               int nb_sectors,
+                                               BlockDriverCompletionFunc *cb,
+                                               void *opaque,
+                                               bool is_write);
 
 static QTAILQ_HEAD(, BlockDriverState) bdrv_states =
     QTAILQ_HEAD_INITIALIZER(bdrv_states);
@@ -169,18 +194,40 @@ void path_combine(char *dest, int dest_size,
 
 void bdrv_register(BlockDriver *bdrv)
 {
-    if (!bdrv->bdrv_aio_readv) {
-        /* add AIO emulation layer */
-        bdrv->bdrv_aio_readv = bdrv_aio_readv_em;
-        bdrv->bdrv_aio_writev = bdrv_aio_writev_em;
-    } else if (!bdrv->bdrv_read) {
-        /* add synchronous IO emulation layer */
+    if (bdrv->bdrv_co_readv) {
+        /* Emulate AIO by coroutines, and sync by AIO */
+        bdrv->bdrv_aio_readv = bdrv_co_aio_readv_em;
+        bdrv->bdrv_aio_writev = bdrv_co_aio_writev_em;
         bdrv->bdrv_read = bdrv_read_em;
         bdrv->bdrv_write = bdrv_write_em;
+    } else {
+        bdrv->bdrv_co_readv = bdrv_co_readv_em;
+        bdrv->bdrv_co_writev = bdrv_co_writev_em;
+
+        if (!bdrv->bdrv_aio_readv) {
+            /* add AIO emulation layer */
+            bdrv->bdrv_aio_readv = bdrv_aio_readv_em;
+            bdrv->bdrv_aio_writev = bdrv_aio_writev_em;
+        } else if (!bdrv->bdrv_read) {
+            /* add synchronous IO emulation layer */
+            bdrv->bdrv_read = bdrv_read_em;
+            bdrv->bdrv_write = bdrv_write_em;
+        }
     }
 
-    if (!bdrv->bdrv_aio_flush)
-        bdrv->bdrv_aio_flush = bdrv_aio_flush_em;
+    if (bdrv->bdrv_co_flush) {
+        if (!bdrv->bdrv_aio_flush) {
+            bdrv->bdrv_aio_flush = bdrv_co_aio_flush_em;
+        }
+        if (!bdrv->bdrv_flush) {
+            bdrv->bdrv_flush = bdrv_flush_em;
+        }
+    } else {
+        bdrv->bdrv_co_flush = bdrv_co_flush_em;
+        if (!bdrv->bdrv_aio_flush) {
+            bdrv->bdrv_aio_flush = bdrv_aio_flush_em;
+        }
+    }
 
     QLIST_INSERT_HEAD(&bdrv_drivers, bdrv, list);
 }
@@ -192,6 +239,8 @@ BlockDriverState *bdrv_new(const char *device_name)
 
     bs = qemu_mallocz(sizeof(BlockDriverState));
     pstrcpy(bs->device_name, sizeof(bs->device_name), device_name);
+    QTAILQ_INIT(&bs->throttled_reqs);
+    QLIST_INIT(&bs->tracked_requests);
     if (device_name[0] != '\0') {
         QTAILQ_INSERT_TAIL(&bdrv_states, bs, list);
     }
@@ -446,7 +495,8 @@ static int bdrv_open_common(BlockDriverState *bs, const char *filename,
      * Clear flags that are internal to the block layer before opening the
      * image.
      */
-    open_flags = flags & ~(BDRV_O_SNAPSHOT | BDRV_O_NO_BACKING);
+    open_flags = flags & ~(BDRV_O_SNAPSHOT | BDRV_O_NO_BACKING |
+                           BDRV_O_COPY_ON_READ);
 
     /*
      * Snapshots should be writable.
@@ -471,6 +521,11 @@ static int bdrv_open_common(BlockDriverState *bs, const char *filename,
 
     bs->keep_read_only = bs->read_only = !(open_flags & BDRV_O_RDWR);
 
+    /* Copying into a read-only image is not possible, just ignore the flag */
+    if ((flags & BDRV_O_COPY_ON_READ) && !bs->read_only) {
+        bdrv_enable_copy_on_read(bs);
+    }
+
     ret = refresh_total_sectors(bs, bs->total_sectors);
     if (ret < 0) {
         goto free_and_fail;
@@ -619,8 +674,8 @@ int bdrv_open(BlockDriverState *bs, const char *filename, int flags,
         }
 
         /* backing files always opened read-only */
-        back_flags =
-            flags & ~(BDRV_O_RDWR | BDRV_O_SNAPSHOT | BDRV_O_NO_BACKING);
+        back_flags = flags & ~(BDRV_O_RDWR | BDRV_O_SNAPSHOT |
+                               BDRV_O_NO_BACKING | BDRV_O_COPY_ON_READ);
 
         ret = bdrv_open(bs->backing_hd, backing_filename, back_flags, back_drv);
         if (ret < 0) {
@@ -651,29 +706,42 @@ unlink_and_fail:
     return ret;
 }
 
-void bdrv_close(BlockDriverState *bs)
+static void bdrv_close_image(BlockDriverState *bs)
 {
-    if (bs->drv) {
-        if (bs == bs_snapshots) {
-            bs_snapshots = NULL;
-        }
-        if (bs->backing_hd) {
-            bdrv_delete(bs->backing_hd);
-            bs->backing_hd = NULL;
-        }
-        bs->drv->bdrv_close(bs);
-        qemu_free(bs->opaque);
+    if (bs == bs_snapshots) {
+        bs_snapshots = NULL;
+    }
+    if (bs->backing_hd) {
+        bdrv_delete(bs->backing_hd);
+        bs->backing_hd = NULL;
+    }
+    bs->drv->bdrv_close(bs);
+    qemu_free(bs->opaque);
 #ifdef _WIN32
-        if (bs->is_temporary) {
-            unlink(bs->filename);
-        }
+    if (bs->is_temporary) {
+        unlink(bs->filename);
+    }
 #endif
-        bs->opaque = NULL;
-        bs->drv = NULL;
+    bs->opaque = NULL;
+    bs->drv = NULL;
 
-        if (bs->file != NULL) {
-            bdrv_close(bs->file);
-        }
+    if (bs->file != NULL) {
+        bdrv_close(bs->file);
+    }
+}
+
+void bdrv_close(BlockDriverState *bs)
+{
+    /* Throttled requests must reach the driver before it goes away */
+    bdrv_io_limits_dispatch(bs, true);
+
+    if (bs->job) {
+        block_job_cancel_sync(bs->job);
+    }
+    bs->copy_on_read = 0;
+
+    if (bs->drv) {
+        bdrv_close_image(bs);
 
         /* call the change callback */
         bs->media_changed = 1;
@@ -682,6 +750,40 @@ void bdrv_close(BlockDriverState *bs)
     }
 }
 
+/*
+ * Switch the device bs over to the image in filename, for example at the end
+ * of a block job that copied the device's contents there.  Unlike closing and
+ * opening bs, this leaves the block job of the device alone.  If the new
+ * image can't be opened, the old one is reopened.
+ */
+int bdrv_replace_image(BlockDriverState *bs, const char *filename, int flags,
+                       BlockDriver *drv)
+{
+    BlockDriver *old_drv = bs->drv;
+    int old_flags = bs->open_flags;
+    char old_filename[1024];
+    int ret;
+
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    }
+
+    pstrcpy(old_filename, sizeof(old_filename), bs->filename);
+
+    bdrv_drain_all();
+    bdrv_flush(bs);
+    bdrv_close_image(bs);
+
+    ret = bdrv_open(bs, filename, flags, drv);
+    if (ret < 0) {
+        if (bdrv_open(bs, old_filename, old_flags, old_drv) < 0) {
+            error_report("Could not reopen '%s' after failing to open '%s'",
+                         old_filename, filename);
+        }
+    }
+    return ret;
+}
+
 void bdrv_close_all(void)
 {
     BlockDriverState *bs;
@@ -714,6 +816,10 @@ void bdrv_delete(BlockDriverState *bs)
     }
 
     assert(bs != bs_snapshots);
+    if (bs->io_limits_timer) {
+        qemu_del_timer(bs->io_limits_timer);
+        qemu_free_timer(bs->io_limits_timer);
+    }
     qemu_free(bs);
 }
 
@@ -920,6 +1026,16 @@ static int bdrv_check_request(BlockDriverState *bs, int64_t sector_num,
                                    nb_sectors * BDRV_SECTOR_SIZE);
 }
 
+/*
+ * Inside a coroutine, a synchronous request on a driver that can do AIO is
+ * turned into a coroutine request so that the caller yields instead of
+ * blocking the whole process while the I/O is in flight.
+ */
+static bool bdrv_rw_in_coroutine(BlockDriver *drv)
+{
+    return qemu_in_coroutine() && drv->bdrv_aio_readv != bdrv_aio_readv_em;
+}
+
 /* return < 0 if error. See bdrv_write() for the return codes */
 int bdrv_read(BlockDriverState *bs, int64_t sector_num,
               uint8_t *buf, int nb_sectors)
@@ -931,6 +1047,16 @@ int bdrv_read(BlockDriverState *bs, int64_t sector_num,
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return -EIO;
 
+    if (bdrv_rw_in_coroutine(drv)) {
+        struct iovec iov;
+        QEMUIOVector qiov;
+
+        iov.iov_base = (void *)buf;
+        iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        return drv->bdrv_co_readv(bs, sector_num, nb_sectors, &qiov);
+    }
+
     return drv->bdrv_read(bs, sector_num, buf, nb_sectors);
 }
 
@@ -987,9 +1113,284 @@ int bdrv_write(BlockDriverState *bs, int64_t sector_num,
         bs->wr_highest_sector = sector_num + nb_sectors - 1;
     }
 
+    if (bdrv_rw_in_coroutine(drv)) {
+        struct iovec iov;
+        QEMUIOVector qiov;
+
+        iov.iov_base = (void *)buf;
+        iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        return drv->bdrv_co_writev(bs, sector_num, nb_sectors, &qiov);
+    }
+
     return drv->bdrv_write(bs, sector_num, buf, nb_sectors);
 }
 
+/*
+ * Copy-on-read
+ *
+ * While copy-on-read is enabled, all requests are tracked so that the data
+ * copied up from the backing file cannot overwrite a concurrent guest write.
+ * Overlap is checked at cluster granularity because that is the unit in
+ * which the image format allocates, and therefore copies, data.
+ */
+
+typedef struct BdrvTrackedRequest {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    int nb_sectors;
+    bool is_write;
+    QLIST_ENTRY(BdrvTrackedRequest) list;
+    CoQueue wait_queue; /* coroutines blocked on this request */
+} BdrvTrackedRequest;
+
+static void tracked_request_begin(BdrvTrackedRequest *req,
+                                  BlockDriverState *bs,
+                                  int64_t sector_num,
+                                  int nb_sectors, bool is_write)
+{
+    *req = (BdrvTrackedRequest){
+        .bs = bs,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .is_write = is_write,
+    };
+
+    qemu_co_queue_init(&req->wait_queue);
+    QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+}
+
+static void tracked_request_end(BdrvTrackedRequest *req)
+{
+    QLIST_REMOVE(req, list);
+    qemu_co_queue_restart_all(&req->wait_queue);
+}
+
+/*
+ * Round a region to cluster boundaries, without going past the end of the
+ * image.  Formats without clusters are handled at sector granularity.
+ */
+static void round_to_clusters(BlockDriverState *bs,
+                              int64_t sector_num, int nb_sectors,
+                              int64_t *cluster_sector_num,
+                              int *cluster_nb_sectors)
+{
+    BlockDriverInfo bdi;
+    int64_t cluster_sectors, end;
+
+    if (bdrv_get_info(bs, &bdi) < 0 || bdi.cluster_size == 0) {
+        *cluster_sector_num = sector_num;
+        *cluster_nb_sectors = nb_sectors;
+        return;
+    }
+
+    cluster_sectors = bdi.cluster_size >> BDRV_SECTOR_BITS;
+    *cluster_sector_num = sector_num - sector_num % cluster_sectors;
+    end = sector_num + nb_sectors + cluster_sectors - 1;
+    end -= end % cluster_sectors;
+    if (end > bs->total_sectors) {
+        end = MAX(bs->total_sectors, sector_num + nb_sectors);
+    }
+    *cluster_nb_sectors = end - *cluster_sector_num;
+}
+
+static bool tracked_request_overlaps(BdrvTrackedRequest *req,
+                                     int64_t sector_num, int nb_sectors)
+{
+    /*        aaaa   bbbb */
+    if (sector_num >= req->sector_num + req->nb_sectors) {
+        return false;
+    }
+    /* bbbb   aaaa        */
+    if (req->sector_num >= sector_num + nb_sectors) {
+        return false;
+    }
+    return true;
+}
+
+static void coroutine_fn wait_for_overlapping_requests(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors)
+{
+    BdrvTrackedRequest *req;
+    int64_t cluster_sector_num;
+    int cluster_nb_sectors;
+    bool retry;
+
+    round_to_clusters(bs, sector_num, nb_sectors,
+                      &cluster_sector_num, &cluster_nb_sectors);
+
+    do {
+        retry = false;
+        QLIST_FOREACH(req, &bs->tracked_requests, list) {
+            if (tracked_request_overlaps(req, cluster_sector_num,
+                                         cluster_nb_sectors)) {
+                qemu_co_queue_wait(&req->wait_queue);
+                retry = true;
+                break;
+            }
+        }
+    } while (retry);
+}
+
+void bdrv_enable_copy_on_read(BlockDriverState *bs)
+{
+    bs->copy_on_read++;
+}
+
+void bdrv_disable_copy_on_read(BlockDriverState *bs)
+{
+    assert(bs->copy_on_read > 0);
+    bs->copy_on_read--;
+}
+
+static int coroutine_fn bdrv_co_do_copy_on_readv(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    BlockDriver *drv = bs->drv;
+    struct iovec iov;
+    QEMUIOVector bounce_qiov;
+    int64_t cluster_sector_num;
+    int cluster_nb_sectors;
+    size_t skip_bytes;
+    void *bounce_buffer;
+    int ret;
+
+    /*
+     * Read and write whole clusters through a bounce buffer.  Writing less
+     * than a cluster would make the format copy the rest from the backing
+     * file again, and the guest may scribble over its own buffer while the
+     * request is in flight.
+     */
+    round_to_clusters(bs, sector_num, nb_sectors,
+                      &cluster_sector_num, &cluster_nb_sectors);
+
+    trace_bdrv_co_copy_on_readv(bs, sector_num, nb_sectors,
+                                cluster_sector_num, cluster_nb_sectors);
+
+    iov.iov_len = cluster_nb_sectors * BDRV_SECTOR_SIZE;
+    iov.iov_base = bounce_buffer = qemu_blockalign(bs, iov.iov_len);
+    qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+
+    ret = drv->bdrv_co_readv(bs, cluster_sector_num, cluster_nb_sectors,
+                             &bounce_qiov);
+    if (ret < 0) {
+        goto err;
+    }
+
+    /*
+     * A failure to populate the image is not a failure of the read itself,
+     * the data is simply read from the backing file again next time.
+     */
+    drv->bdrv_co_writev(bs, cluster_sector_num, cluster_nb_sectors,
+                        &bounce_qiov);
+
+    skip_bytes = (sector_num - cluster_sector_num) * BDRV_SECTOR_SIZE;
+    qemu_iovec_from_buffer(qiov, bounce_buffer + skip_bytes,
+                           nb_sectors * BDRV_SECTOR_SIZE);
+
+err:
+    qemu_vfree(bounce_buffer);
+    return ret;
+}
+
+static int coroutine_fn bdrv_co_do_readv(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    BlockDriver *drv = bs->drv;
+    BdrvTrackedRequest req;
+    int pnum;
+    int ret;
+
+    if (!bs->copy_on_read) {
+        return drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+    }
+
+    wait_for_overlapping_requests(bs, sector_num, nb_sectors);
+    tracked_request_begin(&req, bs, sector_num, nb_sectors, false);
+
+    if (bs->backing_hd &&
+        (!bdrv_co_is_allocated(bs, sector_num, nb_sectors, &pnum) ||
+         pnum != nb_sectors)) {
+        ret = bdrv_co_do_copy_on_readv(bs, sector_num, nb_sectors, qiov);
+    } else {
+        ret = drv->bdrv_co_readv(bs, sector_num, nb_sectors, qiov);
+    }
+
+    tracked_request_end(&req);
+    return ret;
+}
+
+static int coroutine_fn bdrv_co_do_writev(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    BlockDriver *drv = bs->drv;
+    BdrvTrackedRequest req;
+    int ret;
+
+    if (!bs->copy_on_read) {
+        return drv->bdrv_co_writev(bs, sector_num, nb_sectors, qiov);
+    }
+
+    wait_for_overlapping_requests(bs, sector_num, nb_sectors);
+    tracked_request_begin(&req, bs, sector_num, nb_sectors, true);
+    ret = drv->bdrv_co_writev(bs, sector_num, nb_sectors, qiov);
+    tracked_request_end(&req);
+
+    return ret;
+}
+
+int coroutine_fn bdrv_co_readv(BlockDriverState *bs, int64_t sector_num,
+    int nb_sectors, QEMUIOVector *qiov)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (bdrv_check_request(bs, sector_num, nb_sectors)) {
+        return -EIO;
+    }
+
+    return bdrv_co_do_readv(bs, sector_num, nb_sectors, qiov);
+}
+
+int coroutine_fn bdrv_co_writev(BlockDriverState *bs, int64_t sector_num,
+    int nb_sectors, QEMUIOVector *qiov)
+{
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    }
+    if (bs->read_only) {
+        return -EACCES;
+    }
+    if (bdrv_check_request(bs, sector_num, nb_sectors)) {
+        return -EIO;
+    }
+
+    if (bs->dirty_bitmap) {
+        set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
+    }
+
+    if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
+        bs->wr_highest_sector = sector_num + nb_sectors - 1;
+    }
+
+    return bdrv_co_do_writev(bs, sector_num, nb_sectors, qiov);
+}
+
+int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
+{
+    if (bs->open_flags & BDRV_O_NO_FLUSH) {
+        return 0;
+    }
+
+    if (!bs->drv) {
+        return 0;
+    }
+
+    return bs->drv->bdrv_co_flush(bs);
+}
+
 int bdrv_pread(BlockDriverState *bs, int64_t offset,
                void *buf, int count1)
 {
@@ -1650,63 +2051,280 @@ int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
     return bs->drv->bdrv_is_allocated(bs, sector_num, nb_sectors, pnum);
 }
 
-void bdrv_mon_event(const BlockDriverState *bdrv,
-                    BlockMonEventAction action, int is_read)
+/*
+ * Like bdrv_is_allocated(), but for callers in coroutine context: drivers
+ * that serialize their metadata accesses with a CoMutex provide their own
+ * implementation that takes the lock.
+ */
+int coroutine_fn bdrv_co_is_allocated(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, int *pnum)
 {
-    QObject *data;
-    const char *action_str;
-
-    switch (action) {
-    case BDRV_ACTION_REPORT:
-        action_str = "report";
-        break;
-    case BDRV_ACTION_IGNORE:
-        action_str = "ignore";
-        break;
-    case BDRV_ACTION_STOP:
-        action_str = "stop";
-        break;
-    default:
-        abort();
+    if (bs->drv->bdrv_co_is_allocated) {
+        return bs->drv->bdrv_co_is_allocated(bs, sector_num, nb_sectors, pnum);
     }
-
-    data = qobject_from_jsonf("{ 'device': %s, 'action': %s, 'operation': %s }",
-                              bdrv->device_name,
-                              action_str,
-                              is_read ? "read" : "write");
-    monitor_protocol_event(QEVENT_BLOCK_IO_ERROR, data);
-
-    qobject_decref(data);
+    return bdrv_is_allocated(bs, sector_num, nb_sectors, pnum);
 }
 
-static void bdrv_print_dict(QObject *obj, void *opaque)
+/*
+ * Returns the status of the sectors starting at sector_num as a combination
+ * of BDRV_BLOCK_* flags, or a negative errno.  If neither BDRV_BLOCK_DATA nor
+ * BDRV_BLOCK_ZERO is set, the sectors are read from the backing file.
+ *
+ * *pnum is set to the number of sectors, starting at sector_num, that have
+ * the same status.
+ */
+int64_t coroutine_fn bdrv_co_get_block_status(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              int nb_sectors, int *pnum)
 {
-    QDict *bs_dict;
-    Monitor *mon = opaque;
-
-    bs_dict = qobject_to_qdict(obj);
-
-    monitor_printf(mon, "%s: removable=%d",
-                        qdict_get_str(bs_dict, "device"),
-                        qdict_get_bool(bs_dict, "removable"));
+    BlockDriver *drv = bs->drv;
+    int64_t ret;
 
-    if (qdict_get_bool(bs_dict, "removable")) {
-        monitor_printf(mon, " locked=%d", qdict_get_bool(bs_dict, "locked"));
+    if (!drv) {
+        return -ENOMEDIUM;
     }
 
-    if (qdict_haskey(bs_dict, "inserted")) {
-        QDict *qdict = qobject_to_qdict(qdict_get(bs_dict, "inserted"));
+    if (sector_num >= bs->total_sectors) {
+        *pnum = 0;
+        return 0;
+    }
+    nb_sectors = MIN(nb_sectors, bs->total_sectors - sector_num);
 
-        monitor_printf(mon, " file=");
-        monitor_print_filename(mon, qdict_get_str(qdict, "file"));
-        if (qdict_haskey(qdict, "backing_file")) {
-            monitor_printf(mon, " backing_file=");
-            monitor_print_filename(mon, qdict_get_str(qdict, "backing_file"));
+    if (drv->bdrv_co_get_block_status) {
+        ret = drv->bdrv_co_get_block_status(bs, sector_num, nb_sectors, pnum);
+    } else if (drv->bdrv_co_is_allocated || drv->bdrv_is_allocated) {
+        ret = bdrv_co_is_allocated(bs, sector_num, nb_sectors, pnum);
+        if (ret > 0) {
+            ret = BDRV_BLOCK_DATA;
+        }
+    } else {
+        /* Everything is allocated; a protocol maps sectors one to one */
+        *pnum = nb_sectors;
+        ret = BDRV_BLOCK_DATA;
+        if (drv->protocol_name) {
+            ret |= BDRV_BLOCK_OFFSET_VALID |
+                   (sector_num << BDRV_SECTOR_BITS);
+        }
+    }
+
+    if (ret < 0 || (ret & (BDRV_BLOCK_DATA | BDRV_BLOCK_ZERO))) {
+        return ret;
+    }
+
+    /* Unallocated sectors past the end of the backing file read as zero */
+    if (!bs->backing_hd ||
+        sector_num >= bs->backing_hd->total_sectors) {
+        ret |= BDRV_BLOCK_ZERO;
+    } else if (sector_num + *pnum > bs->backing_hd->total_sectors) {
+        *pnum = bs->backing_hd->total_sectors - sector_num;
+    }
+
+    return ret;
+}
+
+/*
+ * Given an image chain: ... -> [BASE] -> [INTER1] -> [INTER2] -> [TOP]
+ *
+ * Like bdrv_co_get_block_status(), but looks through the images between BASE
+ * (exclusive) and TOP (inclusive) until one of them has data or zeroes for
+ * the sectors.  BASE can be NULL to walk the whole chain, in which case
+ * unallocated sectors are always reported as BDRV_BLOCK_ZERO.
+ */
+int64_t coroutine_fn bdrv_co_get_block_status_above(BlockDriverState *top,
+                                                    BlockDriverState *base,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum)
+{
+    BlockDriverState *p;
+    int64_t ret = 0;
+
+    for (p = top; p && p != base; p = p->backing_hd) {
+        ret = bdrv_co_get_block_status(p, sector_num, nb_sectors, pnum);
+        if (ret < 0 || (ret & (BDRV_BLOCK_DATA | BDRV_BLOCK_ZERO))) {
+            break;
+        }
+        /* The status of a lower image can only be as long as ours */
+        nb_sectors = *pnum;
+    }
+
+    return ret;
+}
+
+typedef struct BdrvCoGetBlockStatusData {
+    BlockDriverState *bs;
+    BlockDriverState *base;
+    int64_t sector_num;
+    int nb_sectors;
+    int *pnum;
+    int64_t ret;
+    bool done;
+} BdrvCoGetBlockStatusData;
+
+static void coroutine_fn bdrv_get_block_status_co_entry(void *opaque)
+{
+    BdrvCoGetBlockStatusData *data = opaque;
+
+    data->ret = bdrv_co_get_block_status_above(data->bs, data->base,
+                                               data->sector_num,
+                                               data->nb_sectors, data->pnum);
+    data->done = true;
+}
+
+/*
+ * Synchronous wrapper around bdrv_co_get_block_status_above()
+ */
+int64_t bdrv_get_block_status_above(BlockDriverState *top,
+                                    BlockDriverState *base,
+                                    int64_t sector_num,
+                                    int nb_sectors, int *pnum)
+{
+    Coroutine *co;
+    BdrvCoGetBlockStatusData data = {
+        .bs = top,
+        .base = base,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .pnum = pnum,
+        .done = false,
+    };
+
+    if (qemu_in_coroutine()) {
+        return bdrv_co_get_block_status_above(top, base, sector_num,
+                                              nb_sectors, pnum);
+    }
+
+    co = qemu_coroutine_create(bdrv_get_block_status_co_entry);
+    qemu_coroutine_enter(co, &data);
+    while (!data.done) {
+        qemu_aio_wait();
+    }
+    return data.ret;
+}
+
+/*
+ * Like bdrv_get_block_status_above(), but only for bs itself: sectors that
+ * come from the backing file have neither BDRV_BLOCK_DATA nor BDRV_BLOCK_ZERO.
+ */
+int64_t bdrv_get_block_status(BlockDriverState *bs, int64_t sector_num,
+                              int nb_sectors, int *pnum)
+{
+    return bdrv_get_block_status_above(bs, bs->backing_hd, sector_num,
+                                       nb_sectors, pnum);
+}
+
+/*
+ * Remove the backing file from an image whose data has been completely
+ * copied up.  This relies on copy-on-read being enabled, so that requests
+ * which may still be reading from the backing file are tracked and can be
+ * waited for before it is closed.
+ */
+int coroutine_fn bdrv_co_drop_backing_hd(BlockDriverState *bs)
+{
+    BlockDriverState *backing_hd = bs->backing_hd;
+    BdrvTrackedRequest marker, *req;
+    int ret;
+
+    assert(bs->copy_on_read);
+
+    ret = bdrv_change_backing_file(bs, NULL, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bs->backing_hd = NULL;
+    bs->backing_file[0] = '\0';
+    bs->backing_format[0] = '\0';
+
+    /*
+     * New requests are inserted at the head of the list, so everything after
+     * the (empty, never overlapping) marker was started before the backing
+     * file was detached.
+     */
+    tracked_request_begin(&marker, bs, 0, 0, false);
+    while ((req = QLIST_NEXT(&marker, list))) {
+        qemu_co_queue_wait(&req->wait_queue);
+    }
+    tracked_request_end(&marker);
+
+    if (backing_hd) {
+        bdrv_delete(backing_hd);
+    }
+    return 0;
+}
+
+void bdrv_mon_event(const BlockDriverState *bdrv,
+                    BlockMonEventAction action, int is_read)
+{
+    QObject *data;
+    const char *action_str;
+
+    switch (action) {
+    case BDRV_ACTION_REPORT:
+        action_str = "report";
+        break;
+    case BDRV_ACTION_IGNORE:
+        action_str = "ignore";
+        break;
+    case BDRV_ACTION_STOP:
+        action_str = "stop";
+        break;
+    default:
+        abort();
+    }
+
+    data = qobject_from_jsonf("{ 'device': %s, 'action': %s, 'operation': %s }",
+                              bdrv->device_name,
+                              action_str,
+                              is_read ? "read" : "write");
+    monitor_protocol_event(QEVENT_BLOCK_IO_ERROR, data);
+
+    qobject_decref(data);
+}
+
+static void bdrv_print_dict(QObject *obj, void *opaque)
+{
+    QDict *bs_dict;
+    Monitor *mon = opaque;
+
+    bs_dict = qobject_to_qdict(obj);
+
+    monitor_printf(mon, "%s: removable=%d",
+                        qdict_get_str(bs_dict, "device"),
+                        qdict_get_bool(bs_dict, "removable"));
+
+    if (qdict_get_bool(bs_dict, "removable")) {
+        monitor_printf(mon, " locked=%d", qdict_get_bool(bs_dict, "locked"));
+    }
+
+    if (qdict_haskey(bs_dict, "inserted")) {
+        QDict *qdict = qobject_to_qdict(qdict_get(bs_dict, "inserted"));
+
+        monitor_printf(mon, " file=");
+        monitor_print_filename(mon, qdict_get_str(qdict, "file"));
+        if (qdict_haskey(qdict, "backing_file")) {
+            monitor_printf(mon, " backing_file=");
+            monitor_print_filename(mon, qdict_get_str(qdict, "backing_file"));
+        }
+        monitor_printf(mon, " ro=%d drv=%s encrypted=%d",
+                            qdict_get_bool(qdict, "ro"),
+                            qdict_get_str(qdict, "drv"),
+                            qdict_get_bool(qdict, "encrypted"));
+        if (qdict_get_int(qdict, "bps") ||
+            qdict_get_int(qdict, "bps_rd") ||
+            qdict_get_int(qdict, "bps_wr") ||
+            qdict_get_int(qdict, "iops") ||
+            qdict_get_int(qdict, "iops_rd") ||
+            qdict_get_int(qdict, "iops_wr")) {
+            monitor_printf(mon, " bps=%" PRId64 " bps_rd=%" PRId64
+                            " bps_wr=%" PRId64 " iops=%" PRId64
+                            " iops_rd=%" PRId64 " iops_wr=%" PRId64,
+                            qdict_get_int(qdict, "bps"),
+                            qdict_get_int(qdict, "bps_rd"),
+                            qdict_get_int(qdict, "bps_wr"),
+                            qdict_get_int(qdict, "iops"),
+                            qdict_get_int(qdict, "iops_rd"),
+                            qdict_get_int(qdict, "iops_wr"));
         }
-        monitor_printf(mon, " ro=%d drv=%s encrypted=%d",
-                            qdict_get_bool(qdict, "ro"),
-                            qdict_get_str(qdict, "drv"),
-                            qdict_get_bool(qdict, "encrypted"));
     } else {
         monitor_printf(mon, " [not inserted]");
     }
@@ -1739,10 +2357,22 @@ void bdrv_info(Monitor *mon, QObject **ret_data)
             QDict *bs_dict = qobject_to_qdict(bs_obj);
 
             obj = qobject_from_jsonf("{ 'file': %s, 'ro': %i, 'drv': %s, "
-                                     "'encrypted': %i }",
+                                     "'encrypted': %i, "
+                                     "'bps': %" PRId64 ", "
+                                     "'bps_rd': %" PRId64 ", "
+                                     "'bps_wr': %" PRId64 ", "
+                                     "'iops': %" PRId64 ", "
+                                     "'iops_rd': %" PRId64 ", "
+                                     "'iops_wr': %" PRId64 " }",
                                      bs->filename, bs->read_only,
                                      bs->drv->format_name,
-                                     bdrv_is_encrypted(bs));
+                                     bdrv_is_encrypted(bs),
+                                     bs->io_limits.bps[BLOCK_IO_LIMIT_TOTAL],
+                                     bs->io_limits.bps[BLOCK_IO_LIMIT_READ],
+                                     bs->io_limits.bps[BLOCK_IO_LIMIT_WRITE],
+                                     bs->io_limits.iops[BLOCK_IO_LIMIT_TOTAL],
+                                     bs->io_limits.iops[BLOCK_IO_LIMIT_READ],
+                                     bs->io_limits.iops[BLOCK_IO_LIMIT_WRITE]);
             if (bs->backing_file[0] != '\0') {
                 QDict *qdict = qobject_to_qdict(obj);
                 qdict_put(qdict, "backing_file",
@@ -2115,12 +2745,316 @@ char *bdrv_snapshot_dump(char *buf, int buf_size, QEMUSnapshotInfo *sn)
 /**************************************************************/
 /* async I/Os */
 
+/**************************************************************/
+/* I/O throttling */
+
+/*
+ * Each limit is a token bucket that is refilled at the configured rate and
+ * holds at most BLOCK_IO_SLICE_NS worth of tokens, which bounds the burst a
+ * drive can issue after being idle.  A request is admitted as long as none of
+ * the buckets it draws from is in debt; it then takes its full cost, so a
+ * request larger than the bucket is still served but delays the ones behind
+ * it accordingly.  Requests that can't be admitted are queued in FIFO order
+ * and dispatched from a timer.
+ */
+#define BLOCK_IO_SLICE_NS   100000000LL
+
+typedef struct BlockThrottledRequest {
+    BlockDriverAIOCB common;
+    BlockDriverAIOCB *acb;  /* request submitted to the driver, if any */
+    int64_t sector_num;
+    QEMUIOVector *qiov;
+    int nb_sectors;
+    bool is_write;
+    QTAILQ_ENTRY(BlockThrottledRequest) entry;
+} BlockThrottledRequest;
+
+static BlockDriverAIOCB *bdrv_aio_do_readv(BlockDriverState *bs,
+                                           int64_t sector_num,
+                                           QEMUIOVector *qiov, int nb_sectors,
+                                           BlockDriverCompletionFunc *cb,
+                                           void *opaque);
+static BlockDriverAIOCB *bdrv_aio_do_writev(BlockDriverState *bs,
+                                            int64_t sector_num,
+                                            QEMUIOVector *qiov, int nb_sectors,
+                                            BlockDriverCompletionFunc *cb,
+                                            void *opaque);
+
+static void bdrv_io_limits_refill(BlockDriverState *bs)
+{
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    double elapsed = (double)(now - bs->io_tokens_time) / 1000000000LL;
+    double slice = (double)BLOCK_IO_SLICE_NS / 1000000000LL;
+    int i;
+
+    bs->io_tokens_time = now;
+    for (i = 0; i < BLOCK_IO_LIMIT_MAX; i++) {
+        int64_t bps = bs->io_limits.bps[i];
+        int64_t iops = bs->io_limits.iops[i];
+
+        if (bps) {
+            bs->bps_tokens[i] = MIN(bs->bps_tokens[i] + bps * elapsed,
+                                    bps * slice);
+        }
+        if (iops) {
+            bs->iops_tokens[i] = MIN(bs->iops_tokens[i] + iops * elapsed,
+                                     iops * slice);
+        }
+    }
+}
+
+/*
+ * Returns the time in ns until a request in the given direction may be
+ * admitted, 0 if it may be admitted now.
+ */
+static int64_t bdrv_io_limits_wait(BlockDriverState *bs, bool is_write)
+{
+    int types[2] = { is_write ? BLOCK_IO_LIMIT_WRITE : BLOCK_IO_LIMIT_READ,
+                     BLOCK_IO_LIMIT_TOTAL };
+    double wait = 0;
+    int i;
+
+    bdrv_io_limits_refill(bs);
+
+    for (i = 0; i < ARRAY_SIZE(types); i++) {
+        int type = types[i];
+
+        if (bs->io_limits.bps[type] && bs->bps_tokens[type] < 0) {
+            wait = MAX(wait, -bs->bps_tokens[type] / bs->io_limits.bps[type]);
+        }
+        if (bs->io_limits.iops[type] && bs->iops_tokens[type] < 0) {
+            wait = MAX(wait, -bs->iops_tokens[type] / bs->io_limits.iops[type]);
+        }
+    }
+
+    return wait ? (int64_t)(wait * 1000000000LL) + 1 : 0;
+}
+
+static void bdrv_io_limits_account(BlockDriverState *bs, bool is_write,
+                                   int nb_sectors)
+{
+    int types[2] = { is_write ? BLOCK_IO_LIMIT_WRITE : BLOCK_IO_LIMIT_READ,
+                     BLOCK_IO_LIMIT_TOTAL };
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(types); i++) {
+        if (bs->io_limits.bps[types[i]]) {
+            bs->bps_tokens[types[i]] -= (double)nb_sectors * BDRV_SECTOR_SIZE;
+        }
+        if (bs->io_limits.iops[types[i]]) {
+            bs->iops_tokens[types[i]] -= 1;
+        }
+    }
+}
+
+/*
+ * Decide whether a new request has to be queued.  Requests issued from a
+ * nested AsyncContext (synchronous emulation) are never throttled because
+ * the throttling timer does not run while such a request is waited for.
+ */
+static bool bdrv_io_limits_intercept(BlockDriverState *bs, bool is_write,
+                                     int nb_sectors)
+{
+    if (!bs->io_limits_enabled || get_async_context_id() != 0) {
+        return false;
+    }
+
+    /* Keep FIFO order with the requests that are already waiting */
+    if (!QTAILQ_EMPTY(&bs->throttled_reqs) ||
+        bdrv_io_limits_wait(bs, is_write)) {
+        return true;
+    }
+
+    bdrv_io_limits_account(bs, is_write, nb_sectors);
+    return false;
+}
+
+static void bdrv_io_limits_cancel(BlockDriverAIOCB *blockacb)
+{
+    BlockThrottledRequest *req =
+        container_of(blockacb, BlockThrottledRequest, common);
+
+    if (req->acb) {
+        bdrv_aio_cancel(req->acb);
+    } else {
+        QTAILQ_REMOVE(&req->common.bs->throttled_reqs, req, entry);
+    }
+    qemu_aio_release(req);
+}
+
+static AIOPool bdrv_throttled_aio_pool = {
+    .aiocb_size         = sizeof(BlockThrottledRequest),
+    .cancel             = bdrv_io_limits_cancel,
+};
+
+static void bdrv_io_limits_cb(void *opaque, int ret)
+{
+    BlockThrottledRequest *req = opaque;
+
+    req->common.cb(req->common.opaque, ret);
+    qemu_aio_release(req);
+}
+
+static BlockDriverAIOCB *bdrv_io_limits_queue(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              QEMUIOVector *qiov,
+                                              int nb_sectors,
+                                              BlockDriverCompletionFunc *cb,
+                                              void *opaque, bool is_write)
+{
+    BlockThrottledRequest *req;
+    bool was_empty = QTAILQ_EMPTY(&bs->throttled_reqs);
+
+    req = qemu_aio_get(&bdrv_throttled_aio_pool, bs, cb, opaque);
+    req->acb = NULL;
+    req->sector_num = sector_num;
+    req->qiov = qiov;
+    req->nb_sectors = nb_sectors;
+    req->is_write = is_write;
+    QTAILQ_INSERT_TAIL(&bs->throttled_reqs, req, entry);
+
+    trace_bdrv_io_limits_queue(bs, req, sector_num, nb_sectors, is_write);
+
+    if (was_empty) {
+        qemu_mod_timer(bs->io_limits_timer, qemu_get_clock_ns(vm_clock) +
+                       bdrv_io_limits_wait(bs, is_write));
+    }
+
+    return &req->common;
+}
+
+/*
+ * Submit queued requests as long as the limits allow it, or all of them if
+ * force is true.
+ */
+static void bdrv_io_limits_dispatch(BlockDriverState *bs, bool force)
+{
+    BlockThrottledRequest *req;
+    BlockDriverAIOCB *acb;
+    int64_t wait;
+
+    while ((req = QTAILQ_FIRST(&bs->throttled_reqs)) != NULL) {
+        wait = bdrv_io_limits_wait(bs, req->is_write);
+        if (wait && !force) {
+            qemu_mod_timer(bs->io_limits_timer,
+                           qemu_get_clock_ns(vm_clock) + wait);
+            return;
+        }
+
+        QTAILQ_REMOVE(&bs->throttled_reqs, req, entry);
+        bdrv_io_limits_account(bs, req->is_write, req->nb_sectors);
+
+        trace_bdrv_io_limits_dispatch(bs, req, req->sector_num,
+                                      req->nb_sectors, req->is_write);
+
+        acb = NULL;
+        if (!bs->drv) {
+            /* media went away while the request was waiting */
+        } else if (req->is_write) {
+            acb = bdrv_aio_do_writev(bs, req->sector_num, req->qiov,
+                                     req->nb_sectors, bdrv_io_limits_cb, req);
+        } else {
+            acb = bdrv_aio_do_readv(bs, req->sector_num, req->qiov,
+                                    req->nb_sectors, bdrv_io_limits_cb, req);
+        }
+
+        if (acb == NULL) {
+            req->common.cb(req->common.opaque, -EIO);
+            qemu_aio_release(req);
+        } else {
+            req->acb = acb;
+        }
+    }
+}
+
+static void bdrv_io_limits_timer_cb(void *opaque)
+{
+    bdrv_io_limits_dispatch(opaque, false);
+}
+
+/*
+ * Limits on the total and on the individual directions are mutually
+ * exclusive for each of bps and iops, and none may be negative.
+ */
+int bdrv_io_limits_valid(const BlockIOLimit *io_limits)
+{
+    int i;
+
+    if ((io_limits->bps[BLOCK_IO_LIMIT_TOTAL] &&
+         (io_limits->bps[BLOCK_IO_LIMIT_READ] ||
+          io_limits->bps[BLOCK_IO_LIMIT_WRITE])) ||
+        (io_limits->iops[BLOCK_IO_LIMIT_TOTAL] &&
+         (io_limits->iops[BLOCK_IO_LIMIT_READ] ||
+          io_limits->iops[BLOCK_IO_LIMIT_WRITE]))) {
+        return 0;
+    }
+
+    for (i = 0; i < BLOCK_IO_LIMIT_MAX; i++) {
+        if (io_limits->bps[i] < 0 || io_limits->iops[i] < 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+void bdrv_set_io_limits(BlockDriverState *bs, const BlockIOLimit *io_limits)
+{
+    int i;
+
+    bs->io_limits = *io_limits;
+    bs->io_limits_enabled = false;
+
+    /* Start with full buckets */
+    for (i = 0; i < BLOCK_IO_LIMIT_MAX; i++) {
+        bs->bps_tokens[i] =
+            (double)io_limits->bps[i] * BLOCK_IO_SLICE_NS / 1000000000LL;
+        bs->iops_tokens[i] =
+            (double)io_limits->iops[i] * BLOCK_IO_SLICE_NS / 1000000000LL;
+        if (io_limits->bps[i] || io_limits->iops[i]) {
+            bs->io_limits_enabled = true;
+        }
+    }
+    bs->io_tokens_time = qemu_get_clock_ns(vm_clock);
+
+    if (bs->io_limits_enabled && !bs->io_limits_timer) {
+        bs->io_limits_timer = qemu_new_timer_ns(vm_clock,
+                                                bdrv_io_limits_timer_cb, bs);
+    }
+
+    /* Requests already waiting are re-evaluated against the new limits */
+    if (bs->io_limits_timer) {
+        qemu_del_timer(bs->io_limits_timer);
+    }
+    bdrv_io_limits_dispatch(bs, !bs->io_limits_enabled);
+}
+
+/*
+ * Wait for all in-flight requests to complete, including those still held
+ * back by I/O throttling, which are submitted regardless of their limits.
+ */
+void bdrv_drain_all(void)
+{
+    BlockDriverState *bs;
+    bool busy;
+
+    do {
+        busy = false;
+        QTAILQ_FOREACH(bs, &bdrv_states, list) {
+            if (!QTAILQ_EMPTY(&bs->throttled_reqs)) {
+                bdrv_io_limits_dispatch(bs, true);
+                busy = true;
+            }
+        }
+        qemu_aio_flush();
+    } while (busy);
+}
+
 BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
                                  QEMUIOVector *qiov, int nb_sectors,
                                  BlockDriverCompletionFunc *cb, void *opaque)
 {
     BlockDriver *drv = bs->drv;
-    BlockDriverAIOCB *ret;
 
     trace_bdrv_aio_readv(bs, sector_num, nb_sectors, opaque);
 
@@ -2129,8 +3063,30 @@ BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return NULL;
 
-    ret = drv->bdrv_aio_readv(bs, sector_num, qiov, nb_sectors,
-                              cb, opaque);
+    if (bdrv_io_limits_intercept(bs, false, nb_sectors)) {
+        return bdrv_io_limits_queue(bs, sector_num, qiov, nb_sectors,
+                                    cb, opaque, false);
+    }
+
+    return bdrv_aio_do_readv(bs, sector_num, qiov, nb_sectors, cb, opaque);
+}
+
+static BlockDriverAIOCB *bdrv_aio_do_readv(BlockDriverState *bs,
+                                           int64_t sector_num,
+                                           QEMUIOVector *qiov, int nb_sectors,
+                                           BlockDriverCompletionFunc *cb,
+                                           void *opaque)
+{
+    BlockDriver *drv = bs->drv;
+    BlockDriverAIOCB *ret;
+
+    if (bs->copy_on_read) {
+        ret = bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors,
+                                    cb, opaque, false);
+    } else {
+        ret = drv->bdrv_aio_readv(bs, sector_num, qiov, nb_sectors,
+                                  cb, opaque);
+    }
 
     if (ret) {
 	/* Update stats even though technically transfer has not happened. */
@@ -2182,8 +3138,6 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
                                   BlockDriverCompletionFunc *cb, void *opaque)
 {
     BlockDriver *drv = bs->drv;
-    BlockDriverAIOCB *ret;
-    BlockCompleteData *blk_cb_data;
 
     trace_bdrv_aio_writev(bs, sector_num, nb_sectors, opaque);
 
@@ -2194,6 +3148,24 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return NULL;
 
+    if (bdrv_io_limits_intercept(bs, true, nb_sectors)) {
+        return bdrv_io_limits_queue(bs, sector_num, qiov, nb_sectors,
+                                    cb, opaque, true);
+    }
+
+    return bdrv_aio_do_writev(bs, sector_num, qiov, nb_sectors, cb, opaque);
+}
+
+static BlockDriverAIOCB *bdrv_aio_do_writev(BlockDriverState *bs,
+                                            int64_t sector_num,
+                                            QEMUIOVector *qiov, int nb_sectors,
+                                            BlockDriverCompletionFunc *cb,
+                                            void *opaque)
+{
+    BlockDriver *drv = bs->drv;
+    BlockDriverAIOCB *ret;
+    BlockCompleteData *blk_cb_data;
+
     if (bs->dirty_bitmap) {
         blk_cb_data = blk_dirty_cb_alloc(bs, sector_num, nb_sectors, cb,
                                          opaque);
@@ -2201,8 +3173,13 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
         opaque = blk_cb_data;
     }
 
-    ret = drv->bdrv_aio_writev(bs, sector_num, qiov, nb_sectors,
-                               cb, opaque);
+    if (bs->copy_on_read) {
+        ret = bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors,
+                                    cb, opaque, true);
+    } else {
+        ret = drv->bdrv_aio_writev(bs, sector_num, qiov, nb_sectors,
+                                   cb, opaque);
+    }
 
     if (ret) {
         /* Update stats even though technically transfer has not happened. */
@@ -2475,6 +3452,34 @@ void bdrv_aio_cancel(BlockDriverAIOCB *acb)
     acb->pool->cancel(acb);
 }
 
+/*
+ * Hint that a series of requests follows which should be submitted to the
+ * host in one go.  Every bdrv_io_plug() must be paired with a call to
+ * bdrv_io_unplug(); nesting is allowed.  Drivers without a plug callback
+ * pass the hint on to their protocol.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
+
 
 /**************************************************************/
 /* async block device emulation */
@@ -2669,6 +3674,219 @@ fail:
     return async_ret;
 }
 
+static int bdrv_flush_em(BlockDriverState *bs)
+{
+    int async_ret;
+    BlockDriverAIOCB *acb;
+
+    if (qemu_in_coroutine()) {
+        return bs->drv->bdrv_co_flush(bs);
+    }
+
+    async_context_push();
+
+    async_ret = NOT_DONE;
+    acb = bs->drv->bdrv_aio_flush(bs, bdrv_rw_em_cb, &async_ret);
+    if (acb == NULL) {
+        async_ret = -1;
+        goto fail;
+    }
+    while (async_ret == NOT_DONE) {
+        qemu_aio_wait();
+    }
+
+fail:
+    async_context_pop();
+    return async_ret;
+}
+
+/**************************************************************/
+/* AIO emulation for coroutine drivers */
+
+typedef struct BlockDriverAIOCBCoroutine {
+    BlockDriverAIOCB common;
+    BlockRequest req;
+    bool is_write;
+    QEMUBH *bh;
+} BlockDriverAIOCBCoroutine;
+
+static void bdrv_aio_co_cancel_em(BlockDriverAIOCB *blockacb)
+{
+    /* A coroutine can't be stopped halfway, wait for it to finish */
+    qemu_aio_flush();
+}
+
+static AIOPool bdrv_em_co_aio_pool = {
+    .aiocb_size         = sizeof(BlockDriverAIOCBCoroutine),
+    .cancel             = bdrv_aio_co_cancel_em,
+};
+
+static void bdrv_co_em_bh(void *opaque)
+{
+    BlockDriverAIOCBCoroutine *acb = opaque;
+
+    acb->common.cb(acb->common.opaque, acb->req.error);
+    qemu_bh_delete(acb->bh);
+    qemu_aio_release(acb);
+}
+
+static void coroutine_fn bdrv_co_rw(void *opaque)
+{
+    BlockDriverAIOCBCoroutine *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+
+    if (!acb->is_write) {
+        acb->req.error = bdrv_co_do_readv(bs, acb->req.sector,
+            acb->req.nb_sectors, acb->req.qiov);
+    } else {
+        acb->req.error = bdrv_co_do_writev(bs, acb->req.sector,
+            acb->req.nb_sectors, acb->req.qiov);
+    }
+
+    qemu_bh_schedule(acb->bh);
+}
+
+static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
+                                               int64_t sector_num,
+                                               QEMUIOVector *qiov,
+                                               int nb_sectors,
+                                               BlockDriverCompletionFunc *cb,
+                                               void *opaque,
+                                               bool is_write)
+{
+    Coroutine *co;
+    BlockDriverAIOCBCoroutine *acb;
+
+    acb = qemu_aio_get(&bdrv_em_co_aio_pool, bs, cb, opaque);
+    acb->req.sector = sector_num;
+    acb->req.nb_sectors = nb_sectors;
+    acb->req.qiov = qiov;
+    acb->is_write = is_write;
+
+    /*
+     * The BH is created here so that the completion is delivered in the
+     * AsyncContext of the submitter, wherever the coroutine is resumed from.
+     */
+    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+
+    co = qemu_coroutine_create(bdrv_co_rw);
+    qemu_coroutine_enter(co, acb);
+
+    return &acb->common;
+}
+
+static BlockDriverAIOCB *bdrv_co_aio_readv_em(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors, cb, opaque,
+                                 false);
+}
+
+static BlockDriverAIOCB *bdrv_co_aio_writev_em(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return bdrv_co_aio_rw_vector(bs, sector_num, qiov, nb_sectors, cb, opaque,
+                                 true);
+}
+
+static void coroutine_fn bdrv_co_flush_entry(void *opaque)
+{
+    BlockDriverAIOCBCoroutine *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+
+    acb->req.error = bs->drv->bdrv_co_flush(bs);
+    qemu_bh_schedule(acb->bh);
+}
+
+static BlockDriverAIOCB *bdrv_co_aio_flush_em(BlockDriverState *bs,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    Coroutine *co;
+    BlockDriverAIOCBCoroutine *acb;
+
+    acb = qemu_aio_get(&bdrv_em_co_aio_pool, bs, cb, opaque);
+    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+
+    co = qemu_coroutine_create(bdrv_co_flush_entry);
+    qemu_coroutine_enter(co, acb);
+
+    return &acb->common;
+}
+
+/**************************************************************/
+/* coroutine emulation for AIO drivers */
+
+typedef struct CoroutineIOCompletion {
+    Coroutine *coroutine;
+    int ret;
+} CoroutineIOCompletion;
+
+static void bdrv_co_io_em_complete(void *opaque, int ret)
+{
+    CoroutineIOCompletion *co = opaque;
+
+    co->ret = ret;
+    qemu_coroutine_enter(co->coroutine, NULL);
+}
+
+static int coroutine_fn bdrv_co_io_em(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, QEMUIOVector *iov,
+                                      bool is_write)
+{
+    CoroutineIOCompletion co = {
+        .coroutine = qemu_coroutine_self(),
+    };
+    BlockDriverAIOCB *acb;
+
+    if (is_write) {
+        acb = bs->drv->bdrv_aio_writev(bs, sector_num, iov, nb_sectors,
+                                       bdrv_co_io_em_complete, &co);
+    } else {
+        acb = bs->drv->bdrv_aio_readv(bs, sector_num, iov, nb_sectors,
+                                      bdrv_co_io_em_complete, &co);
+    }
+
+    trace_bdrv_co_io_em(bs, sector_num, nb_sectors, is_write, acb);
+    if (!acb) {
+        return -EIO;
+    }
+    qemu_coroutine_yield();
+
+    return co.ret;
+}
+
+static int coroutine_fn bdrv_co_readv_em(BlockDriverState *bs,
+                                         int64_t sector_num, int nb_sectors,
+                                         QEMUIOVector *iov)
+{
+    return bdrv_co_io_em(bs, sector_num, nb_sectors, iov, false);
+}
+
+static int coroutine_fn bdrv_co_writev_em(BlockDriverState *bs,
+                                         int64_t sector_num, int nb_sectors,
+                                         QEMUIOVector *iov)
+{
+    return bdrv_co_io_em(bs, sector_num, nb_sectors, iov, true);
+}
+
+static int coroutine_fn bdrv_co_flush_em(BlockDriverState *bs)
+{
+    CoroutineIOCompletion co = {
+        .coroutine = qemu_coroutine_self(),
+    };
+    BlockDriverAIOCB *acb;
+
+    acb = bs->drv->bdrv_aio_flush(bs, bdrv_co_io_em_complete, &co);
+    if (!acb) {
+        return -EIO;
+    }
+    qemu_coroutine_yield();
+
+    return co.ret;
+}
+
 void bdrv_init(void)
 {
     module_call_init(MODULE_INIT_BLOCK);
@@ -2854,12 +4072,48 @@ int bdrv_get_dirty(BlockDriverState *bs, int64_t sector)
     }
 }
 
+void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
+                    int nr_sectors)
+{
+    set_dirty_bitmap(bs, cur_sector, nr_sectors, 1);
+}
+
 void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector,
                       int nr_sectors)
 {
     set_dirty_bitmap(bs, cur_sector, nr_sectors, 0);
 }
 
+/* Return the first dirty sector at or after sector, or -1 if there is none */
+int64_t bdrv_get_next_dirty(BlockDriverState *bs, int64_t sector)
+{
+    const int bits = sizeof(unsigned long) * 8;
+    int64_t chunk, nb_chunks;
+    unsigned long val;
+
+    if (!bs->dirty_bitmap) {
+        return -1;
+    }
+
+    nb_chunks = (bs->total_sectors + BDRV_SECTORS_PER_DIRTY_CHUNK - 1) /
+                BDRV_SECTORS_PER_DIRTY_CHUNK;
+    chunk = sector / BDRV_SECTORS_PER_DIRTY_CHUNK;
+
+    while (chunk < nb_chunks) {
+        val = bs->dirty_bitmap[chunk / bits] >> (chunk % bits);
+        if (val) {
+            chunk += ctz64(val);
+            break;
+        }
+        chunk = (chunk / bits + 1) * bits;
+    }
+
+    if (chunk >= nb_chunks) {
+        return -1;
+    }
+    return chunk * BDRV_SECTORS_PER_DIRTY_CHUNK;
+}
+
 int64_t bdrv_get_dirty_count(BlockDriverState *bs)
 {
     return bs->dirty_count;
@@ -3018,3 +4272,90 @@ out:
 
     return ret;
 }
+
+/**************************************************************/
+/* block jobs */
+
+void *block_job_create(const BlockJobType *job_type, BlockDriverState *bs,
+                       BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockJob *job;
+
+    if (bs->job || bdrv_in_use(bs)) {
+        return NULL;
+    }
+    bdrv_set_in_use(bs, 1);
+
+    job = qemu_mallocz(job_type->instance_size);
+    job->job_type = job_type;
+    job->bs = bs;
+    job->cb = cb;
+    job->opaque = opaque;
+    job->busy = true;
+    bs->job = job;
+    return job;
+}
+
+void block_job_complete(BlockJob *job, int ret)
+{
+    BlockDriverState *bs = job->bs;
+
+    assert(bs->job == job);
+    job->cb(job->opaque, ret);
+    bs->job = NULL;
+    qemu_free(job);
+    bdrv_set_in_use(bs, 0);
+}
+
+int block_job_set_speed(BlockJob *job, int64_t value)
+{
+    int ret;
+
+    if (!job->job_type->set_speed) {
+        return -ENOTSUP;
+    }
+    ret = job->job_type->set_speed(job, value);
+    if (ret == 0) {
+        job->speed = value;
+    }
+    return ret;
+}
+
+void block_job_cancel(BlockJob *job)
+{
+    job->cancelled = true;
+
+    /* Wake up a sleeping job so that it notices the cancellation */
+    if (job->co && !job->busy) {
+        qemu_coroutine_enter(job->co, NULL);
+    }
+}
+
+bool block_job_is_cancelled(BlockJob *job)
+{
+    return job->cancelled;
+}
+
+void block_job_cancel_sync(BlockJob *job)
+{
+    BlockDriverState *bs = job->bs;
+
+    assert(bs->job == job);
+    block_job_cancel(job);
+    while (bs->job) {
+        qemu_aio_wait();
+    }
+}
+
+void coroutine_fn block_job_sleep_ns(BlockJob *job, QEMUClock *clock,
+                                     int64_t ns)
+{
+    /* A cancelled job must not go to sleep, nobody would wake it up */
+    if (block_job_is_cancelled(job)) {
+        return;
+    }
+
+    job->busy = false;
+    co_sleep_ns(clock, ns);
+    job->busy = true;
+}
@@ -34,33 +34,60 @@
 #define DPRINTF(fmt, ...) do { } while (0)
 #endif
 
-#define CURL_NUM_STATES 8
-#define CURL_NUM_ACB    8
-#define SECTOR_SIZE     512
-#define READ_AHEAD_SIZE (256 * 1024)
+/*
+ * Data is downloaded and cached in segments of CURL_SEGMENT_SIZE bytes.  The
+ * cache, the maximum read-ahead and the number of parallel connections can
+ * be set with trailing options on the URL, e.g.
+ *
+ *   http://server/image.img:readahead=1048576:cachesize=16777216:connections=4:
+ */
+#define CURL_NUM_STATES         16
+#define CURL_MAX_STATES         64
+#define SECTOR_SIZE             512
+#define READ_AHEAD_SIZE         (256 * 1024)
+#define CURL_SEGMENT_SIZE       (64 * 1024)
+#define CURL_CACHE_SIZE         (8 * 1024 * 1024)
 
-#define FIND_RET_NONE   0
-#define FIND_RET_OK     1
-#define FIND_RET_WAIT   2
+/* Segments fetched by a single range request */
+#define CURL_MAX_TRANSFER_SEGS  32
 
 struct BDRVCURLState;
 
 typedef struct CURLAIOCB {
     BlockDriverAIOCB common;
+    QEMUBH *bh;
     QEMUIOVector *qiov;
+    char *buf;
     size_t start;
     size_t end;
+    size_t first_seg;
+    size_t last_seg;
+    size_t next_seg;    /* first segment that hasn't been submitted yet */
+    bool *waiting;      /* per segment, data still has to be copied */
+    int pending;        /* segments being waited for, +1 until submitted */
+    bool submitted;
+    bool in_submit;
+    int ret;
+    QTAILQ_ENTRY(CURLAIOCB) next;
 } CURLAIOCB;
 
+typedef struct CURLSegment {
+    size_t index;       /* offset in the file divided by the segment size */
+    char *data;
+    bool hashed;        /* index is valid and the segment can be looked up */
+    bool pending;       /* download in progress */
+    QLIST_ENTRY(CURLSegment) hash_next;
+    QTAILQ_ENTRY(CURLSegment) lru_next;
+} CURLSegment;
+
 typedef struct CURLState
 {
     struct BDRVCURLState *s;
-    CURLAIOCB *acb[CURL_NUM_ACB];
     CURL *curl;
-    char *orig_buf;
-    size_t buf_start;
+    CURLSegment *segs[CURL_MAX_TRANSFER_SEGS];
+    int nb_segs;
+    int done_segs;      /* segments received completely */
     size_t buf_off;
-    size_t buf_len;
     char range[128];
     char errmsg[CURL_ERROR_SIZE];
     char in_use;
@@ -69,13 +96,29 @@ typedef struct CURLState
 typedef struct BDRVCURLState {
     CURLM *multi;
     size_t len;
-    CURLState states[CURL_NUM_STATES];
+    CURLState *states;
+    int num_states;
     char *url;
+
+    /* Segment cache, most recently used segments at the tail of the list */
+    CURLSegment *segs;
+    int num_segs;
+    QLIST_HEAD(, CURLSegment) *hash;
+    size_t hash_mask;
+    QTAILQ_HEAD(, CURLSegment) lru;
+
+    /* Requests waiting for a download */
+    QTAILQ_HEAD(, CURLAIOCB) acbs;
+
+    /* Read-ahead grows while the guest reads sequentially */
     size_t readahead_size;
+    size_t ra_window;
+    size_t ra_next;
 } BDRVCURLState;
 
 static void curl_clean_state(CURLState *s);
 static void curl_multi_do(void *arg);
+static void curl_aio_submit(BDRVCURLState *s, CURLAIOCB *acb, size_t ra_end);
 
 static int curl_sock_cb(CURL *curl, curl_socket_t fd, int action,
                         void *s, void *sp)
@@ -113,95 +156,187 @@ static size_t curl_size_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
     return realsize;
 }
 
-static size_t curl_read_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
+static size_t curl_seg_len(BDRVCURLState *s, size_t index)
 {
-    CURLState *s = ((CURLState*)opaque);
-    size_t realsize = size * nmemb;
-    int i;
+    return MIN(CURL_SEGMENT_SIZE, s->len - index * CURL_SEGMENT_SIZE);
+}
 
-    DPRINTF("CURL: Just reading %zd bytes\n", realsize);
+static CURLSegment *curl_seg_find(BDRVCURLState *s, size_t index)
+{
+    CURLSegment *seg;
 
-    if (!s || !s->orig_buf)
-        goto read_end;
+    QLIST_FOREACH(seg, &s->hash[index & s->hash_mask], hash_next) {
+        if (seg->index == index) {
+            return seg;
+        }
+    }
+    return NULL;
+}
 
-    memcpy(s->orig_buf + s->buf_off, ptr, realsize);
-    s->buf_off += realsize;
+static void curl_seg_touch(BDRVCURLState *s, CURLSegment *seg)
+{
+    QTAILQ_REMOVE(&s->lru, seg, lru_next);
+    QTAILQ_INSERT_TAIL(&s->lru, seg, lru_next);
+}
 
-    for(i=0; i<CURL_NUM_ACB; i++) {
-        CURLAIOCB *acb = s->acb[i];
+static void curl_seg_drop(BDRVCURLState *s, CURLSegment *seg)
+{
+    if (seg->hashed) {
+        QLIST_REMOVE(seg, hash_next);
+        seg->hashed = false;
+    }
+    seg->pending = false;
+}
 
-        if (!acb)
-            continue;
+/*
+ * Takes the least recently used segment that isn't being downloaded and
+ * reuses it for index.  Returns NULL if all segments are busy.
+ */
+static CURLSegment *curl_seg_alloc(BDRVCURLState *s, size_t index)
+{
+    CURLSegment *seg;
 
-        if ((s->buf_off >= acb->end)) {
-            qemu_iovec_from_buffer(acb->qiov, s->orig_buf + acb->start,
-                                   acb->end - acb->start);
-            acb->common.cb(acb->common.opaque, 0);
-            qemu_aio_release(acb);
-            s->acb[i] = NULL;
+    QTAILQ_FOREACH(seg, &s->lru, lru_next) {
+        if (!seg->pending) {
+            break;
         }
     }
+    if (!seg) {
+        return NULL;
+    }
 
-read_end:
-    return realsize;
+    curl_seg_drop(s, seg);
+    if (!seg->data) {
+        seg->data = qemu_malloc(CURL_SEGMENT_SIZE);
+    }
+    seg->index = index;
+    seg->hashed = true;
+    seg->pending = true;
+    QLIST_INSERT_HEAD(&s->hash[index & s->hash_mask], seg, hash_next);
+    curl_seg_touch(s, seg);
+
+    return seg;
 }
 
-static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
-                         CURLAIOCB *acb)
+/* Copies the part of the segment that the request covers */
+static void curl_seg_copy(BDRVCURLState *s, CURLAIOCB *acb, CURLSegment *seg)
 {
-    int i;
-    size_t end = start + len;
+    size_t seg_start = seg->index * CURL_SEGMENT_SIZE;
+    size_t start = MAX(seg_start, acb->start);
+    size_t end = MIN(seg_start + curl_seg_len(s, seg->index), acb->end);
 
-    for (i=0; i<CURL_NUM_STATES; i++) {
-        CURLState *state = &s->states[i];
-        size_t buf_end = (state->buf_start + state->buf_off);
-        size_t buf_fend = (state->buf_start + state->buf_len);
+    memcpy(acb->buf + (start - acb->start), seg->data + (start - seg_start),
+           end - start);
+}
 
-        if (!state->orig_buf)
-            continue;
-        if (!state->buf_off)
-            continue;
+static void curl_aio_complete(CURLAIOCB *acb)
+{
+    BDRVCURLState *s = acb->common.bs->opaque;
 
-        // Does the existing buffer cover our section?
-        if ((start >= state->buf_start) &&
-            (start <= buf_end) &&
-            (end >= state->buf_start) &&
-            (end <= buf_end))
-        {
-            char *buf = state->orig_buf + (start - state->buf_start);
+    qemu_iovec_from_buffer(acb->qiov, acb->buf, acb->qiov->size);
+    acb->common.cb(acb->common.opaque, acb->ret);
 
-            qemu_iovec_from_buffer(acb->qiov, buf, len);
-            acb->common.cb(acb->common.opaque, 0);
+    QTAILQ_REMOVE(&s->acbs, acb, next);
+    qemu_free(acb->buf);
+    qemu_free(acb->waiting);
+    qemu_aio_release(acb);
+}
 
-            return FIND_RET_OK;
+static void curl_aio_bh_cb(void *opaque)
+{
+    CURLAIOCB *acb = opaque;
+
+    qemu_bh_delete(acb->bh);
+    acb->bh = NULL;
+    curl_aio_complete(acb);
+}
+
+/*
+ * Requests are completed from a bottom half, so that their callbacks can
+ * start new requests without reentering libcurl.
+ */
+static void curl_aio_schedule_complete(CURLAIOCB *acb)
+{
+    acb->bh = qemu_bh_new(curl_aio_bh_cb, acb);
+    qemu_bh_schedule(acb->bh);
+}
+
+/*
+ * Called when a segment download has finished, ret is 0 if the data is now
+ * in the segment.  Completes the requests that were waiting for it.
+ */
+static void curl_seg_done(BDRVCURLState *s, CURLSegment *seg, int ret)
+{
+    CURLAIOCB *acb;
+
+    seg->pending = false;
+
+    QTAILQ_FOREACH(acb, &s->acbs, next) {
+        size_t i = seg->index - acb->first_seg;
+
+        if (seg->index < acb->first_seg || seg->index > acb->last_seg ||
+            !acb->waiting[i]) {
+            continue;
         }
 
-        // Wait for unfinished chunks
-        if ((start >= state->buf_start) &&
-            (start <= buf_fend) &&
-            (end >= state->buf_start) &&
-            (end <= buf_fend))
-        {
-            int j;
-
-            acb->start = start - state->buf_start;
-            acb->end = acb->start + len;
-
-            for (j=0; j<CURL_NUM_ACB; j++) {
-                if (!state->acb[j]) {
-                    state->acb[j] = acb;
-                    return FIND_RET_WAIT;
-                }
-            }
+        acb->waiting[i] = false;
+        if (ret < 0) {
+            acb->ret = ret;
+        } else {
+            curl_seg_copy(s, acb, seg);
+        }
+        if (--acb->pending == 0) {
+            curl_aio_schedule_complete(acb);
         }
     }
 
-    return FIND_RET_NONE;
+    if (ret < 0) {
+        curl_seg_drop(s, seg);
+    }
+}
+
+static size_t curl_read_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
+{
+    CURLState *state = ((CURLState*)opaque);
+    BDRVCURLState *s = state->s;
+    size_t realsize = size * nmemb;
+    char *data = ptr;
+    size_t left = realsize;
+
+    DPRINTF("CURL: Just reading %zd bytes\n", realsize);
+
+    while (left > 0) {
+        int i = state->done_segs;
+        CURLSegment *seg;
+        size_t seg_off, seg_len, n;
+
+        if (i >= state->nb_segs) {
+            /* More data than we asked for */
+            break;
+        }
+        seg_off = state->buf_off - i * CURL_SEGMENT_SIZE;
+        seg = state->segs[i];
+        seg_len = curl_seg_len(s, seg->index);
+        n = MIN(left, seg_len - seg_off);
+
+        memcpy(seg->data + seg_off, data, n);
+        data += n;
+        left -= n;
+        state->buf_off += n;
+
+        if (seg_off + n == seg_len) {
+            state->done_segs++;
+            curl_seg_done(s, seg, 0);
+        }
+    }
+
+    return realsize;
 }
 
 static void curl_multi_do(void *arg)
 {
     BDRVCURLState *s = (BDRVCURLState *)arg;
+    CURLAIOCB *acb;
     int running;
     int r;
     int msgs_in_queue;
@@ -228,7 +363,21 @@ static void curl_multi_do(void *arg)
             case CURLMSG_DONE:
             {
                 CURLState *state = NULL;
+                int i;
+
                 curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&state);
+                if (msg->data.result != CURLE_OK) {
+                    fprintf(stderr, "CURL: Error reading %s: %s\n",
+                            state->range, state->errmsg);
+                }
+
+                /*
+                 * Fail the segments that didn't arrive.  The ones that did
+                 * may already be reused for another download.
+                 */
+                for (i = state->done_segs; i < state->nb_segs; i++) {
+                    curl_seg_done(s, state->segs[i], -EIO);
+                }
                 curl_clean_state(state);
                 break;
             }
@@ -237,18 +386,22 @@ static void curl_multi_do(void *arg)
                 break;
         }
     } while(msgs_in_queue);
+
+    /* Finished downloads may have freed cache segments for waiting requests */
+    QTAILQ_FOREACH(acb, &s->acbs, next) {
+        if (!acb->submitted && !acb->in_submit) {
+            curl_aio_submit(s, acb, acb->last_seg);
+        }
+    }
 }
 
 static CURLState *curl_init_state(BDRVCURLState *s)
 {
     CURLState *state = NULL;
-    int i, j;
+    int i;
 
     do {
-        for (i=0; i<CURL_NUM_STATES; i++) {
-            for (j=0; j<CURL_NUM_ACB; j++)
-                if (s->states[i].acb[j])
-                    continue;
+        for (i=0; i<s->num_states; i++) {
             if (s->states[i].in_use)
                 continue;
 
@@ -266,8 +419,10 @@ static CURLState *curl_init_state(BDRVCURLState *s)
         goto has_curl;
 
     state->curl = curl_easy_init();
-    if (!state->curl)
+    if (!state->curl) {
+        state->in_use = 0;
         return NULL;
+    }
     curl_easy_setopt(state->curl, CURLOPT_URL, s->url);
     curl_easy_setopt(state->curl, CURLOPT_TIMEOUT, 5);
     curl_easy_setopt(state->curl, CURLOPT_WRITEFUNCTION, (void *)curl_read_cb);
@@ -276,6 +431,7 @@ static CURLState *curl_init_state(BDRVCURLState *s)
     curl_easy_setopt(state->curl, CURLOPT_AUTOREFERER, 1);
     curl_easy_setopt(state->curl, CURLOPT_FOLLOWLOCATION, 1);
     curl_easy_setopt(state->curl, CURLOPT_NOSIGNAL, 1);
+    curl_easy_setopt(state->curl, CURLOPT_FAILONERROR, 1);
     curl_easy_setopt(state->curl, CURLOPT_ERRORBUFFER, state->errmsg);
     
 #ifdef DEBUG_VERBOSE
@@ -285,6 +441,9 @@ static CURLState *curl_init_state(BDRVCURLState *s)
 has_curl:
 
     state->s = s;
+    state->nb_segs = 0;
+    state->done_segs = 0;
+    state->buf_off = 0;
 
     return state;
 }
@@ -293,55 +452,143 @@ static void curl_clean_state(CURLState *s)
 {
     if (s->s->multi)
         curl_multi_remove_handle(s->s->multi, s->curl);
+    s->nb_segs = 0;
     s->in_use = 0;
 }
 
+/*
+ * Starts a range request for the given run of consecutive segments, which
+ * must have been allocated with curl_seg_alloc().
+ */
+static void curl_start_transfer(BDRVCURLState *s, CURLSegment **segs,
+                                int nb_segs)
+{
+    CURLState *state;
+    size_t start, end;
+    int i;
+
+    if (nb_segs == 0) {
+        return;
+    }
+
+    state = curl_init_state(s);
+    if (!state) {
+        for (i = 0; i < nb_segs; i++) {
+            curl_seg_done(s, segs[i], -EIO);
+        }
+        return;
+    }
+
+    memcpy(state->segs, segs, nb_segs * sizeof(segs[0]));
+    state->nb_segs = nb_segs;
+    start = segs[0]->index * CURL_SEGMENT_SIZE;
+    end = MIN((segs[0]->index + nb_segs) * CURL_SEGMENT_SIZE, s->len) - 1;
+
+    snprintf(state->range, 127, "%zd-%zd", start, end);
+    DPRINTF("CURL (AIO): Reading %d segments at %zd (%s)\n",
+            nb_segs, start, state->range);
+    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
+
+    curl_multi_add_handle(s->multi, state->curl);
+}
+
+/*
+ * Parses trailing ":name=value:" options off the URL.  Unknown options are
+ * left alone as part of the URL.
+ */
+static int curl_parse_options(BDRVCURLState *s, char *file, size_t *cache_size)
+{
+    size_t len = strlen(file);
+    bool found = false;
+
+    if (len < 2 || file[len - 1] != ':') {
+        goto done;
+    }
+    file[len - 1] = '\0';
+
+    for (;;) {
+        char *opt, *val, *end;
+        unsigned long long n;
+
+        opt = strrchr(file, ':');
+        val = opt ? strchr(opt, '=') : NULL;
+        n = val ? strtoull(val + 1, &end, 10) : 0;
+        if (!val || end == val + 1 || *end != '\0') {
+            break;
+        }
+
+        if (!strncmp(opt + 1, "readahead=", val - opt)) {
+            s->readahead_size = n;
+        } else if (!strncmp(opt + 1, "cachesize=", val - opt)) {
+            *cache_size = n;
+        } else if (!strncmp(opt + 1, "connections=", val - opt)) {
+            if (n < 1 || n > CURL_MAX_STATES) {
+                fprintf(stderr, "CURL: connections must be between 1 and %d\n",
+                        CURL_MAX_STATES);
+                return -EINVAL;
+            }
+            s->num_states = n;
+        } else {
+            break;
+        }
+
+        *opt = '\0';
+        found = true;
+    }
+
+    if (!found) {
+        file[len - 1] = ':';
+    }
+
+done:
+    if ((s->readahead_size & 0x1ff) != 0) {
+        fprintf(stderr, "HTTP_READAHEAD_SIZE %zd is not a multiple of 512\n",
+                s->readahead_size);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static void curl_cache_init(BDRVCURLState *s, size_t cache_size)
+{
+    int i;
+
+    /* A single transfer must always fit, plus read-ahead for another one */
+    s->num_segs = MAX(cache_size / CURL_SEGMENT_SIZE,
+                      2 * CURL_MAX_TRANSFER_SEGS);
+    s->segs = qemu_mallocz(s->num_segs * sizeof(CURLSegment));
+
+    s->hash_mask = 1;
+    while (s->hash_mask < s->num_segs) {
+        s->hash_mask <<= 1;
+    }
+    s->hash = qemu_mallocz(s->hash_mask * sizeof(s->hash[0]));
+    s->hash_mask--;
+
+    QTAILQ_INIT(&s->lru);
+    for (i = 0; i < s->num_segs; i++) {
+        QTAILQ_INSERT_TAIL(&s->lru, &s->segs[i], lru_next);
+    }
+    QTAILQ_INIT(&s->acbs);
+}
+
 static int curl_open(BlockDriverState *bs, const char *filename, int flags)
 {
     BDRVCURLState *s = bs->opaque;
     CURLState *state = NULL;
+    size_t cache_size = CURL_CACHE_SIZE;
     double d;
 
-    #define RA_OPTSTR ":readahead="
     char *file;
-    char *ra;
-    const char *ra_val;
-    int parse_state = 0;
 
     static int inited = 0;
 
     file = qemu_strdup(filename);
     s->readahead_size = READ_AHEAD_SIZE;
+    s->num_states = CURL_NUM_STATES;
 
-    /* Parse a trailing ":readahead=#:" param, if present. */
-    ra = file + strlen(file) - 1;
-    while (ra >= file) {
-        if (parse_state == 0) {
-            if (*ra == ':')
-                parse_state++;
-            else
-                break;
-        } else if (parse_state == 1) {
-            if (*ra > '9' || *ra < '0') {
-                char *opt_start = ra - strlen(RA_OPTSTR) + 1;
-                if (opt_start > file &&
-                    strncmp(opt_start, RA_OPTSTR, strlen(RA_OPTSTR)) == 0) {
-                    ra_val = ra + 1;
-                    ra -= strlen(RA_OPTSTR) - 1;
-                    *ra = '\0';
-                    s->readahead_size = atoi(ra_val);
-                    break;
-                } else {
-                    break;
-                }
-            }
-        }
-        ra--;
-    }
-
-    if ((s->readahead_size & 0x1ff) != 0) {
-        fprintf(stderr, "HTTP_READAHEAD_SIZE %zd is not a multiple of 512\n",
-                s->readahead_size);
+    if (curl_parse_options(s, file, &cache_size) < 0) {
         goto out_noclean;
     }
 
@@ -352,6 +599,7 @@ static int curl_open(BlockDriverState *bs, const char *filename, int flags)
 
     DPRINTF("CURL: Opening %s\n", file);
     s->url = file;
+    s->states = qemu_mallocz(s->num_states * sizeof(CURLState));
     state = curl_init_state(s);
     if (!state)
         goto out_noclean;
@@ -375,12 +623,20 @@ static int curl_open(BlockDriverState *bs, const char *filename, int flags)
     curl_easy_cleanup(state->curl);
     state->curl = NULL;
 
+    curl_cache_init(s, cache_size);
+
     // Now we know the file exists and its size, so let's
     // initialize the multi interface!
 
     s->multi = curl_multi_init();
     curl_multi_setopt( s->multi, CURLMOPT_SOCKETDATA, s); 
     curl_multi_setopt( s->multi, CURLMOPT_SOCKETFUNCTION, curl_sock_cb ); 
+    /*
+     * Requests are spread over parallel connections.  Without this, newer
+     * libcurl versions hold back requests until they know whether the
+     * connection that is being set up can be shared, which needs a timer.
+     */
+    curl_multi_setopt(s->multi, CURLMOPT_PIPELINING, 0L);
     curl_multi_do(s);
 
     return 0;
@@ -390,7 +646,10 @@ out:
     curl_easy_cleanup(state->curl);
     state->curl = NULL;
 out_noclean:
+    qemu_free(s->states);
+    s->states = NULL;
     qemu_free(file);
+    s->url = NULL;
     return -EINVAL;
 }
 
@@ -404,6 +663,88 @@ static AIOPool curl_aio_pool = {
     .cancel             = curl_aio_cancel,
 };
 
+/* Adjusts the read-ahead window for a request and returns it in segments */
+static size_t curl_readahead_segs(BDRVCURLState *s, size_t start, size_t end)
+{
+    if (start == s->ra_next) {
+        s->ra_window = MIN(MAX(s->ra_window * 2, CURL_SEGMENT_SIZE),
+                           s->readahead_size);
+    } else {
+        s->ra_window = 0;
+    }
+    s->ra_next = end;
+
+    return s->ra_window / CURL_SEGMENT_SIZE;
+}
+
+/*
+ * Looks up the segments of a request in the cache, starting at
+ * acb->next_seg, and downloads the missing ones together with ra_end
+ * read-ahead segments.  If the cache runs out of free segments, the rest of
+ * the request is submitted from curl_multi_do() once downloads have finished.
+ */
+static void curl_aio_submit(BDRVCURLState *s, CURLAIOCB *acb, size_t ra_end)
+{
+    CURLSegment *run[CURL_MAX_TRANSFER_SEGS];
+    int nb_run = 0;
+
+    acb->in_submit = true;
+
+    for (; acb->next_seg <= ra_end; acb->next_seg++) {
+        size_t index = acb->next_seg;
+        bool needed = index <= acb->last_seg;
+        CURLSegment *seg = curl_seg_find(s, index);
+
+        if (seg) {
+            /* Cache hit, or somebody else is already downloading it */
+            curl_start_transfer(s, run, nb_run);
+            nb_run = 0;
+            if (!needed) {
+                break;
+            }
+            curl_seg_touch(s, seg);
+            if (seg->pending) {
+                acb->waiting[index - acb->first_seg] = true;
+                acb->pending++;
+            } else {
+                curl_seg_copy(s, acb, seg);
+            }
+            continue;
+        }
+
+        seg = curl_seg_alloc(s, index);
+        if (!seg) {
+            /* Don't wait for free segments just for read-ahead */
+            if (!needed) {
+                break;
+            }
+            curl_start_transfer(s, run, nb_run);
+            acb->in_submit = false;
+            return;
+        }
+
+        if (needed) {
+            acb->waiting[index - acb->first_seg] = true;
+            acb->pending++;
+        }
+        run[nb_run++] = seg;
+        if (nb_run == CURL_MAX_TRANSFER_SEGS) {
+            curl_start_transfer(s, run, nb_run);
+            nb_run = 0;
+        }
+    }
+    curl_start_transfer(s, run, nb_run);
+
+    acb->in_submit = false;
+    if (!acb->submitted) {
+        acb->submitted = true;
+        if (--acb->pending == 0) {
+            /* Everything was in the cache */
+            curl_aio_schedule_complete(acb);
+        }
+    }
+}
+
 static BlockDriverAIOCB *curl_aio_readv(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque)
@@ -411,52 +752,39 @@ static BlockDriverAIOCB *curl_aio_readv(BlockDriverState *bs,
     BDRVCURLState *s = bs->opaque;
     CURLAIOCB *acb;
     size_t start = sector_num * SECTOR_SIZE;
-    size_t end;
-    CURLState *state;
+    size_t end = MIN(start + nb_sectors * SECTOR_SIZE, s->len);
+    size_t ra_end;
 
     acb = qemu_aio_get(&curl_aio_pool, bs, cb, opaque);
     if (!acb)
         return NULL;
 
     acb->qiov = qiov;
-
-    // In case we have the requested data already (e.g. read-ahead),
-    // we can just call the callback and be done.
-
-    switch (curl_find_buf(s, start, nb_sectors * SECTOR_SIZE, acb)) {
-        case FIND_RET_OK:
-            qemu_aio_release(acb);
-            // fall through
-        case FIND_RET_WAIT:
-            return &acb->common;
-        default:
-            break;
+    acb->start = start;
+    acb->end = end;
+    acb->ret = 0;
+    acb->bh = NULL;
+    acb->buf = qemu_mallocz(nb_sectors * SECTOR_SIZE);
+    acb->first_seg = start / CURL_SEGMENT_SIZE;
+    acb->next_seg = acb->first_seg;
+    if (start < end) {
+        acb->last_seg = (end - 1) / CURL_SEGMENT_SIZE;
+    } else {
+        /* Nothing to read, the request is all zeroes past EOF */
+        acb->last_seg = acb->first_seg;
+        acb->next_seg = acb->last_seg + 1;
     }
+    acb->waiting = qemu_mallocz((acb->last_seg - acb->first_seg + 1) *
+                                sizeof(bool));
+    acb->pending = 1;
+    acb->submitted = false;
+    acb->in_submit = false;
+    QTAILQ_INSERT_TAIL(&s->acbs, acb, next);
 
-    // No cache found, so let's start a new request
-
-    state = curl_init_state(s);
-    if (!state)
-        return NULL;
-
-    acb->start = 0;
-    acb->end = (nb_sectors * SECTOR_SIZE);
-
-    state->buf_off = 0;
-    if (state->orig_buf)
-        qemu_free(state->orig_buf);
-    state->buf_start = start;
-    state->buf_len = acb->end + s->readahead_size;
-    end = MIN(start + state->buf_len, s->len) - 1;
-    state->orig_buf = qemu_malloc(state->buf_len);
-    state->acb[0] = acb;
+    ra_end = acb->last_seg + curl_readahead_segs(s, start, end);
+    ra_end = MIN(ra_end, (s->len - 1) / CURL_SEGMENT_SIZE);
 
-    snprintf(state->range, 127, "%zd-%zd", start, end);
-    DPRINTF("CURL (AIO): Reading %d at %zd (%s)\n",
-            (nb_sectors * SECTOR_SIZE), start, state->range);
-    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
-
-    curl_multi_add_handle(s->multi, state->curl);
+    curl_aio_submit(s, acb, MAX(ra_end, acb->last_seg));
     curl_multi_do(s);
 
     return &acb->common;
@@ -468,18 +796,20 @@ static void curl_close(BlockDriverState *bs)
     int i;
 
     DPRINTF("CURL: Close\n");
-    for (i=0; i<CURL_NUM_STATES; i++) {
+    for (i=0; i<s->num_states; i++) {
         if (s->states[i].in_use)
             curl_clean_state(&s->states[i]);
         if (s->states[i].curl) {
             curl_easy_cleanup(s->states[i].curl);
             s->states[i].curl = NULL;
         }
-        if (s->states[i].orig_buf) {
-            qemu_free(s->states[i].orig_buf);
-            s->states[i].orig_buf = NULL;
-        }
     }
+    for (i = 0; i < s->num_segs; i++) {
+        qemu_free(s->segs[i].data);
+    }
+    qemu_free(s->segs);
+    qemu_free(s->hash);
+    qemu_free(s->states);
     if (s->multi)
         curl_multi_cleanup(s->multi);
     if (s->url)
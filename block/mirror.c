@@ -0,0 +1,371 @@
+/*
+ * Image mirroring
+ *
+ * Copyright IBM, Corp. 2011
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "block_int.h"
+#include "ratelimit.h"
+#include "bitmap.h"
+
+/*
+ * The device is copied in chunks of the dirty bitmap's granularity, with up
+ * to MIRROR_MAX_IN_FLIGHT chunks being read or written at the same time.
+ */
+#define MIRROR_CHUNK_SECTORS    BDRV_SECTORS_PER_DIRTY_CHUNK
+#define MIRROR_CHUNK_SIZE       (MIRROR_CHUNK_SECTORS * BDRV_SECTOR_SIZE)
+#define MIRROR_MAX_IN_FLIGHT    16
+
+#define SLICE_TIME 100000000ULL /* ns */
+
+typedef struct MirrorBlockJob {
+    BlockJob common;
+    RateLimit limit;
+    BlockDriverState *target;
+    QEMUBH *bh;
+
+    /* Whether the allocated parts of the device were marked dirty already */
+    bool populated;
+
+    /* Next sector to look at for dirty chunks */
+    int64_t sector_num;
+
+    /* Chunks that are being copied, they must not be copied twice at once */
+    unsigned long *in_flight_bitmap;
+    int in_flight;
+
+    /* The job coroutine waits for a copy to finish */
+    bool waiting;
+
+    int ret;
+} MirrorBlockJob;
+
+typedef struct MirrorOp {
+    MirrorBlockJob *s;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int64_t sector_num;
+    int nb_sectors;
+} MirrorOp;
+
+static void mirror_op_complete(MirrorOp *op, int ret)
+{
+    MirrorBlockJob *s = op->s;
+    BlockDriverState *bs = s->common.bs;
+
+    trace_mirror_op_complete(s, op->sector_num, op->nb_sectors, ret);
+
+    if (ret < 0) {
+        /* The chunk still needs to be copied */
+        bdrv_set_dirty(bs, op->sector_num, op->nb_sectors);
+        if (s->ret == 0) {
+            s->ret = ret;
+        }
+    }
+
+    clear_bit(op->sector_num / MIRROR_CHUNK_SECTORS, s->in_flight_bitmap);
+    s->in_flight--;
+    qemu_vfree(op->iov.iov_base);
+    qemu_free(op);
+
+    if (s->waiting) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static void mirror_write_complete(void *opaque, int ret)
+{
+    mirror_op_complete(opaque, ret);
+}
+
+static void mirror_read_complete(void *opaque, int ret)
+{
+    MirrorOp *op = opaque;
+    MirrorBlockJob *s = op->s;
+
+    if (ret < 0) {
+        mirror_op_complete(op, ret);
+        return;
+    }
+
+    if (!bdrv_aio_writev(s->target, op->sector_num, &op->qiov, op->nb_sectors,
+                         mirror_write_complete, op)) {
+        mirror_op_complete(op, -EIO);
+    }
+}
+
+static int mirror_start_op(MirrorBlockJob *s, int64_t sector_num, int64_t end)
+{
+    BlockDriverState *bs = s->common.bs;
+    MirrorOp *op;
+
+    op = qemu_mallocz(sizeof(*op));
+    op->s = s;
+    op->sector_num = sector_num;
+    op->nb_sectors = MIN(MIRROR_CHUNK_SECTORS, end - sector_num);
+    op->iov.iov_base = qemu_blockalign(bs, MIRROR_CHUNK_SIZE);
+    op->iov.iov_len = op->nb_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&op->qiov, &op->iov, 1);
+
+    /*
+     * Guest writes that complete from now on mark the chunk dirty again, so
+     * that it is copied once more.
+     */
+    bdrv_reset_dirty(bs, sector_num, op->nb_sectors);
+    set_bit(sector_num / MIRROR_CHUNK_SECTORS, s->in_flight_bitmap);
+    s->in_flight++;
+
+    trace_mirror_start_op(s, sector_num, op->nb_sectors);
+
+    if (!bdrv_aio_readv(bs, sector_num, &op->qiov, op->nb_sectors,
+                        mirror_read_complete, op)) {
+        mirror_op_complete(op, -EIO);
+        return -EIO;
+    }
+    return 0;
+}
+
+/* Wait until at least one copy in flight has completed */
+static void coroutine_fn mirror_wait(MirrorBlockJob *s)
+{
+    s->waiting = true;
+    qemu_coroutine_yield();
+    s->waiting = false;
+}
+
+/*
+ * Everything that the device could read as data must be copied.  The target
+ * was just created, so areas that read as zeroes can be skipped if the target
+ * reads as zeroes too.
+ */
+static int coroutine_fn mirror_populate(MirrorBlockJob *s, int64_t end)
+{
+    BlockDriverState *bs = s->common.bs;
+    bool zero_init = bdrv_has_zero_init(s->target);
+    int64_t sector_num, ret;
+    int n;
+
+    for (sector_num = 0; sector_num < end; sector_num += n) {
+        if (block_job_is_cancelled(&s->common)) {
+            return 0;
+        }
+
+        n = MIN(end - sector_num, INT_MAX / BDRV_SECTOR_SIZE);
+        if (zero_init) {
+            ret = bdrv_co_get_block_status_above(bs, NULL, sector_num, n, &n);
+            if (ret < 0) {
+                return ret;
+            }
+            if (n == 0) {
+                return -EIO;
+            }
+            if (ret & BDRV_BLOCK_ZERO) {
+                continue;
+            }
+        }
+        bdrv_set_dirty(bs, sector_num, n);
+    }
+
+    s->populated = true;
+    return 0;
+}
+
+static void coroutine_fn mirror_run(void *opaque)
+{
+    MirrorBlockJob *s = opaque;
+    BlockDriverState *bs = s->common.bs;
+    int64_t end, next, delay_ns = 0;
+    int ret = 0;
+
+    end = s->common.len >> BDRV_SECTOR_BITS;
+
+    if (!s->populated) {
+        ret = mirror_populate(s, end);
+    }
+
+    while (ret == 0 && s->ret == 0) {
+        int64_t dirty = bdrv_get_dirty_count(bs);
+
+        /* Publish progress */
+        s->common.offset = s->common.len -
+            MIN(s->common.len, (dirty + s->in_flight) * MIRROR_CHUNK_SIZE);
+
+        if (dirty == 0 && s->in_flight == 0) {
+            /* The target has caught up with the device */
+            break;
+        }
+
+        /*
+         * Give the guest's requests a chance to run between chunks, and
+         * stay within the speed limit.
+         */
+        block_job_sleep_ns(&s->common, rt_clock, delay_ns);
+        delay_ns = 0;
+        if (block_job_is_cancelled(&s->common)) {
+            break;
+        }
+
+        next = -1;
+        if (dirty > 0 && s->in_flight < MIRROR_MAX_IN_FLIGHT) {
+            next = bdrv_get_next_dirty(bs, s->sector_num);
+            if (next < 0) {
+                next = bdrv_get_next_dirty(bs, 0);
+            }
+        }
+
+        if (next < 0 ||
+            test_bit(next / MIRROR_CHUNK_SECTORS, s->in_flight_bitmap)) {
+            /* Nothing to start right now */
+            if (s->in_flight > 0) {
+                mirror_wait(s);
+            }
+            continue;
+        }
+
+        ret = mirror_start_op(s, next, end);
+        s->sector_num = next + MIRROR_CHUNK_SECTORS;
+        if (s->common.speed) {
+            delay_ns = ratelimit_calculate_delay(&s->limit, MIRROR_CHUNK_SIZE);
+        }
+    }
+
+    while (s->in_flight > 0) {
+        mirror_wait(s);
+    }
+
+    if (ret == 0) {
+        ret = s->ret;
+    }
+    s->ret = ret;
+
+    /*
+     * Switching over to the target must not race with guest writes, so it
+     * is done outside of the coroutine, where nothing else can run between
+     * the final check of the dirty bitmap and the switch.
+     */
+    qemu_bh_schedule(s->bh);
+}
+
+static int mirror_pivot(MirrorBlockJob *s)
+{
+    BlockDriverState *bs = s->common.bs;
+    BlockDriverState *target = s->target;
+    BlockDriver *drv = target->drv;
+    int flags = target->open_flags;
+    char filename[1024];
+
+    pstrcpy(filename, sizeof(filename), target->filename);
+    bdrv_delete(target);
+    s->target = NULL;
+
+    trace_mirror_pivot(s, filename);
+    return bdrv_replace_image(bs, filename, flags, drv);
+}
+
+static void mirror_complete_bh(void *opaque)
+{
+    MirrorBlockJob *s = opaque;
+    BlockDriverState *bs = s->common.bs;
+    int ret = s->ret;
+
+    if (ret == 0 && !block_job_is_cancelled(&s->common)) {
+        /*
+         * Flushing runs a nested aio loop in which the guest can write to
+         * the device, so it must come before the final check.
+         */
+        ret = bdrv_flush(s->target);
+        if (ret == 0) {
+            bdrv_drain_all();
+            if (bdrv_get_dirty_count(bs) > 0) {
+                /* The guest wrote in the meantime, keep copying */
+                s->common.co = qemu_coroutine_create(mirror_run);
+                qemu_coroutine_enter(s->common.co, s);
+                return;
+            }
+        }
+    }
+
+    qemu_bh_delete(s->bh);
+    bdrv_set_dirty_tracking(bs, 0);
+
+    if (ret == 0 && !block_job_is_cancelled(&s->common)) {
+        ret = mirror_pivot(s);
+    }
+    if (s->target) {
+        bdrv_delete(s->target);
+    }
+    qemu_free(s->in_flight_bitmap);
+    block_job_complete(&s->common, ret);
+}
+
+static int mirror_set_speed(BlockJob *job, int64_t value)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    if (value < 0) {
+        return -EINVAL;
+    }
+    ratelimit_set_speed(&s->limit, value, SLICE_TIME);
+    return 0;
+}
+
+static BlockJobType mirror_job_type = {
+    .instance_size = sizeof(MirrorBlockJob),
+    .job_type      = "mirror",
+    .set_speed     = mirror_set_speed,
+};
+
+/*
+ * Copy the contents of bs to target, which must be at least as large, and
+ * then switch bs over to the image file of target.  The job takes ownership
+ * of target.
+ */
+int mirror_start(BlockDriverState *bs, BlockDriverState *target,
+                 BlockDriverCompletionFunc *cb, void *opaque)
+{
+    MirrorBlockJob *s;
+    int64_t len, target_len;
+    Coroutine *co;
+
+    if (bs->dirty_bitmap) {
+        return -EBUSY; /* someone else is tracking writes already */
+    }
+
+    len = bdrv_getlength(bs);
+    if (len < 0) {
+        return len;
+    }
+    target_len = bdrv_getlength(target);
+    if (target_len < 0) {
+        return target_len;
+    }
+    if (target_len < len) {
+        return -EINVAL;
+    }
+
+    s = block_job_create(&mirror_job_type, bs, cb, opaque);
+    if (!s) {
+        return -EBUSY; /* bs must already be in use */
+    }
+
+    s->target = target;
+    s->common.len = len;
+    s->bh = qemu_bh_new(mirror_complete_bh, s);
+    s->in_flight_bitmap = bitmap_new((len >> BDRV_SECTOR_BITS) /
+                                     MIRROR_CHUNK_SECTORS + 1);
+
+    /* Writes that are already in flight are not seen by the dirty bitmap */
+    bdrv_set_dirty_tracking(bs, 1);
+    bdrv_drain_all();
+
+    co = qemu_coroutine_create(mirror_run);
+    s->common.co = co;
+    trace_mirror_start(bs, target, s, co, opaque);
+    qemu_coroutine_enter(co, s);
+    return 0;
+}
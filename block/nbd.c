@@ -28,6 +28,7 @@
 
 #include "qemu-common.h"
 #include "nbd.h"
+#include "block_int.h"
 #include "module.h"
 #include "qemu_socket.h"
 
@@ -45,8 +46,20 @@
 #define logout(fmt, ...) ((void)0)
 #endif
 
+/* Requests kept in flight on the connection */
+#define MAX_NBD_REQUESTS    16
+
+#define NBD_MAX_SECTORS     (NBD_MAX_BUFFER_SIZE / BDRV_SECTOR_SIZE)
+
+/* The handle of a request is its slot in recv_coroutine, salted with the
+ * state pointer so that it is never zero.
+ */
+#define HANDLE_TO_INDEX(s, handle) ((handle) ^ ((uint64_t)(intptr_t)(s)))
+#define INDEX_TO_HANDLE(s, index)  ((index)  ^ ((uint64_t)(intptr_t)(s)))
+
 typedef struct BDRVNBDState {
     int sock;
+    uint32_t nbdflags;
     off_t size;
     size_t blocksize;
     char *export_name; /* An NBD server may export several devices */
@@ -55,8 +68,38 @@ typedef struct BDRVNBDState {
      * it's a string of the form <hostname|ip4|\[ip6\]>:port
      */
     char *host_spec;
+
+    CoMutex send_mutex;
+    CoQueue free_sema;
+    Coroutine *send_coroutine;
+    int in_flight;
+
+    /* Requests in flight indexed by handle, and whether they are waiting
+     * for their reply header
+     */
+    Coroutine *recv_coroutine[MAX_NBD_REQUESTS];
+    bool recv_waiting[MAX_NBD_REQUESTS];
+    struct nbd_reply reply;
+
+    /* The reply header being read, it may arrive in several pieces */
+    uint8_t reply_hdr[NBD_REPLY_SIZE];
+    int reply_hdr_len;
+
+    /* The stream is out of sync, requests fail without being sent */
+    bool failed;
 } BDRVNBDState;
 
+static void nbd_reply_ready(void *opaque);
+static void nbd_restart_write(void *opaque);
+static int nbd_have_request(void *opaque);
+
+static void nbd_update_fd_handler(BDRVNBDState *s)
+{
+    qemu_aio_set_fd_handler(s->sock, s->failed ? NULL : nbd_reply_ready,
+                            s->send_coroutine ? nbd_restart_write : NULL,
+                            nbd_have_request, NULL, s);
+}
+
 static int nbd_config(BDRVNBDState *s, const char *filename, int flags)
 {
     char *file;
@@ -137,9 +180,12 @@ static int nbd_establish_connection(BlockDriverState *bs)
     socket_set_nonblock(sock);
 
     s->sock = sock;
+    s->nbdflags = nbdflags;
     s->size = size;
     s->blocksize = blocksize;
 
+    nbd_update_fd_handler(s);
+
     logout("Established connection with NBD server\n");
     return 0;
 }
@@ -150,11 +196,12 @@ static void nbd_teardown_connection(BlockDriverState *bs)
     struct nbd_request request;
 
     request.type = NBD_CMD_DISC;
-    request.handle = (uint64_t)(intptr_t)bs;
+    request.handle = INDEX_TO_HANDLE(s, MAX_NBD_REQUESTS);
     request.from = 0;
     request.len = 0;
     nbd_send_request(s->sock, &request);
 
+    qemu_aio_set_fd_handler(s->sock, NULL, NULL, NULL, NULL, NULL);
     closesocket(s->sock);
 }
 
@@ -163,6 +210,9 @@ static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
     BDRVNBDState *s = bs->opaque;
     int result;
 
+    qemu_co_mutex_init(&s->send_mutex);
+    qemu_co_queue_init(&s->free_sema);
+
     /* Pop the config into our state object. Exit if invalid. */
     result = nbd_config(s, filename, flags);
     if (result != 0) {
@@ -177,64 +227,358 @@ static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
     return result;
 }
 
-static int nbd_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+/* Transfer len bytes of qiov, starting at offset, over the non-blocking
+ * socket.  The coroutine yields whenever the socket would block and is
+ * reentered by the fd handlers once it is ready again.
+ */
+static int coroutine_fn nbd_co_rwv(int sock, QEMUIOVector *qiov,
+                                   size_t offset, size_t len, bool do_read)
 {
-    BDRVNBDState *s = bs->opaque;
-    struct nbd_request request;
-    struct nbd_reply reply;
+    int i = 0;
 
-    request.type = NBD_CMD_READ;
-    request.handle = (uint64_t)(intptr_t)bs;
-    request.from = sector_num * 512;;
-    request.len = nb_sectors * 512;
+    while (len > 0) {
+        struct iovec *iov;
+        size_t iov_len;
+        ssize_t ret;
 
-    if (nbd_send_request(s->sock, &request) == -1)
-        return -errno;
+        /* Skip to the iovec that holds offset */
+        while (offset >= qiov->iov[i].iov_len) {
+            offset -= qiov->iov[i].iov_len;
+            i++;
+        }
+        iov = &qiov->iov[i];
+        iov_len = MIN(len, iov->iov_len - offset);
 
-    if (nbd_receive_reply(s->sock, &reply) == -1)
-        return -errno;
+        if (do_read) {
+            ret = recv(sock, iov->iov_base + offset, iov_len, 0);
+        } else {
+            ret = send(sock, iov->iov_base + offset, iov_len, 0);
+        }
 
-    if (reply.error !=0)
-        return -reply.error;
+        if (ret == -1) {
+            errno = socket_error();
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                qemu_coroutine_yield();
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (ret == 0) {
+            return -EIO;
+        }
 
-    if (reply.handle != request.handle)
-        return -EIO;
+        offset += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int nbd_have_request(void *opaque)
+{
+    BDRVNBDState *s = opaque;
+
+    return s->in_flight > 0;
+}
+
+/* The connection is in an unknown state.  The requests that wait for their
+ * reply fail now, the others once they get there.  The ones that are still
+ * sending or waiting to send must not be entered from here.
+ */
+static void nbd_fail(BDRVNBDState *s)
+{
+    int i;
+
+    s->failed = true;
+    s->reply.handle = 0;
+    s->reply_hdr_len = 0;
+    nbd_update_fd_handler(s);
+
+    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
+        if (s->recv_waiting[i]) {
+            qemu_coroutine_enter(s->recv_coroutine[i], NULL);
+        }
+    }
+}
+
+static void nbd_reply_ready(void *opaque)
+{
+    BDRVNBDState *s = opaque;
+    uint64_t i;
+    ssize_t ret;
+
+    if (s->reply.handle == 0) {
+        /* No reply already in flight, fetch a header.  Never wait for the
+         * rest of it here, just come back when the socket has more.
+         */
+        ret = recv(s->sock, s->reply_hdr + s->reply_hdr_len,
+                   NBD_REPLY_SIZE - s->reply_hdr_len, 0);
+        if (ret == -1) {
+            errno = socket_error();
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return;
+            }
+        }
+        if (ret <= 0) {
+            nbd_fail(s);
+            return;
+        }
+        s->reply_hdr_len += ret;
+        if (s->reply_hdr_len < NBD_REPLY_SIZE) {
+            return;
+        }
+        s->reply_hdr_len = 0;
+
+        if (nbd_decode_reply(s->reply_hdr, &s->reply) < 0) {
+            s->reply.handle = 0;
+            nbd_fail(s);
+            return;
+        }
+
+        i = HANDLE_TO_INDEX(s, s->reply.handle);
+        if (i >= MAX_NBD_REQUESTS || !s->recv_waiting[i]) {
+            nbd_fail(s);
+            return;
+        }
+    }
+
+    /* The handler is the only one reading headers, so at most one coroutine
+     * at a time is receiving its payload and no lock is needed here.
+     */
+    i = HANDLE_TO_INDEX(s, s->reply.handle);
+    qemu_coroutine_enter(s->recv_coroutine[i], NULL);
+}
+
+static void nbd_restart_write(void *opaque)
+{
+    BDRVNBDState *s = opaque;
+
+    qemu_coroutine_enter(s->send_coroutine, NULL);
+}
+
+static void coroutine_fn nbd_coroutine_start(BDRVNBDState *s,
+                                             struct nbd_request *request)
+{
+    int i;
+
+    while (s->in_flight >= MAX_NBD_REQUESTS) {
+        qemu_co_queue_wait(&s->free_sema);
+    }
+    s->in_flight++;
+
+    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
+        if (s->recv_coroutine[i] == NULL) {
+            s->recv_coroutine[i] = qemu_coroutine_self();
+            break;
+        }
+    }
+    assert(i < MAX_NBD_REQUESTS);
+    request->handle = INDEX_TO_HANDLE(s, i);
+}
+
+static void nbd_coroutine_end(BDRVNBDState *s, struct nbd_request *request)
+{
+    int i = HANDLE_TO_INDEX(s, request->handle);
+
+    s->recv_coroutine[i] = NULL;
+    s->in_flight--;
+    qemu_co_queue_next(&s->free_sema);
+}
+
+static int coroutine_fn nbd_co_send_request(BDRVNBDState *s,
+                                            struct nbd_request *request,
+                                            QEMUIOVector *qiov, int offset)
+{
+    uint8_t buf[NBD_REQUEST_SIZE];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+    QEMUIOVector hdr_qiov;
+    int ret;
 
-    if (nbd_wr_sync(s->sock, buf, request.len, 1) != request.len)
+    nbd_encode_request(buf, request);
+    qemu_iovec_init_external(&hdr_qiov, &iov, 1);
+
+    qemu_co_mutex_lock(&s->send_mutex);
+    if (s->failed) {
+        qemu_co_mutex_unlock(&s->send_mutex);
         return -EIO;
+    }
+    s->send_coroutine = qemu_coroutine_self();
+    nbd_update_fd_handler(s);
 
-    return 0;
+    ret = nbd_co_rwv(s->sock, &hdr_qiov, 0, sizeof(buf), false);
+    if (ret == 0 && qiov) {
+        ret = nbd_co_rwv(s->sock, qiov, offset, request->len, false);
+    }
+
+    s->send_coroutine = NULL;
+    nbd_update_fd_handler(s);
+    qemu_co_mutex_unlock(&s->send_mutex);
+    return ret;
+}
+
+static void coroutine_fn nbd_co_receive_reply(BDRVNBDState *s,
+                                              struct nbd_request *request,
+                                              struct nbd_reply *reply,
+                                              QEMUIOVector *qiov, int offset)
+{
+    int i = HANDLE_TO_INDEX(s, request->handle);
+
+    if (s->failed) {
+        reply->error = EIO;
+        return;
+    }
+
+    /* Wait until the read handler has our reply header */
+    s->recv_waiting[i] = true;
+    qemu_coroutine_yield();
+    s->recv_waiting[i] = false;
+    *reply = s->reply;
+
+    if (reply->handle != request->handle) {
+        reply->error = EIO;
+        return;
+    }
+
+    if (qiov && reply->error == 0) {
+        if (nbd_co_rwv(s->sock, qiov, offset, request->len, true) < 0) {
+            /* Part of the payload may be left on the socket */
+            reply->error = EIO;
+            nbd_fail(s);
+            return;
+        }
+    }
+
+    /* Let the read handler fetch the next header */
+    s->reply.handle = 0;
 }
 
-static int nbd_write(BlockDriverState *bs, int64_t sector_num,
-                     const uint8_t *buf, int nb_sectors)
+static int coroutine_fn nbd_co_request(BlockDriverState *bs, int type,
+                                       int64_t sector_num, int nb_sectors,
+                                       QEMUIOVector *qiov, int offset)
 {
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
     struct nbd_reply reply;
+    int ret;
 
-    request.type = NBD_CMD_WRITE;
-    request.handle = (uint64_t)(intptr_t)bs;
-    request.from = sector_num * 512;;
-    request.len = nb_sectors * 512;
+    request.type = type;
+    request.from = sector_num * BDRV_SECTOR_SIZE;
+    request.len = nb_sectors * BDRV_SECTOR_SIZE;
 
-    if (nbd_send_request(s->sock, &request) == -1)
-        return -errno;
+    nbd_coroutine_start(s, &request);
+    ret = nbd_co_send_request(s, &request,
+                              type == NBD_CMD_WRITE ? qiov : NULL, offset);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(s, &request, &reply,
+                             type == NBD_CMD_READ ? qiov : NULL, offset);
+    }
+    nbd_coroutine_end(s, &request);
 
-    if (nbd_wr_sync(s->sock, (uint8_t*)buf, request.len, 0) != request.len)
-        return -EIO;
+    return -reply.error;
+}
 
-    if (nbd_receive_reply(s->sock, &reply) == -1)
-        return -errno;
+/* A request split in pieces, the caller waits until all of them are done */
+typedef struct NBDSplitRequest {
+    BlockDriverState *bs;
+    int type;
+    QEMUIOVector *qiov;
+    Coroutine *co;
+    int pending;
+    int ret;
+} NBDSplitRequest;
 
-    if (reply.error !=0)
-        return -reply.error;
+typedef struct NBDPiece {
+    NBDSplitRequest *split;
+    int64_t sector_num;
+    int nb_sectors;
+    int offset;
+} NBDPiece;
 
-    if (reply.handle != request.handle)
-        return -EIO;
+static void coroutine_fn nbd_co_piece(void *opaque)
+{
+    NBDPiece *piece = opaque;
+    NBDSplitRequest *split = piece->split;
+    int ret;
 
-    return 0;
+    ret = nbd_co_request(split->bs, split->type, piece->sector_num,
+                         piece->nb_sectors, split->qiov, piece->offset);
+    qemu_free(piece);
+
+    if (ret < 0 && split->ret == 0) {
+        split->ret = ret;
+    }
+    if (--split->pending == 0) {
+        qemu_coroutine_enter(split->co, NULL);
+    }
+}
+
+/* Requests bigger than what the server accepts are split.  Each piece is
+ * sent from its own coroutine, so that they are all in flight at once.
+ */
+static int coroutine_fn nbd_co_rw(BlockDriverState *bs, int type,
+                                  int64_t sector_num, int nb_sectors,
+                                  QEMUIOVector *qiov)
+{
+    NBDSplitRequest split = {
+        .bs = bs,
+        .type = type,
+        .qiov = qiov,
+        .co = qemu_coroutine_self(),
+        .pending = 1,
+    };
+    int offset = 0;
+
+    if (nb_sectors <= NBD_MAX_SECTORS) {
+        return nbd_co_request(bs, type, sector_num, nb_sectors, qiov, 0);
+    }
+
+    do {
+        NBDPiece *piece = qemu_malloc(sizeof(*piece));
+        int n = MIN(nb_sectors, NBD_MAX_SECTORS);
+
+        piece->split = &split;
+        piece->sector_num = sector_num;
+        piece->nb_sectors = n;
+        piece->offset = offset;
+        split.pending++;
+        qemu_coroutine_enter(qemu_coroutine_create(nbd_co_piece), piece);
+
+        offset += n * BDRV_SECTOR_SIZE;
+        sector_num += n;
+        nb_sectors -= n;
+    } while (nb_sectors > 0);
+
+    /* The last piece to finish reenters us */
+    if (--split.pending > 0) {
+        qemu_coroutine_yield();
+    }
+    return split.ret;
+}
+
+static int coroutine_fn nbd_co_readv(BlockDriverState *bs, int64_t sector_num,
+                                     int nb_sectors, QEMUIOVector *qiov)
+{
+    return nbd_co_rw(bs, NBD_CMD_READ, sector_num, nb_sectors, qiov);
+}
+
+static int coroutine_fn nbd_co_writev(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, QEMUIOVector *qiov)
+{
+    return nbd_co_rw(bs, NBD_CMD_WRITE, sector_num, nb_sectors, qiov);
+}
+
+static int coroutine_fn nbd_co_flush(BlockDriverState *bs)
+{
+    BDRVNBDState *s = bs->opaque;
+
+    if (!(s->nbdflags & NBD_FLAG_SEND_FLUSH)) {
+        return 0;
+    }
+    return nbd_co_request(bs, NBD_CMD_FLUSH, 0, 0, NULL, 0);
 }
 
 static void nbd_close(BlockDriverState *bs)
@@ -257,8 +601,9 @@ static BlockDriver bdrv_nbd = {
     .format_name	= "nbd",
     .instance_size	= sizeof(BDRVNBDState),
     .bdrv_file_open	= nbd_open,
-    .bdrv_read		= nbd_read,
-    .bdrv_write		= nbd_write,
+    .bdrv_co_readv	= nbd_co_readv,
+    .bdrv_co_writev	= nbd_co_writev,
+    .bdrv_co_flush	= nbd_co_flush,
     .bdrv_close		= nbd_close,
     .bdrv_getlength	= nbd_getlength,
     .protocol_name	= "nbd",
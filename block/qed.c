@@ -695,6 +695,68 @@ static int bdrv_qed_is_allocated(BlockDriverState *bs, int64_t sector_num,
     return cb.is_allocated;
 }
 
+typedef struct {
+    Coroutine *co;
+    int64_t status;
+    int *pnum;
+} QEDGetBlockStatusCB;
+
+static void qed_get_block_status_cb(void *opaque, int ret, uint64_t offset,
+                                    size_t len)
+{
+    QEDGetBlockStatusCB *cb = opaque;
+
+    *cb->pnum = len / BDRV_SECTOR_SIZE;
+    switch (ret) {
+    case QED_CLUSTER_FOUND:
+        cb->status = BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID | offset;
+        break;
+    case QED_CLUSTER_ZERO:
+        cb->status = BDRV_BLOCK_ZERO;
+        break;
+    case QED_CLUSTER_L2:
+    case QED_CLUSTER_L1:
+        cb->status = 0;
+        break;
+    default:
+        cb->status = ret;
+        break;
+    }
+
+    if (cb->co) {
+        qemu_coroutine_enter(cb->co, NULL);
+    }
+}
+
+static int64_t coroutine_fn bdrv_qed_co_get_block_status(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, int *pnum)
+{
+    BDRVQEDState *s = bs->opaque;
+    uint64_t pos = (uint64_t)sector_num * BDRV_SECTOR_SIZE;
+    size_t len = (size_t)nb_sectors * BDRV_SECTOR_SIZE;
+    QEDGetBlockStatusCB cb = {
+        .co = NULL,
+        .status = -EINPROGRESS,
+        .pnum = pnum,
+    };
+    QEDRequest request = { .l2_table = NULL };
+
+    qed_find_cluster(s, &request, pos, len, qed_get_block_status_cb, &cb);
+
+    /* The L2 table may have to be read first, wait for it */
+    if (cb.status == -EINPROGRESS) {
+        cb.co = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+
+    qed_unref_l2_cache_entry(request.l2_table);
+
+    if (cb.status > 0 && (cb.status & BDRV_BLOCK_OFFSET_VALID)) {
+        cb.status += qed_offset_into_cluster(s, pos);
+    }
+    return cb.status;
+}
+
 static int bdrv_qed_make_empty(BlockDriverState *bs)
 {
     return -ENOTSUP;
@@ -1485,6 +1547,7 @@ static BlockDriver bdrv_qed = {
     .bdrv_create              = bdrv_qed_create,
     .bdrv_flush               = bdrv_qed_flush,
     .bdrv_is_allocated        = bdrv_qed_is_allocated,
+    .bdrv_co_get_block_status = bdrv_qed_co_get_block_status,
     .bdrv_make_empty          = bdrv_qed_make_empty,
     .bdrv_aio_readv           = bdrv_qed_aio_readv,
     .bdrv_aio_writev          = bdrv_qed_aio_writev,
@@ -33,11 +33,16 @@ BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
 BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
         unsigned long int req, void *buf,
         BlockDriverCompletionFunc *cb, void *opaque);
+int paio_set_thread_limits(int min, int max);
+void paio_info(Monitor *mon);
 
 /* linux-aio.c - Linux native implementation */
 void *laio_init(void);
 BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type);
+void laio_io_plug(void *aio_ctx);
+void laio_io_unplug(void *aio_ctx);
+void laio_info(Monitor *mon);
 
 #endif /* QEMU_RAW_POSIX_AIO_H */
@@ -619,6 +619,26 @@ static BlockDriverAIOCB *raw_aio_writev(BlockDriverState *bs,
                           cb, opaque, QEMU_AIO_WRITE);
 }
 
+static void raw_io_plug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+    if (s->use_aio) {
+        laio_io_plug(s->aio_ctx);
+    }
+#endif
+}
+
+static void raw_io_unplug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+    if (s->use_aio) {
+        laio_io_unplug(s->aio_ctx);
+    }
+#endif
+}
+
 static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
@@ -858,6 +878,42 @@ static int raw_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
     return 0;
 }
 
+/*
+ * Reports holes in sparse files as zeroes, so that callers such as qemu-img
+ * convert don't need to read them.
+ */
+static int64_t coroutine_fn raw_co_get_block_status(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, int *pnum)
+{
+    int64_t ret = BDRV_BLOCK_OFFSET_VALID | (sector_num << BDRV_SECTOR_BITS);
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    BDRVRawState *s = bs->opaque;
+    off_t start = sector_num << BDRV_SECTOR_BITS;
+    off_t data, hole;
+
+    data = lseek(s->fd, start, SEEK_DATA);
+    if (data < 0 && errno == ENXIO) {
+        /* No more data until the end of the file */
+        *pnum = nb_sectors;
+        return ret | BDRV_BLOCK_ZERO;
+    } else if (data >= start + BDRV_SECTOR_SIZE) {
+        *pnum = MIN(nb_sectors, (data - start) >> BDRV_SECTOR_BITS);
+        return ret | BDRV_BLOCK_ZERO;
+    } else if (data >= 0) {
+        hole = lseek(s->fd, start, SEEK_HOLE);
+        if (hole > start) {
+            *pnum = MIN(nb_sectors,
+                        DIV_ROUND_UP(hole - start, BDRV_SECTOR_SIZE));
+            return ret | BDRV_BLOCK_DATA;
+        }
+    }
+    /* Not supported by the file system, assume that everything is data */
+#endif
+
+    *pnum = nb_sectors;
+    return ret | BDRV_BLOCK_DATA;
+}
+
 static QEMUOptionParameter raw_create_options[] = {
     {
         .name = BLOCK_OPT_SIZE,
@@ -879,10 +935,13 @@ static BlockDriver bdrv_file = {
     .bdrv_create = raw_create,
     .bdrv_flush = raw_flush,
     .bdrv_discard = raw_discard,
+    .bdrv_co_get_block_status = raw_co_get_block_status,
 
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
     .bdrv_aio_flush = raw_aio_flush,
+    .bdrv_io_plug = raw_io_plug,
+    .bdrv_io_unplug = raw_io_unplug,
 
     .bdrv_truncate = raw_truncate,
     .bdrv_getlength = raw_getlength,
@@ -1150,6 +1209,8 @@ static BlockDriver bdrv_host_device = {
     .bdrv_aio_readv	= raw_aio_readv,
     .bdrv_aio_writev	= raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug       = raw_io_plug,
+    .bdrv_io_unplug     = raw_io_unplug,
 
     .bdrv_read          = raw_read,
     .bdrv_write         = raw_write,
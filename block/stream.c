@@ -0,0 +1,158 @@
+/*
+ * Image streaming
+ *
+ * Copyright IBM, Corp. 2011
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "block_int.h"
+#include "ratelimit.h"
+
+enum {
+    /*
+     * Size of data buffer for populating the image file.  This should be large
+     * enough to process multiple clusters in a single call, so that populating
+     * contiguous regions of the image is efficient.
+     */
+    STREAM_BUFFER_SIZE = 512 * 1024, /* in bytes */
+};
+
+#define SLICE_TIME 100000000ULL /* ns */
+
+typedef struct StreamBlockJob {
+    BlockJob common;
+    RateLimit limit;
+} StreamBlockJob;
+
+static int coroutine_fn stream_populate(BlockDriverState *bs,
+                                        int64_t sector_num, int nb_sectors,
+                                        void *buf)
+{
+    struct iovec iov = {
+        .iov_base = buf,
+        .iov_len  = nb_sectors * BDRV_SECTOR_SIZE,
+    };
+    QEMUIOVector qiov;
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    /* Copy-on-read the unallocated clusters */
+    return bdrv_co_readv(bs, sector_num, nb_sectors, &qiov);
+}
+
+static void coroutine_fn stream_run(void *opaque)
+{
+    StreamBlockJob *s = opaque;
+    BlockDriverState *bs = s->common.bs;
+    int64_t sector_num, end;
+    int64_t delay_ns = 0;
+    int ret = 0;
+    int n = 0;
+    void *buf;
+
+    s->common.len = bdrv_getlength(bs);
+    if (s->common.len < 0) {
+        bdrv_disable_copy_on_read(bs);
+        block_job_complete(&s->common, s->common.len);
+        return;
+    }
+
+    end = s->common.len >> BDRV_SECTOR_BITS;
+    buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
+
+    for (sector_num = 0; sector_num < end; sector_num += n) {
+        /*
+         * Give the guest's requests a chance to run between chunks, and
+         * stay within the speed limit.
+         */
+        block_job_sleep_ns(&s->common, rt_clock, delay_ns);
+        if (block_job_is_cancelled(&s->common)) {
+            break;
+        }
+
+        ret = bdrv_co_is_allocated(bs, sector_num,
+                                   MIN(end - sector_num,
+                                       STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE),
+                                   &n);
+        trace_stream_one_iteration(s, sector_num, n, ret);
+        if (n == 0) {
+            ret = -EIO;
+            break;
+        }
+
+        delay_ns = 0;
+        if (ret == 0) {
+            ret = stream_populate(bs, sector_num, n, buf);
+            if (s->common.speed) {
+                delay_ns = ratelimit_calculate_delay(&s->limit,
+                                                     n * BDRV_SECTOR_SIZE);
+            }
+        }
+        if (ret < 0) {
+            break;
+        }
+        ret = 0;
+
+        /* Publish progress */
+        s->common.offset += n * BDRV_SECTOR_SIZE;
+    }
+
+    if (!block_job_is_cancelled(&s->common) && sector_num == end && ret == 0) {
+        ret = bdrv_co_drop_backing_hd(bs);
+    }
+
+    bdrv_disable_copy_on_read(bs);
+    qemu_vfree(buf);
+    block_job_complete(&s->common, ret);
+}
+
+static int stream_set_speed(BlockJob *job, int64_t value)
+{
+    StreamBlockJob *s = container_of(job, StreamBlockJob, common);
+
+    if (value < 0) {
+        return -EINVAL;
+    }
+    ratelimit_set_speed(&s->limit, value, SLICE_TIME);
+    return 0;
+}
+
+static BlockJobType stream_job_type = {
+    .instance_size = sizeof(StreamBlockJob),
+    .job_type      = "stream",
+    .set_speed     = stream_set_speed,
+};
+
+int stream_start(BlockDriverState *bs, BlockDriverCompletionFunc *cb,
+                 void *opaque)
+{
+    StreamBlockJob *s;
+    Coroutine *co;
+
+    if (bdrv_is_read_only(bs)) {
+        return -EACCES;
+    }
+
+    s = block_job_create(&stream_job_type, bs, cb, opaque);
+    if (!s) {
+        return -EBUSY; /* bs must already be in use */
+    }
+
+    /*
+     * Requests that are already in flight are not tracked, so wait for them
+     * before copy-on-read starts serializing guest writes against the
+     * clusters being populated.
+     */
+    bdrv_drain_all();
+    bdrv_enable_copy_on_read(bs);
+
+    co = qemu_coroutine_create(stream_run);
+    s->common.co = co;
+    trace_stream_start(bs, s, co, opaque);
+    qemu_coroutine_enter(co, s);
+    return 0;
+}
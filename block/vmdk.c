@@ -58,9 +58,23 @@ typedef struct {
     char check_bytes[4];
 } __attribute__((packed)) VMDK4Header;
 
-#define L2_CACHE_SIZE 16
+/*
+ * Grain tables are cached per extent.  The cache covers the whole extent if
+ * it has at most L2_CACHE_MAX_SIZE grain tables (16 GB with the default
+ * 64 KB grains); for larger extents the least used tables are evicted.
+ */
+#define L2_CACHE_MAX_SIZE 512
+
+/* Maximum size of a descriptor file */
+#define DESC_FILE_MAX_SIZE (64 * 1024)
+
+typedef struct VmdkExtent {
+    BlockDriverState *file;
+    bool flat;
+    int64_t sectors;
+    int64_t end_sector;
+    int64_t flat_start_offset;
 
-typedef struct BDRVVmdkState {
     int64_t l1_table_offset;
     int64_t l1_backup_table_offset;
     uint32_t *l1_table;
@@ -69,12 +83,22 @@ typedef struct BDRVVmdkState {
     uint32_t l1_entry_sectors;
 
     unsigned int l2_size;
+    unsigned int l2_cache_size;
     uint32_t *l2_cache;
-    uint32_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
+    int *l2_cache_l1_index;     /* L1 index of each cached table, or -1 */
+    uint32_t *l2_cache_counts;
+    int *l2_cache_slot;         /* cache slot + 1 of each L1 entry, or 0 */
 
     unsigned int cluster_sectors;
+} VmdkExtent;
+
+typedef struct BDRVVmdkState {
+    CoMutex lock;
+    int64_t desc_offset;        /* -1 if there is no descriptor */
     uint32_t parent_cid;
+    int cid_updated;
+    int num_extents;
+    VmdkExtent *extents;
 } BDRVVmdkState;
 
 typedef struct VmdkMetaData {
@@ -87,6 +111,7 @@ typedef struct VmdkMetaData {
 
 static int vmdk_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
+    static const char desc_magic[] = "# Disk DescriptorFile";
     uint32_t magic;
 
     if (buf_size < 4)
@@ -95,8 +120,10 @@ static int vmdk_probe(const uint8_t *buf, int buf_size, const char *filename)
     if (magic == VMDK3_MAGIC ||
         magic == VMDK4_MAGIC)
         return 100;
-    else
-        return 0;
+    if (buf_size >= sizeof(desc_magic) - 1 &&
+        !memcmp(buf, desc_magic, sizeof(desc_magic) - 1))
+        return 100;
+    return 0;
 }
 
 #define CHECK_CID 1
@@ -105,15 +132,50 @@ static int vmdk_probe(const uint8_t *buf, int buf_size, const char *filename)
 #define DESC_SIZE 20*SECTOR_SIZE	// 20 sectors of 512 bytes each
 #define HEADER_SIZE 512   			// first sector of 512 bytes
 
+/*
+ * Read the descriptor into a NUL terminated buffer of *size bytes, which the
+ * caller must free.  An embedded descriptor takes DESC_SIZE bytes, a
+ * descriptor file is read whole.
+ */
+static char *vmdk_read_desc(BlockDriverState *bs, int *size)
+{
+    int64_t desc_offset = 0x200;
+    int64_t len = DESC_SIZE - 1;
+    char *desc;
+
+    /* The backing file of a VMDK image is not necessarily a VMDK image */
+    if (!strcmp(bs->drv->format_name, "vmdk")) {
+        BDRVVmdkState *s = bs->opaque;
+        desc_offset = s->desc_offset;
+    }
+    if (desc_offset < 0)
+        return NULL;
+
+    if (desc_offset == 0) {
+        len = bdrv_getlength(bs->file);
+        if (len < 0 || len > DESC_FILE_MAX_SIZE)
+            return NULL;
+    }
+
+    *size = len + 1;
+    desc = qemu_mallocz(*size);
+    if (bdrv_pread(bs->file, desc_offset, desc, len) < 0) {
+        qemu_free(desc);
+        return NULL;
+    }
+    return desc;
+}
+
 static uint32_t vmdk_read_cid(BlockDriverState *bs, int parent)
 {
-    char desc[DESC_SIZE];
-    uint32_t cid;
+    char *desc;
+    int desc_size;
+    uint32_t cid = 0;
     const char *p_name, *cid_str;
     size_t cid_str_size;
 
-    /* the descriptor offset = 0x200 */
-    if (bdrv_pread(bs->file, 0x200, desc, DESC_SIZE) != DESC_SIZE)
+    desc = vmdk_read_desc(bs, &desc_size);
+    if (!desc)
         return 0;
 
     if (parent) {
@@ -129,29 +191,52 @@ static uint32_t vmdk_read_cid(BlockDriverState *bs, int parent)
         sscanf(p_name,"%x",&cid);
     }
 
+    qemu_free(desc);
     return cid;
 }
 
 static int vmdk_write_cid(BlockDriverState *bs, uint32_t cid)
 {
-    char desc[DESC_SIZE], tmp_desc[DESC_SIZE];
+    BDRVVmdkState *s = bs->opaque;
+    char *desc, *tmp_desc = NULL;
     char *p_name, *tmp_str;
+    int desc_size, len, ret = -1;
 
-    /* the descriptor offset = 0x200 */
-    if (bdrv_pread(bs->file, 0x200, desc, DESC_SIZE) != DESC_SIZE)
+    desc = vmdk_read_desc(bs, &desc_size);
+    if (!desc)
         return -1;
+    if (s->desc_offset == 0) {
+        /* A descriptor file may grow with the new CID, 8 hex digits at most */
+        desc_size += 8;
+        desc = qemu_realloc(desc, desc_size);
+    }
 
     tmp_str = strstr(desc,"parentCID");
-    pstrcpy(tmp_desc, sizeof(tmp_desc), tmp_str);
+    if (!tmp_str)
+        goto out;
+    tmp_desc = qemu_strdup(tmp_str);
     if ((p_name = strstr(desc,"CID")) != NULL) {
         p_name += sizeof("CID");
-        snprintf(p_name, sizeof(desc) - (p_name - desc), "%x\n", cid);
-        pstrcat(desc, sizeof(desc), tmp_desc);
+        snprintf(p_name, desc_size - (p_name - desc), "%x\n", cid);
+        pstrcat(desc, desc_size, tmp_desc);
     }
 
-    if (bdrv_pwrite_sync(bs->file, 0x200, desc, DESC_SIZE) < 0)
-        return -1;
-    return 0;
+    if (s->desc_offset == 0) {
+        /* A descriptor file, its length may have changed */
+        len = strlen(desc);
+        if (bdrv_pwrite_sync(bs->file, 0, desc, len) < 0)
+            goto out;
+        if (bdrv_truncate(bs->file, len) < 0)
+            goto out;
+    } else {
+        if (bdrv_pwrite_sync(bs->file, s->desc_offset, desc, DESC_SIZE) < 0)
+            goto out;
+    }
+    ret = 0;
+out:
+    qemu_free(tmp_desc);
+    qemu_free(desc);
+    return ret;
 }
 
 static int vmdk_is_cid_valid(BlockDriverState *bs)
@@ -333,14 +418,14 @@ fail:
     close(snp_fd);
     return ret;
 }
-
 static int vmdk_parent_open(BlockDriverState *bs)
 {
     char *p_name;
-    char desc[DESC_SIZE];
+    char *desc;
+    int desc_size, ret = -1;
 
-    /* the descriptor offset = 0x200 */
-    if (bdrv_pread(bs->file, 0x200, desc, DESC_SIZE) != DESC_SIZE)
+    desc = vmdk_read_desc(bs, &desc_size);
+    if (!desc)
         return -1;
 
     if ((p_name = strstr(desc,"parentFileNameHint")) != NULL) {
@@ -348,135 +433,377 @@ static int vmdk_parent_open(BlockDriverState *bs)
 
         p_name += sizeof("parentFileNameHint") + 1;
         if ((end_name = strchr(p_name,'\"')) == NULL)
-            return -1;
+            goto out;
         if ((end_name - p_name) > sizeof (bs->backing_file) - 1)
-            return -1;
+            goto out;
 
         pstrcpy(bs->backing_file, end_name - p_name + 1, p_name);
     }
+    ret = 0;
+out:
+    qemu_free(desc);
+    return ret;
+}
+
+static VmdkExtent *vmdk_add_extent(BlockDriverState *bs,
+                                   BlockDriverState *file, bool flat,
+                                   int64_t sectors)
+{
+    BDRVVmdkState *s = bs->opaque;
+    VmdkExtent *extent;
+
+    s->extents = qemu_realloc(s->extents,
+                              (s->num_extents + 1) * sizeof(VmdkExtent));
+    extent = &s->extents[s->num_extents];
+    s->num_extents++;
+
+    memset(extent, 0, sizeof(VmdkExtent));
+    extent->file = file;
+    extent->flat = flat;
+    extent->sectors = sectors;
+    extent->end_sector = sectors;
+    if (s->num_extents > 1) {
+        extent->end_sector += s->extents[s->num_extents - 2].end_sector;
+    }
+    return extent;
+}
+
+static void vmdk_free_extent_tables(VmdkExtent *extent)
+{
+    qemu_free(extent->l1_table);
+    qemu_free(extent->l1_backup_table);
+    qemu_free(extent->l2_cache);
+    qemu_free(extent->l2_cache_l1_index);
+    qemu_free(extent->l2_cache_counts);
+    qemu_free(extent->l2_cache_slot);
+}
+
+static void vmdk_free_extents(BlockDriverState *bs)
+{
+    BDRVVmdkState *s = bs->opaque;
+    VmdkExtent *extent;
+    int i;
+
+    for (i = 0; i < s->num_extents; i++) {
+        extent = &s->extents[i];
+        vmdk_free_extent_tables(extent);
+        if (extent->file != bs->file) {
+            bdrv_delete(extent->file);
+        }
+    }
+    qemu_free(s->extents);
+    s->extents = NULL;
+    s->num_extents = 0;
+}
 
+/* Read the grain directories and set up the grain table cache */
+static int vmdk_init_tables(VmdkExtent *extent)
+{
+    int l1_size, i;
+
+    if (extent->l1_entry_sectors <= 0 ||
+        extent->l2_size == 0 || extent->cluster_sectors == 0)
+        return -EINVAL;
+
+    l1_size = extent->l1_size * sizeof(uint32_t);
+    extent->l1_table = qemu_malloc(l1_size);
+    if (bdrv_pread(extent->file, extent->l1_table_offset, extent->l1_table,
+                   l1_size) != l1_size)
+        return -EIO;
+    for (i = 0; i < extent->l1_size; i++) {
+        le32_to_cpus(&extent->l1_table[i]);
+    }
+
+    if (extent->l1_backup_table_offset) {
+        extent->l1_backup_table = qemu_malloc(l1_size);
+        if (bdrv_pread(extent->file, extent->l1_backup_table_offset,
+                       extent->l1_backup_table, l1_size) != l1_size)
+            return -EIO;
+        for (i = 0; i < extent->l1_size; i++) {
+            le32_to_cpus(&extent->l1_backup_table[i]);
+        }
+    }
+
+    extent->l2_cache_size = MAX(1, MIN(extent->l1_size, L2_CACHE_MAX_SIZE));
+    extent->l2_cache = qemu_malloc(extent->l2_cache_size * extent->l2_size *
+                                   sizeof(uint32_t));
+    extent->l2_cache_l1_index = qemu_malloc(extent->l2_cache_size *
+                                            sizeof(int));
+    extent->l2_cache_counts = qemu_mallocz(extent->l2_cache_size *
+                                           sizeof(uint32_t));
+    extent->l2_cache_slot = qemu_mallocz(extent->l1_size * sizeof(int));
+    for (i = 0; i < extent->l2_cache_size; i++) {
+        extent->l2_cache_l1_index[i] = -1;
+    }
     return 0;
 }
 
-static int vmdk_open(BlockDriverState *bs, int flags)
+/* Open a hosted sparse extent; for VMDK4, *sectors is the capacity */
+static int vmdk_open_sparse(BlockDriverState *bs, BlockDriverState *file,
+                            int64_t *sectors)
 {
     BDRVVmdkState *s = bs->opaque;
+    VmdkExtent *extent;
     uint32_t magic;
-    int l1_size, i;
+    int ret;
 
-    if (bdrv_pread(bs->file, 0, &magic, sizeof(magic)) != sizeof(magic))
-        goto fail;
+    if (bdrv_pread(file, 0, &magic, sizeof(magic)) != sizeof(magic))
+        return -EIO;
 
     magic = be32_to_cpu(magic);
     if (magic == VMDK3_MAGIC) {
         VMDK3Header header;
 
-        if (bdrv_pread(bs->file, sizeof(magic), &header, sizeof(header)) != sizeof(header))
-            goto fail;
-        s->cluster_sectors = le32_to_cpu(header.granularity);
-        s->l2_size = 1 << 9;
-        s->l1_size = 1 << 6;
-        bs->total_sectors = le32_to_cpu(header.disk_sectors);
-        s->l1_table_offset = le32_to_cpu(header.l1dir_offset) << 9;
-        s->l1_backup_table_offset = 0;
-        s->l1_entry_sectors = s->l2_size * s->cluster_sectors;
+        if (bdrv_pread(file, sizeof(magic), &header, sizeof(header)) != sizeof(header))
+            return -EIO;
+        if (!*sectors)
+            *sectors = le32_to_cpu(header.disk_sectors);
+        extent = vmdk_add_extent(bs, file, false, *sectors);
+        extent->cluster_sectors = le32_to_cpu(header.granularity);
+        extent->l2_size = 1 << 9;
+        extent->l1_size = 1 << 6;
+        extent->l1_table_offset = le32_to_cpu(header.l1dir_offset) << 9;
+        extent->l1_backup_table_offset = 0;
+        extent->l1_entry_sectors = extent->l2_size * extent->cluster_sectors;
     } else if (magic == VMDK4_MAGIC) {
         VMDK4Header header;
 
-        if (bdrv_pread(bs->file, sizeof(magic), &header, sizeof(header)) != sizeof(header))
-            goto fail;
-        bs->total_sectors = le64_to_cpu(header.capacity);
-        s->cluster_sectors = le64_to_cpu(header.granularity);
-        s->l2_size = le32_to_cpu(header.num_gtes_per_gte);
-        s->l1_entry_sectors = s->l2_size * s->cluster_sectors;
-        if (s->l1_entry_sectors <= 0)
-            goto fail;
-        s->l1_size = (bs->total_sectors + s->l1_entry_sectors - 1)
-            / s->l1_entry_sectors;
-        s->l1_table_offset = le64_to_cpu(header.rgd_offset) << 9;
-        s->l1_backup_table_offset = le64_to_cpu(header.gd_offset) << 9;
-
-        // try to open parent images, if exist
-        if (vmdk_parent_open(bs) != 0)
-            goto fail;
-        // write the CID once after the image creation
-        s->parent_cid = vmdk_read_cid(bs,1);
+        if (bdrv_pread(file, sizeof(magic), &header, sizeof(header)) != sizeof(header))
+            return -EIO;
+        if (!*sectors)
+            *sectors = le64_to_cpu(header.capacity);
+        extent = vmdk_add_extent(bs, file, false, *sectors);
+        extent->cluster_sectors = le64_to_cpu(header.granularity);
+        extent->l2_size = le32_to_cpu(header.num_gtes_per_gte);
+        extent->l1_entry_sectors = extent->l2_size * extent->cluster_sectors;
+        if (extent->l1_entry_sectors <= 0) {
+            s->num_extents--;
+            return -EINVAL;
+        }
+        extent->l1_size = (extent->sectors + extent->l1_entry_sectors - 1)
+            / extent->l1_entry_sectors;
+        extent->l1_table_offset = le64_to_cpu(header.rgd_offset) << 9;
+        extent->l1_backup_table_offset = le64_to_cpu(header.gd_offset) << 9;
     } else {
-        goto fail;
+        return -EINVAL;
     }
 
-    /* read the L1 table */
-    l1_size = s->l1_size * sizeof(uint32_t);
-    s->l1_table = qemu_malloc(l1_size);
-    if (bdrv_pread(bs->file, s->l1_table_offset, s->l1_table, l1_size) != l1_size)
-        goto fail;
-    for(i = 0; i < s->l1_size; i++) {
-        le32_to_cpus(&s->l1_table[i]);
+    ret = vmdk_init_tables(extent);
+    if (ret < 0) {
+        /* Drop the extent again, file is left to the caller */
+        vmdk_free_extent_tables(extent);
+        s->num_extents--;
     }
+    return ret;
+}
 
-    if (s->l1_backup_table_offset) {
-        s->l1_backup_table = qemu_malloc(l1_size);
-        if (bdrv_pread(bs->file, s->l1_backup_table_offset, s->l1_backup_table, l1_size) != l1_size)
-            goto fail;
-        for(i = 0; i < s->l1_size; i++) {
-            le32_to_cpus(&s->l1_backup_table[i]);
+/*
+ * Parse the extent lines of a descriptor file, for example
+ *
+ *   RW 4192256 SPARSE "disk-s001.vmdk"
+ *   RW 4192256 FLAT "disk-f001.vmdk" 0
+ *
+ * Extent file names are relative to the descriptor file.
+ */
+static int vmdk_parse_extents(BlockDriverState *bs, const char *desc,
+                              int flags)
+{
+    const char *p = desc;
+    char access[11], type[11], fname[512];
+    char extent_path[PATH_MAX];
+    BlockDriverState *extent_file;
+    VmdkExtent *extent;
+    int64_t sectors, flat_offset;
+    int matches, ret;
+
+    for (; *p; p = strchr(p, '\n') ? strchr(p, '\n') + 1 : p + strlen(p)) {
+        flat_offset = 0;
+        matches = sscanf(p, "%10s %" SCNd64 " %10s \"%511[^\n\r\"]\" %" SCNd64,
+                         access, &sectors, type, fname, &flat_offset);
+        if (matches < 4 ||
+            (strcmp(access, "RW") && strcmp(access, "RDONLY"))) {
+            continue;
+        }
+        if (sectors <= 0 || flat_offset < 0) {
+            return -EINVAL;
+        }
+
+        path_combine(extent_path, sizeof(extent_path), bs->filename, fname);
+
+        if (!strcmp(type, "FLAT") || !strcmp(type, "VMFS")) {
+            ret = bdrv_file_open(&extent_file, extent_path, flags);
+            if (ret < 0) {
+                return ret;
+            }
+            extent = vmdk_add_extent(bs, extent_file, true, sectors);
+            extent->flat_start_offset = flat_offset << 9;
+        } else if (!strcmp(type, "SPARSE")) {
+            ret = bdrv_file_open(&extent_file, extent_path, flags);
+            if (ret < 0) {
+                return ret;
+            }
+            ret = vmdk_open_sparse(bs, extent_file, &sectors);
+            if (ret < 0) {
+                bdrv_delete(extent_file);
+                return ret;
+            }
+        } else {
+            fprintf(stderr, "VMDK: unsupported extent type '%s'\n", type);
+            return -ENOTSUP;
         }
     }
 
-    s->l2_cache = qemu_malloc(s->l2_size * L2_CACHE_SIZE * sizeof(uint32_t));
     return 0;
- fail:
-    qemu_free(s->l1_backup_table);
-    qemu_free(s->l1_table);
-    qemu_free(s->l2_cache);
-    return -1;
 }
 
-static uint64_t get_cluster_offset(BlockDriverState *bs, VmdkMetaData *m_data,
-                                   uint64_t offset, int allocate);
+static int vmdk_open_desc_file(BlockDriverState *bs, int flags)
+{
+    BDRVVmdkState *s = bs->opaque;
+    int64_t size;
+    char *desc;
+    int ret;
+
+    size = bdrv_getlength(bs->file);
+    if (size < 0) {
+        return size;
+    }
+    if (size > DESC_FILE_MAX_SIZE) {
+        return -EINVAL;
+    }
+
+    desc = qemu_mallocz(size + 1);
+    ret = bdrv_pread(bs->file, 0, desc, size);
+    if (ret < 0) {
+        goto out;
+    }
 
-static int get_whole_cluster(BlockDriverState *bs, uint64_t cluster_offset,
-                             uint64_t offset, int allocate)
+    s->desc_offset = 0;
+    ret = vmdk_parse_extents(bs, desc, flags);
+    if (ret == 0 && s->num_extents == 0) {
+        ret = -EINVAL;
+    }
+out:
+    qemu_free(desc);
+    return ret;
+}
+
+static int vmdk_open(BlockDriverState *bs, int flags)
 {
     BDRVVmdkState *s = bs->opaque;
-    uint8_t  whole_grain[s->cluster_sectors*512];        // 128 sectors * 512 bytes each = grain size 64KB
+    uint32_t magic;
+    int64_t sectors = 0;
+    int ret;
 
-    // we will be here if it's first write on non-exist grain(cluster).
-    // try to read from parent image, if exist
-    if (bs->backing_hd) {
-        int ret;
+    qemu_co_mutex_init(&s->lock);
+    s->desc_offset = -1;
 
-        if (!vmdk_is_cid_valid(bs))
-            return -1;
+    if (bdrv_pread(bs->file, 0, &magic, sizeof(magic)) != sizeof(magic))
+        return -EIO;
 
-        ret = bdrv_read(bs->backing_hd, offset >> 9, whole_grain,
-            s->cluster_sectors);
-        if (ret < 0) {
-            return -1;
-        }
+    magic = be32_to_cpu(magic);
+    if (magic == VMDK3_MAGIC || magic == VMDK4_MAGIC) {
+        /* A monolithic sparse image with an embedded descriptor */
+        if (magic == VMDK4_MAGIC)
+            s->desc_offset = 0x200;
+        ret = vmdk_open_sparse(bs, bs->file, &sectors);
+    } else {
+        ret = vmdk_open_desc_file(bs, flags);
+    }
+    if (ret < 0)
+        goto fail;
 
-        //Write grain only into the active image
-        ret = bdrv_write(bs->file, cluster_offset, whole_grain,
-            s->cluster_sectors);
-        if (ret < 0) {
-            return -1;
+    bs->total_sectors = s->extents[s->num_extents - 1].end_sector;
+
+    if (s->desc_offset >= 0) {
+        // try to open parent images, if exist
+        if (vmdk_parent_open(bs) != 0) {
+            ret = -EINVAL;
+            goto fail;
         }
+        // write the CID once after the image creation
+        s->parent_cid = vmdk_read_cid(bs,1);
     }
     return 0;
+
+ fail:
+    vmdk_free_extents(bs);
+    return ret;
 }
 
-static int vmdk_L2update(BlockDriverState *bs, VmdkMetaData *m_data)
+/* Find the extent that contains sector_num, extents are sorted by sector */
+static VmdkExtent *find_extent(BDRVVmdkState *s, int64_t sector_num)
 {
-    BDRVVmdkState *s = bs->opaque;
+    int low = 0, high = s->num_extents - 1, mid;
+
+    while (low <= high) {
+        mid = (low + high) / 2;
+        if (sector_num >= s->extents[mid].end_sector) {
+            low = mid + 1;
+        } else if (mid > 0 && sector_num < s->extents[mid - 1].end_sector) {
+            high = mid - 1;
+        } else {
+            return &s->extents[mid];
+        }
+    }
+    return NULL;
+}
+
+static int64_t extent_start(VmdkExtent *extent)
+{
+    return extent->end_sector - extent->sectors;
+}
+
+/* Number of sectors from sector_num that map to contiguous extent sectors */
+static int extent_run_sectors(VmdkExtent *extent, int64_t sector_num,
+                              int nb_sectors)
+{
+    int64_t n;
+
+    if (extent->flat) {
+        n = extent->end_sector - sector_num;
+    } else {
+        n = extent->cluster_sectors -
+            (sector_num - extent_start(extent)) % extent->cluster_sectors;
+    }
+    return MIN(n, nb_sectors);
+}
+
+static int get_whole_cluster(BlockDriverState *bs, VmdkExtent *extent,
+                             uint64_t cluster_offset, uint64_t offset)
+{
+    uint8_t *whole_grain;
+    int ret;
 
+    // we will be here if it's first write on non-exist grain(cluster).
+    // try to read from parent image, if exist
+    if (!bs->backing_hd)
+        return 0;
+
+    if (!vmdk_is_cid_valid(bs))
+        return -1;
+
+    whole_grain = qemu_blockalign(bs, extent->cluster_sectors * 512);
+    ret = bdrv_read(bs->backing_hd, offset >> 9, whole_grain,
+        extent->cluster_sectors);
+    if (ret >= 0) {
+        //Write grain only into the active image
+        ret = bdrv_write(extent->file, cluster_offset, whole_grain,
+            extent->cluster_sectors);
+    }
+    qemu_vfree(whole_grain);
+    return ret < 0 ? -1 : 0;
+}
+
+static int vmdk_L2update(VmdkExtent *extent, VmdkMetaData *m_data)
+{
     /* update L2 table */
-    if (bdrv_pwrite_sync(bs->file, ((int64_t)m_data->l2_offset * 512) + (m_data->l2_index * sizeof(m_data->offset)),
+    if (bdrv_pwrite_sync(extent->file, ((int64_t)m_data->l2_offset * 512) + (m_data->l2_index * sizeof(m_data->offset)),
                     &(m_data->offset), sizeof(m_data->offset)) < 0)
         return -1;
     /* update backup L2 table */
-    if (s->l1_backup_table_offset != 0) {
-        m_data->l2_offset = s->l1_backup_table[m_data->l1_index];
-        if (bdrv_pwrite_sync(bs->file, ((int64_t)m_data->l2_offset * 512) + (m_data->l2_index * sizeof(m_data->offset)),
+    if (extent->l1_backup_table_offset != 0) {
+        m_data->l2_offset = extent->l1_backup_table[m_data->l1_index];
+        if (bdrv_pwrite_sync(extent->file, ((int64_t)m_data->l2_offset * 512) + (m_data->l2_index * sizeof(m_data->offset)),
                         &(m_data->offset), sizeof(m_data->offset)) < 0)
             return -1;
     }
@@ -484,66 +811,101 @@ static int vmdk_L2update(BlockDriverState *bs, VmdkMetaData *m_data)
     return 0;
 }
 
-static uint64_t get_cluster_offset(BlockDriverState *bs, VmdkMetaData *m_data,
-                                   uint64_t offset, int allocate)
+/* Return the cached grain table for l1_index, loading it if necessary */
+static uint32_t *get_l2_table(VmdkExtent *extent, unsigned int l1_index)
 {
-    BDRVVmdkState *s = bs->opaque;
-    unsigned int l1_index, l2_offset, l2_index;
-    int min_index, i, j;
-    uint32_t min_count, *l2_table, tmp = 0;
-    uint64_t cluster_offset;
-
-    if (m_data)
-        m_data->valid = 0;
-
-    l1_index = (offset >> 9) / s->l1_entry_sectors;
-    if (l1_index >= s->l1_size)
-        return 0;
-    l2_offset = s->l1_table[l1_index];
-    if (!l2_offset)
-        return 0;
-    for(i = 0; i < L2_CACHE_SIZE; i++) {
-        if (l2_offset == s->l2_cache_offsets[i]) {
-            /* increment the hit count */
-            if (++s->l2_cache_counts[i] == 0xffffffff) {
-                for(j = 0; j < L2_CACHE_SIZE; j++) {
-                    s->l2_cache_counts[j] >>= 1;
-                }
+    unsigned int l2_offset = extent->l1_table[l1_index];
+    int slot, min_index, i;
+    uint32_t min_count, *l2_table;
+
+    slot = extent->l2_cache_slot[l1_index] - 1;
+    if (slot >= 0) {
+        /* increment the hit count */
+        if (++extent->l2_cache_counts[slot] == 0xffffffff) {
+            for (i = 0; i < extent->l2_cache_size; i++) {
+                extent->l2_cache_counts[i] >>= 1;
             }
-            l2_table = s->l2_cache + (i * s->l2_size);
-            goto found;
         }
+        return extent->l2_cache + (slot * extent->l2_size);
     }
+
     /* not found: load a new entry in the least used one */
     min_index = 0;
     min_count = 0xffffffff;
-    for(i = 0; i < L2_CACHE_SIZE; i++) {
-        if (s->l2_cache_counts[i] < min_count) {
-            min_count = s->l2_cache_counts[i];
+    for (i = 0; i < extent->l2_cache_size; i++) {
+        if (extent->l2_cache_counts[i] < min_count) {
+            min_count = extent->l2_cache_counts[i];
             min_index = i;
         }
     }
-    l2_table = s->l2_cache + (min_index * s->l2_size);
-    if (bdrv_pread(bs->file, (int64_t)l2_offset * 512, l2_table, s->l2_size * sizeof(uint32_t)) !=
-                                                                        s->l2_size * sizeof(uint32_t))
+    if (extent->l2_cache_l1_index[min_index] >= 0) {
+        extent->l2_cache_slot[extent->l2_cache_l1_index[min_index]] = 0;
+        extent->l2_cache_l1_index[min_index] = -1;
+        extent->l2_cache_counts[min_index] = 0;
+    }
+
+    l2_table = extent->l2_cache + (min_index * extent->l2_size);
+    if (bdrv_pread(extent->file, (int64_t)l2_offset * 512, l2_table,
+                   extent->l2_size * sizeof(uint32_t)) !=
+                   extent->l2_size * sizeof(uint32_t))
+        return NULL;
+
+    extent->l2_cache_l1_index[min_index] = l1_index;
+    extent->l2_cache_counts[min_index] = 1;
+    extent->l2_cache_slot[l1_index] = min_index + 1;
+    return l2_table;
+}
+
+/*
+ * Store the offset of sector_num in the file of its extent in
+ * *cluster_offset.  offset is the byte offset of sector_num in the whole
+ * image.  Returns 0 if the sector is allocated and -1 if it is not, so that
+ * offset 0 of a flat extent isn't mistaken for a hole.
+ */
+static int get_cluster_offset(BlockDriverState *bs, VmdkExtent *extent,
+                              VmdkMetaData *m_data, uint64_t offset,
+                              int allocate, uint64_t *cluster_offset)
+{
+    unsigned int l1_index, l2_offset, l2_index;
+    uint32_t *l2_table, tmp = 0;
+    uint64_t grain;
+    int64_t extent_sector = (offset >> 9) - extent_start(extent);
+    uint64_t index_in_cluster;
+
+    if (m_data)
+        m_data->valid = 0;
+
+    if (extent->flat) {
+        *cluster_offset = extent->flat_start_offset + (extent_sector << 9);
         return 0;
+    }
+
+    index_in_cluster = extent_sector % extent->cluster_sectors;
+
+    l1_index = extent_sector / extent->l1_entry_sectors;
+    if (l1_index >= extent->l1_size)
+        return -1;
+    l2_offset = extent->l1_table[l1_index];
+    if (!l2_offset)
+        return -1;
+    l2_table = get_l2_table(extent, l1_index);
+    if (!l2_table)
+        return -1;
 
-    s->l2_cache_offsets[min_index] = l2_offset;
-    s->l2_cache_counts[min_index] = 1;
- found:
-    l2_index = ((offset >> 9) / s->cluster_sectors) % s->l2_size;
-    cluster_offset = le32_to_cpu(l2_table[l2_index]);
+    l2_index = (extent_sector / extent->cluster_sectors) % extent->l2_size;
+    grain = le32_to_cpu(l2_table[l2_index]);
 
-    if (!cluster_offset) {
+    if (!grain) {
         if (!allocate)
-            return 0;
+            return -1;
 
         // Avoid the L2 tables update for the images that have snapshots.
-        cluster_offset = bdrv_getlength(bs->file);
-        bdrv_truncate(bs->file, cluster_offset + (s->cluster_sectors << 9));
+        grain = bdrv_getlength(extent->file);
+        bdrv_truncate(extent->file,
+                      grain + (extent->cluster_sectors << 9));
 
-        cluster_offset >>= 9;
-        tmp = cpu_to_le32(cluster_offset);
+        grain >>= 9;
+        tmp = cpu_to_le32(grain);
         l2_table[l2_index] = tmp;
 
         /* First of all we write grain itself, to avoid race condition
@@ -551,8 +913,11 @@ static uint64_t get_cluster_offset(BlockDriverState *bs, VmdkMetaData *m_data,
          * This problem may occur because of insufficient space on host disk
          * or inappropriate VM shutdown.
          */
-        if (get_whole_cluster(bs, cluster_offset, offset, allocate) == -1)
-            return 0;
+        if (get_whole_cluster(bs, extent, grain,
+                              offset - (index_in_cluster << 9)) == -1) {
+            l2_table[l2_index] = 0;
+            return -1;
+        }
 
         if (m_data) {
             m_data->offset = tmp;
@@ -562,105 +927,212 @@ static uint64_t get_cluster_offset(BlockDriverState *bs, VmdkMetaData *m_data,
             m_data->valid = 1;
         }
     }
-    cluster_offset <<= 9;
-    return cluster_offset;
+    *cluster_offset = (grain << 9) + (index_in_cluster << 9);
+    return 0;
 }
 
 static int vmdk_is_allocated(BlockDriverState *bs, int64_t sector_num,
                              int nb_sectors, int *pnum)
 {
     BDRVVmdkState *s = bs->opaque;
-    int index_in_cluster, n;
+    VmdkExtent *extent;
     uint64_t cluster_offset;
+    int ret;
 
-    cluster_offset = get_cluster_offset(bs, NULL, sector_num << 9, 0);
-    index_in_cluster = sector_num % s->cluster_sectors;
-    n = s->cluster_sectors - index_in_cluster;
-    if (n > nb_sectors)
-        n = nb_sectors;
-    *pnum = n;
-    return (cluster_offset != 0);
+    extent = find_extent(s, sector_num);
+    if (!extent) {
+        *pnum = 0;
+        return 0;
+    }
+    ret = get_cluster_offset(bs, extent, NULL, sector_num << 9, 0,
+                             &cluster_offset);
+    *pnum = extent_run_sectors(extent, sector_num, nb_sectors);
+    return (ret == 0);
 }
 
-static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+static int coroutine_fn vmdk_co_is_allocated(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, int *pnum)
 {
     BDRVVmdkState *s = bs->opaque;
-    int index_in_cluster, n, ret;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = vmdk_is_allocated(bs, sector_num, nb_sectors, pnum);
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+static int64_t coroutine_fn vmdk_co_get_block_status(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, int *pnum)
+{
+    BDRVVmdkState *s = bs->opaque;
+    VmdkExtent *extent;
     uint64_t cluster_offset;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    extent = find_extent(s, sector_num);
+    if (!extent) {
+        qemu_co_mutex_unlock(&s->lock);
+        *pnum = 0;
+        return -EIO;
+    }
+    ret = get_cluster_offset(bs, extent, NULL, sector_num << 9, 0,
+                             &cluster_offset);
+    *pnum = extent_run_sectors(extent, sector_num, nb_sectors);
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (ret < 0) {
+        return 0;
+    }
+    if (extent->file != bs->file) {
+        /* The offset is in another file than bs->file */
+        return BDRV_BLOCK_DATA;
+    }
+    return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID | cluster_offset;
+}
+
+static int coroutine_fn vmdk_co_readv(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, QEMUIOVector *qiov)
+{
+    BDRVVmdkState *s = bs->opaque;
+    VmdkExtent *extent;
+    int n, ret = 0;
+    uint64_t cluster_offset;
+    uint64_t bytes_done = 0;
+    QEMUIOVector hd_qiov;
+
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+
+    qemu_co_mutex_lock(&s->lock);
 
     while (nb_sectors > 0) {
-        cluster_offset = get_cluster_offset(bs, NULL, sector_num << 9, 0);
-        index_in_cluster = sector_num % s->cluster_sectors;
-        n = s->cluster_sectors - index_in_cluster;
-        if (n > nb_sectors)
-            n = nb_sectors;
-        if (!cluster_offset) {
+        extent = find_extent(s, sector_num);
+        if (!extent) {
+            ret = -EIO;
+            goto fail;
+        }
+        ret = get_cluster_offset(bs, extent, NULL, sector_num << 9, 0,
+                                 &cluster_offset);
+        n = extent_run_sectors(extent, sector_num, nb_sectors);
+
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_copy(&hd_qiov, qiov, bytes_done, n * 512);
+
+        if (ret < 0) {
             // try to read from parent image, if exist
             if (bs->backing_hd) {
-                if (!vmdk_is_cid_valid(bs))
-                    return -1;
-                ret = bdrv_read(bs->backing_hd, sector_num, buf, n);
+                if (!vmdk_is_cid_valid(bs)) {
+                    ret = -EINVAL;
+                    goto fail;
+                }
+                qemu_co_mutex_unlock(&s->lock);
+                ret = bdrv_co_readv(bs->backing_hd, sector_num, n, &hd_qiov);
+                qemu_co_mutex_lock(&s->lock);
                 if (ret < 0)
-                    return -1;
+                    goto fail;
             } else {
-                memset(buf, 0, 512 * n);
+                qemu_iovec_memset(&hd_qiov, 0, 512 * n);
             }
         } else {
-            if(bdrv_pread(bs->file, cluster_offset + index_in_cluster * 512, buf, n * 512) != n * 512)
-                return -1;
+            qemu_co_mutex_unlock(&s->lock);
+            ret = bdrv_co_readv(extent->file, cluster_offset >> 9, n,
+                                &hd_qiov);
+            qemu_co_mutex_lock(&s->lock);
+            if (ret < 0)
+                goto fail;
         }
         nb_sectors -= n;
         sector_num += n;
-        buf += n * 512;
+        bytes_done += n * 512;
     }
-    return 0;
+    ret = 0;
+
+fail:
+    qemu_co_mutex_unlock(&s->lock);
+    qemu_iovec_destroy(&hd_qiov);
+    return ret;
 }
 
-static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
-                     const uint8_t *buf, int nb_sectors)
+static int coroutine_fn vmdk_co_writev(BlockDriverState *bs,
+                                       int64_t sector_num, int nb_sectors,
+                                       QEMUIOVector *qiov)
 {
     BDRVVmdkState *s = bs->opaque;
+    VmdkExtent *extent;
     VmdkMetaData m_data;
-    int index_in_cluster, n;
+    int n, ret = 0;
     uint64_t cluster_offset;
-    static int cid_update = 0;
+    uint64_t bytes_done = 0;
+    QEMUIOVector hd_qiov;
 
     if (sector_num > bs->total_sectors) {
         fprintf(stderr,
                 "(VMDK) Wrong offset: sector_num=0x%" PRIx64
                 " total_sectors=0x%" PRIx64 "\n",
                 sector_num, bs->total_sectors);
-        return -1;
+        return -EIO;
     }
 
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+
+    qemu_co_mutex_lock(&s->lock);
+
     while (nb_sectors > 0) {
-        index_in_cluster = sector_num & (s->cluster_sectors - 1);
-        n = s->cluster_sectors - index_in_cluster;
-        if (n > nb_sectors)
-            n = nb_sectors;
-        cluster_offset = get_cluster_offset(bs, &m_data, sector_num << 9, 1);
-        if (!cluster_offset)
-            return -1;
+        extent = find_extent(s, sector_num);
+        if (!extent) {
+            ret = -EIO;
+            goto fail;
+        }
+        if (get_cluster_offset(bs, extent, &m_data, sector_num << 9, 1,
+                               &cluster_offset) < 0) {
+            ret = -EIO;
+            goto fail;
+        }
+        n = extent_run_sectors(extent, sector_num, nb_sectors);
+
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_copy(&hd_qiov, qiov, bytes_done, n * 512);
 
-        if (bdrv_pwrite(bs->file, cluster_offset + index_in_cluster * 512, buf, n * 512) != n * 512)
-            return -1;
         if (m_data.valid) {
+            /*
+             * A new grain: keep the lock until the grain table points to it,
+             * so that nobody else sees the grain before it has its data.
+             */
+            ret = bdrv_co_writev(extent->file, cluster_offset >> 9, n,
+                                 &hd_qiov);
+            if (ret < 0)
+                goto fail;
             /* update L2 tables */
-            if (vmdk_L2update(bs, &m_data) == -1)
-                return -1;
+            if (vmdk_L2update(extent, &m_data) == -1) {
+                ret = -EIO;
+                goto fail;
+            }
+        } else {
+            qemu_co_mutex_unlock(&s->lock);
+            ret = bdrv_co_writev(extent->file, cluster_offset >> 9, n,
+                                 &hd_qiov);
+            qemu_co_mutex_lock(&s->lock);
+            if (ret < 0)
+                goto fail;
         }
         nb_sectors -= n;
         sector_num += n;
-        buf += n * 512;
+        bytes_done += n * 512;
 
         // update CID on the first write every time the virtual disk is opened
-        if (!cid_update) {
+        if (!s->cid_updated && s->desc_offset >= 0) {
+            s->cid_updated = 1;
             vmdk_write_cid(bs, time(NULL));
-            cid_update++;
         }
     }
-    return 0;
+    ret = 0;
+
+fail:
+    qemu_co_mutex_unlock(&s->lock);
+    qemu_iovec_destroy(&hd_qiov);
+    return ret;
 }
 
 static int vmdk_create(const char *filename, QEMUOptionParameter *options)
@@ -822,17 +1294,29 @@ exit:
 
 static void vmdk_close(BlockDriverState *bs)
 {
-    BDRVVmdkState *s = bs->opaque;
-
-    qemu_free(s->l1_table);
-    qemu_free(s->l2_cache);
+    vmdk_free_extents(bs);
 }
 
-static int vmdk_flush(BlockDriverState *bs)
+static int coroutine_fn vmdk_co_flush(BlockDriverState *bs)
 {
-    return bdrv_flush(bs->file);
-}
+    BDRVVmdkState *s = bs->opaque;
+    int i, ret, err = 0;
 
+    for (i = 0; i < s->num_extents; i++) {
+        ret = bdrv_co_flush(s->extents[i].file);
+        if (ret < 0) {
+            err = ret;
+        }
+    }
+    if (s->desc_offset == 0) {
+        /* the descriptor file */
+        ret = bdrv_co_flush(bs->file);
+        if (ret < 0) {
+            err = ret;
+        }
+    }
+    return err;
+}
 
 static QEMUOptionParameter vmdk_create_options[] = {
     {
@@ -858,13 +1342,16 @@ static BlockDriver bdrv_vmdk = {
     .instance_size	= sizeof(BDRVVmdkState),
     .bdrv_probe		= vmdk_probe,
     .bdrv_open      = vmdk_open,
-    .bdrv_read		= vmdk_read,
-    .bdrv_write		= vmdk_write,
     .bdrv_close		= vmdk_close,
     .bdrv_create	= vmdk_create,
-    .bdrv_flush		= vmdk_flush,
     .bdrv_is_allocated	= vmdk_is_allocated,
 
+    .bdrv_co_readv          = vmdk_co_readv,
+    .bdrv_co_writev         = vmdk_co_writev,
+    .bdrv_co_flush          = vmdk_co_flush,
+    .bdrv_co_is_allocated   = vmdk_co_is_allocated,
+    .bdrv_co_get_block_status = vmdk_co_get_block_status,
+
     .create_options = vmdk_create_options,
 };
 
@@ -30,8 +30,6 @@
 
 #define HEADER_SIZE 512
 
-//#define CACHE
-
 enum vhd_type {
     VHD_FIXED           = 2,
     VHD_DYNAMIC         = 3,
@@ -109,24 +107,36 @@ struct vhd_dyndisk_header {
     } parent_locator[8];
 };
 
+/* Number of block bitmaps that are kept in memory */
+#define BITMAP_CACHE_SIZE 16
+
 typedef struct BDRVVPCState {
+    CoMutex lock;
     uint8_t footer_buf[HEADER_SIZE];
     uint64_t free_data_block_offset;
     int max_table_entries;
     uint32_t *pagetable;
     uint64_t bat_offset;
-    uint64_t last_bitmap_offset;
 
     uint32_t block_size;
     uint32_t bitmap_size;
 
-#ifdef CACHE
-    uint8_t *pageentry_u8;
-    uint32_t *pageentry_u32;
-    uint16_t *pageentry_u16;
-
-    uint64_t last_bitmap;
-#endif
+    /* Fixed images have neither BAT nor bitmaps, the data starts at 0 */
+    int fixed;
+
+    uint8_t *bitmap_cache;
+    int bitmap_cache_index[BITMAP_CACHE_SIZE];
+    uint32_t bitmap_cache_counts[BITMAP_CACHE_SIZE];
+
+    /*
+     * With writeback caching, the BAT entries and the footer of newly
+     * allocated blocks are only written on flush.  BAT entries from
+     * bat_dirty_start to bat_dirty_end (exclusive) must be written then.
+     */
+    bool writethrough;
+    bool footer_dirty;
+    int bat_dirty_start;
+    int bat_dirty_end;
 } BDRVVPCState;
 
 static uint32_t vpc_checksum(uint8_t* buf, size_t size)
@@ -156,13 +166,23 @@ static int vpc_open(BlockDriverState *bs, int flags)
     struct vhd_dyndisk_header* dyndisk_header;
     uint8_t buf[HEADER_SIZE];
     uint32_t checksum;
+    int64_t offset;
 
     if (bdrv_pread(bs->file, 0, s->footer_buf, HEADER_SIZE) != HEADER_SIZE)
         goto fail;
 
     footer = (struct vhd_footer*) s->footer_buf;
-    if (strncmp(footer->creator, "conectix", 8))
-        goto fail;
+    if (strncmp(footer->creator, "conectix", 8)) {
+        // Fixed images only have a footer at the end of the file
+        offset = bdrv_getlength(bs->file);
+        if (offset < HEADER_SIZE)
+            goto fail;
+        if (bdrv_pread(bs->file, offset - HEADER_SIZE, s->footer_buf,
+                       HEADER_SIZE) != HEADER_SIZE)
+            goto fail;
+        if (strncmp(footer->creator, "conectix", 8))
+            goto fail;
+    }
 
     checksum = be32_to_cpu(footer->checksum);
     footer->checksum = 0;
@@ -176,6 +196,21 @@ static int vpc_open(BlockDriverState *bs, int flags)
     bs->total_sectors = (int64_t)
         be16_to_cpu(footer->cyls) * footer->heads * footer->secs_per_cyl;
 
+    // Hyper-V uses the size in the footer, and so do fixed images whose
+    // data can't extend beyond it
+    if (!strncmp(footer->creator_app, "win ", 4) ||
+        be32_to_cpu(footer->type) == VHD_FIXED) {
+        bs->total_sectors = be64_to_cpu(footer->size) / BDRV_SECTOR_SIZE;
+    }
+
+    s->writethrough = ((flags & BDRV_O_CACHE_WB) == 0);
+    qemu_co_mutex_init(&s->lock);
+
+    if (be32_to_cpu(footer->type) == VHD_FIXED) {
+        s->fixed = 1;
+        return 0;
+    }
+
     if (bdrv_pread(bs->file, be64_to_cpu(footer->data_offset), buf, HEADER_SIZE)
             != HEADER_SIZE)
         goto fail;
@@ -187,6 +222,12 @@ static int vpc_open(BlockDriverState *bs, int flags)
 
 
     s->block_size = be32_to_cpu(dyndisk_header->block_size);
+    if (s->block_size < BDRV_SECTOR_SIZE ||
+        (s->block_size & (s->block_size - 1))) {
+        fprintf(stderr, "block-vpc: Invalid block size %" PRIu32 " in '%s'\n",
+                s->block_size, bs->filename);
+        goto fail;
+    }
     s->bitmap_size = ((s->block_size / (8 * 512)) + 511) & ~511;
 
     s->max_table_entries = be32_to_cpu(dyndisk_header->max_table_entries);
@@ -211,107 +252,234 @@ static int vpc_open(BlockDriverState *bs, int flags)
         }
     }
 
-    s->last_bitmap_offset = (int64_t) -1;
-
-#ifdef CACHE
-    s->pageentry_u8 = qemu_malloc(512);
-    s->pageentry_u32 = s->pageentry_u8;
-    s->pageentry_u16 = s->pageentry_u8;
-    s->last_pagetable = -1;
-#endif
+    s->bitmap_cache = qemu_malloc(BITMAP_CACHE_SIZE * s->bitmap_size);
+    for (i = 0; i < BITMAP_CACHE_SIZE; i++) {
+        s->bitmap_cache_index[i] = -1;
+        s->bitmap_cache_counts[i] = 0;
+    }
 
     return 0;
  fail:
+    qemu_free(s->pagetable);
+    s->pagetable = NULL;
     return -1;
 }
 
 /*
- * Returns the absolute byte offset of the given sector in the image file.
- * If the sector is not allocated, -1 is returned instead.
+ * Returns a cache slot for the bitmap of the given block, evicting the least
+ * used bitmap if the block isn't cached yet.  *hit tells whether the slot
+ * already contains the bitmap.
+ */
+static uint8_t *bitmap_cache_slot(BDRVVPCState *s, int index, int *hit)
+{
+    int i, slot = -1, min_index = 0;
+    uint32_t min_count = 0xffffffff;
+
+    for (i = 0; i < BITMAP_CACHE_SIZE; i++) {
+        if (s->bitmap_cache_index[i] == index) {
+            slot = i;
+            break;
+        }
+        if (s->bitmap_cache_counts[i] < min_count) {
+            min_count = s->bitmap_cache_counts[i];
+            min_index = i;
+        }
+    }
+
+    if (slot >= 0) {
+        /* increment the hit count */
+        if (++s->bitmap_cache_counts[slot] == 0xffffffff) {
+            for (i = 0; i < BITMAP_CACHE_SIZE; i++) {
+                s->bitmap_cache_counts[i] >>= 1;
+            }
+        }
+        *hit = 1;
+    } else {
+        /* not found: use the least used entry */
+        slot = min_index;
+        s->bitmap_cache_index[slot] = index;
+        s->bitmap_cache_counts[slot] = 1;
+        *hit = 0;
+    }
+    return s->bitmap_cache + slot * s->bitmap_size;
+}
+
+/* Forgets the cached bitmap of a block whose bitmap couldn't be set up */
+static void bitmap_cache_drop(BDRVVPCState *s, int index)
+{
+    int i;
+
+    for (i = 0; i < BITMAP_CACHE_SIZE; i++) {
+        if (s->bitmap_cache_index[i] == index) {
+            s->bitmap_cache_index[i] = -1;
+            s->bitmap_cache_counts[i] = 0;
+        }
+    }
+}
+
+/* Returns the bitmap of an allocated block, or NULL on I/O errors */
+static uint8_t *get_bitmap(BlockDriverState *bs, int index)
+{
+    BDRVVPCState *s = bs->opaque;
+    uint8_t *bitmap;
+    int hit;
+
+    bitmap = bitmap_cache_slot(s, index, &hit);
+    if (!hit) {
+        if (bdrv_pread(bs->file, 512 * (int64_t) s->pagetable[index], bitmap,
+                       s->bitmap_size) != s->bitmap_size) {
+            bitmap_cache_drop(s, index);
+            return NULL;
+        }
+    }
+    return bitmap;
+}
+
+/* The bitmap has one bit per sector, the most significant bit first */
+static inline int bitmap_test(const uint8_t *bitmap, uint32_t i)
+{
+    return (bitmap[i / 8] >> (7 - (i % 8))) & 1;
+}
+
+/*
+ * Looks up where the sectors starting at sector_num are stored.  *offset is
+ * set to their absolute byte offset in the image file, or to -1 if they read
+ * as zeroes.  *pnum is set to the number of sectors, at most nb_sectors, that
+ * are in the same state and contiguous in the image file.
  *
- * The parameter write must be 1 if the offset will be used for a write
- * operation (the block bitmaps is updated then), 0 otherwise.
+ * Returns 0 on success and < 0 on error
  */
-static inline int64_t get_sector_offset(BlockDriverState *bs,
-    int64_t sector_num, int write)
+static int get_sector_offset(BlockDriverState *bs, int64_t sector_num,
+    int nb_sectors, int64_t *offset, int *pnum)
 {
     BDRVVPCState *s = bs->opaque;
-    uint64_t offset = sector_num * 512;
     uint64_t bitmap_offset, block_offset;
-    uint32_t pagetable_index, pageentry_index;
+    uint32_t pagetable_index, pageentry_index, sectors_per_block;
+    uint8_t *bitmap;
+    int allocated, n, i;
+
+    if (s->fixed) {
+        *offset = sector_num * BDRV_SECTOR_SIZE;
+        *pnum = nb_sectors;
+        return 0;
+    }
 
-    pagetable_index = offset / s->block_size;
-    pageentry_index = (offset % s->block_size) / 512;
+    sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
+    pagetable_index = sector_num / sectors_per_block;
+    pageentry_index = sector_num % sectors_per_block;
+    n = MIN(nb_sectors, sectors_per_block - pageentry_index);
 
-    if (pagetable_index >= s->max_table_entries || s->pagetable[pagetable_index] == 0xffffffff)
-        return -1; // not allocated
+    if (pagetable_index >= s->max_table_entries ||
+        s->pagetable[pagetable_index] == 0xffffffff) {
+        *offset = -1; // not allocated
+        *pnum = n;
+        return 0;
+    }
 
-    bitmap_offset = 512 * (uint64_t) s->pagetable[pagetable_index];
-    block_offset = bitmap_offset + s->bitmap_size + (512 * pageentry_index);
+    bitmap = get_bitmap(bs, pagetable_index);
+    if (!bitmap) {
+        return -EIO;
+    }
 
-    // We must ensure that we don't write to any sectors which are marked as
-    // unused in the bitmap. We get away with setting all bits in the block
-    // bitmap each time we write to a new block. This might cause Virtual PC to
-    // miss sparse read optimization, but it's not a problem in terms of
-    // correctness.
-    if (write && (s->last_bitmap_offset != bitmap_offset)) {
-        uint8_t bitmap[s->bitmap_size];
+    // Sectors of an allocated block that are clear in the bitmap have never
+    // been written and read as zeroes
+    allocated = bitmap_test(bitmap, pageentry_index);
+    for (i = 1; i < n; i++) {
+        uint32_t j = pageentry_index + i;
 
-        s->last_bitmap_offset = bitmap_offset;
-        memset(bitmap, 0xff, s->bitmap_size);
-        bdrv_pwrite_sync(bs->file, bitmap_offset, bitmap, s->bitmap_size);
+        if (j % 8 == 0 && i + 8 <= n &&
+            bitmap[j / 8] == (allocated ? 0xff : 0)) {
+            i += 7;
+            continue;
+        }
+        if (bitmap_test(bitmap, j) != allocated) {
+            break;
+        }
     }
+    *pnum = i;
 
-//    printf("sector: %" PRIx64 ", index: %x, offset: %x, bioff: %" PRIx64 ", bloff: %" PRIx64 "\n",
-//	sector_num, pagetable_index, pageentry_index,
-//	bitmap_offset, block_offset);
+    if (!allocated) {
+        *offset = -1;
+        return 0;
+    }
 
-// disabled by reason
-#if 0
-#ifdef CACHE
-    if (bitmap_offset != s->last_bitmap)
-    {
-	lseek(s->fd, bitmap_offset, SEEK_SET);
+    bitmap_offset = 512 * (uint64_t) s->pagetable[pagetable_index];
+    block_offset = bitmap_offset + s->bitmap_size + (512 * pageentry_index);
+    *offset = block_offset;
+    return 0;
+}
 
-	s->last_bitmap = bitmap_offset;
+/*
+ * Marks sectors of an allocated block as written in its bitmap.  Only the
+ * parts of the bitmap that change are written to the image file.
+ *
+ * Returns 0 on success and < 0 on error
+ */
+static int set_bitmap(BlockDriverState *bs, uint32_t pagetable_index,
+    uint32_t pageentry_index, int nb_sectors)
+{
+    BDRVVPCState *s = bs->opaque;
+    uint8_t *bitmap;
+    uint32_t i, first = -1, last = 0;
+    int ret;
 
-	// Scary! Bitmap is stored as big endian 32bit entries,
-	// while we used to look it up byte by byte
-	read(s->fd, s->pageentry_u8, 512);
-	for (i = 0; i < 128; i++)
-	    be32_to_cpus(&s->pageentry_u32[i]);
+    bitmap = get_bitmap(bs, pagetable_index);
+    if (!bitmap) {
+        return -EIO;
     }
 
-    if ((s->pageentry_u8[pageentry_index / 8] >> (pageentry_index % 8)) & 1)
-	return -1;
-#else
-    lseek(s->fd, bitmap_offset + (pageentry_index / 8), SEEK_SET);
-
-    read(s->fd, &bitmap_entry, 1);
-
-    if ((bitmap_entry >> (pageentry_index % 8)) & 1)
-	return -1; // not allocated
-#endif
-#endif
+    for (i = pageentry_index; i < pageentry_index + nb_sectors; i++) {
+        if (!bitmap_test(bitmap, i)) {
+            bitmap[i / 8] |= 0x80 >> (i % 8);
+            first = MIN(first, i / 8);
+            last = i / 8;
+        }
+    }
+    if (first == -1) {
+        return 0;
+    }
 
-    return block_offset;
+    ret = bdrv_pwrite(bs->file,
+        512 * (uint64_t) s->pagetable[pagetable_index] + first,
+        bitmap + first, last - first + 1);
+    return ret < 0 ? ret : 0;
 }
 
 /*
- * Writes the footer to the end of the image file. This is needed when the
- * file grows as it overwrites the old footer
+ * Writes the footer to the end of the image file and the BAT entries of
+ * newly allocated blocks.  The footer is needed when the file grows as it
+ * overwrites the old footer.
  *
  * Returns 0 on success and < 0 on error
  */
-static int rewrite_footer(BlockDriverState* bs)
+static int rewrite_metadata(BlockDriverState* bs)
 {
     int ret;
     BDRVVPCState *s = bs->opaque;
     int64_t offset = s->free_data_block_offset;
+    uint32_t *bat;
+    int i, n;
+
+    if (s->footer_dirty) {
+        ret = bdrv_pwrite(bs->file, offset, s->footer_buf, HEADER_SIZE);
+        if (ret < 0)
+            return ret;
+        s->footer_dirty = false;
+    }
 
-    ret = bdrv_pwrite_sync(bs->file, offset, s->footer_buf, HEADER_SIZE);
-    if (ret < 0)
-        return ret;
+    if (s->bat_dirty_start < s->bat_dirty_end) {
+        n = s->bat_dirty_end - s->bat_dirty_start;
+        bat = qemu_malloc(n * 4);
+        for (i = 0; i < n; i++) {
+            bat[i] = cpu_to_be32(s->pagetable[s->bat_dirty_start + i]);
+        }
+        ret = bdrv_pwrite(bs->file, s->bat_offset + 4 * s->bat_dirty_start,
+                          bat, n * 4);
+        qemu_free(bat);
+        if (ret < 0)
+            return ret;
+        s->bat_dirty_start = s->bat_dirty_end = 0;
+    }
 
     return 0;
 }
@@ -319,127 +487,212 @@ static int rewrite_footer(BlockDriverState* bs)
 /*
  * Allocates a new block. This involves writing a new footer and updating
  * the Block Allocation Table to use the space at the old end of the image
- * file (overwriting the old footer)
+ * file (overwriting the old footer).  With writeback caching, the footer and
+ * BAT are only written on the next flush, so that they are written once for
+ * all blocks allocated in the meantime.
  *
- * Returns the sectors' offset in the image file on success and < 0 on error
+ * Returns 0 on success and < 0 on error
  */
-static int64_t alloc_block(BlockDriverState* bs, int64_t sector_num)
+static int alloc_block(BlockDriverState* bs, uint32_t index)
 {
     BDRVVPCState *s = bs->opaque;
-    int64_t bat_offset;
-    uint32_t index, bat_value;
-    int ret;
-    uint8_t bitmap[s->bitmap_size];
-
-    // Check if sector_num is valid
-    if ((sector_num < 0) || (sector_num > bs->total_sectors))
-        return -1;
-
-    // Write entry into in-memory BAT
-    index = (sector_num * 512) / s->block_size;
-    if (s->pagetable[index] != 0xFFFFFFFF)
-        return -1;
+    uint8_t *bitmap;
+    int hit, ret;
 
-    s->pagetable[index] = s->free_data_block_offset / 512;
-
-    // Initialize the block's bitmap
+    // We must ensure that we don't write to any sectors which are marked as
+    // unused in the bitmap. We get away with setting all bits in the block
+    // bitmap when allocating the block, as the new block reads as zeroes.
+    // This might cause Virtual PC to miss sparse read optimization, but it's
+    // not a problem in terms of correctness.
+    bitmap = bitmap_cache_slot(s, index, &hit);
     memset(bitmap, 0xff, s->bitmap_size);
-    bdrv_pwrite_sync(bs->file, s->free_data_block_offset, bitmap,
+    ret = bdrv_pwrite(bs->file, s->free_data_block_offset, bitmap,
         s->bitmap_size);
-
-    // Write new footer (the old one will be overwritten)
-    s->free_data_block_offset += s->block_size + s->bitmap_size;
-    ret = rewrite_footer(bs);
     if (ret < 0)
         goto fail;
 
-    // Write BAT entry to disk
-    bat_offset = s->bat_offset + (4 * index);
-    bat_value = be32_to_cpu(s->pagetable[index]);
-    ret = bdrv_pwrite_sync(bs->file, bat_offset, &bat_value, 4);
-    if (ret < 0)
-        goto fail;
+    // Write entry into in-memory BAT
+    s->pagetable[index] = s->free_data_block_offset / 512;
+    s->free_data_block_offset += s->block_size + s->bitmap_size;
+
+    s->footer_dirty = true;
+    if (s->bat_dirty_start < s->bat_dirty_end) {
+        s->bat_dirty_start = MIN(s->bat_dirty_start, index);
+        s->bat_dirty_end = MAX(s->bat_dirty_end, index + 1);
+    } else {
+        s->bat_dirty_start = index;
+        s->bat_dirty_end = index + 1;
+    }
+
+    if (s->writethrough) {
+        ret = rewrite_metadata(bs);
+        if (ret < 0) {
+            s->free_data_block_offset -= s->block_size + s->bitmap_size;
+            s->pagetable[index] = 0xFFFFFFFF;
+            goto fail;
+        }
+    }
 
-    return get_sector_offset(bs, sector_num, 0);
+    return 0;
 
 fail:
-    s->free_data_block_offset -= (s->block_size + s->bitmap_size);
-    return -1;
+    bitmap_cache_drop(s, index);
+    return ret;
 }
 
-static int vpc_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+static int coroutine_fn vpc_co_readv(BlockDriverState *bs, int64_t sector_num,
+                                     int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVVPCState *s = bs->opaque;
-    int ret;
+    int ret = 0;
     int64_t offset;
-    int64_t sectors, sectors_per_block;
+    int sectors;
+    uint64_t bytes_done = 0;
+    QEMUIOVector hd_qiov;
 
-    while (nb_sectors > 0) {
-        offset = get_sector_offset(bs, sector_num, 0);
+    qemu_iovec_init(&hd_qiov, qiov->niov);
 
-        sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
-        sectors = sectors_per_block - (sector_num % sectors_per_block);
-        if (sectors > nb_sectors) {
-            sectors = nb_sectors;
+    qemu_co_mutex_lock(&s->lock);
+
+    while (nb_sectors > 0) {
+        ret = get_sector_offset(bs, sector_num, nb_sectors, &offset, &sectors);
+        if (ret < 0) {
+            goto fail;
         }
 
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_copy(&hd_qiov, qiov, bytes_done,
+                        sectors * BDRV_SECTOR_SIZE);
+
         if (offset == -1) {
-            memset(buf, 0, sectors * BDRV_SECTOR_SIZE);
+            qemu_iovec_memset(&hd_qiov, 0, sectors * BDRV_SECTOR_SIZE);
         } else {
-            ret = bdrv_pread(bs->file, offset, buf,
-                sectors * BDRV_SECTOR_SIZE);
-            if (ret != sectors * BDRV_SECTOR_SIZE) {
-                return -1;
+            qemu_co_mutex_unlock(&s->lock);
+            ret = bdrv_co_readv(bs->file, offset >> BDRV_SECTOR_BITS, sectors,
+                                &hd_qiov);
+            qemu_co_mutex_lock(&s->lock);
+            if (ret < 0) {
+                goto fail;
             }
         }
 
         nb_sectors -= sectors;
         sector_num += sectors;
-        buf += sectors * BDRV_SECTOR_SIZE;
+        bytes_done += sectors * BDRV_SECTOR_SIZE;
     }
-    return 0;
+    ret = 0;
+
+fail:
+    qemu_co_mutex_unlock(&s->lock);
+    qemu_iovec_destroy(&hd_qiov);
+    return ret;
 }
 
-static int vpc_write(BlockDriverState *bs, int64_t sector_num,
-    const uint8_t *buf, int nb_sectors)
+static int coroutine_fn vpc_co_writev(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, QEMUIOVector *qiov)
 {
     BDRVVPCState *s = bs->opaque;
     int64_t offset;
-    int64_t sectors, sectors_per_block;
-    int ret;
+    uint32_t sectors_per_block, pagetable_index, pageentry_index;
+    int sectors;
+    uint64_t bytes_done = 0;
+    QEMUIOVector hd_qiov;
+    int ret = 0;
 
-    while (nb_sectors > 0) {
-        offset = get_sector_offset(bs, sector_num, 1);
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+
+    qemu_co_mutex_lock(&s->lock);
 
-        sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
-        sectors = sectors_per_block - (sector_num % sectors_per_block);
-        if (sectors > nb_sectors) {
+    while (nb_sectors > 0) {
+        if (s->fixed) {
+            offset = sector_num * BDRV_SECTOR_SIZE;
             sectors = nb_sectors;
+            pagetable_index = pageentry_index = 0;
+        } else {
+            sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
+            pagetable_index = sector_num / sectors_per_block;
+            pageentry_index = sector_num % sectors_per_block;
+            sectors = MIN(nb_sectors, sectors_per_block - pageentry_index);
+
+            if (pagetable_index >= s->max_table_entries) {
+                ret = -EIO;
+                goto fail;
+            }
+            if (s->pagetable[pagetable_index] == 0xFFFFFFFF) {
+                ret = alloc_block(bs, pagetable_index);
+                if (ret < 0) {
+                    goto fail;
+                }
+            }
+            offset = 512 * (uint64_t) s->pagetable[pagetable_index] +
+                s->bitmap_size + 512 * pageentry_index;
         }
 
-        if (offset == -1) {
-            offset = alloc_block(bs, sector_num);
-            if (offset < 0)
-                return -1;
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_copy(&hd_qiov, qiov, bytes_done,
+                        sectors * BDRV_SECTOR_SIZE);
+
+        qemu_co_mutex_unlock(&s->lock);
+        ret = bdrv_co_writev(bs->file, offset >> BDRV_SECTOR_BITS, sectors,
+                             &hd_qiov);
+        qemu_co_mutex_lock(&s->lock);
+        if (ret < 0) {
+            goto fail;
         }
 
-        ret = bdrv_pwrite(bs->file, offset, buf, sectors * BDRV_SECTOR_SIZE);
-        if (ret != sectors * BDRV_SECTOR_SIZE) {
-            return -1;
+        // The data must be on disk before the bitmap says it is valid
+        if (!s->fixed) {
+            ret = set_bitmap(bs, pagetable_index, pageentry_index, sectors);
+            if (ret < 0) {
+                goto fail;
+            }
         }
 
         nb_sectors -= sectors;
         sector_num += sectors;
-        buf += sectors * BDRV_SECTOR_SIZE;
+        bytes_done += sectors * BDRV_SECTOR_SIZE;
     }
+    ret = 0;
 
-    return 0;
+fail:
+    qemu_co_mutex_unlock(&s->lock);
+    qemu_iovec_destroy(&hd_qiov);
+    return ret;
 }
 
-static int vpc_flush(BlockDriverState *bs)
+static int64_t coroutine_fn vpc_co_get_block_status(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, int *pnum)
 {
-    return bdrv_flush(bs->file);
+    BDRVVPCState *s = bs->opaque;
+    int64_t offset;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = get_sector_offset(bs, sector_num, nb_sectors, &offset, pnum);
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (ret < 0) {
+        return ret;
+    }
+    if (offset == -1) {
+        return 0;
+    }
+    return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID | offset;
+}
+
+static int coroutine_fn vpc_co_flush(BlockDriverState *bs)
+{
+    BDRVVPCState *s = bs->opaque;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = rewrite_metadata(bs);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return bdrv_co_flush(bs->file);
 }
 
 /*
@@ -613,10 +866,13 @@ static int vpc_create(const char *filename, QEMUOptionParameter *options)
 static void vpc_close(BlockDriverState *bs)
 {
     BDRVVPCState *s = bs->opaque;
+
+    if (!s->fixed && rewrite_metadata(bs) < 0) {
+        fprintf(stderr, "block-vpc: Failed to update the BAT of '%s'\n",
+            bs->filename);
+    }
     qemu_free(s->pagetable);
-#ifdef CACHE
-    qemu_free(s->pageentry_u8);
-#endif
+    qemu_free(s->bitmap_cache);
 }
 
 static QEMUOptionParameter vpc_create_options[] = {
@@ -633,12 +889,14 @@ static BlockDriver bdrv_vpc = {
     .instance_size  = sizeof(BDRVVPCState),
     .bdrv_probe     = vpc_probe,
     .bdrv_open      = vpc_open,
-    .bdrv_read      = vpc_read,
-    .bdrv_write     = vpc_write,
-    .bdrv_flush     = vpc_flush,
     .bdrv_close     = vpc_close,
     .bdrv_create    = vpc_create,
 
+    .bdrv_co_readv  = vpc_co_readv,
+    .bdrv_co_writev = vpc_co_writev,
+    .bdrv_co_flush  = vpc_co_flush,
+    .bdrv_co_get_block_status = vpc_co_get_block_status,
+
     .create_options = vpc_create_options,
 };
 
@@ -27,6 +27,8 @@
 #include "block.h"
 #include "qemu-option.h"
 #include "qemu-queue.h"
+#include "qemu-coroutine.h"
+#include "qemu-timer.h"
 
 #define BLOCK_FLAG_ENCRYPT	1
 #define BLOCK_FLAG_COMPAT6	4
@@ -40,6 +42,47 @@
 #define BLOCK_OPT_TABLE_SIZE    "table_size"
 #define BLOCK_OPT_PREALLOC      "preallocation"
 
+typedef struct BlockJob BlockJob;
+
+/*
+ * A long-running operation on a block device, such as image streaming.
+ * Each job type embeds a BlockJob as the first member of its own struct.
+ */
+typedef struct BlockJobType {
+    /* Size of the job type's struct that embeds BlockJob */
+    size_t instance_size;
+
+    /* Name of the operation, as reported by query-block-jobs */
+    const char *job_type;
+
+    /* Optional callback for job types that support a speed limit */
+    int (*set_speed)(BlockJob *job, int64_t value);
+} BlockJobType;
+
+struct BlockJob {
+    const BlockJobType *job_type;
+    BlockDriverState *bs;
+
+    /* The coroutine that executes the job */
+    Coroutine *co;
+
+    /* Set by block_job_cancel(), checked by the job at each iteration */
+    bool cancelled;
+
+    /* False while the job sleeps and may be woken up early by a cancel */
+    bool busy;
+
+    /* Progress in bytes, out of len */
+    int64_t offset;
+    int64_t len;
+
+    /* Speed limit in bytes per second, 0 means unlimited */
+    int64_t speed;
+
+    BlockDriverCompletionFunc *cb;
+    void *opaque;
+};
+
 typedef struct AIOPool {
     void (*cancel)(BlockDriverAIOCB *acb);
     int aiocb_size;
@@ -62,6 +105,10 @@ struct BlockDriver {
     int (*bdrv_flush)(BlockDriverState *bs);
     int (*bdrv_is_allocated)(BlockDriverState *bs, int64_t sector_num,
                              int nb_sectors, int *pnum);
+    int64_t coroutine_fn (*bdrv_co_get_block_status)(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, int *pnum);
+    int coroutine_fn (*bdrv_co_is_allocated)(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, int *pnum);
     int (*bdrv_set_key)(BlockDriverState *bs, const char *key);
     int (*bdrv_make_empty)(BlockDriverState *bs);
     /* aio */
@@ -76,11 +123,30 @@ struct BlockDriver {
     int (*bdrv_discard)(BlockDriverState *bs, int64_t sector_num,
                         int nb_sectors);
 
+    /*
+     * Coroutine interface.  A driver that implements bdrv_co_readv and
+     * bdrv_co_writev gets its AIO and synchronous functions emulated on top
+     * of them; for all other drivers the coroutine functions are emulated
+     * using AIO.
+     */
+    int coroutine_fn (*bdrv_co_readv)(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
+    int coroutine_fn (*bdrv_co_writev)(BlockDriverState *bs,
+        int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
+    int coroutine_fn (*bdrv_co_flush)(BlockDriverState *bs);
+
     int (*bdrv_aio_multiwrite)(BlockDriverState *bs, BlockRequest *reqs,
         int num_reqs);
     int (*bdrv_merge_requests)(BlockDriverState *bs, BlockRequest* a,
         BlockRequest *b);
 
+    /*
+     * Requests submitted between plug and unplug may be held back and
+     * issued together when the outermost unplug is reached.
+     */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
+
 
     const char *protocol_name;
     int (*bdrv_truncate)(BlockDriverState *bs, int64_t offset);
@@ -199,6 +265,23 @@ struct BlockDriverState {
     unsigned long *dirty_bitmap;
     int64_t dirty_count;
     int in_use; /* users other than guest access, eg. block migration */
+
+    /* I/O throttling: token buckets refilled at the configured rates */
+    BlockIOLimit io_limits;
+    bool io_limits_enabled;
+    double bps_tokens[BLOCK_IO_LIMIT_MAX];
+    double iops_tokens[BLOCK_IO_LIMIT_MAX];
+    int64_t io_tokens_time;
+    QEMUTimer *io_limits_timer;
+    QTAILQ_HEAD(, BlockThrottledRequest) throttled_reqs;
+
+    /* if non-zero, reads populate the image from its backing file */
+    int copy_on_read;
+    QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
+
+    /* the long-running operation on this device, if any */
+    BlockJob *job;
+
     QTAILQ_ENTRY(BlockDriverState) list;
     void *private;
 };
@@ -222,6 +305,35 @@ void qemu_aio_release(void *p);
 
 void *qemu_blockalign(BlockDriverState *bs, size_t size);
 
+int coroutine_fn bdrv_co_is_allocated(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors, int *pnum);
+int64_t coroutine_fn bdrv_co_get_block_status(BlockDriverState *bs,
+                                              int64_t sector_num,
+                                              int nb_sectors, int *pnum);
+int64_t coroutine_fn bdrv_co_get_block_status_above(BlockDriverState *top,
+                                                    BlockDriverState *base,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum);
+int coroutine_fn bdrv_co_drop_backing_hd(BlockDriverState *bs);
+
+void *block_job_create(const BlockJobType *job_type, BlockDriverState *bs,
+                       BlockDriverCompletionFunc *cb, void *opaque);
+void block_job_complete(BlockJob *job, int ret);
+int block_job_set_speed(BlockJob *job, int64_t value);
+void block_job_cancel(BlockJob *job);
+bool block_job_is_cancelled(BlockJob *job);
+void block_job_cancel_sync(BlockJob *job);
+void coroutine_fn block_job_sleep_ns(BlockJob *job, QEMUClock *clock,
+                                     int64_t ns);
+
+int bdrv_replace_image(BlockDriverState *bs, const char *filename, int flags,
+                       BlockDriver *drv);
+
+int stream_start(BlockDriverState *bs, BlockDriverCompletionFunc *cb,
+                 void *opaque);
+int mirror_start(BlockDriverState *bs, BlockDriverState *target,
+                 BlockDriverCompletionFunc *cb, void *opaque);
+
 #ifdef _WIN32
 int is_windows_drive(const char *filename);
 #endif
@@ -16,6 +16,7 @@
 #include "sysemu.h"
 #include "hw/qdev.h"
 #include "block_int.h"
+#include "qjson.h"
 
 static QTAILQ_HEAD(drivelist, DriveInfo) drives = QTAILQ_HEAD_INITIALIZER(drives);
 
@@ -234,9 +235,11 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     int ro = 0;
     int bdrv_flags = 0;
     int on_read_error, on_write_error;
+    BlockIOLimit io_limits;
     const char *devaddr;
     DriveInfo *dinfo;
     int snapshot = 0;
+    int copy_on_read;
     int ret;
 
     translation = BIOS_ATA_TRANSLATION_AUTO;
@@ -261,6 +264,7 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
 
     snapshot = qemu_opt_get_bool(opts, "snapshot", 0);
     ro = qemu_opt_get_bool(opts, "readonly", 0);
+    copy_on_read = qemu_opt_get_bool(opts, "copy-on-read", 0);
 
     file = qemu_opt_get(opts, "file");
     serial = qemu_opt_get(opts, "serial");
@@ -393,6 +397,26 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
         }
     }
 
+    /* disk I/O throttling */
+    io_limits.bps[BLOCK_IO_LIMIT_TOTAL] =
+                           qemu_opt_get_number(opts, "bps", 0);
+    io_limits.bps[BLOCK_IO_LIMIT_READ] =
+                           qemu_opt_get_number(opts, "bps_rd", 0);
+    io_limits.bps[BLOCK_IO_LIMIT_WRITE] =
+                           qemu_opt_get_number(opts, "bps_wr", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_TOTAL] =
+                           qemu_opt_get_number(opts, "iops", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_READ] =
+                           qemu_opt_get_number(opts, "iops_rd", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_WRITE] =
+                           qemu_opt_get_number(opts, "iops_wr", 0);
+
+    if (!bdrv_io_limits_valid(&io_limits)) {
+        error_report("bps and iops values must not be negative, and a total"
+                     " limit can't be combined with a read or write limit");
+        return NULL;
+    }
+
     if ((devaddr = qemu_opt_get(opts, "addr")) != NULL) {
         if (type != IF_VIRTIO) {
             error_report("addr is not supported by this bus type");
@@ -473,6 +497,7 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     QTAILQ_INSERT_TAIL(&drives, dinfo, next);
 
     bdrv_set_on_error(dinfo->bdrv, on_read_error, on_write_error);
+    bdrv_set_io_limits(dinfo->bdrv, &io_limits);
 
     switch(type) {
     case IF_IDE:
@@ -531,6 +556,14 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
         }
     }
 
+    if (copy_on_read) {
+        if (ro) {
+            error_report("warning: disabling copy-on-read on read-only drive");
+        } else {
+            bdrv_flags |= BDRV_O_COPY_ON_READ;
+        }
+    }
+
     bdrv_flags |= ro ? 0 : BDRV_O_RDWR;
 
     ret = bdrv_open(dinfo->bdrv, file, bdrv_flags, drv);
@@ -622,7 +655,7 @@ int do_snapshot_blkdev(Monitor *mon, const QDict *qdict, QObject **ret_data)
         goto out;
     }
 
-    qemu_aio_flush();
+    bdrv_drain_all();
     bdrv_flush(bs);
 
     bdrv_close(bs);
@@ -750,7 +783,7 @@ int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
     }
 
     /* quiesce block driver; prevent further io */
-    qemu_aio_flush();
+    bdrv_drain_all();
     bdrv_flush(bs);
     bdrv_close(bs);
 
@@ -797,3 +830,267 @@ int do_block_resize(Monitor *mon, const QDict *qdict, QObject **ret_data)
 
     return 0;
 }
+
+int do_block_set_io_throttle(Monitor *mon,
+                             const QDict *qdict, QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    BlockIOLimit io_limits;
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, device);
+        return -1;
+    }
+
+    io_limits.bps[BLOCK_IO_LIMIT_TOTAL] = qdict_get_int(qdict, "bps");
+    io_limits.bps[BLOCK_IO_LIMIT_READ] = qdict_get_int(qdict, "bps_rd");
+    io_limits.bps[BLOCK_IO_LIMIT_WRITE] = qdict_get_int(qdict, "bps_wr");
+    io_limits.iops[BLOCK_IO_LIMIT_TOTAL] = qdict_get_int(qdict, "iops");
+    io_limits.iops[BLOCK_IO_LIMIT_READ] = qdict_get_int(qdict, "iops_rd");
+    io_limits.iops[BLOCK_IO_LIMIT_WRITE] = qdict_get_int(qdict, "iops_wr");
+
+    if (!bdrv_io_limits_valid(&io_limits)) {
+        qerror_report(QERR_INVALID_PARAMETER_COMBINATION);
+        return -1;
+    }
+
+    bdrv_set_io_limits(bs, &io_limits);
+
+    return 0;
+}
+
+static QObject *qobject_from_block_job(BlockJob *job)
+{
+    return qobject_from_jsonf("{ 'type': %s,"
+                              "'device': %s,"
+                              "'len': %" PRId64 ","
+                              "'offset': %" PRId64 ","
+                              "'speed': %" PRId64 " }",
+                              job->job_type->job_type,
+                              bdrv_get_device_name(job->bs),
+                              job->len,
+                              job->offset,
+                              job->speed);
+}
+
+static void block_job_cb(void *opaque, int ret)
+{
+    BlockDriverState *bs = opaque;
+    QObject *obj;
+
+    obj = qobject_from_block_job(bs->job);
+    if (ret < 0) {
+        QDict *dict = qobject_to_qdict(obj);
+        qdict_put(dict, "error", qstring_from_str(strerror(-ret)));
+    }
+
+    if (block_job_is_cancelled(bs->job)) {
+        monitor_protocol_event(QEVENT_BLOCK_JOB_CANCELLED, obj);
+    } else {
+        monitor_protocol_event(QEVENT_BLOCK_JOB_COMPLETED, obj);
+    }
+    qobject_decref(obj);
+}
+
+int do_block_stream(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    BlockDriverState *bs;
+    int ret;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, device);
+        return -1;
+    }
+
+    ret = stream_start(bs, block_job_cb, bs);
+    if (ret == -EACCES) {
+        qerror_report(QERR_DEVICE_IS_READ_ONLY, device);
+        return -1;
+    } else if (ret < 0) {
+        qerror_report(QERR_DEVICE_IN_USE, device);
+        return -1;
+    }
+
+    return 0;
+}
+
+int do_drive_mirror(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    const char *filename = qdict_get_str(qdict, "target");
+    const char *format = qdict_get_try_str(qdict, "format");
+    BlockDriverState *bs, *target;
+    BlockDriver *drv;
+    int64_t size;
+    int flags, ret;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, device);
+        return -1;
+    }
+    if (!bs->drv) {
+        qerror_report(QERR_DEVICE_NOT_ACTIVE, device);
+        return -1;
+    }
+    if (bdrv_is_read_only(bs)) {
+        qerror_report(QERR_DEVICE_IS_READ_ONLY, device);
+        return -1;
+    }
+    if (bs->job || bdrv_in_use(bs)) {
+        qerror_report(QERR_DEVICE_IN_USE, device);
+        return -1;
+    }
+    if (!strcmp(filename, bs->filename)) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "target",
+                      "a file other than the current image");
+        return -1;
+    }
+
+    if (!format) {
+        format = bs->drv->format_name;
+    }
+    drv = bdrv_find_format(format);
+    if (!drv) {
+        qerror_report(QERR_INVALID_BLOCK_FORMAT, format);
+        return -1;
+    }
+
+    size = bdrv_getlength(bs);
+    if (size < 0) {
+        qerror_report(QERR_UNDEFINED_ERROR);
+        return -1;
+    }
+
+    /* The target is a standalone copy of the whole device */
+    flags = bs->open_flags & ~(BDRV_O_SNAPSHOT | BDRV_O_COPY_ON_READ);
+    ret = bdrv_img_create(filename, format, NULL, NULL, NULL, size, flags);
+    if (ret) {
+        return -1;
+    }
+
+    target = bdrv_new("");
+    ret = bdrv_open(target, filename, flags | BDRV_O_NO_BACKING, drv);
+    if (ret < 0) {
+        bdrv_delete(target);
+        qerror_report(QERR_OPEN_FILE_FAILED, filename);
+        return -1;
+    }
+
+    ret = mirror_start(bs, target, block_job_cb, bs);
+    if (ret < 0) {
+        bdrv_delete(target);
+        switch (ret) {
+        case -EBUSY:
+            qerror_report(QERR_DEVICE_IN_USE, device);
+            break;
+        case -EINVAL:
+            qerror_report(QERR_INVALID_PARAMETER_VALUE, "target",
+                          "an image at least as large as the device");
+            break;
+        case -ENOMEDIUM:
+            qerror_report(QERR_DEVICE_NOT_ACTIVE, device);
+            break;
+        default:
+            /* The length of the device or of the target is unknown */
+            qerror_report(QERR_UNDEFINED_ERROR);
+            break;
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+static BlockJob *find_block_job(const char *device)
+{
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs || !bs->job) {
+        return NULL;
+    }
+    return bs->job;
+}
+
+int do_block_job_set_speed(Monitor *mon, const QDict *qdict,
+                           QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    int64_t value = qdict_get_int(qdict, "value");
+    BlockJob *job = find_block_job(device);
+
+    if (!job) {
+        qerror_report(QERR_DEVICE_NOT_ACTIVE, device);
+        return -1;
+    }
+
+    if (block_job_set_speed(job, value) < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "value",
+                      "a non-negative speed");
+        return -1;
+    }
+
+    return 0;
+}
+
+int do_block_job_cancel(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    BlockJob *job = find_block_job(device);
+
+    if (!job) {
+        qerror_report(QERR_DEVICE_NOT_ACTIVE, device);
+        return -1;
+    }
+
+    block_job_cancel(job);
+    return 0;
+}
+
+static void do_info_block_jobs_one(void *opaque, BlockDriverState *bs)
+{
+    QList *list = opaque;
+
+    if (bs->job) {
+        qlist_append_obj(list, qobject_from_block_job(bs->job));
+    }
+}
+
+void do_info_block_jobs(Monitor *mon, QObject **ret_data)
+{
+    QList *list = qlist_new();
+
+    bdrv_iterate(do_info_block_jobs_one, list);
+    *ret_data = QOBJECT(list);
+}
+
+static void do_info_block_jobs_print_one(QObject *obj, void *opaque)
+{
+    Monitor *mon = opaque;
+    QDict *dict = qobject_to_qdict(obj);
+
+    monitor_printf(mon, "Type %s, device %s: Completed %" PRId64
+                   " of %" PRId64 " bytes, speed limit %" PRId64
+                   " bytes/s\n",
+                   qdict_get_str(dict, "type"),
+                   qdict_get_str(dict, "device"),
+                   qdict_get_int(dict, "offset"),
+                   qdict_get_int(dict, "len"),
+                   qdict_get_int(dict, "speed"));
+}
+
+void do_info_block_jobs_print(Monitor *mon, const QObject *data)
+{
+    QList *list = qobject_to_qlist(data);
+
+    if (qlist_empty(list)) {
+        monitor_printf(mon, "No active jobs\n");
+        return;
+    }
+    qlist_iter(list, do_info_block_jobs_print_one, mon);
+}
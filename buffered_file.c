@@ -15,13 +15,18 @@
 #include "hw/hw.h"
 #include "qemu-timer.h"
 #include "qemu-char.h"
+#include "qemu-thread.h"
 #include "buffered_file.h"
 
 //#define DEBUG_BUFFERED_FILE
 
+/* Length of the time slice that the transfer limit applies to, in ms */
+#define BUFFER_DELAY 100
+
 typedef struct QEMUFileBuffered
 {
     BufferedPutFunc *put_buffer;
+    BufferedWritevFunc *writev;
     BufferedPutReadyFunc *put_ready;
     BufferedWaitForUnfreezeFunc *wait_for_unfreeze;
     BufferedCloseFunc *close;
@@ -34,7 +39,13 @@ typedef struct QEMUFileBuffered
     uint8_t *buffer;
     size_t buffer_size;
     size_t buffer_capacity;
+#ifdef CONFIG_IOTHREAD
+    QemuThread thread;
+    int thread_running;
+    int stop;
+#else
     QEMUTimer *timer;
+#endif
 } QEMUFileBuffered;
 
 #ifdef DEBUG_BUFFERED_FILE
@@ -98,6 +109,7 @@ static void buffered_flush(QEMUFileBuffered *s)
         } else {
             DPRINTF("flushed %zd byte(s)\n", ret);
             offset += ret;
+            s->bytes_xfer += ret;
         }
     }
 
@@ -106,6 +118,74 @@ static void buffered_flush(QEMUFileBuffered *s)
     s->buffer_size -= offset;
 }
 
+#ifdef CONFIG_IOTHREAD
+/*
+ * The stream is produced by a thread of its own, which calls put_ready
+ * without holding the global mutex for as long as the transfer limit and
+ * the backend allow.  It keeps going until put_ready reports that there is
+ * nothing left to produce and everything was sent, or until it is stopped.
+ */
+static void *buffered_file_thread(void *opaque)
+{
+    QEMUFileBuffered *s = opaque;
+    int64_t window_start = qemu_get_clock_ms(rt_clock);
+    size_t queued;
+    int done = 0;
+
+    while (!s->stop) {
+        int64_t now = qemu_get_clock_ms(rt_clock);
+
+        if (now >= window_start + BUFFER_DELAY) {
+            s->bytes_xfer = 0;
+            window_start = now;
+        }
+
+        buffered_flush(s);
+        if (s->freeze_output && !s->has_error) {
+            DPRINTF("waiting for the backend\n");
+            if (s->wait_for_unfreeze(s->opaque)) {
+                break;
+            }
+            s->freeze_output = 0;
+            continue;
+        }
+
+        if (done) {
+            break;
+        }
+
+        if (!s->has_error && s->bytes_xfer > s->xfer_limit) {
+            DPRINTF("transfer limit reached, sleeping\n");
+            usleep((window_start + BUFFER_DELAY - now) * 1000);
+            continue;
+        }
+
+        queued = s->bytes_xfer + s->buffer_size;
+        done = s->put_ready(s->opaque);
+        if (!done && s->bytes_xfer + s->buffer_size == queued) {
+            /* Nothing to send for now, don't spin */
+            usleep((window_start + BUFFER_DELAY - now) * 1000);
+        }
+    }
+
+    DPRINTF("thread exiting\n");
+    return NULL;
+}
+
+static void buffered_stop_thread(QEMUFileBuffered *s)
+{
+    DPRINTF("stopping thread\n");
+    s->stop = 1;
+
+    /* The thread may be waiting for the global mutex */
+    qemu_mutex_unlock_iothread();
+    qemu_thread_join(&s->thread);
+    qemu_mutex_lock_iothread();
+
+    s->thread_running = 0;
+}
+#endif
+
 static int buffered_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, int size)
 {
     QEMUFileBuffered *s = opaque;
@@ -114,6 +194,13 @@ static int buffered_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, in
 
     DPRINTF("putting %d bytes at %" PRId64 "\n", size, pos);
 
+#ifdef CONFIG_IOTHREAD
+    if (s->thread_running && !qemu_thread_is_self(&s->thread)) {
+        /* Somebody else takes over the file, most likely to close it */
+        buffered_stop_thread(s);
+    }
+#endif
+
     if (s->has_error) {
         DPRINTF("flush when error, bailing\n");
         return -EINVAL;
@@ -157,15 +244,81 @@ static int buffered_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, in
 
     if (pos == 0 && size == 0) {
         DPRINTF("file is ready\n");
+#ifdef CONFIG_IOTHREAD
+        if (!s->thread_running && !s->stop) {
+            DPRINTF("starting thread\n");
+            s->thread_running = 1;
+            qemu_thread_create(&s->thread, buffered_file_thread, s);
+        }
+#else
         if (s->bytes_xfer <= s->xfer_limit) {
             DPRINTF("notifying client\n");
             s->put_ready(s->opaque);
         }
+#endif
     }
 
     return offset;
 }
 
+static ssize_t buffered_writev_buffer(void *opaque, struct iovec *iov,
+                                      int iovcnt, int64_t pos)
+{
+    QEMUFileBuffered *s = opaque;
+    ssize_t ret = 0;
+    size_t offset, total = 0;
+    int i;
+
+    DPRINTF("putting %d iovec(s) at %" PRId64 "\n", iovcnt, pos);
+
+#ifdef CONFIG_IOTHREAD
+    if (s->thread_running && !qemu_thread_is_self(&s->thread)) {
+        /* Somebody else takes over the file, most likely to close it */
+        buffered_stop_thread(s);
+    }
+#endif
+
+    if (s->has_error) {
+        DPRINTF("flush when error, bailing\n");
+        return -EINVAL;
+    }
+
+    s->freeze_output = 0;
+
+    buffered_flush(s);
+
+    /* Whatever was buffered before has to go out first */
+    if (!s->freeze_output && s->buffer_size == 0 &&
+        s->bytes_xfer <= s->xfer_limit) {
+        ret = s->writev(s->opaque, iov, iovcnt);
+        if (ret == -EAGAIN) {
+            DPRINTF("backend not ready, freezing\n");
+            s->freeze_output = 1;
+            ret = 0;
+        } else if (ret < 0) {
+            DPRINTF("error putting\n");
+            s->has_error = 1;
+            return -EINVAL;
+        }
+        DPRINTF("put %zd byte(s)\n", ret);
+        s->bytes_xfer += ret;
+    }
+
+    offset = ret;
+    for (i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        buffered_append(s, (uint8_t *)iov[i].iov_base + offset,
+                        iov[i].iov_len - offset);
+        offset = 0;
+    }
+
+    return total;
+}
+
 static int buffered_close(void *opaque)
 {
     QEMUFileBuffered *s = opaque;
@@ -173,16 +326,29 @@ static int buffered_close(void *opaque)
 
     DPRINTF("closing\n");
 
+#ifdef CONFIG_IOTHREAD
+    if (s->thread_running) {
+        buffered_stop_thread(s);
+    }
+#endif
+
     while (!s->has_error && s->buffer_size) {
         buffered_flush(s);
-        if (s->freeze_output)
-            s->wait_for_unfreeze(s);
+        if (s->freeze_output && s->wait_for_unfreeze(s->opaque)) {
+            DPRINTF("dropping %zu byte(s)\n", s->buffer_size);
+            break;
+        }
     }
 
     ret = s->close(s->opaque);
+    if (s->has_error && ret == 0) {
+        ret = -EIO;
+    }
 
+#ifndef CONFIG_IOTHREAD
     qemu_del_timer(s->timer);
     qemu_free_timer(s->timer);
+#endif
     qemu_free(s->buffer);
     qemu_free(s);
 
@@ -221,6 +387,13 @@ out:
     return s->xfer_limit;
 }
 
+static void buffered_credit_transfer(void *opaque, int64_t size)
+{
+    QEMUFileBuffered *s = opaque;
+
+    s->bytes_xfer += size;
+}
+
 static int64_t buffered_get_rate_limit(void *opaque)
 {
     QEMUFileBuffered *s = opaque;
@@ -228,6 +401,7 @@ static int64_t buffered_get_rate_limit(void *opaque)
     return s->xfer_limit;
 }
 
+#ifndef CONFIG_IOTHREAD
 static void buffered_rate_tick(void *opaque)
 {
     QEMUFileBuffered *s = opaque;
@@ -237,7 +411,7 @@ static void buffered_rate_tick(void *opaque)
         return;
     }
 
-    qemu_mod_timer(s->timer, qemu_get_clock_ms(rt_clock) + 100);
+    qemu_mod_timer(s->timer, qemu_get_clock_ms(rt_clock) + BUFFER_DELAY);
 
     if (s->freeze_output)
         return;
@@ -249,10 +423,12 @@ static void buffered_rate_tick(void *opaque)
     /* Add some checks around this */
     s->put_ready(s->opaque);
 }
+#endif
 
 QEMUFile *qemu_fopen_ops_buffered(void *opaque,
                                   size_t bytes_per_sec,
                                   BufferedPutFunc *put_buffer,
+                                  BufferedWritevFunc *writev,
                                   BufferedPutReadyFunc *put_ready,
                                   BufferedWaitForUnfreezeFunc *wait_for_unfreeze,
                                   BufferedCloseFunc *close)
@@ -264,6 +440,7 @@ QEMUFile *qemu_fopen_ops_buffered(void *opaque,
     s->opaque = opaque;
     s->xfer_limit = bytes_per_sec / 10;
     s->put_buffer = put_buffer;
+    s->writev = writev;
     s->put_ready = put_ready;
     s->wait_for_unfreeze = wait_for_unfreeze;
     s->close = close;
@@ -272,10 +449,16 @@ QEMUFile *qemu_fopen_ops_buffered(void *opaque,
                              buffered_close, buffered_rate_limit,
                              buffered_set_rate_limit,
 			     buffered_get_rate_limit);
+    if (writev) {
+        qemu_file_set_writev_buffer(s->file, buffered_writev_buffer);
+    }
+    qemu_file_set_credit_transfer(s->file, buffered_credit_transfer);
 
+#ifndef CONFIG_IOTHREAD
     s->timer = qemu_new_timer_ms(rt_clock, buffered_rate_tick, s);
 
-    qemu_mod_timer(s->timer, qemu_get_clock_ms(rt_clock) + 100);
+    qemu_mod_timer(s->timer, qemu_get_clock_ms(rt_clock) + BUFFER_DELAY);
+#endif
 
     return s->file;
 }
@@ -17,12 +17,26 @@
 #include "hw/hw.h"
 
 typedef ssize_t (BufferedPutFunc)(void *opaque, const void *data, size_t size);
-typedef void (BufferedPutReadyFunc)(void *opaque);
-typedef void (BufferedWaitForUnfreezeFunc)(void *opaque);
+/* Like BufferedPutFunc, for the data of an iovec array */
+typedef ssize_t (BufferedWritevFunc)(void *opaque, struct iovec *iov,
+                                     int iovcnt);
+/* Returns non-zero once there is nothing left to put */
+typedef int (BufferedPutReadyFunc)(void *opaque);
+/* Returns non-zero if the remaining data shouldn't be sent anymore */
+typedef int (BufferedWaitForUnfreezeFunc)(void *opaque);
 typedef int (BufferedCloseFunc)(void *opaque);
 
+/*
+ * With the I/O thread, put_ready is called from a thread of its own that is
+ * started by qemu_file_put_notify(), and the global mutex is not held.  The
+ * thread is stopped when the file is used or closed by another thread.
+ *
+ * With writev, what the backend can take right away is written straight
+ * from the memory that is put, only the rest is copied to the buffer.
+ */
 QEMUFile *qemu_fopen_ops_buffered(void *opaque, size_t xfer_limit,
                                   BufferedPutFunc *put_buffer,
+                                  BufferedWritevFunc *writev,
                                   BufferedPutReadyFunc *put_ready,
                                   BufferedWaitForUnfreezeFunc *wait_for_unfreeze,
                                   BufferedCloseFunc *close);
@@ -0,0 +1,284 @@
+/*
+ * Coroutine unit-tests.
+ *
+ * Copyright IBM, Corp. 2011
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+#include <check.h>
+
+#include "qemu-common.h"
+#include "qemu-coroutine.h"
+#include "qemu-timer.h"
+
+/*
+ * Check that qemu_in_coroutine() works
+ */
+
+static void coroutine_fn verify_in_coroutine(void *opaque)
+{
+    fail_unless(qemu_in_coroutine());
+}
+
+START_TEST(in_coroutine_test)
+{
+    Coroutine *coroutine;
+
+    fail_unless(!qemu_in_coroutine());
+
+    coroutine = qemu_coroutine_create(verify_in_coroutine);
+    qemu_coroutine_enter(coroutine, NULL);
+}
+END_TEST
+
+/*
+ * Check that qemu_coroutine_self() works
+ */
+
+static void coroutine_fn verify_self(void *opaque)
+{
+    fail_unless(qemu_coroutine_self() == opaque);
+}
+
+START_TEST(self_test)
+{
+    Coroutine *coroutine;
+
+    coroutine = qemu_coroutine_create(verify_self);
+    qemu_coroutine_enter(coroutine, coroutine);
+}
+END_TEST
+
+/*
+ * Check that coroutines may nest multiple levels
+ */
+
+typedef struct {
+    unsigned int n_enter;   /* num coroutines entered */
+    unsigned int n_return;  /* num coroutines returned */
+    unsigned int max;       /* maximum level of nesting */
+} NestData;
+
+static void coroutine_fn nest(void *opaque)
+{
+    NestData *nd = opaque;
+
+    nd->n_enter++;
+
+    if (nd->n_enter < nd->max) {
+        Coroutine *child;
+
+        child = qemu_coroutine_create(nest);
+        qemu_coroutine_enter(child, nd);
+    }
+
+    nd->n_return++;
+}
+
+START_TEST(nesting_test)
+{
+    Coroutine *root;
+    NestData nd = {
+        .n_enter  = 0,
+        .n_return = 0,
+        .max      = 128,
+    };
+
+    root = qemu_coroutine_create(nest);
+    qemu_coroutine_enter(root, &nd);
+
+    fail_unless(nd.n_enter == nd.max);
+    fail_unless(nd.n_return == nd.max);
+}
+END_TEST
+
+/*
+ * Check that yield/enter transfer control correctly
+ */
+
+static void coroutine_fn yield_5_times(void *opaque)
+{
+    bool *done = opaque;
+    int i;
+
+    for (i = 0; i < 5; i++) {
+        qemu_coroutine_yield();
+    }
+    *done = true;
+}
+
+START_TEST(yield_test)
+{
+    Coroutine *coroutine = qemu_coroutine_create(yield_5_times);
+    bool done = false;
+    int i = -1; /* one extra time to return from coroutine */
+
+    while (!done) {
+        qemu_coroutine_enter(coroutine, &done);
+        i++;
+    }
+    fail_unless(i == 5);
+}
+END_TEST
+
+/*
+ * Check that creation, enter, and return work
+ */
+
+static void coroutine_fn set_and_exit(void *opaque)
+{
+    bool *done = opaque;
+
+    *done = true;
+}
+
+START_TEST(lifecycle_test)
+{
+    Coroutine *coroutine;
+    bool done = false;
+
+    /* Create, enter, and return from coroutine */
+    coroutine = qemu_coroutine_create(set_and_exit);
+    qemu_coroutine_enter(coroutine, &done);
+    fail_unless(done);
+
+    /* Repeat to check that no state affects this test */
+    done = false;
+    coroutine = qemu_coroutine_create(set_and_exit);
+    qemu_coroutine_enter(coroutine, &done);
+    fail_unless(done);
+}
+END_TEST
+
+/*
+ * Check that a CoMutex serializes coroutines and that an unlocked
+ * waiter only runs once the unlocking coroutine has switched out
+ */
+
+typedef struct {
+    CoMutex lock;
+    CoQueue release;
+    int owner;
+    int order[3];
+    int n;
+} MutexData;
+
+static void coroutine_fn mutex_user(void *opaque)
+{
+    MutexData *md = opaque;
+    int id = ++md->owner;
+
+    qemu_co_mutex_lock(&md->lock);
+    md->order[md->n++] = id;
+    qemu_co_queue_wait(&md->release);
+    qemu_co_mutex_unlock(&md->lock);
+}
+
+START_TEST(mutex_test)
+{
+    MutexData md = { .owner = 0, .n = 0 };
+    Coroutine *co[3];
+    int i;
+
+    qemu_co_mutex_init(&md.lock);
+    qemu_co_queue_init(&md.release);
+
+    for (i = 0; i < 3; i++) {
+        co[i] = qemu_coroutine_create(mutex_user);
+        qemu_coroutine_enter(co[i], &md);
+    }
+
+    /* Only the first coroutine holds the lock, the others are queued */
+    fail_unless(md.n == 1);
+    fail_unless(md.lock.locked);
+
+    for (i = 0; i < 3; i++) {
+        fail_unless(qemu_co_queue_next(&md.release));
+    }
+    fail_unless(!qemu_co_queue_next(&md.release));
+    fail_unless(!md.lock.locked);
+
+    for (i = 0; i < 3; i++) {
+        fail_unless(md.order[i] == i + 1);
+    }
+}
+END_TEST
+
+/*
+ * Measure the cost of a coroutine switch
+ */
+
+static void coroutine_fn perf_yield(void *opaque)
+{
+    unsigned int *counter = opaque;
+
+    while (*counter > 0) {
+        (*counter)--;
+        qemu_coroutine_yield();
+    }
+}
+
+START_TEST(perf_yield_test)
+{
+    unsigned int i, maxcycles = 5000000;
+    Coroutine *coroutine;
+    int64_t start, duration;
+
+    i = maxcycles;
+    coroutine = qemu_coroutine_create(perf_yield);
+
+    start = get_clock();
+    while (i > 0) {
+        qemu_coroutine_enter(coroutine, &i);
+    }
+    duration = get_clock() - start;
+
+    /* Each iteration is an enter plus a yield, i.e. two switches */
+    printf("Coroutine switch: %u iterations, %" PRId64 " ns/switch\n",
+           maxcycles, duration / (2 * (int64_t)maxcycles));
+}
+END_TEST
+
+static Suite *coroutine_suite(void)
+{
+    Suite *s;
+    TCase *basic_tcase, *lock_tcase, *perf_tcase;
+
+    s = suite_create("Coroutine suite");
+
+    basic_tcase = tcase_create("Basic");
+    suite_add_tcase(s, basic_tcase);
+    tcase_add_test(basic_tcase, in_coroutine_test);
+    tcase_add_test(basic_tcase, self_test);
+    tcase_add_test(basic_tcase, nesting_test);
+    tcase_add_test(basic_tcase, yield_test);
+    tcase_add_test(basic_tcase, lifecycle_test);
+
+    lock_tcase = tcase_create("Locking");
+    suite_add_tcase(s, lock_tcase);
+    tcase_add_test(lock_tcase, mutex_test);
+
+    perf_tcase = tcase_create("Performance");
+    suite_add_tcase(s, perf_tcase);
+    tcase_set_timeout(perf_tcase, 30);
+    tcase_add_test(perf_tcase, perf_yield_test);
+
+    return s;
+}
+
+int main(void)
+{
+    int nf;
+    Suite *s;
+    SRunner *sr;
+
+    s = coroutine_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    nf = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return (nf == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
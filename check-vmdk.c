@@ -0,0 +1,250 @@
+/*
+ * VMDK unit-tests.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+#include <check.h>
+
+#include "qemu-common.h"
+#include "qemu-option.h"
+#include "block.h"
+#include "block_int.h"
+
+#define IMAGE_SIZE  (64 * 1024 * 1024)
+
+static char image[] = "/tmp/check-vmdk.XXXXXX";
+static char flat_image[] = "/tmp/check-vmdk-flat.XXXXXX";
+
+static BlockDriverState *open_new_image(void)
+{
+    BlockDriver *drv;
+    BlockDriverState *bs;
+    QEMUOptionParameter *options;
+    int fd;
+
+    strcpy(image, "/tmp/check-vmdk.XXXXXX");
+    fd = mkstemp(image);
+    fail_unless(fd >= 0);
+    close(fd);
+
+    drv = bdrv_find_format("vmdk");
+    fail_unless(drv != NULL);
+
+    options = parse_option_parameters("", drv->create_options, NULL);
+    set_option_parameter_int(options, BLOCK_OPT_SIZE, IMAGE_SIZE);
+    fail_unless(bdrv_create(drv, image, options) == 0);
+    free_option_parameters(options);
+
+    bs = bdrv_new("");
+    fail_unless(bdrv_open(bs, image, BDRV_O_RDWR, drv) == 0);
+    return bs;
+}
+
+/*
+ * Open a descriptor file with nb_extents flat extents of 8 sectors, one
+ * after the other in the same file, and padding comment lines after them
+ */
+static BlockDriverState *open_desc_image(int nb_extents, int padding)
+{
+    BlockDriverState *bs;
+    FILE *f;
+    int fd, i;
+
+    strcpy(flat_image, "/tmp/check-vmdk-flat.XXXXXX");
+    fd = mkstemp(flat_image);
+    fail_unless(fd >= 0);
+    fail_unless(ftruncate(fd, nb_extents * 8 * 512) == 0);
+    close(fd);
+
+    strcpy(image, "/tmp/check-vmdk.XXXXXX");
+    fd = mkstemp(image);
+    fail_unless(fd >= 0);
+    f = fdopen(fd, "w");
+    fail_unless(f != NULL);
+    fprintf(f, "# Disk DescriptorFile\n"
+               "version=1\n"
+               "CID=1\n"
+               "parentCID=ffffffff\n"
+               "createType=\"monolithicFlat\"\n"
+               "\n"
+               "# Extent description\n");
+    for (i = 0; i < nb_extents; i++) {
+        fprintf(f, "RW 8 FLAT \"%s\" %d\n", flat_image, i * 8);
+    }
+    for (i = 0; i < padding; i++) {
+        fprintf(f, "# padding %d\n", i);
+    }
+    fclose(f);
+
+    bs = bdrv_new("");
+    fail_unless(bdrv_open(bs, image, BDRV_O_RDWR,
+                          bdrv_find_format("vmdk")) == 0);
+    return bs;
+}
+
+static void close_image(BlockDriverState *bs)
+{
+    bdrv_delete(bs);
+    unlink(image);
+    unlink(flat_image);
+}
+
+static void write_pattern(BlockDriverState *bs, int64_t offset, int len,
+                          int pattern)
+{
+    uint8_t *buf = qemu_blockalign(bs, len);
+
+    memset(buf, pattern, len);
+    fail_unless(bdrv_write(bs, offset >> 9, buf, len >> 9) == 0);
+    qemu_vfree(buf);
+}
+
+static void check_pattern(BlockDriverState *bs, int64_t offset, int len,
+                          int pattern)
+{
+    uint8_t *buf = qemu_blockalign(bs, len);
+    int i;
+
+    fail_unless(bdrv_read(bs, offset >> 9, buf, len >> 9) == 0);
+    for (i = 0; i < len; i++) {
+        fail_unless(buf[i] == pattern,
+                    "offset %" PRId64 ": 0x%02x instead of 0x%02x",
+                    offset + i, buf[i], pattern);
+    }
+    qemu_vfree(buf);
+}
+
+/*
+ * Check that a write in the middle of an allocated grain lands there
+ */
+
+START_TEST(unaligned_rewrite_test)
+{
+    BlockDriverState *bs = open_new_image();
+
+    write_pattern(bs, 0, 64 * 1024, 0x11);
+    write_pattern(bs, 8 * 1024, 4 * 1024, 0x22);
+
+    check_pattern(bs, 0, 8 * 1024, 0x11);
+    check_pattern(bs, 8 * 1024, 4 * 1024, 0x22);
+    check_pattern(bs, 12 * 1024, 52 * 1024, 0x11);
+
+    close_image(bs);
+}
+END_TEST
+
+/*
+ * Check that the first write to a grain needn't start at its beginning
+ */
+
+START_TEST(unaligned_allocate_test)
+{
+    BlockDriverState *bs = open_new_image();
+
+    write_pattern(bs, 70 * 1024, 3 * 1024, 0x33);
+
+    check_pattern(bs, 64 * 1024, 6 * 1024, 0);
+    check_pattern(bs, 70 * 1024, 3 * 1024, 0x33);
+    check_pattern(bs, 73 * 1024, 55 * 1024, 0);
+
+    close_image(bs);
+}
+END_TEST
+
+/*
+ * Check a write that spans two grains and starts in neither's beginning
+ */
+
+START_TEST(unaligned_span_test)
+{
+    BlockDriverState *bs = open_new_image();
+
+    write_pattern(bs, 60 * 1024, 8 * 1024, 0x44);
+
+    check_pattern(bs, 0, 60 * 1024, 0);
+    check_pattern(bs, 60 * 1024, 8 * 1024, 0x44);
+    check_pattern(bs, 68 * 1024, 60 * 1024, 0);
+
+    close_image(bs);
+}
+END_TEST
+
+/*
+ * Check that the first sector of a flat extent at offset 0 is allocated
+ */
+
+START_TEST(flat_offset_zero_test)
+{
+    BlockDriverState *bs = open_desc_image(1, 0);
+    int pnum;
+
+    fail_unless(bdrv_is_allocated(bs, 0, 8, &pnum) == 1);
+    write_pattern(bs, 0, 4 * 1024, 0x55);
+    check_pattern(bs, 0, 4 * 1024, 0x55);
+
+    close_image(bs);
+}
+END_TEST
+
+/*
+ * Check that a descriptor file larger than an embedded descriptor keeps all
+ * of its extents when the CID is updated on the first write
+ */
+
+START_TEST(large_desc_test)
+{
+    BlockDriverState *bs = open_desc_image(400, 1000);
+
+    fail_unless(bdrv_getlength(bs) == 400 * 8 * 512);
+    write_pattern(bs, 399 * 8 * 512, 4 * 1024, 0x66);
+    bdrv_delete(bs);
+
+    bs = bdrv_new("");
+    fail_unless(bdrv_open(bs, image, BDRV_O_RDWR,
+                          bdrv_find_format("vmdk")) == 0);
+    fail_unless(bdrv_getlength(bs) == 400 * 8 * 512);
+    check_pattern(bs, 399 * 8 * 512, 4 * 1024, 0x66);
+
+    close_image(bs);
+}
+END_TEST
+
+static Suite *vmdk_suite(void)
+{
+    Suite *s;
+    TCase *unaligned_tcase, *desc_tcase;
+
+    s = suite_create("VMDK suite");
+
+    unaligned_tcase = tcase_create("Unaligned");
+    suite_add_tcase(s, unaligned_tcase);
+    tcase_add_test(unaligned_tcase, unaligned_rewrite_test);
+    tcase_add_test(unaligned_tcase, unaligned_allocate_test);
+    tcase_add_test(unaligned_tcase, unaligned_span_test);
+
+    desc_tcase = tcase_create("Descriptor file");
+    suite_add_tcase(s, desc_tcase);
+    tcase_add_test(desc_tcase, flat_offset_zero_test);
+    tcase_add_test(desc_tcase, large_desc_test);
+
+    return s;
+}
+
+int main(void)
+{
+    int nf;
+    Suite *s;
+    SRunner *sr;
+
+    bdrv_init();
+
+    s = vmdk_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    nf = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return (nf == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -125,18 +125,26 @@ static void do_vm_stop(int reason)
         vm_running = 0;
         pause_all_vcpus();
         vm_state_notify(0, reason);
-        qemu_aio_flush();
+        bdrv_drain_all();
         bdrv_flush_all();
         monitor_protocol_event(QEVENT_STOP, NULL);
     }
 }
 
+/*
+ * While the vCPUs are throttled, they are kept from running for a part of
+ * every CPU_THROTTLE_TIMESLICE_NS, as if the VM was stopped.
+ */
+static QEMUTimer *throttle_timer;
+static int throttle_percentage;
+static int throttle_sleeping;
+
 static int cpu_can_run(CPUState *env)
 {
     if (env->stop) {
         return 0;
     }
-    if (env->stopped || !vm_running) {
+    if (env->stopped || !vm_running || throttle_sleeping) {
         return 0;
     }
     return 1;
@@ -147,7 +155,7 @@ static bool cpu_thread_is_idle(CPUState *env)
     if (env->stop || env->queued_work_first) {
         return false;
     }
-    if (env->stopped || !vm_running) {
+    if (env->stopped || !vm_running || throttle_sleeping) {
         return true;
     }
     if (!env->halted || qemu_cpu_has_work(env) ||
@@ -169,6 +177,68 @@ bool all_cpu_threads_idle(void)
     return true;
 }
 
+static void cpu_throttle_kick_all(void)
+{
+    CPUState *env;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        qemu_cpu_kick(env);
+    }
+}
+
+static void cpu_throttle_timer_tick(void *opaque)
+{
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    double pct;
+
+    if (throttle_sleeping) {
+        throttle_sleeping = 0;
+        qemu_mod_timer(throttle_timer, now + CPU_THROTTLE_TIMESLICE_NS);
+    } else {
+        /* Sleep long enough for the time run to be 100 - pct percent */
+        pct = throttle_percentage / 100.0;
+        throttle_sleeping = 1;
+        qemu_mod_timer(throttle_timer,
+                       now + CPU_THROTTLE_TIMESLICE_NS * pct / (1 - pct));
+    }
+    cpu_throttle_kick_all();
+}
+
+void cpu_throttle_set(int new_throttle_pct)
+{
+    new_throttle_pct = MIN(MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN),
+                           CPU_THROTTLE_PCT_MAX);
+
+    if (!throttle_timer) {
+        throttle_timer = qemu_new_timer_ns(rt_clock, cpu_throttle_timer_tick,
+                                           NULL);
+    }
+    if (!throttle_percentage) {
+        qemu_mod_timer(throttle_timer, qemu_get_clock_ns(rt_clock) +
+                                       CPU_THROTTLE_TIMESLICE_NS);
+    }
+    throttle_percentage = new_throttle_pct;
+}
+
+void cpu_throttle_stop(void)
+{
+    if (!throttle_percentage) {
+        return;
+    }
+
+    throttle_percentage = 0;
+    qemu_del_timer(throttle_timer);
+    if (throttle_sleeping) {
+        throttle_sleeping = 0;
+        cpu_throttle_kick_all();
+    }
+}
+
+int cpu_throttle_get_percentage(void)
+{
+    return throttle_percentage;
+}
+
 static void cpu_handle_guest_debug(CPUState *env)
 {
     gdb_set_stop_cpu(env);
@@ -1020,9 +1090,25 @@ void cpu_stop_current(void)
     }
 }
 
+static int qemu_in_vcpu_thread(void)
+{
+    CPUState *env;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (env->thread && qemu_cpu_is_self(env)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
 void vm_stop(int reason)
 {
-    if (!qemu_thread_is_self(&io_thread)) {
+    /*
+     * A VCPU can't wait for itself to stop, but other threads that hold the
+     * global mutex (like the migration thread) can stop the VM right away.
+     */
+    if (qemu_in_vcpu_thread()) {
         qemu_system_vmstop_request(reason);
         /*
          * FIXME: should not return to device code in case
@@ -12,6 +12,15 @@ void cpu_synchronize_all_states(void);
 void cpu_synchronize_all_post_reset(void);
 void cpu_synchronize_all_post_init(void);
 
+/* Keep the vCPUs from running for a percentage of the time */
+#define CPU_THROTTLE_PCT_MIN 1
+#define CPU_THROTTLE_PCT_MAX 99
+#define CPU_THROTTLE_TIMESLICE_NS 10000000
+
+void cpu_throttle_set(int new_throttle_pct);
+void cpu_throttle_stop(void);
+int cpu_throttle_get_percentage(void);
+
 /* vl.c */
 extern int smp_cores;
 extern int smp_threads;
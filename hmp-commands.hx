@@ -71,6 +71,90 @@ resizes image files, it can not resize block devices like LVM volumes.
 ETEXI
 
 
+    {
+        .name       = "block_set_io_throttle",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l",
+        .params     = "device bps bps_rd bps_wr iops iops_rd iops_wr",
+        .help       = "change I/O throttle limits for a block drive",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_set_io_throttle,
+    },
+
+STEXI
+@item block_set_io_throttle @var{device} @var{bps} @var{bps_rd} @var{bps_wr} @var{iops} @var{iops_rd} @var{iops_wr}
+@findex block_set_io_throttle
+Change I/O throttle limits for a block drive to @var{bps} @var{bps_rd} @var{bps_wr} @var{iops} @var{iops_rd} @var{iops_wr}.
+A value of 0 disables the corresponding limit.
+ETEXI
+
+    {
+        .name       = "block_stream",
+        .args_type  = "device:B",
+        .params     = "device",
+        .help       = "copy data from a backing file into a block device",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_stream,
+    },
+
+STEXI
+@item block_stream @var{device}
+@findex block_stream
+Copy data from the backing file chain into the image of @var{device} in the
+background, then drop the backing file.  Progress is shown by
+@code{info block-jobs}.
+ETEXI
+
+    {
+        .name       = "drive_mirror",
+        .args_type  = "device:B,target:s,format:s?",
+        .params     = "device target [format]",
+        .help       = "copy a block device to a new image and switch to it",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_drive_mirror,
+    },
+
+STEXI
+@item drive_mirror @var{device} @var{target} [@var{format}]
+@findex drive_mirror
+Create the image @var{target} (in the format of the current image, or in
+@var{format}) and copy the contents of @var{device} to it in the background.
+Guest writes are copied as well, and once @var{target} has caught up, the
+device switches over to it.  Progress is shown by @code{info block-jobs}.
+ETEXI
+
+    {
+        .name       = "block_job_set_speed",
+        .args_type  = "device:B,value:o",
+        .params     = "device value",
+        .help       = "set maximum speed for a background block operation",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_set_speed,
+    },
+
+STEXI
+@item block_job_set_speed @var{device} @var{value}
+@findex block_job_set_speed
+Set maximum speed for a background block operation, in bytes per second.
+A value of 0 removes the limit.
+ETEXI
+
+    {
+        .name       = "block_job_cancel",
+        .args_type  = "device:B",
+        .params     = "device",
+        .help       = "stop an active background block operation",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_cancel,
+    },
+
+STEXI
+@item block_job_cancel @var{device}
+@findex block_job_cancel
+Stop an active background block operation.  The data copied so far stays in
+the image; a cancelled @code{drive_mirror} leaves the device on its original
+image.
+ETEXI
+
     {
         .name       = "eject",
         .args_type  = "force:-f,device:B",
@@ -773,6 +857,9 @@ STEXI
 Migrate to @var{uri} (using -d to not wait for completion).
 	-b for migration with full copy of disk
 	-i for migration with incremental copy of disk (base image is shared)
+With a file:@var{path} uri, the state is saved to a file while the guest runs,
+and the guest keeps running once it completed.  The file is loaded with
+-incoming file:@var{path}.
 ETEXI
 
     {
@@ -819,6 +906,95 @@ STEXI
 @item migrate_set_downtime @var{second}
 @findex migrate_set_downtime
 Set maximum tolerated downtime (in seconds) for migration.
+ETEXI
+
+    {
+        .name       = "migrate_set_cache_size",
+        .args_type  = "value:o",
+        .params     = "value",
+        .help       = "set cache size (in bytes) for XBZRLE migrations, "
+        "the cache size will be rounded down to the nearest power of 2. "
+        "Defaults to MB if no size suffix is specified, ie. B/K/M/G/T",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_cache_size,
+    },
+
+STEXI
+@item migrate_set_cache_size @var{value}
+@findex migrate_set_cache_size
+Set cache size to @var{value} (in bytes) for xbzrle migrations.
+ETEXI
+
+    {
+        .name       = "migrate_set_capability",
+        .args_type  = "capability:s,state:b",
+        .params     = "capability state",
+        .help       = "Enable/Disable the usage of a capability for migration",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_capability,
+    },
+
+STEXI
+@item migrate_set_capability @var{capability} @var{state}
+@findex migrate_set_capability
+Enable/Disable the usage of a capability @var{capability} for migration.
+The capabilities can only be changed while no migration is running:
+@table @option
+@item block-compress
+Compress the disk blocks sent by block migration with zlib.
+@item xbzrle
+Keep a cache of the RAM pages that were sent, and only send what changed
+when they are sent again.  The cache size is set with migrate_set_cache_size.
+@item compress
+Compress the RAM pages with zlib in a pool of threads on both sides.  See
+migrate_set_parameter for the number of threads and the compression level.
+@item auto-converge
+Throttle the vCPUs when the guest dirties memory faster than it can be sent,
+more and more until the migration converges.
+@item postcopy-ram
+Start the guest on the destination after the first pass over RAM, and send
+the rest of it while the guest runs there.  The pages that the destination
+touches before they arrived are requested from the source on demand.  This
+needs a tcp: or unix: uri, and the migration can no longer be cancelled once
+the guest runs on the destination.
+@item multifd
+Send the RAM pages over several additional TCP connections, each one with a
+thread of its own on both sides.  The number of connections is set with
+migrate_set_parameter.  This needs a tcp: uri, and can't be combined with
+postcopy-ram.
+@end table
+ETEXI
+
+    {
+        .name       = "migrate_set_parameter",
+        .args_type  = "parameter:s,value:i",
+        .params     = "parameter value",
+        .help       = "Set a parameter of the migration capabilities",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_parameter,
+    },
+
+STEXI
+@item migrate_set_parameter @var{parameter} @var{value}
+@findex migrate_set_parameter
+Set the migration parameter @var{parameter} to @var{value}.  The parameters
+can only be changed while no migration is running:
+@table @option
+@item compress-level
+zlib compression level of the compress capability, from 0 to 9 (default 1).
+@item compress-threads
+Number of threads that compress pages on the source (default 8).
+@item decompress-threads
+Number of threads that decompress pages on the destination (default 2).
+@item cpu-throttle-initial
+Percentage of the time the vCPUs are kept from running when auto-converge
+first throttles them (default 20).
+@item cpu-throttle-increment
+Percentage added every time auto-converge throttles them more (default 10).
+@item multifd-channels
+Number of connections that the multifd capability sends RAM over, from 1 to
+16 (default 2).
+@end table
 ETEXI
 
     {
@@ -1293,6 +1469,11 @@ show the character devices
 show the block devices
 @item info blockstats
 show block device statistics
+@item info block-jobs
+show progress of ongoing block device operations
+@item info aio
+show host AIO statistics (thread pool latency histograms, Linux AIO
+submission batch sizes)
 @item info registers
 show the cpu registers
 @item info cpus
@@ -1345,6 +1526,10 @@ show CPU statistics
 show user network stack connection states
 @item info migrate
 show migration status
+@item info migrate_capabilities
+show current migration capabilities
+@item info migrate_parameters
+show current migration parameters
 @item info balloon
 show balloon information
 @item info qtree
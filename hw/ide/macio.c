@@ -183,7 +183,7 @@ static void pmac_ide_flush(DBDMA_io *io)
     MACIOIDEState *m = io->opaque;
 
     if (m->aiocb)
-        qemu_aio_flush();
+        bdrv_drain_all();
 }
 
 /* PowerMac IDE memory IO */
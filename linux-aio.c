@@ -9,6 +9,7 @@
  */
 #include "qemu-common.h"
 #include "qemu-aio.h"
+#include "monitor.h"
 #include "block_int.h"
 #include "block/raw-posix-aio.h"
 
@@ -25,6 +26,40 @@
  */
 #define MAX_EVENTS 128
 
+/*
+ * Completion ring as mapped into user space by the kernel at the address
+ * returned by io_setup.  If the header looks sane we reap completions from
+ * it directly instead of calling io_getevents.
+ */
+#define AIO_RING_MAGIC 0xa10a10a1
+
+struct aio_ring {
+    unsigned id;
+    unsigned nr;
+    unsigned head;
+    unsigned tail;
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;
+    struct io_event io_events[0];
+};
+
+/* Batch size histogram buckets: 1, 2-3, 4-7, ..., 64-127, 128 */
+#define LAIO_BATCH_BUCKETS 8
+
+typedef struct LaioStats {
+    uint64_t submit_calls;
+    uint64_t submitted;
+    uint64_t max_batch;
+    uint64_t batch_hist[LAIO_BATCH_BUCKETS];
+    uint64_t getevents_calls;
+    uint64_t getevents_events;
+    uint64_t ring_events;
+} LaioStats;
+
+static LaioStats laio_stats;
+
 struct qemu_laiocb {
     BlockDriverAIOCB common;
     struct qemu_laio_state *ctx;
@@ -35,10 +70,19 @@ struct qemu_laiocb {
     QLIST_ENTRY(qemu_laiocb) node;
 };
 
+/* Requests held back while the device is plugged */
+typedef struct LaioQueue {
+    struct iocb *iocbs[MAX_EVENTS];
+    int plugged;
+    int n;
+} LaioQueue;
+
 struct qemu_laio_state {
     io_context_t ctx;
     int efd;
     int count;
+    int use_ring;
+    LaioQueue io_q;
     QLIST_HEAD(, qemu_laiocb) completed_reqs;
 };
 
@@ -86,8 +130,8 @@ static int qemu_laio_process_requests(void *opaque)
 
     QLIST_FOREACH_SAFE (laiocb, &s->completed_reqs, node, next) {
         if (laiocb->async_context_id == get_async_context_id()) {
-            qemu_laio_process_completion(s, laiocb);
             QLIST_REMOVE(laiocb, node);
+            qemu_laio_process_completion(s, laiocb);
             res = 1;
         }
     }
@@ -110,6 +154,85 @@ static void qemu_laio_enqueue_completed(struct qemu_laio_state *s,
     }
 }
 
+static void laio_account_submit(int n)
+{
+    int i = 0;
+
+    laio_stats.submit_calls++;
+    laio_stats.submitted += n;
+    if (n > laio_stats.max_batch) {
+        laio_stats.max_batch = n;
+    }
+    while ((n >>= 1) && i < LAIO_BATCH_BUCKETS - 1) {
+        i++;
+    }
+    laio_stats.batch_hist[i]++;
+}
+
+/*
+ * Submits all requests that were queued while the device was plugged.
+ * Requests that the kernel refuses fail from qemu_laio_completion_cb(), the
+ * caller may be laio_submit() or laio_cancel() and still use them.
+ */
+static void ioq_submit(struct qemu_laio_state *s)
+{
+    int ret = 0, i, done = 0, len = s->io_q.n;
+    uint64_t val = 1;
+    ssize_t n;
+
+    s->io_q.n = 0;
+    while (done < len) {
+        ret = io_submit(s->ctx, len - done, &s->io_q.iocbs[done]);
+        if (ret <= 0) {
+            break;
+        }
+        laio_account_submit(ret);
+        done += ret;
+    }
+
+    for (i = done; i < len; i++) {
+        struct qemu_laiocb *laiocb =
+                container_of(s->io_q.iocbs[i], struct qemu_laiocb, iocb);
+
+        laiocb->ret = ret < 0 ? ret : -EIO;
+        QLIST_INSERT_HEAD(&s->completed_reqs, laiocb, node);
+    }
+
+    if (done < len) {
+        do {
+            n = write(s->efd, &val, sizeof(val));
+        } while (n == -1 && errno == EINTR);
+    }
+}
+
+/*
+ * Copies up to max events out of the completion ring and hands the slots
+ * back to the kernel.
+ */
+static int qemu_laio_reap_ring(struct qemu_laio_state *s,
+                               struct io_event *events, int max)
+{
+    struct aio_ring *ring = (struct aio_ring *)s->ctx;
+    unsigned head, tail;
+    int n = 0;
+
+    head = ring->head;
+    tail = ring->tail;
+    /* read the events only after the tail that covers them */
+    __sync_synchronize();
+
+    while (head != tail && n < max) {
+        events[n++] = ring->io_events[head];
+        head = (head + 1) % ring->nr;
+    }
+
+    __sync_synchronize();
+    ring->head = head;
+
+    laio_stats.ring_events += n;
+    return n;
+}
+
 static void qemu_laio_completion_cb(void *opaque)
 {
     struct qemu_laio_state *s = opaque;
@@ -131,9 +254,17 @@ static void qemu_laio_completion_cb(void *opaque)
         if (ret != 8)
             break;
 
-        do {
-            nevents = io_getevents(s->ctx, val, MAX_EVENTS, events, &ts);
-        } while (nevents == -EINTR);
+        if (s->use_ring) {
+            nevents = qemu_laio_reap_ring(s, events, MAX_EVENTS);
+        } else {
+            do {
+                nevents = io_getevents(s->ctx, val, MAX_EVENTS, events, &ts);
+            } while (nevents == -EINTR);
+            laio_stats.getevents_calls++;
+            if (nevents > 0) {
+                laio_stats.getevents_events += nevents;
+            }
+        }
 
         for (i = 0; i < nevents; i++) {
             struct iocb *iocb = events[i].obj;
@@ -144,12 +275,20 @@ static void qemu_laio_completion_cb(void *opaque)
             qemu_laio_enqueue_completed(s, laiocb);
         }
     }
+
+    /* Requests that ioq_submit() couldn't submit */
+    qemu_laio_process_requests(s);
 }
 
 static int qemu_laio_flush_cb(void *opaque)
 {
     struct qemu_laio_state *s = opaque;
 
+    /* Nobody is going to unplug while we wait for the requests */
+    if (s->io_q.n) {
+        ioq_submit(s);
+    }
+
     return (s->count > 0) ? 1 : 0;
 }
 
@@ -162,6 +301,18 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    /*
+     * The request may still be waiting to be submitted.  If the kernel
+     * refuses it, it is released without calling back.
+     */
+    if (laiocb->ctx->io_q.n) {
+        ioq_submit(laiocb->ctx);
+        if (laiocb->ret != -EINPROGRESS) {
+            laiocb->ret = -ECANCELED;
+            return;
+        }
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -223,8 +374,17 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     io_set_eventfd(&laiocb->iocb, s->efd);
     s->count++;
 
+    if (s->io_q.plugged) {
+        s->io_q.iocbs[s->io_q.n++] = iocbs;
+        if (s->io_q.n == MAX_EVENTS) {
+            ioq_submit(s);
+        }
+        return &laiocb->common;
+    }
+
     if (io_submit(s->ctx, 1, &iocbs) < 0)
         goto out_dec_count;
+    laio_account_submit(1);
     return &laiocb->common;
 
 out_free_aiocb:
@@ -234,6 +394,48 @@ out_dec_count:
     return NULL;
 }
 
+void laio_io_plug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void laio_io_unplug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0);
+    if (--s->io_q.plugged == 0 && s->io_q.n) {
+        ioq_submit(s);
+    }
+}
+
+void laio_info(Monitor *mon)
+{
+    int i;
+
+    monitor_printf(mon, "linux-aio: io_submit calls=%" PRIu64
+                   " requests=%" PRIu64 " max_batch=%" PRIu64 "\n",
+                   laio_stats.submit_calls, laio_stats.submitted,
+                   laio_stats.max_batch);
+    for (i = 0; i < LAIO_BATCH_BUCKETS; i++) {
+        if (!laio_stats.batch_hist[i]) {
+            continue;
+        }
+        if (i == LAIO_BATCH_BUCKETS - 1) {
+            monitor_printf(mon, "  batch >=%d", 1 << i);
+        } else {
+            monitor_printf(mon, "  batch %d-%d", 1 << i, (2 << i) - 1);
+        }
+        monitor_printf(mon, ": %" PRIu64 "\n", laio_stats.batch_hist[i]);
+    }
+    monitor_printf(mon, "linux-aio: io_getevents calls=%" PRIu64
+                   " events=%" PRIu64 " ring_events=%" PRIu64 "\n",
+                   laio_stats.getevents_calls, laio_stats.getevents_events,
+                   laio_stats.ring_events);
+}
+
 void *laio_init(void)
 {
     struct qemu_laio_state *s;
@@ -248,6 +450,11 @@ void *laio_init(void)
     if (io_setup(MAX_EVENTS, &s->ctx) != 0)
         goto out_close_efd;
 
+    if (((struct aio_ring *)s->ctx)->magic == AIO_RING_MAGIC &&
+        ((struct aio_ring *)s->ctx)->incompat_features == 0) {
+        s->use_ring = 1;
+    }
+
     qemu_aio_set_fd_handler(s->efd, qemu_laio_completion_cb, NULL,
         qemu_laio_flush_cb, qemu_laio_process_requests, s);
 
@@ -0,0 +1,137 @@
+/*
+ * QEMU live snapshot to a file
+ *
+ * The state is written like for a migration, while the guest runs, and the
+ * guest only stops for the last pass.  Unlike with a migration, it resumes
+ * once the file is complete.  The file is loaded with -incoming file:path.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "migration.h"
+#include "monitor.h"
+#include "buffered_file.h"
+#include "block.h"
+#include "hw/hw.h"
+#include <fcntl.h>
+
+//#define DEBUG_MIGRATION_FILE
+
+#ifdef DEBUG_MIGRATION_FILE
+#define DPRINTF(fmt, ...) \
+    do { printf("migration-file: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+static int file_errno(FdMigrationState *s)
+{
+    return errno;
+}
+
+static int file_write(FdMigrationState *s, const void * buf, size_t size)
+{
+    return write(s->fd, buf, size);
+}
+
+static int file_close(FdMigrationState *s)
+{
+    int ret = 0;
+
+    DPRINTF("file_close\n");
+    if (s->fd != -1) {
+        /* The snapshot is only complete once it is on disk */
+        if (qemu_fdatasync(s->fd) < 0) {
+            ret = -1;
+        }
+        if (close(s->fd) < 0) {
+            ret = -1;
+        }
+        s->fd = -1;
+    }
+    return ret;
+}
+
+MigrationState *file_start_outgoing_migration(Monitor *mon,
+                                              const char *path,
+                                              int64_t bandwidth_limit,
+                                              int detach,
+                                              int blk,
+                                              int inc)
+{
+    FdMigrationState *s;
+
+    s = qemu_mallocz(sizeof(*s));
+
+    s->fd = qemu_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0600);
+    if (s->fd == -1) {
+        DPRINTF("Unable to open %s\n", path);
+        qemu_free(s);
+        return NULL;
+    }
+
+    s->get_error = file_errno;
+    s->write = file_write;
+    s->close = file_close;
+    s->mig_state.cancel = migrate_fd_cancel;
+    s->mig_state.get_status = migrate_fd_get_status;
+    s->mig_state.release = migrate_fd_release;
+
+    s->mig_state.blk = blk;
+    s->mig_state.shared = inc;
+
+    s->state = MIG_STATE_ACTIVE;
+    s->mon = NULL;
+    s->bandwidth_limit = bandwidth_limit;
+    s->snapshot = 1;
+
+    if (!detach) {
+        migrate_fd_monitor_suspend(s, mon);
+    }
+
+    migrate_fd_connect(s);
+    return &s->mig_state;
+}
+
+static void file_accept_incoming_migration(void *opaque)
+{
+    QEMUFile *f = opaque;
+
+    process_incoming_migration(f);
+    qemu_set_fd_handler2(qemu_stdio_fd(f), NULL, NULL, NULL, NULL);
+    qemu_fclose(f);
+}
+
+int file_start_incoming_migration(const char *path)
+{
+    QEMUFile *f;
+    int fd, ret;
+
+    DPRINTF("Attempting to start an incoming migration from %s\n", path);
+
+    fd = qemu_open(path, O_RDONLY | O_BINARY);
+    if (fd == -1) {
+        return -errno;
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    /* The file is read once from start to end, let the kernel read ahead */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    f = qemu_fdopen(fd, "rb");
+    if (f == NULL) {
+        DPRINTF("Unable to apply qemu wrapper to file descriptor\n");
+        ret = -errno;
+        close(fd);
+        return ret;
+    }
+
+    qemu_set_fd_handler2(fd, NULL, file_accept_incoming_migration, NULL, f);
+
+    return 0;
+}
@@ -17,6 +17,7 @@
 #include "qemu-char.h"
 #include "buffered_file.h"
 #include "block.h"
+#include "multifd-ram.h"
 
 //#define DEBUG_MIGRATION_TCP
 
@@ -38,16 +39,71 @@ static int socket_write(FdMigrationState *s, const void * buf, size_t size)
     return send(s->fd, buf, size, 0);
 }
 
+static int socket_read(FdMigrationState *s, void *buf, size_t size)
+{
+    return recv(s->fd, buf, size, 0);
+}
+
 static int tcp_close(FdMigrationState *s)
 {
+    int ret;
+
     DPRINTF("tcp_close\n");
+    /* The pages that are left on the channels go out after the stream */
+    ret = multifd_send_cleanup();
     if (s->fd != -1) {
         close(s->fd);
         s->fd = -1;
     }
+    return ret;
+}
+
+/* Opens the connections for the multifd channels, to where s->fd went */
+static int tcp_connect_channels(FdMigrationState *s)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int fds[MULTIFD_MAX_CHANNELS];
+    int n = migrate_multifd_channels();
+    int i, ret;
+
+    if (getpeername(s->fd, (struct sockaddr *)&addr, &addrlen) < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        fds[i] = qemu_socket(PF_INET, SOCK_STREAM, 0);
+        if (fds[i] == -1) {
+            goto err;
+        }
+        do {
+            ret = connect(fds[i], (struct sockaddr *)&addr, addrlen);
+        } while (ret == -1 && socket_error() == EINTR);
+        if (ret == -1) {
+            closesocket(fds[i]);
+            goto err;
+        }
+    }
+
+    multifd_send_init(fds, n);
     return 0;
+
+err:
+    DPRINTF("connecting channel %d failed\n", i);
+    while (--i >= 0) {
+        closesocket(fds[i]);
+    }
+    return -1;
 }
 
+static void tcp_connected(FdMigrationState *s)
+{
+    if (migrate_use_multifd() && tcp_connect_channels(s) < 0) {
+        migrate_fd_error(s);
+        return;
+    }
+    migrate_fd_connect(s);
+}
 
 static void tcp_wait_for_connect(void *opaque)
 {
@@ -68,7 +124,7 @@ static void tcp_wait_for_connect(void *opaque)
     qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
 
     if (val == 0)
-        migrate_fd_connect(s);
+        tcp_connected(s);
     else {
         DPRINTF("error connecting %d\n", val);
         migrate_fd_error(s);
@@ -93,6 +149,7 @@ MigrationState *tcp_start_outgoing_migration(Monitor *mon,
 
     s->get_error = socket_errno;
     s->write = socket_write;
+    s->read = socket_read;
     s->close = tcp_close;
     s->mig_state.cancel = migrate_fd_cancel;
     s->mig_state.get_status = migrate_fd_get_status;
@@ -129,7 +186,7 @@ MigrationState *tcp_start_outgoing_migration(Monitor *mon,
         DPRINTF("connect failed\n");
         migrate_fd_error(s);
     } else if (ret >= 0)
-        migrate_fd_connect(s);
+        tcp_connected(s);
 
     return &s->mig_state;
 }
@@ -140,7 +197,7 @@ static void tcp_accept_incoming_migration(void *opaque)
     socklen_t addrlen = sizeof(addr);
     int s = (intptr_t)opaque;
     QEMUFile *f;
-    int c;
+    int c, ret;
 
     do {
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
@@ -159,7 +216,15 @@ static void tcp_accept_incoming_migration(void *opaque)
         goto out;
     }
 
-    process_incoming_migration(f);
+    /* RAM may come over more connections, they follow this one */
+    multifd_recv_set_listener(s);
+    ret = process_incoming_migration(f);
+    multifd_recv_set_listener(-1);
+
+    if (ret > 0) {
+        /* The connection is used until all of RAM arrived */
+        goto out2;
+    }
     qemu_fclose(f);
 out:
     close(c);
@@ -189,7 +254,7 @@ int tcp_start_incoming_migration(const char *host_port)
     if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1)
         goto err;
 
-    if (listen(s, 1) == -1)
+    if (listen(s, 1 + MULTIFD_MAX_CHANNELS) == -1)
         goto err;
 
     qemu_set_fd_handler2(s, NULL, tcp_accept_incoming_migration, NULL,
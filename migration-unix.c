@@ -38,6 +38,11 @@ static int unix_write(FdMigrationState *s, const void * buf, size_t size)
     return write(s->fd, buf, size);
 }
 
+static int unix_read(FdMigrationState *s, void *buf, size_t size)
+{
+    return read(s->fd, buf, size);
+}
+
 static int unix_close(FdMigrationState *s)
 {
     DPRINTF("unix_close\n");
@@ -92,6 +97,7 @@ MigrationState *unix_start_outgoing_migration(Monitor *mon,
 
     s->get_error = unix_errno;
     s->write = unix_write;
+    s->read = unix_read;
     s->close = unix_close;
     s->mig_state.cancel = migrate_fd_cancel;
     s->mig_state.get_status = migrate_fd_get_status;
@@ -167,12 +173,16 @@ static void unix_accept_incoming_migration(void *opaque)
         goto out;
     }
 
-    process_incoming_migration(f);
+    if (process_incoming_migration(f) > 0) {
+        /* The connection is used until all of RAM arrived */
+        goto out_listen;
+    }
     qemu_fclose(f);
 out:
+    close(c);
+out_listen:
     qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
     close(s);
-    close(c);
 }
 
 int unix_start_incoming_migration(const char *path)
@@ -18,8 +18,12 @@
 #include "sysemu.h"
 #include "block.h"
 #include "qemu_socket.h"
+#include "qemu-timer.h"
 #include "block-migration.h"
 #include "qemu-objects.h"
+#include "qerror.h"
+#include "cpus.h"
+#include "multifd-ram.h"
 
 //#define DEBUG_MIGRATION
 
@@ -39,6 +43,31 @@ static MigrationState *current_migration;
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
+/* How the iterations of the outgoing migration went, times are in ns */
+static struct {
+    uint64_t iterations;
+    int64_t last_iteration;
+    int64_t max_iteration;
+    int64_t locked;
+    int64_t max_locked;
+    int64_t lock_start;
+    uint64_t direct_bytes;      /* written straight from what was put */
+    uint64_t buffered_bytes;    /* copied to the buffer before */
+} migration_stats;
+
+/* How the last incoming migration went, the time is in ns */
+static struct {
+    int done;
+    int state;
+    int64_t time;
+    int64_t bytes;
+} incoming_stats;
+
+#ifdef CONFIG_IOTHREAD
+/* Whether this thread iterates over the live state without the global mutex */
+static __thread int migration_unlocked;
+#endif
+
 int qemu_start_incoming_migration(const char *uri)
 {
     const char *p;
@@ -53,6 +82,8 @@ int qemu_start_incoming_migration(const char *uri)
         ret = unix_start_incoming_migration(p);
     else if (strstart(uri, "fd:", &p))
         ret = fd_start_incoming_migration(p);
+    else if (strstart(uri, "file:", &p))
+        ret = file_start_incoming_migration(p);
 #endif
     else {
         fprintf(stderr, "unknown migration protocol: %s\n", uri);
@@ -61,12 +92,26 @@ int qemu_start_incoming_migration(const char *uri)
     return ret;
 }
 
-void process_incoming_migration(QEMUFile *f)
+/*
+ * Returns 1 if the rest of RAM is loaded in the background, while the guest
+ * runs already.  f must stay open then.
+ */
+int process_incoming_migration(QEMUFile *f)
 {
-    if (qemu_loadvm_state(f) < 0) {
+    int64_t start;
+    int ret;
+
+    ram_load_reset_stats();
+    start = qemu_get_clock_ns(rt_clock);
+    ret = qemu_loadvm_state(f);
+    if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
         exit(0);
     }
+    incoming_stats.done = 1;
+    incoming_stats.state = ret > 0 ? MIG_STATE_ACTIVE : MIG_STATE_COMPLETED;
+    incoming_stats.time = qemu_get_clock_ns(rt_clock) - start;
+    incoming_stats.bytes = qemu_ftell(f);
     qemu_announce_self();
     DPRINTF("successfully loaded vm state\n");
 
@@ -74,6 +119,21 @@ void process_incoming_migration(QEMUFile *f)
 
     if (autostart)
         vm_start();
+
+    return ret;
+}
+
+void process_incoming_postcopy_done(int ret)
+{
+    if (ret < 0) {
+        /* The source doesn't have the guest anymore either */
+        fprintf(stderr, "post-copy migration failed, the guest can't "
+                "continue\n");
+        incoming_stats.state = MIG_STATE_ERROR;
+        vm_stop(VMSTOP_MIGRATE);
+    } else {
+        incoming_stats.state = MIG_STATE_COMPLETED;
+    }
 }
 
 int do_migrate(Monitor *mon, const QDict *qdict, QObject **ret_data)
@@ -95,6 +155,26 @@ int do_migrate(Monitor *mon, const QDict *qdict, QObject **ret_data)
         return -1;
     }
 
+    /* Pages are requested over the connection itself */
+    if (migrate_use_postcopy() && !strstart(uri, "tcp:", NULL) &&
+        !strstart(uri, "unix:", NULL)) {
+        monitor_printf(mon, "post-copy migration needs a tcp: or unix: "
+                       "uri\n");
+        return -1;
+    }
+
+    /* The channels connect to the same address as the migration stream */
+    if (migrate_use_multifd() && !strstart(uri, "tcp:", NULL)) {
+        monitor_printf(mon, "multifd migration needs a tcp: uri\n");
+        return -1;
+    }
+
+    /* Requested pages would race with the ones on the channels */
+    if (migrate_use_multifd() && migrate_use_postcopy()) {
+        monitor_printf(mon, "multifd and postcopy-ram can't be combined\n");
+        return -1;
+    }
+
     if (strstart(uri, "tcp:", &p)) {
         s = tcp_start_outgoing_migration(mon, p, max_throttle, detach,
                                          blk, inc);
@@ -108,6 +188,9 @@ int do_migrate(Monitor *mon, const QDict *qdict, QObject **ret_data)
     } else if (strstart(uri, "fd:", &p)) {
         s = fd_start_outgoing_migration(mon, p, max_throttle, detach, 
                                         blk, inc);
+    } else if (strstart(uri, "file:", &p)) {
+        s = file_start_outgoing_migration(mon, p, max_throttle, detach,
+                                          blk, inc);
 #endif
     } else {
         monitor_printf(mon, "unknown migration protocol: %s\n", uri);
@@ -157,6 +240,12 @@ int do_migrate_set_speed(Monitor *mon, const QDict *qdict, QObject **ret_data)
     return 0;
 }
 
+/* in bytes per second */
+uint64_t migrate_max_bandwidth(void)
+{
+    return max_throttle;
+}
+
 /* amount of nanoseconds we are willing to wait for migration to be down.
  * the choice of nanoseconds is because it is the maximum resolution that
  * get_clock() can achieve. It is an internal measure. All user-visible
@@ -180,6 +269,243 @@ int do_migrate_set_downtime(Monitor *mon, const QDict *qdict,
     return 0;
 }
 
+static const char *migration_capability_names[MIGRATION_CAP_MAX] = {
+    [MIGRATION_CAP_BLOCK_COMPRESS] = "block-compress",
+    [MIGRATION_CAP_XBZRLE] = "xbzrle",
+    [MIGRATION_CAP_COMPRESS] = "compress",
+    [MIGRATION_CAP_AUTO_CONVERGE] = "auto-converge",
+    [MIGRATION_CAP_POSTCOPY] = "postcopy-ram",
+    [MIGRATION_CAP_MULTIFD] = "multifd",
+};
+
+static int migration_capabilities[MIGRATION_CAP_MAX];
+
+int migrate_use_block_compress(void)
+{
+    return migration_capabilities[MIGRATION_CAP_BLOCK_COMPRESS];
+}
+
+int migrate_use_xbzrle(void)
+{
+    return migration_capabilities[MIGRATION_CAP_XBZRLE];
+}
+
+int migrate_use_compression(void)
+{
+    return migration_capabilities[MIGRATION_CAP_COMPRESS];
+}
+
+int migrate_auto_converge(void)
+{
+    return migration_capabilities[MIGRATION_CAP_AUTO_CONVERGE];
+}
+
+int migrate_use_postcopy(void)
+{
+    return migration_capabilities[MIGRATION_CAP_POSTCOPY];
+}
+
+int migrate_use_multifd(void)
+{
+    return migration_capabilities[MIGRATION_CAP_MULTIFD];
+}
+
+/* Whether the devices are being saved for the switch to post-copy */
+int migrate_postcopy_switching(void)
+{
+    return current_migration &&
+           migrate_to_fms(current_migration)->postcopy == POSTCOPY_SWITCHING;
+}
+
+/* Tunables of the optional features, see migrate_set_parameter */
+static const struct {
+    const char *name;
+    int64_t min;
+    int64_t max;
+} migration_parameter_info[MIGRATION_PARAM_MAX] = {
+    [MIGRATION_PARAM_COMPRESS_LEVEL] = { "compress-level", 0, 9 },
+    [MIGRATION_PARAM_COMPRESS_THREADS] = { "compress-threads", 1, 255 },
+    [MIGRATION_PARAM_DECOMPRESS_THREADS] = { "decompress-threads", 1, 255 },
+    [MIGRATION_PARAM_CPU_THROTTLE_INITIAL] = {
+        "cpu-throttle-initial", CPU_THROTTLE_PCT_MIN, CPU_THROTTLE_PCT_MAX
+    },
+    [MIGRATION_PARAM_CPU_THROTTLE_INCREMENT] = {
+        "cpu-throttle-increment", CPU_THROTTLE_PCT_MIN, CPU_THROTTLE_PCT_MAX
+    },
+    [MIGRATION_PARAM_MULTIFD_CHANNELS] = {
+        "multifd-channels", 1, MULTIFD_MAX_CHANNELS
+    },
+};
+
+static int64_t migration_parameters[MIGRATION_PARAM_MAX] = {
+    [MIGRATION_PARAM_COMPRESS_LEVEL] = 1,
+    [MIGRATION_PARAM_COMPRESS_THREADS] = 8,
+    [MIGRATION_PARAM_DECOMPRESS_THREADS] = 2,
+    [MIGRATION_PARAM_CPU_THROTTLE_INITIAL] = 20,
+    [MIGRATION_PARAM_CPU_THROTTLE_INCREMENT] = 10,
+    [MIGRATION_PARAM_MULTIFD_CHANNELS] = 2,
+};
+
+int migrate_compress_level(void)
+{
+    return migration_parameters[MIGRATION_PARAM_COMPRESS_LEVEL];
+}
+
+int migrate_compress_threads(void)
+{
+    return migration_parameters[MIGRATION_PARAM_COMPRESS_THREADS];
+}
+
+int migrate_decompress_threads(void)
+{
+    return migration_parameters[MIGRATION_PARAM_DECOMPRESS_THREADS];
+}
+
+int migrate_cpu_throttle_initial(void)
+{
+    return migration_parameters[MIGRATION_PARAM_CPU_THROTTLE_INITIAL];
+}
+
+int migrate_cpu_throttle_increment(void)
+{
+    return migration_parameters[MIGRATION_PARAM_CPU_THROTTLE_INCREMENT];
+}
+
+int migrate_multifd_channels(void)
+{
+    return migration_parameters[MIGRATION_PARAM_MULTIFD_CHANNELS];
+}
+
+int do_migrate_set_parameter(Monitor *mon, const QDict *qdict,
+                             QObject **ret_data)
+{
+    const char *name = qdict_get_str(qdict, "parameter");
+    int64_t value = qdict_get_int(qdict, "value");
+    char range[64];
+    int i;
+
+    if (current_migration &&
+        current_migration->get_status(current_migration) == MIG_STATE_ACTIVE) {
+        qerror_report(QERR_MIGRATION_ACTIVE);
+        return -1;
+    }
+
+    for (i = 0; i < MIGRATION_PARAM_MAX; i++) {
+        if (!strcmp(name, migration_parameter_info[i].name)) {
+            if (value < migration_parameter_info[i].min ||
+                value > migration_parameter_info[i].max) {
+                snprintf(range, sizeof(range),
+                         "a value between %" PRId64 " and %" PRId64,
+                         migration_parameter_info[i].min,
+                         migration_parameter_info[i].max);
+                qerror_report(QERR_INVALID_PARAMETER_VALUE, "value", range);
+                return -1;
+            }
+            migration_parameters[i] = value;
+            return 0;
+        }
+    }
+
+    qerror_report(QERR_INVALID_PARAMETER_VALUE, "parameter",
+                  "a migration parameter");
+    return -1;
+}
+
+static void migrate_print_parameter(QObject *obj, void *opaque)
+{
+    Monitor *mon = opaque;
+    QDict *qdict = qobject_to_qdict(obj);
+
+    monitor_printf(mon, "%s: %" PRId64 "\n", qdict_get_str(qdict, "parameter"),
+                   qdict_get_int(qdict, "value"));
+}
+
+void do_info_migrate_parameters_print(Monitor *mon, const QObject *data)
+{
+    qlist_iter(qobject_to_qlist(data), migrate_print_parameter, mon);
+}
+
+void do_info_migrate_parameters(Monitor *mon, QObject **ret_data)
+{
+    QList *list = qlist_new();
+    int i;
+
+    for (i = 0; i < MIGRATION_PARAM_MAX; i++) {
+        qlist_append_obj(list, qobject_from_jsonf("{ 'parameter': %s, "
+                                                  "'value': %" PRId64 " }",
+                                migration_parameter_info[i].name,
+                                migration_parameters[i]));
+    }
+
+    *ret_data = QOBJECT(list);
+}
+
+int do_migrate_set_cache_size(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data)
+{
+    if (xbzrle_cache_resize(qdict_get_int(qdict, "value")) < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "value",
+                      "a cache size of at least one page");
+        return -1;
+    }
+
+    return 0;
+}
+
+int do_migrate_set_capability(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data)
+{
+    const char *name = qdict_get_str(qdict, "capability");
+    int state = qdict_get_bool(qdict, "state");
+    int i;
+
+    if (current_migration &&
+        current_migration->get_status(current_migration) == MIG_STATE_ACTIVE) {
+        qerror_report(QERR_MIGRATION_ACTIVE);
+        return -1;
+    }
+
+    for (i = 0; i < MIGRATION_CAP_MAX; i++) {
+        if (!strcmp(name, migration_capability_names[i])) {
+            migration_capabilities[i] = state;
+            return 0;
+        }
+    }
+
+    qerror_report(QERR_INVALID_PARAMETER_VALUE, "capability",
+                  "a migration capability");
+    return -1;
+}
+
+static void migrate_print_capability(QObject *obj, void *opaque)
+{
+    Monitor *mon = opaque;
+    QDict *qdict = qobject_to_qdict(obj);
+
+    monitor_printf(mon, "%s: %s\n", qdict_get_str(qdict, "capability"),
+                   qdict_get_bool(qdict, "state") ? "on" : "off");
+}
+
+void do_info_migrate_capabilities_print(Monitor *mon, const QObject *data)
+{
+    qlist_iter(qobject_to_qlist(data), migrate_print_capability, mon);
+}
+
+void do_info_migrate_capabilities(Monitor *mon, QObject **ret_data)
+{
+    QList *list = qlist_new();
+    int i;
+
+    for (i = 0; i < MIGRATION_CAP_MAX; i++) {
+        qlist_append_obj(list, qobject_from_jsonf("{ 'capability': %s, "
+                                                  "'state': %i }",
+                                migration_capability_names[i],
+                                migration_capabilities[i]));
+    }
+
+    *ret_data = QOBJECT(list);
+}
+
 static void migrate_print_status(Monitor *mon, const char *name,
                                  const QDict *status_dict)
 {
@@ -193,6 +519,14 @@ static void migrate_print_status(Monitor *mon, const char *name,
                         qdict_get_int(qdict, "remaining") >> 10);
     monitor_printf(mon, "total %s: %" PRIu64 " kbytes\n", name,
                         qdict_get_int(qdict, "total") >> 10);
+    if (qdict_haskey(qdict, "zero-blocks")) {
+        monitor_printf(mon, "zero %s blocks: %" PRIu64 "\n", name,
+                       qdict_get_int(qdict, "zero-blocks"));
+    }
+    if (qdict_haskey(qdict, "sent")) {
+        monitor_printf(mon, "sent %s: %" PRIu64 " kbytes\n", name,
+                       qdict_get_int(qdict, "sent") >> 10);
+    }
 }
 
 void do_info_migrate_print(Monitor *mon, const QObject *data)
@@ -201,6 +535,24 @@ void do_info_migrate_print(Monitor *mon, const QObject *data)
 
     qdict = qobject_to_qdict(data);
 
+    if (qdict_haskey(qdict, "incoming")) {
+        QDict *in = qobject_to_qdict(qdict_get(qdict, "incoming"));
+
+        monitor_printf(mon, "Incoming migration: %s, %" PRId64 " ms, "
+                       "%" PRId64 " kbytes\n",
+                       qdict_get_str(in, "status"),
+                       qdict_get_int(in, "total-time"),
+                       qdict_get_int(in, "bytes") >> 10);
+        monitor_printf(mon, "loaded pages: %" PRId64 " (zero %" PRId64 ", "
+                       "already zero %" PRId64 ")\n",
+                       qdict_get_int(in, "pages"),
+                       qdict_get_int(in, "zero-pages"),
+                       qdict_get_int(in, "zero-pages-skipped"));
+        monitor_printf(mon, "restore rate: %" PRId64 " MB/s\n",
+                       qdict_get_int(in, "restore-rate") >> 20);
+        return;
+    }
+
     monitor_printf(mon, "Migration status: %s\n",
                    qdict_get_str(qdict, "status"));
 
@@ -211,6 +563,85 @@ void do_info_migrate_print(Monitor *mon, const QObject *data)
     if (qdict_haskey(qdict, "disk")) {
         migrate_print_status(mon, "disk", qdict);
     }
+
+    if (qdict_haskey(qdict, "xbzrle-cache")) {
+        QDict *cache = qobject_to_qdict(qdict_get(qdict, "xbzrle-cache"));
+
+        monitor_printf(mon, "cache size: %" PRId64 " bytes\n",
+                       qdict_get_int(cache, "cache-size"));
+        monitor_printf(mon, "xbzrle transferred: %" PRId64 " kbytes\n",
+                       qdict_get_int(cache, "bytes") >> 10);
+        monitor_printf(mon, "xbzrle pages: %" PRId64 " pages\n",
+                       qdict_get_int(cache, "pages"));
+        monitor_printf(mon, "xbzrle cache miss: %" PRId64 "\n",
+                       qdict_get_int(cache, "cache-miss"));
+        monitor_printf(mon, "xbzrle overflow: %" PRId64 "\n",
+                       qdict_get_int(cache, "overflow"));
+    }
+
+    if (qdict_haskey(qdict, "compression")) {
+        QDict *comp = qobject_to_qdict(qdict_get(qdict, "compression"));
+
+        monitor_printf(mon, "compressed pages: %" PRId64 " pages\n",
+                       qdict_get_int(comp, "pages"));
+        monitor_printf(mon, "compressed size: %" PRId64 " kbytes\n",
+                       qdict_get_int(comp, "bytes") >> 10);
+    }
+
+    if (qdict_haskey(qdict, "multifd")) {
+        QDict *mfd = qobject_to_qdict(qdict_get(qdict, "multifd"));
+
+        monitor_printf(mon, "multifd channels: %" PRId64 "\n",
+                       qdict_get_int(mfd, "channels"));
+        monitor_printf(mon, "multifd pages: %" PRId64 " pages\n",
+                       qdict_get_int(mfd, "pages"));
+        monitor_printf(mon, "multifd size: %" PRId64 " kbytes\n",
+                       qdict_get_int(mfd, "bytes") >> 10);
+    }
+
+    if (qdict_haskey(qdict, "cpu-throttle-percentage")) {
+        monitor_printf(mon, "cpu throttle percentage: %" PRId64 "\n",
+                       qdict_get_int(qdict, "cpu-throttle-percentage"));
+    }
+
+    if (qdict_haskey(qdict, "iterations")) {
+        QDict *iter = qobject_to_qdict(qdict_get(qdict, "iterations"));
+
+        monitor_printf(mon, "iterations: %" PRId64 "\n",
+                       qdict_get_int(iter, "count"));
+        monitor_printf(mon, "last iteration: %" PRId64 " ms "
+                       "(longest %" PRId64 " ms)\n",
+                       qdict_get_int(iter, "last-time"),
+                       qdict_get_int(iter, "max-time"));
+        monitor_printf(mon, "global mutex held: %" PRId64 " ms "
+                       "(longest %" PRId64 " ms)\n",
+                       qdict_get_int(iter, "locked-time"),
+                       qdict_get_int(iter, "max-locked-time"));
+    }
+
+    if (qdict_haskey(qdict, "zero-copy")) {
+        QDict *zc = qobject_to_qdict(qdict_get(qdict, "zero-copy"));
+
+        monitor_printf(mon, "zero-copy pages: %" PRId64 "\n",
+                       qdict_get_int(zc, "pages"));
+        monitor_printf(mon, "sent without copy: %" PRId64 " kbytes\n",
+                       qdict_get_int(zc, "direct-bytes") >> 10);
+        monitor_printf(mon, "sent from buffer: %" PRId64 " kbytes\n",
+                       qdict_get_int(zc, "buffered-bytes") >> 10);
+    }
+
+    if (qdict_haskey(qdict, "dirty-sync")) {
+        QDict *sync = qobject_to_qdict(qdict_get(qdict, "dirty-sync"));
+
+        monitor_printf(mon, "dirty sync count: %" PRId64 "\n",
+                       qdict_get_int(sync, "count"));
+        monitor_printf(mon, "last dirty sync: %" PRId64 " us "
+                       "(longest %" PRId64 " us)\n",
+                       qdict_get_int(sync, "last-time"),
+                       qdict_get_int(sync, "max-time"));
+        monitor_printf(mon, "dirty sync rate: %" PRId64 " pages/s\n",
+                       qdict_get_int(sync, "pages-per-sec"));
+    }
 }
 
 static void migrate_put_status(QDict *qdict, const char *name,
@@ -233,17 +664,94 @@ void do_info_migrate(Monitor *mon, QObject **ret_data)
         switch (s->get_status(s)) {
         case MIG_STATE_ACTIVE:
             qdict = qdict_new();
-            qdict_put(qdict, "status", qstring_from_str("active"));
+            if (migrate_to_fms(s)->postcopy == POSTCOPY_ACTIVE) {
+                qdict_put(qdict, "status", qstring_from_str("postcopy-active"));
+            } else {
+                qdict_put(qdict, "status", qstring_from_str("active"));
+            }
 
             migrate_put_status(qdict, "ram", ram_bytes_transferred(),
                                ram_bytes_remaining(), ram_bytes_total());
 
             if (blk_mig_active()) {
+                QDict *disk;
+
                 migrate_put_status(qdict, "disk", blk_mig_bytes_transferred(),
                                    blk_mig_bytes_remaining(),
                                    blk_mig_bytes_total());
+                disk = qobject_to_qdict(qdict_get(qdict, "disk"));
+                qdict_put(disk, "zero-blocks",
+                          qint_from_int(blk_mig_zero_blocks()));
+                qdict_put(disk, "sent", qint_from_int(blk_mig_bytes_sent()));
+            }
+
+            if (migrate_use_xbzrle()) {
+                qdict_put_obj(qdict, "xbzrle-cache",
+                              qobject_from_jsonf("{ 'cache-size': %" PRId64 ", "
+                                                 "'bytes': %" PRId64 ", "
+                                                 "'pages': %" PRId64 ", "
+                                                 "'cache-miss': %" PRId64 ", "
+                                                 "'overflow': %" PRId64 " }",
+                                        xbzrle_get_cache_size(),
+                                        xbzrle_mig_bytes_transferred(),
+                                        xbzrle_mig_pages_transferred(),
+                                        xbzrle_mig_pages_cache_miss(),
+                                        xbzrle_mig_pages_overflow()));
             }
 
+            if (migrate_use_compression()) {
+                qdict_put_obj(qdict, "compression",
+                              qobject_from_jsonf("{ 'pages': %" PRId64 ", "
+                                                 "'bytes': %" PRId64 " }",
+                                        compress_mig_pages_transferred(),
+                                        compress_mig_bytes_transferred()));
+            }
+
+            if (migrate_use_multifd()) {
+                qdict_put_obj(qdict, "multifd",
+                              qobject_from_jsonf("{ 'channels': %d, "
+                                                 "'pages': %" PRId64 ", "
+                                                 "'bytes': %" PRId64 " }",
+                                        migrate_multifd_channels(),
+                                        multifd_mig_pages_transferred(),
+                                        multifd_mig_bytes_transferred()));
+            }
+
+            if (migrate_auto_converge()) {
+                qdict_put(qdict, "cpu-throttle-percentage",
+                          qint_from_int(cpu_throttle_get_percentage()));
+            }
+
+            qdict_put_obj(qdict, "iterations",
+                          qobject_from_jsonf("{ 'count': %" PRId64 ", "
+                                             "'last-time': %" PRId64 ", "
+                                             "'max-time': %" PRId64 ", "
+                                             "'locked-time': %" PRId64 ", "
+                                             "'max-locked-time': %" PRId64 " }",
+                                    migration_stats.iterations,
+                                    migration_stats.last_iteration / 1000000,
+                                    migration_stats.max_iteration / 1000000,
+                                    migration_stats.locked / 1000000,
+                                    migration_stats.max_locked / 1000000));
+
+            qdict_put_obj(qdict, "zero-copy",
+                          qobject_from_jsonf("{ 'pages': %" PRId64 ", "
+                                             "'direct-bytes': %" PRId64 ", "
+                                             "'buffered-bytes': %" PRId64 " }",
+                                             ram_zero_copy_pages(),
+                                             migration_stats.direct_bytes,
+                                             migration_stats.buffered_bytes));
+
+            qdict_put_obj(qdict, "dirty-sync",
+                          qobject_from_jsonf("{ 'count': %" PRId64 ", "
+                                             "'last-time': %" PRId64 ", "
+                                             "'max-time': %" PRId64 ", "
+                                             "'pages-per-sec': %" PRId64 " }",
+                                    ram_dirty_sync_count(),
+                                    ram_dirty_sync_last_time() / 1000,
+                                    ram_dirty_sync_max_time() / 1000,
+                                    ram_dirty_sync_rate()));
+
             *ret_data = QOBJECT(qdict);
             break;
         case MIG_STATE_COMPLETED:
@@ -256,9 +764,65 @@ void do_info_migrate(Monitor *mon, QObject **ret_data)
             *ret_data = qobject_from_jsonf("{ 'status': 'cancelled' }");
             break;
         }
+    } else if (incoming_stats.done) {
+        const char *status = "completed";
+        int64_t rate = 0;
+
+        if (incoming_stats.state == MIG_STATE_ACTIVE) {
+            status = "postcopy-active";
+        } else if (incoming_stats.state == MIG_STATE_ERROR) {
+            status = "failed";
+        }
+        if (incoming_stats.time > 0) {
+            rate = ram_load_bytes() * 1000000000ULL / incoming_stats.time;
+        }
+        *ret_data = qobject_from_jsonf("{ 'incoming': { "
+                                       "'status': %s, "
+                                       "'total-time': %" PRId64 ", "
+                                       "'bytes': %" PRId64 ", "
+                                       "'pages': %" PRId64 ", "
+                                       "'zero-pages': %" PRId64 ", "
+                                       "'zero-pages-skipped': %" PRId64 ", "
+                                       "'restore-rate': %" PRId64 " } }",
+                                       status,
+                                       incoming_stats.time / 1000000,
+                                       incoming_stats.bytes,
+                                       ram_load_pages(),
+                                       ram_load_zero_pages(),
+                                       ram_load_zero_pages_skipped(),
+                                       rate);
     }
 }
 
+/*
+ * Live savevm handlers call these around the parts of an iteration that
+ * touch the rest of the VM.  They take the global mutex when the outgoing
+ * migration runs in a thread of its own, and do nothing otherwise.
+ */
+void migrate_lock_iothread(void)
+{
+#ifdef CONFIG_IOTHREAD
+    if (migration_unlocked) {
+        qemu_mutex_lock_iothread();
+        migration_stats.lock_start = qemu_get_clock_ns(rt_clock);
+    }
+#endif
+}
+
+void migrate_unlock_iothread(void)
+{
+#ifdef CONFIG_IOTHREAD
+    if (migration_unlocked) {
+        int64_t held = qemu_get_clock_ns(rt_clock) -
+                       migration_stats.lock_start;
+
+        migration_stats.locked += held;
+        migration_stats.max_locked = MAX(migration_stats.max_locked, held);
+        qemu_mutex_unlock_iothread();
+    }
+#endif
+}
+
 /* shared migration helpers */
 
 void migrate_fd_monitor_suspend(FdMigrationState *s, Monitor *mon)
@@ -286,6 +850,11 @@ int migrate_fd_cleanup(FdMigrationState *s)
 
     qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
 
+    /* Unless the migration completes, what the RAM channels hold is lost */
+    if (s->state != MIG_STATE_ACTIVE) {
+        multifd_send_shutdown();
+    }
+
     if (s->file) {
         DPRINTF("closing file\n");
         if (qemu_fclose(s->file) != 0) {
@@ -315,17 +884,15 @@ void migrate_fd_put_notify(void *opaque)
     qemu_file_put_notify(s->file);
 }
 
-ssize_t migrate_fd_put_buffer(void *opaque, const void *data, size_t size)
+static ssize_t migrate_fd_put_result(FdMigrationState *s, ssize_t ret)
 {
-    FdMigrationState *s = opaque;
-    ssize_t ret;
-
-    do {
-        ret = s->write(s, data, size);
-    } while (ret == -1 && ((s->get_error(s)) == EINTR));
-
-    if (ret == -1)
-        ret = -(s->get_error(s));
+#ifdef CONFIG_IOTHREAD
+    /*
+     * The migration thread waits for the socket itself, and errors show up
+     * in the file when it iterates.
+     */
+    return ret;
+#endif
 
     if (ret == -EAGAIN) {
         qemu_set_fd_handler2(s->fd, NULL, NULL, migrate_fd_put_notify, s);
@@ -340,13 +907,60 @@ ssize_t migrate_fd_put_buffer(void *opaque, const void *data, size_t size)
     return ret;
 }
 
+ssize_t migrate_fd_put_buffer(void *opaque, const void *data, size_t size)
+{
+    FdMigrationState *s = opaque;
+    ssize_t ret;
+
+    do {
+        ret = s->write(s, data, size);
+    } while (ret == -1 && ((s->get_error(s)) == EINTR));
+
+    if (ret == -1)
+        ret = -(s->get_error(s));
+    else
+        migration_stats.buffered_bytes += ret;
+
+    return migrate_fd_put_result(s, ret);
+}
+
+#ifndef _WIN32
+static ssize_t migrate_fd_writev(void *opaque, struct iovec *iov, int iovcnt)
+{
+    FdMigrationState *s = opaque;
+    ssize_t ret;
+
+    do {
+        ret = writev(s->fd, iov, iovcnt);
+    } while (ret == -1 && ((s->get_error(s)) == EINTR));
+
+    if (ret == -1)
+        ret = -(s->get_error(s));
+    else
+        migration_stats.direct_bytes += ret;
+
+    return migrate_fd_put_result(s, ret);
+}
+#endif
+
 void migrate_fd_connect(FdMigrationState *s)
 {
     int ret;
 
+    memset(&migration_stats, 0, sizeof(migration_stats));
+    s->old_vm_running = 0;
+    s->bh = NULL;
+    s->postcopy = POSTCOPY_NONE;
+    s->postcopy_req_len = 0;
+
     s->file = qemu_fopen_ops_buffered(s,
                                       s->bandwidth_limit,
                                       migrate_fd_put_buffer,
+#ifndef _WIN32
+                                      migrate_fd_writev,
+#else
+                                      NULL,
+#endif
                                       migrate_fd_put_ready,
                                       migrate_fd_wait_for_unfreeze,
                                       migrate_fd_close);
@@ -359,44 +973,178 @@ void migrate_fd_connect(FdMigrationState *s)
         migrate_fd_error(s);
         return;
     }
-    
-    migrate_fd_put_ready(s);
+
+    /* Starts the migration thread, if there is one */
+    qemu_file_put_notify(s->file);
+}
+
+static void migrate_fd_completed(FdMigrationState *s)
+{
+    int state;
+
+    if (s->snapshot && s->old_vm_running) {
+        /*
+         * Nobody else takes the guest over after a snapshot, and the state
+         * that is still buffered needn't keep it stopped while it is written.
+         */
+        vm_start();
+        s->old_vm_running = 0;
+    }
+
+    if (s->complete_ret < 0) {
+        if (s->old_vm_running) {
+            vm_start();
+        }
+        state = MIG_STATE_ERROR;
+    } else {
+        state = MIG_STATE_COMPLETED;
+    }
+    if (migrate_fd_cleanup(s) < 0) {
+        if (s->old_vm_running) {
+            vm_start();
+        }
+        state = MIG_STATE_ERROR;
+    }
+    s->state = state;
+    notifier_list_notify(&migration_state_notifiers);
 }
 
-void migrate_fd_put_ready(void *opaque)
+#ifdef CONFIG_IOTHREAD
+static void migrate_fd_complete_bh(void *opaque)
 {
     FdMigrationState *s = opaque;
 
+    qemu_bh_delete(s->bh);
+    s->bh = NULL;
+    migrate_fd_completed(s);
+}
+#endif
+
+/*
+ * After the switch to post-copy, the destination requests the pages that
+ * the guest needs over the connection, and they are sent ahead of the
+ * others.  Returns 1 once all pages were sent.
+ */
+static int migrate_postcopy_iterate(FdMigrationState *s)
+{
+    ssize_t len;
+    int ret;
+
+    for (;;) {
+        len = s->read(s, (uint8_t *)s->postcopy_req + s->postcopy_req_len,
+                      sizeof(s->postcopy_req) - s->postcopy_req_len);
+        if (len == 0) {
+            DPRINTF("destination closed the connection\n");
+            return -EIO;
+        } else if (len < 0) {
+            ret = s->get_error(s);
+            if (ret == EINTR) {
+                continue;
+            }
+            if (ret == EAGAIN || ret == EWOULDBLOCK) {
+                break;
+            }
+            return -ret;
+        }
+
+        s->postcopy_req_len += len;
+        if (s->postcopy_req_len < sizeof(s->postcopy_req)) {
+            continue;
+        }
+        s->postcopy_req_len = 0;
+
+        ret = ram_postcopy_request(s->file, be32_to_cpu(s->postcopy_req[0]),
+                                   be32_to_cpu(s->postcopy_req[1]));
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return ram_postcopy_iterate(s->file);
+}
+
+int migrate_fd_put_ready(void *opaque)
+{
+    FdMigrationState *s = opaque;
+    int64_t start, duration;
+    int ret;
+
     if (s->state != MIG_STATE_ACTIVE) {
         DPRINTF("put_ready returning because of non-active state\n");
-        return;
+        return 1;
     }
 
     DPRINTF("iterate\n");
-    if (qemu_savevm_state_iterate(s->mon, s->file) == 1) {
-        int state;
-        int old_vm_running = vm_running;
+    start = qemu_get_clock_ns(rt_clock);
+#ifdef CONFIG_IOTHREAD
+    migration_unlocked = 1;
+#endif
+    if (s->postcopy == POSTCOPY_ACTIVE) {
+        ret = migrate_postcopy_iterate(s);
+    } else {
+        ret = qemu_savevm_state_iterate(s->mon, s->file);
+    }
+#ifdef CONFIG_IOTHREAD
+    migration_unlocked = 0;
+#endif
+    duration = qemu_get_clock_ns(rt_clock) - start;
+    migration_stats.iterations++;
+    migration_stats.last_iteration = duration;
+    migration_stats.max_iteration = MAX(migration_stats.max_iteration,
+                                        duration);
+    if (ret == 0) {
+        return 0;
+    }
 
+#ifdef CONFIG_IOTHREAD
+    qemu_mutex_lock_iothread();
+    if (s->state != MIG_STATE_ACTIVE) {
+        /* Cancelled while iterating */
+        qemu_mutex_unlock_iothread();
+        return 1;
+    }
+#endif
+
+    if (ret > 0 && s->postcopy == POSTCOPY_ACTIVE) {
+        DPRINTF("post-copy done\n");
+        ret = 0;
+    } else if (ret > 0) {
         DPRINTF("done iterating\n");
+        s->old_vm_running = vm_running;
         vm_stop(VMSTOP_MIGRATE);
-
-        if ((qemu_savevm_state_complete(s->mon, s->file)) < 0) {
-            if (old_vm_running) {
-                vm_start();
-            }
-            state = MIG_STATE_ERROR;
-        } else {
-            state = MIG_STATE_COMPLETED;
+        if (migrate_use_postcopy()) {
+            s->postcopy = POSTCOPY_SWITCHING;
         }
-        if (migrate_fd_cleanup(s) < 0) {
-            if (old_vm_running) {
-                vm_start();
-            }
-            state = MIG_STATE_ERROR;
+        ret = qemu_savevm_state_complete(s->mon, s->file);
+        if (ret == 0 && s->postcopy == POSTCOPY_SWITCHING) {
+            /*
+             * The destination runs the guest from now on, the rest of RAM
+             * is sent as the guest needs it and in the background.
+             */
+            DPRINTF("switched to post-copy\n");
+            s->postcopy = POSTCOPY_ACTIVE;
+            s->old_vm_running = 0;
+#ifdef CONFIG_IOTHREAD
+            qemu_mutex_unlock_iothread();
+#endif
+            return 0;
         }
-        s->state = state;
-        notifier_list_notify(&migration_state_notifiers);
+        s->postcopy = POSTCOPY_NONE;
+    } else {
+        DPRINTF("iterate failed, %d\n", ret);
+        qemu_savevm_state_cancel(s->mon, s->file);
     }
+    s->complete_ret = ret;
+
+#ifdef CONFIG_IOTHREAD
+    /* The file can only be closed from outside of the migration thread */
+    s->bh = qemu_bh_new(migrate_fd_complete_bh, s);
+    qemu_bh_schedule(s->bh);
+    qemu_mutex_unlock_iothread();
+#else
+    migrate_fd_completed(s);
+#endif
+    return 1;
 }
 
 int migrate_fd_get_status(MigrationState *mig_state)
@@ -412,13 +1160,24 @@ void migrate_fd_cancel(MigrationState *mig_state)
     if (s->state != MIG_STATE_ACTIVE)
         return;
 
+    if (s->bh) {
+        DPRINTF("too late to cancel, migration is completing\n");
+        return;
+    }
+
+    if (s->postcopy == POSTCOPY_ACTIVE) {
+        DPRINTF("too late to cancel, the destination runs the guest\n");
+        return;
+    }
+
     DPRINTF("cancelling migration\n");
 
     s->state = MIG_STATE_CANCELLED;
     notifier_list_notify(&migration_state_notifiers);
-    qemu_savevm_state_cancel(s->mon, s->file);
 
+    /* Stops the migration thread before the live handlers clean up */
     migrate_fd_cleanup(s);
+    qemu_savevm_state_cancel(s->mon, NULL);
 }
 
 void migrate_fd_release(MigrationState *mig_state)
@@ -435,23 +1194,27 @@ void migrate_fd_release(MigrationState *mig_state)
     qemu_free(s);
 }
 
-void migrate_fd_wait_for_unfreeze(void *opaque)
+int migrate_fd_wait_for_unfreeze(void *opaque)
 {
     FdMigrationState *s = opaque;
     int ret;
 
     DPRINTF("wait for unfreeze\n");
     if (s->state != MIG_STATE_ACTIVE)
-        return;
+        return -1;
 
     do {
         fd_set wfds;
+        /* Wake up now and then, so that a cancelled migration is noticed */
+        struct timeval tv = { 0, 100000 };
 
         FD_ZERO(&wfds);
         FD_SET(s->fd, &wfds);
 
-        ret = select(s->fd + 1, NULL, &wfds, NULL, NULL);
+        ret = select(s->fd + 1, NULL, &wfds, NULL, &tv);
     } while (ret == -1 && (s->get_error(s)) == EINTR);
+
+    return 0;
 }
 
 int migrate_fd_close(void *opaque)
@@ -48,10 +48,28 @@ struct FdMigrationState
     int (*get_error)(struct FdMigrationState*);
     int (*close)(struct FdMigrationState*);
     int (*write)(struct FdMigrationState*, const void *, size_t);
+    int (*read)(struct FdMigrationState*, void *, size_t);
     void *opaque;
+    int old_vm_running;
+    int complete_ret;
+    QEMUBH *bh;
+    int postcopy;
+    uint32_t postcopy_req[2];
+    int postcopy_req_len;
+    int snapshot;           /* the guest keeps running once it completed */
 };
 
-void process_incoming_migration(QEMUFile *f);
+/* How far an outgoing migration got with switching to post-copy */
+enum {
+    POSTCOPY_NONE,
+    POSTCOPY_SWITCHING,     /* the devices are being sent */
+    POSTCOPY_ACTIVE,        /* the destination runs the guest */
+};
+
+int process_incoming_migration(QEMUFile *f);
+
+/* Called once the rest of RAM was loaded after the switch to post-copy */
+void process_incoming_postcopy_done(int ret);
 
 int qemu_start_incoming_migration(const char *uri);
 
@@ -61,11 +79,78 @@ int do_migrate_cancel(Monitor *mon, const QDict *qdict, QObject **ret_data);
 
 int do_migrate_set_speed(Monitor *mon, const QDict *qdict, QObject **ret_data);
 
+uint64_t migrate_max_bandwidth(void);
+
 uint64_t migrate_max_downtime(void);
 
 int do_migrate_set_downtime(Monitor *mon, const QDict *qdict,
                             QObject **ret_data);
 
+/* Optional migration features, see migrate_set_capability */
+enum {
+    MIGRATION_CAP_BLOCK_COMPRESS,
+    MIGRATION_CAP_XBZRLE,
+    MIGRATION_CAP_COMPRESS,
+    MIGRATION_CAP_AUTO_CONVERGE,
+    MIGRATION_CAP_POSTCOPY,
+    MIGRATION_CAP_MULTIFD,
+    MIGRATION_CAP_MAX,
+};
+
+int migrate_use_block_compress(void);
+
+int migrate_use_xbzrle(void);
+
+int migrate_use_compression(void);
+
+int migrate_auto_converge(void);
+
+int migrate_use_postcopy(void);
+
+int migrate_postcopy_switching(void);
+
+int migrate_use_multifd(void);
+
+/* Tunables of the optional features, see migrate_set_parameter */
+enum {
+    MIGRATION_PARAM_COMPRESS_LEVEL,
+    MIGRATION_PARAM_COMPRESS_THREADS,
+    MIGRATION_PARAM_DECOMPRESS_THREADS,
+    MIGRATION_PARAM_CPU_THROTTLE_INITIAL,
+    MIGRATION_PARAM_CPU_THROTTLE_INCREMENT,
+    MIGRATION_PARAM_MULTIFD_CHANNELS,
+    MIGRATION_PARAM_MAX,
+};
+
+int migrate_compress_level(void);
+
+int migrate_compress_threads(void);
+
+int migrate_decompress_threads(void);
+
+int migrate_cpu_throttle_initial(void);
+
+int migrate_cpu_throttle_increment(void);
+
+int migrate_multifd_channels(void);
+
+int do_migrate_set_parameter(Monitor *mon, const QDict *qdict,
+                             QObject **ret_data);
+
+void do_info_migrate_parameters_print(Monitor *mon, const QObject *data);
+
+void do_info_migrate_parameters(Monitor *mon, QObject **ret_data);
+
+int do_migrate_set_cache_size(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data);
+
+int do_migrate_set_capability(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data);
+
+void do_info_migrate_capabilities_print(Monitor *mon, const QObject *data);
+
+void do_info_migrate_capabilities(Monitor *mon, QObject **ret_data);
+
 void do_info_migrate_print(Monitor *mon, const QObject *data);
 
 void do_info_migrate(Monitor *mon, QObject **ret_data);
@@ -106,6 +191,19 @@ MigrationState *fd_start_outgoing_migration(Monitor *mon,
 					    int blk,
 					    int inc);
 
+int file_start_incoming_migration(const char *path);
+
+MigrationState *file_start_outgoing_migration(Monitor *mon,
+                                              const char *path,
+                                              int64_t bandwidth_limit,
+                                              int detach,
+                                              int blk,
+                                              int inc);
+
+void migrate_lock_iothread(void);
+
+void migrate_unlock_iothread(void);
+
 void migrate_fd_monitor_suspend(FdMigrationState *s, Monitor *mon);
 
 void migrate_fd_error(FdMigrationState *s);
@@ -118,7 +216,7 @@ ssize_t migrate_fd_put_buffer(void *opaque, const void *data, size_t size);
 
 void migrate_fd_connect(FdMigrationState *s);
 
-void migrate_fd_put_ready(void *opaque);
+int migrate_fd_put_ready(void *opaque);
 
 int migrate_fd_get_status(MigrationState *mig_state);
 
@@ -126,7 +224,7 @@ void migrate_fd_cancel(MigrationState *mig_state);
 
 void migrate_fd_release(MigrationState *mig_state);
 
-void migrate_fd_wait_for_unfreeze(void *opaque);
+int migrate_fd_wait_for_unfreeze(void *opaque);
 
 int migrate_fd_close(void *opaque);
 
@@ -142,9 +240,34 @@ int get_migration_state(void);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
+uint64_t ram_zero_copy_pages(void);
+uint64_t ram_dirty_sync_count(void);
+int64_t ram_dirty_sync_last_time(void);
+int64_t ram_dirty_sync_max_time(void);
+uint64_t ram_dirty_sync_rate(void);
+
+int64_t xbzrle_cache_resize(int64_t new_size);
+int64_t xbzrle_get_cache_size(void);
+uint64_t xbzrle_mig_bytes_transferred(void);
+uint64_t xbzrle_mig_pages_transferred(void);
+uint64_t xbzrle_mig_pages_cache_miss(void);
+uint64_t xbzrle_mig_pages_overflow(void);
+
+uint64_t compress_mig_pages_transferred(void);
+uint64_t compress_mig_bytes_transferred(void);
 
 int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque);
 int ram_load(QEMUFile *f, void *opaque, int version_id);
+void ram_load_cleanup(void);
+void ram_load_reset_stats(void);
+uint64_t ram_load_pages(void);
+uint64_t ram_load_bytes(void);
+uint64_t ram_load_zero_pages(void);
+uint64_t ram_load_zero_pages_skipped(void);
+
+int ram_postcopy_request(QEMUFile *f, uint32_t block_idx, uint32_t page);
+int ram_postcopy_iterate(QEMUFile *f);
+int ram_load_postcopy(QEMUFile *f);
 
 extern int incoming_expected;
 
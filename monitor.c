@@ -61,6 +61,10 @@
 #include "trace.h"
 #endif
 #include "ui/qemu-spice.h"
+#ifdef CONFIG_POSIX
+#include "block_int.h"
+#include "block/raw-posix-aio.h"
+#endif
 
 //#define DEBUG
 //#define DEBUG_COMPLETION
@@ -468,6 +472,12 @@ void monitor_protocol_event(MonitorEvent event, QObject *data)
         case QEVENT_SPICE_DISCONNECTED:
             event_name = "SPICE_DISCONNECTED";
             break;
+        case QEVENT_BLOCK_JOB_COMPLETED:
+            event_name = "BLOCK_JOB_COMPLETED";
+            break;
+        case QEVENT_BLOCK_JOB_CANCELLED:
+            event_name = "BLOCK_JOB_CANCELLED";
+            break;
         default:
             abort();
             break;
@@ -2811,6 +2821,16 @@ int monitor_get_fd(Monitor *mon, const char *fdname)
     return -1;
 }
 
+#if defined(CONFIG_POSIX)
+static void do_info_aio(Monitor *mon)
+{
+    paio_info(mon);
+#ifdef CONFIG_LINUX_AIO
+    laio_info(mon);
+#endif
+}
+#endif
+
 static const mon_cmd_t mon_cmds[] = {
 #include "hmp-commands.h"
     { NULL, NULL, },
@@ -2857,6 +2877,23 @@ static const mon_cmd_t info_cmds[] = {
         .user_print = bdrv_stats_print,
         .mhandler.info_new = bdrv_info_stats,
     },
+    {
+        .name       = "block-jobs",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show progress of ongoing block device operations",
+        .user_print = do_info_block_jobs_print,
+        .mhandler.info_new = do_info_block_jobs,
+    },
+#if defined(CONFIG_POSIX)
+    {
+        .name       = "aio",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show host AIO statistics",
+        .mhandler.info = do_info_aio,
+    },
+#endif
     {
         .name       = "registers",
         .args_type  = "",
@@ -3059,6 +3096,22 @@ static const mon_cmd_t info_cmds[] = {
         .user_print = do_info_migrate_print,
         .mhandler.info_new = do_info_migrate,
     },
+    {
+        .name       = "migrate_capabilities",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration capabilities",
+        .user_print = do_info_migrate_capabilities_print,
+        .mhandler.info_new = do_info_migrate_capabilities,
+    },
+    {
+        .name       = "migrate_parameters",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration parameters",
+        .user_print = do_info_migrate_parameters_print,
+        .mhandler.info_new = do_info_migrate_parameters,
+    },
     {
         .name       = "balloon",
         .args_type  = "",
@@ -3156,6 +3209,14 @@ static const mon_cmd_t qmp_query_cmds[] = {
         .user_print = bdrv_stats_print,
         .mhandler.info_new = bdrv_info_stats,
     },
+    {
+        .name       = "block-jobs",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show progress of ongoing block device operations",
+        .user_print = do_info_block_jobs_print,
+        .mhandler.info_new = do_info_block_jobs,
+    },
     {
         .name       = "cpus",
         .args_type  = "",
@@ -3238,6 +3299,22 @@ static const mon_cmd_t qmp_query_cmds[] = {
         .user_print = do_info_migrate_print,
         .mhandler.info_new = do_info_migrate,
     },
+    {
+        .name       = "migrate_capabilities",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration capabilities",
+        .user_print = do_info_migrate_capabilities_print,
+        .mhandler.info_new = do_info_migrate_capabilities,
+    },
+    {
+        .name       = "migrate_parameters",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show current migration parameters",
+        .user_print = do_info_migrate_parameters_print,
+        .mhandler.info_new = do_info_migrate_parameters,
+    },
     {
         .name       = "balloon",
         .args_type  = "",
@@ -0,0 +1,676 @@
+/*
+ * Migration of RAM over several connections
+ *
+ * One TCP connection, and the one thread that fills it, only go so fast.
+ * With the multifd capability, RAM pages are sent over additional
+ * connections instead, the channels, each with a thread of its own that
+ * writes the pages straight from guest memory.  Device state and everything
+ * else stays on the migration stream, and so do the pages that come while
+ * all channels are busy.
+ *
+ * Pages go out in packets that tell the block and the offset of each page,
+ * so that the destination puts them in place as they arrive, whichever
+ * channel they came over.  A page is sent at most once per section of the
+ * stream, and at the end of each section every channel gets a sync packet.
+ * The stream tells the destination so, and it waits for all channels to
+ * reach it before it goes on with the next section, so that an older copy
+ * of a page, on the stream or on another channel, can't overwrite a newer
+ * one.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu_socket.h"
+#include "qemu-thread.h"
+#include "multifd-ram.h"
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+#ifndef SHUT_RDWR
+#define SHUT_RDWR 2
+#endif
+
+//#define DEBUG_MULTIFD
+
+#ifdef DEBUG_MULTIFD
+#define DPRINTF(fmt, ...) \
+    do { printf("multifd: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+/* Sent by the source first on each channel, with the index of the channel */
+#define MULTIFD_MAGIC           0x4d464452  /* "MFDR" */
+
+#define MULTIFD_PACKET_PAGES    64
+
+/* The last packet of the channel in this section */
+#define MULTIFD_FLAG_SYNC       0x1
+
+/* All fields are big endian, the pages follow the packet */
+typedef struct MultiFDPage {
+    uint32_t block;     /* in the order of RAM_SAVE_FLAG_MEM_SIZE */
+    uint32_t reserved;
+    uint64_t offset;
+} MultiFDPage;
+
+typedef struct MultiFDPacket {
+    uint32_t flags;
+    uint32_t nr_pages;
+    MultiFDPage pages[MULTIFD_PACKET_PAGES];
+} MultiFDPacket;
+
+#define MULTIFD_PACKET_HEADER_SIZE offsetof(MultiFDPacket, pages)
+
+/*
+ * Transfers all of iov, which is used up on the way.  Returns 1 once done,
+ * 0 if the peer closed the connection before anything was read, or -1.
+ */
+static int multifd_iov_full(int fd, struct iovec *iov, int iovcnt,
+                            int is_write)
+{
+    int started = 0;
+    ssize_t len;
+    size_t n;
+
+    for (;;) {
+        while (iovcnt > 0 && iov->iov_len == 0) {
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt == 0) {
+            return 1;
+        }
+
+#ifndef _WIN32
+        len = is_write ? writev(fd, iov, iovcnt) : readv(fd, iov, iovcnt);
+#else
+        len = is_write ? send(fd, (char *)iov->iov_base, iov->iov_len, 0) :
+                         recv(fd, (char *)iov->iov_base, iov->iov_len, 0);
+#endif
+        if (len < 0) {
+            if (socket_error() == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (len == 0 && !is_write) {
+            return started ? -1 : 0;
+        }
+        started = 1;
+
+        while (len > 0) {
+            n = MIN((size_t)len, iov->iov_len);
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+            len -= n;
+            if (iov->iov_len == 0) {
+                iov++;
+                iovcnt--;
+            }
+        }
+    }
+}
+
+/***********************************************************/
+/* source */
+
+/* A packet and the pages that go with it */
+typedef struct MultiFDBatch {
+    MultiFDPacket packet;
+    struct iovec iov[MULTIFD_PACKET_PAGES + 1];
+    int nr_pages;
+} MultiFDBatch;
+
+typedef struct MultiFDSendParams {
+    QemuThread thread;
+    QemuCond cond;
+    int id;
+    int fd;
+
+    /* Protected by multifd_send.mutex */
+    int busy;           /* batch was handed over and not written yet */
+    int syncs;          /* sync packets that are due on this channel */
+    MultiFDBatch *batch;
+} MultiFDSendParams;
+
+/*
+ * The migration thread fills batch, which is swapped with the empty batch
+ * of an idle channel once it is full.  Nothing waits for the channels, the
+ * channel threads hand over what is due themselves once they are done.
+ */
+static struct {
+    MultiFDSendParams *params;
+    int nr_channels;
+    int next;
+    QemuMutex mutex;
+    MultiFDBatch *batch;
+    int syncs;          /* sum of the syncs of the channels */
+    int quit;
+    int error;
+    uint64_t pages;
+} multifd_send;
+
+uint64_t multifd_mig_pages_transferred(void)
+{
+    return multifd_send.pages;
+}
+
+uint64_t multifd_mig_bytes_transferred(void)
+{
+    return multifd_send.pages * TARGET_PAGE_SIZE;
+}
+
+/* Called with the mutex held, c must be idle */
+static void multifd_send_handover(MultiFDSendParams *c, uint32_t flags)
+{
+    MultiFDBatch *batch = c->batch;
+
+    c->batch = multifd_send.batch;
+    c->batch->packet.flags = cpu_to_be32(flags);
+    c->busy = 1;
+    qemu_cond_signal(&c->cond);
+
+    multifd_send.batch = batch;
+    multifd_send.next = (c->id + 1) % multifd_send.nr_channels;
+}
+
+/*
+ * Hands over what can go out to the idle channels, with the mutex held.
+ * The pages of a section have to be on their way before any of its sync
+ * packets.
+ */
+static void multifd_send_progress(void)
+{
+    MultiFDSendParams *c;
+    int i, n;
+
+    n = multifd_send.batch->nr_pages;
+    if (n == MULTIFD_PACKET_PAGES || (n > 0 && multifd_send.syncs > 0)) {
+        for (i = 0; i < multifd_send.nr_channels; i++) {
+            c = &multifd_send.params[(multifd_send.next + i) %
+                                     multifd_send.nr_channels];
+            if (!c->busy) {
+                multifd_send_handover(c, 0);
+                break;
+            }
+        }
+        if (multifd_send.batch->nr_pages > 0) {
+            return;
+        }
+    }
+
+    for (i = 0; i < multifd_send.nr_channels && multifd_send.syncs; i++) {
+        c = &multifd_send.params[i];
+        if (!c->busy && c->syncs > 0) {
+            multifd_send_handover(c, MULTIFD_FLAG_SYNC);
+            c->syncs--;
+            multifd_send.syncs--;
+        }
+    }
+}
+
+static int multifd_send_batch(int fd, MultiFDBatch *batch)
+{
+    batch->packet.nr_pages = cpu_to_be32(batch->nr_pages);
+    batch->iov[0].iov_base = &batch->packet;
+    batch->iov[0].iov_len = MULTIFD_PACKET_HEADER_SIZE +
+                            batch->nr_pages * sizeof(MultiFDPage);
+
+    return multifd_iov_full(fd, batch->iov, batch->nr_pages + 1, 1);
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    uint32_t hello[2];
+    struct iovec iov;
+    int ret;
+
+    hello[0] = cpu_to_be32(MULTIFD_MAGIC);
+    hello[1] = cpu_to_be32(p->id);
+    iov.iov_base = hello;
+    iov.iov_len = sizeof(hello);
+    ret = multifd_iov_full(p->fd, &iov, 1, 1);
+
+    qemu_mutex_lock(&multifd_send.mutex);
+    while (ret > 0) {
+        /* What is due on the channel is written before quitting */
+        while (!p->busy && !(multifd_send.quit &&
+                             (p->syncs == 0 || multifd_send.error))) {
+            qemu_cond_wait(&p->cond, &multifd_send.mutex);
+        }
+        if (!p->busy) {
+            break;
+        }
+        qemu_mutex_unlock(&multifd_send.mutex);
+
+        ret = multifd_send_batch(p->fd, p->batch);
+
+        qemu_mutex_lock(&multifd_send.mutex);
+        p->batch->nr_pages = 0;
+        p->busy = 0;
+        multifd_send_progress();
+    }
+    if (ret < 0) {
+        DPRINTF("channel %d failed\n", p->id);
+        multifd_send.error = 1;
+    }
+    qemu_mutex_unlock(&multifd_send.mutex);
+
+    return NULL;
+}
+
+void multifd_send_init(const int *fds, int nr_channels)
+{
+    int i;
+
+    DPRINTF("sending over %d channels\n", nr_channels);
+
+    multifd_send.nr_channels = nr_channels;
+    multifd_send.next = 0;
+    multifd_send.syncs = 0;
+    multifd_send.quit = 0;
+    multifd_send.error = 0;
+    multifd_send.pages = 0;
+    multifd_send.batch = qemu_mallocz(sizeof(MultiFDBatch));
+    multifd_send.params = qemu_mallocz(nr_channels *
+                                       sizeof(*multifd_send.params));
+    qemu_mutex_init(&multifd_send.mutex);
+
+    for (i = 0; i < nr_channels; i++) {
+        MultiFDSendParams *p = &multifd_send.params[i];
+
+        p->id = i;
+        p->fd = fds[i];
+        p->batch = qemu_mallocz(sizeof(MultiFDBatch));
+        qemu_cond_init(&p->cond);
+        qemu_thread_create(&p->thread, multifd_send_thread, p);
+    }
+}
+
+int multifd_send_active(void)
+{
+    return multifd_send.params != NULL;
+}
+
+int multifd_send_channels(void)
+{
+    return multifd_send.nr_channels;
+}
+
+int multifd_send_page(uint32_t block, uint64_t offset, uint8_t *host)
+{
+    MultiFDBatch *batch;
+    MultiFDPage *page;
+    int ret = 0;
+
+    qemu_mutex_lock(&multifd_send.mutex);
+    batch = multifd_send.batch;
+    if (multifd_send.error) {
+        ret = -1;
+    } else if (batch->nr_pages < MULTIFD_PACKET_PAGES &&
+               multifd_send.syncs == 0) {
+        page = &batch->packet.pages[batch->nr_pages];
+        page->block = cpu_to_be32(block);
+        page->reserved = 0;
+        page->offset = cpu_to_be64(offset);
+        batch->nr_pages++;
+        batch->iov[batch->nr_pages].iov_base = host;
+        batch->iov[batch->nr_pages].iov_len = TARGET_PAGE_SIZE;
+        multifd_send.pages++;
+        if (batch->nr_pages == MULTIFD_PACKET_PAGES) {
+            multifd_send_progress();
+        }
+        ret = 1;
+    }
+    qemu_mutex_unlock(&multifd_send.mutex);
+
+    return ret;
+}
+
+int multifd_send_sync(void)
+{
+    int i, ret;
+
+    qemu_mutex_lock(&multifd_send.mutex);
+    for (i = 0; i < multifd_send.nr_channels; i++) {
+        multifd_send.params[i].syncs++;
+    }
+    multifd_send.syncs += multifd_send.nr_channels;
+    multifd_send_progress();
+    ret = multifd_send.error ? -1 : 0;
+    qemu_mutex_unlock(&multifd_send.mutex);
+
+    return ret;
+}
+
+void multifd_send_shutdown(void)
+{
+    int i;
+
+    for (i = 0; multifd_send.params && i < multifd_send.nr_channels; i++) {
+        shutdown(multifd_send.params[i].fd, SHUT_RDWR);
+    }
+}
+
+int multifd_send_cleanup(void)
+{
+    int i, ret;
+
+    if (!multifd_send.params) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&multifd_send.mutex);
+    multifd_send.quit = 1;
+    for (i = 0; i < multifd_send.nr_channels; i++) {
+        qemu_cond_signal(&multifd_send.params[i].cond);
+    }
+    qemu_mutex_unlock(&multifd_send.mutex);
+
+    for (i = 0; i < multifd_send.nr_channels; i++) {
+        MultiFDSendParams *p = &multifd_send.params[i];
+
+        qemu_thread_join(&p->thread);
+        closesocket(p->fd);
+        qemu_cond_destroy(&p->cond);
+        qemu_free(p->batch);
+    }
+    ret = multifd_send.error ? -1 : 0;
+
+    qemu_mutex_destroy(&multifd_send.mutex);
+    qemu_free(multifd_send.batch);
+    multifd_send.batch = NULL;
+    qemu_free(multifd_send.params);
+    multifd_send.params = NULL;
+
+    return ret;
+}
+
+/***********************************************************/
+/* destination */
+
+typedef struct MultiFDRecvParams {
+    QemuThread thread;
+    int id;
+    int fd;
+    MultiFDPacket packet;
+    struct iovec iov[MULTIFD_PACKET_PAGES];
+} MultiFDRecvParams;
+
+static struct {
+    int listen_fd;
+    MultiFDRecvParams *params;
+    int nr_channels;
+    RAMBlock **blocks;
+    int nr_blocks;
+    QemuMutex mutex;
+    QemuCond cond;
+
+    /* Protected by mutex */
+    int synced;         /* channels that reached the end of the section */
+    uint64_t section;   /* bumped when they may go on with the next one */
+    uint64_t pages;
+    int quit;
+    int error;
+} multifd_recv = {
+    .listen_fd = -1,
+};
+
+/* The channels are accepted on fd while the migration stream is loaded */
+void multifd_recv_set_listener(int fd)
+{
+    multifd_recv.listen_fd = fd;
+}
+
+/* Reads a packet and its pages, returns 0 if the channel was closed */
+static int multifd_recv_packet(MultiFDRecvParams *p, uint32_t *flags,
+                               uint32_t *nr_pages)
+{
+    MultiFDPacket *packet = &p->packet;
+    struct iovec iov;
+    uint32_t block;
+    uint64_t offset;
+    int i, ret;
+
+    iov.iov_base = packet;
+    iov.iov_len = MULTIFD_PACKET_HEADER_SIZE;
+    ret = multifd_iov_full(p->fd, &iov, 1, 0);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    *flags = be32_to_cpu(packet->flags);
+    *nr_pages = be32_to_cpu(packet->nr_pages);
+    if (*nr_pages > MULTIFD_PACKET_PAGES) {
+        fprintf(stderr, "Invalid multifd packet of %u pages\n", *nr_pages);
+        return -1;
+    }
+
+    iov.iov_base = packet->pages;
+    iov.iov_len = *nr_pages * sizeof(MultiFDPage);
+    if (multifd_iov_full(p->fd, &iov, 1, 0) <= 0) {
+        return -1;
+    }
+
+    for (i = 0; i < *nr_pages; i++) {
+        block = be32_to_cpu(packet->pages[i].block);
+        offset = be64_to_cpu(packet->pages[i].offset);
+        if (block >= multifd_recv.nr_blocks ||
+            offset >= multifd_recv.blocks[block]->length ||
+            (offset & ~TARGET_PAGE_MASK)) {
+            fprintf(stderr, "Invalid multifd page %u:%" PRIx64 "\n",
+                    block, offset);
+            return -1;
+        }
+        p->iov[i].iov_base = multifd_recv.blocks[block]->host + offset;
+        p->iov[i].iov_len = TARGET_PAGE_SIZE;
+    }
+
+    /* The pages are read straight into guest memory */
+    if (multifd_iov_full(p->fd, p->iov, *nr_pages, 0) < 0) {
+        return -1;
+    }
+    return 1;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    uint32_t flags, nr_pages;
+    uint64_t section;
+    int ret;
+
+    for (;;) {
+        ret = multifd_recv_packet(p, &flags, &nr_pages);
+        if (ret <= 0) {
+            break;
+        }
+
+        qemu_mutex_lock(&multifd_recv.mutex);
+        multifd_recv.pages += nr_pages;
+        if (flags & MULTIFD_FLAG_SYNC) {
+            section = multifd_recv.section;
+            multifd_recv.synced++;
+            qemu_cond_broadcast(&multifd_recv.cond);
+            while (multifd_recv.section == section && !multifd_recv.quit) {
+                qemu_cond_wait(&multifd_recv.cond, &multifd_recv.mutex);
+            }
+        }
+        qemu_mutex_unlock(&multifd_recv.mutex);
+    }
+
+    /* The source closes the channels once all of RAM was sent */
+    qemu_mutex_lock(&multifd_recv.mutex);
+    if (ret < 0 && !multifd_recv.quit) {
+        fprintf(stderr, "multifd channel %d failed\n", p->id);
+    }
+    multifd_recv.error = 1;
+    qemu_cond_broadcast(&multifd_recv.cond);
+    qemu_mutex_unlock(&multifd_recv.mutex);
+
+    return NULL;
+}
+
+/* Accepts a channel and returns its socket, or -1 */
+static int multifd_recv_accept(int *id)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    uint32_t hello[2];
+    struct iovec iov;
+    int fd;
+
+    do {
+        fd = qemu_accept(multifd_recv.listen_fd, (struct sockaddr *)&addr,
+                         &addrlen);
+    } while (fd == -1 && socket_error() == EINTR);
+
+    if (fd == -1) {
+        fprintf(stderr, "could not accept multifd channel\n");
+        return -1;
+    }
+
+    iov.iov_base = hello;
+    iov.iov_len = sizeof(hello);
+    if (multifd_iov_full(fd, &iov, 1, 0) <= 0 ||
+        be32_to_cpu(hello[0]) != MULTIFD_MAGIC) {
+        fprintf(stderr, "invalid multifd channel\n");
+        closesocket(fd);
+        return -1;
+    }
+
+    *id = be32_to_cpu(hello[1]);
+    return fd;
+}
+
+int multifd_recv_init(RAMBlock **blocks, int nr_blocks, int nr_channels)
+{
+    int i, fd, id;
+
+    if (multifd_recv.listen_fd == -1 || multifd_recv.params) {
+        fprintf(stderr, "multifd channels can't be accepted\n");
+        return -1;
+    }
+
+    if (nr_channels < 1 || nr_channels > MULTIFD_MAX_CHANNELS) {
+        fprintf(stderr, "Invalid number of multifd channels %d\n",
+                nr_channels);
+        return -1;
+    }
+
+    DPRINTF("receiving over %d channels\n", nr_channels);
+
+    multifd_recv.params = qemu_mallocz(nr_channels *
+                                       sizeof(*multifd_recv.params));
+    for (i = 0; i < nr_channels; i++) {
+        multifd_recv.params[i].fd = -1;
+    }
+
+    for (i = 0; i < nr_channels; i++) {
+        fd = multifd_recv_accept(&id);
+        if (fd == -1) {
+            goto err;
+        }
+        if (id >= nr_channels || multifd_recv.params[id].fd != -1) {
+            fprintf(stderr, "Invalid multifd channel %d\n", id);
+            closesocket(fd);
+            goto err;
+        }
+        multifd_recv.params[id].id = id;
+        multifd_recv.params[id].fd = fd;
+    }
+
+    multifd_recv.nr_channels = nr_channels;
+    multifd_recv.blocks = blocks;
+    multifd_recv.nr_blocks = nr_blocks;
+    multifd_recv.synced = 0;
+    multifd_recv.section = 0;
+    multifd_recv.pages = 0;
+    multifd_recv.quit = 0;
+    multifd_recv.error = 0;
+    qemu_mutex_init(&multifd_recv.mutex);
+    qemu_cond_init(&multifd_recv.cond);
+
+    for (i = 0; i < nr_channels; i++) {
+        qemu_thread_create(&multifd_recv.params[i].thread,
+                           multifd_recv_thread, &multifd_recv.params[i]);
+    }
+    return 0;
+
+err:
+    for (i = 0; i < nr_channels; i++) {
+        if (multifd_recv.params[i].fd != -1) {
+            closesocket(multifd_recv.params[i].fd);
+        }
+    }
+    qemu_free(multifd_recv.params);
+    multifd_recv.params = NULL;
+    return -1;
+}
+
+int multifd_recv_active(void)
+{
+    return multifd_recv.params != NULL;
+}
+
+/*
+ * Lets the channels go on with the next section once all of them are done
+ * with this one.  pages is set to the number of pages they received.
+ */
+int multifd_recv_sync(uint64_t *pages)
+{
+    int ret = 0;
+
+    qemu_mutex_lock(&multifd_recv.mutex);
+    while (multifd_recv.synced < multifd_recv.nr_channels &&
+           !multifd_recv.error) {
+        qemu_cond_wait(&multifd_recv.cond, &multifd_recv.mutex);
+    }
+    if (multifd_recv.synced < multifd_recv.nr_channels) {
+        ret = -1;
+    } else {
+        multifd_recv.synced = 0;
+        multifd_recv.section++;
+        qemu_cond_broadcast(&multifd_recv.cond);
+    }
+    *pages = multifd_recv.pages;
+    multifd_recv.pages = 0;
+    qemu_mutex_unlock(&multifd_recv.mutex);
+
+    return ret;
+}
+
+void multifd_recv_cleanup(void)
+{
+    int i;
+
+    if (!multifd_recv.params) {
+        return;
+    }
+
+    qemu_mutex_lock(&multifd_recv.mutex);
+    multifd_recv.quit = 1;
+    qemu_cond_broadcast(&multifd_recv.cond);
+    qemu_mutex_unlock(&multifd_recv.mutex);
+
+    for (i = 0; i < multifd_recv.nr_channels; i++) {
+        MultiFDRecvParams *p = &multifd_recv.params[i];
+
+        shutdown(p->fd, SHUT_RDWR);
+        qemu_thread_join(&p->thread);
+        closesocket(p->fd);
+    }
+
+    qemu_cond_destroy(&multifd_recv.cond);
+    qemu_mutex_destroy(&multifd_recv.mutex);
+    qemu_free(multifd_recv.params);
+    multifd_recv.params = NULL;
+}
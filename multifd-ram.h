@@ -0,0 +1,65 @@
+/*
+ * Migration of RAM over several connections
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef MULTIFD_RAM_H
+#define MULTIFD_RAM_H
+
+#include "hw/hw.h"
+
+struct RAMBlock;
+
+#define MULTIFD_MAX_CHANNELS 16
+
+/*
+ * Source side.  The channels are connected sockets, which are taken over,
+ * each one with a thread that writes the pages queued to it.  Pages are
+ * identified by their block in the order of RAM_SAVE_FLAG_MEM_SIZE and by
+ * their offset in it, and must stay mapped until multifd_send_cleanup().
+ */
+void multifd_send_init(const int *fds, int nr_channels);
+int multifd_send_active(void);
+int multifd_send_channels(void);
+
+/*
+ * Returns 1 if the page was queued, or 0 if the channels can't take it
+ * without waiting for them, it has to go on the migration stream then.
+ */
+int multifd_send_page(uint32_t block, uint64_t offset, uint8_t *host);
+
+/*
+ * Ends a section of the stream, the destination has to wait for the sync
+ * packets on all channels.  Every section needs one, even if it didn't use
+ * the channels: a page that went on the migration stream could otherwise be
+ * overtaken by a newer copy on a channel in the next section.
+ */
+int multifd_send_sync(void);
+
+/* Makes the threads give up on what they are writing, they may be stuck */
+void multifd_send_shutdown(void);
+
+/* Waits until everything that was queued was written, unless shut down */
+int multifd_send_cleanup(void);
+
+uint64_t multifd_mig_pages_transferred(void);
+uint64_t multifd_mig_bytes_transferred(void);
+
+/*
+ * Destination side.  The channels are accepted on the listening socket of
+ * the migration, and the pages are put in place by their threads.
+ */
+void multifd_recv_set_listener(int fd);
+int multifd_recv_init(struct RAMBlock **blocks, int nr_blocks,
+                      int nr_channels);
+int multifd_recv_active(void);
+
+/* Waits until all channels reached the end of the section */
+int multifd_recv_sync(uint64_t *pages);
+
+void multifd_recv_cleanup(void);
+
+#endif
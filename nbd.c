@@ -30,6 +30,7 @@
 #include <inttypes.h>
 
 #include "qemu_socket.h"
+#include "qemu-timer.h"
 
 //#define DEBUG_NBD
 
@@ -49,7 +50,6 @@
 
 /* This is all part of the "official" NBD API */
 
-#define NBD_REPLY_SIZE          (4 + 4 + 8)
 #define NBD_REQUEST_MAGIC       0x25609513
 #define NBD_REPLY_MAGIC         0x67446698
 
@@ -171,7 +171,7 @@ int unix_socket_outgoing(const char *path)
                   Request (type == 2)
 */
 
-int nbd_negotiate(int csock, off_t size)
+int nbd_negotiate(int csock, off_t size, uint32_t flags)
 {
     char buf[8 + 8 + 8 + 128];
 
@@ -179,14 +179,16 @@ int nbd_negotiate(int csock, off_t size)
         [ 0 ..   7]   passwd   ("NBDMAGIC")
         [ 8 ..  15]   magic    (0x00420281861253)
         [16 ..  23]   size
-        [24 .. 151]   reserved (0)
+        [24 ..  27]   flags
+        [28 .. 151]   reserved (0)
      */
 
     TRACE("Beginning negotiation.");
     memcpy(buf, "NBDMAGIC", 8);
     cpu_to_be64w((uint64_t*)(buf + 8), 0x00420281861253LL);
     cpu_to_be64w((uint64_t*)(buf + 16), size);
-    memset(buf + 24, 0, 128);
+    cpu_to_be32w((uint32_t*)(buf + 24), flags);
+    memset(buf + 28, 0, 124);
 
     if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
         LOG("write failed");
@@ -429,10 +431,8 @@ int nbd_client(int fd)
 }
 #endif
 
-int nbd_send_request(int csock, struct nbd_request *request)
+void nbd_encode_request(uint8_t *buf, const struct nbd_request *request)
 {
-    uint8_t buf[4 + 4 + 8 + 8 + 4];
-
     cpu_to_be32w((uint32_t*)buf, NBD_REQUEST_MAGIC);
     cpu_to_be32w((uint32_t*)(buf + 4), request->type);
     cpu_to_be64w((uint64_t*)(buf + 8), request->handle);
@@ -442,6 +442,13 @@ int nbd_send_request(int csock, struct nbd_request *request)
     TRACE("Sending request to client: "
           "{ .from = %" PRIu64", .len = %u, .handle = %" PRIu64", .type=%i}",
           request->from, request->len, request->handle, request->type);
+}
+
+int nbd_send_request(int csock, struct nbd_request *request)
+{
+    uint8_t buf[NBD_REQUEST_SIZE];
+
+    nbd_encode_request(buf, request);
 
     if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
         LOG("writing to socket failed");
@@ -451,17 +458,10 @@ int nbd_send_request(int csock, struct nbd_request *request)
     return 0;
 }
 
-static int nbd_receive_request(int csock, struct nbd_request *request)
+static int nbd_decode_request(const uint8_t *buf, struct nbd_request *request)
 {
-    uint8_t buf[4 + 4 + 8 + 8 + 4];
     uint32_t magic;
 
-    if (read_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
-        LOG("read failed");
-        errno = EINVAL;
-        return -1;
-    }
-
     /* Request
        [ 0 ..  3]   magic   (NBD_REQUEST_MAGIC)
        [ 4 ..  7]   type    (0 == READ, 1 == WRITE)
@@ -488,19 +488,10 @@ static int nbd_receive_request(int csock, struct nbd_request *request)
     return 0;
 }
 
-int nbd_receive_reply(int csock, struct nbd_reply *reply)
+int nbd_decode_reply(const uint8_t *buf, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
     uint32_t magic;
 
-    memset(buf, 0xAA, sizeof(buf));
-
-    if (read_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
-        LOG("read failed");
-        errno = EINVAL;
-        return -1;
-    }
-
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
@@ -523,144 +514,449 @@ int nbd_receive_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
-static int nbd_send_reply(int csock, struct nbd_reply *reply)
+int nbd_receive_reply(int csock, struct nbd_reply *reply)
+{
+    uint8_t buf[NBD_REPLY_SIZE];
+
+    memset(buf, 0xAA, sizeof(buf));
+
+    if (read_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
+        LOG("read failed");
+        errno = EINVAL;
+        return -1;
+    }
+
+    return nbd_decode_reply(buf, reply);
+}
+
+
+/* Asynchronous server
+ *
+ * Each client socket is non-blocking and driven by fd handlers.  Requests
+ * are read ahead and submitted to the block layer with bdrv_aio_readv/writev
+ * as soon as they are complete, so that a client can keep several of them in
+ * flight.  Replies are queued in completion order and carry the request
+ * handle, so they may go out of order.
+ */
+
+/* Requests in flight per client before we stop reading from its socket */
+#define NBD_MAX_REQUESTS        16
+
+typedef struct NBDRequest NBDRequest;
+
+struct NBDRequest {
+    NBDClient *client;
+    struct nbd_request request;
+    uint8_t *buf;
+    uint8_t *data;              /* payload, the reply header precedes it */
+    size_t send_len;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int64_t start_time_ns;
+    QSIMPLEQ_ENTRY(NBDRequest) entry;
+};
+
+struct NBDExport {
+    BlockDriverState *bs;
+    off_t dev_offset;
+    off_t size;
+    bool readonly;
+};
+
+struct NBDClient {
+    NBDExport *exp;
+    int sock;
+    void (*close)(NBDClient *client);
+    void *opaque;
+
+    bool closing;               /* no more requests, flush replies and close */
+    bool dead;                  /* socket error, drop replies and close */
+    int nb_requests;            /* in flight or waiting for their reply */
+
+    uint8_t recv_hdr[NBD_REQUEST_SIZE];
+    size_t recv_pos;
+    NBDRequest *recv_req;       /* write whose payload is being received */
+
+    QSIMPLEQ_HEAD(, NBDRequest) replies;
+    size_t send_pos;
+
+    NBDClientStats stats;
+};
+
+static void nbd_client_update_handlers(NBDClient *client);
+
+NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset, off_t size,
+                          bool readonly)
+{
+    NBDExport *exp = qemu_mallocz(sizeof(NBDExport));
+
+    exp->bs = bs;
+    exp->dev_offset = dev_offset;
+    exp->size = size;
+    exp->readonly = readonly;
+    return exp;
+}
+
+/* Waits for the requests in flight, the clients must be gone already */
+void nbd_export_close(NBDExport *exp)
+{
+    qemu_aio_flush();
+    qemu_free(exp);
+}
+
+static NBDRequest *nbd_request_get(NBDClient *client,
+                                   const struct nbd_request *request)
+{
+    NBDRequest *req = qemu_mallocz(sizeof(NBDRequest));
+
+    req->client = client;
+    req->request = *request;
+
+    /* Keep the payload sector-aligned and put the reply header right in
+     * front of it, so that a read reply goes out with a single send().
+     */
+    req->buf = qemu_blockalign(client->exp->bs,
+                               BDRV_SECTOR_SIZE + request->len);
+    req->data = req->buf + BDRV_SECTOR_SIZE;
+
+    client->nb_requests++;
+    return req;
+}
+
+static void nbd_request_put(NBDRequest *req)
 {
-    uint8_t buf[4 + 4 + 8];
+    NBDClient *client = req->client;
+
+    qemu_vfree(req->buf);
+    qemu_free(req);
+    client->nb_requests--;
+}
+
+static void nbd_request_complete(NBDRequest *req, int ret)
+{
+    NBDClient *client = req->client;
+    uint8_t *hdr = req->data - NBD_REPLY_SIZE;
+    uint64_t time_ns = get_clock() - req->start_time_ns;
+
+    if (ret == 0 && req->request.type != NBD_CMD_FLUSH) {
+        if (req->request.type == NBD_CMD_READ) {
+            client->stats.rd_bytes += req->request.len;
+            client->stats.rd_ops++;
+        } else {
+            client->stats.wr_bytes += req->request.len;
+            client->stats.wr_ops++;
+        }
+        client->stats.total_time_ns += time_ns;
+        client->stats.max_time_ns = MAX(client->stats.max_time_ns, time_ns);
+    }
+
+    if (client->dead) {
+        nbd_request_put(req);
+        nbd_client_update_handlers(client);
+        return;
+    }
 
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
      */
-    cpu_to_be32w((uint32_t*)buf, NBD_REPLY_MAGIC);
-    cpu_to_be32w((uint32_t*)(buf + 4), reply->error);
-    cpu_to_be64w((uint64_t*)(buf + 8), reply->handle);
+    cpu_to_be32w((uint32_t*)hdr, NBD_REPLY_MAGIC);
+    cpu_to_be32w((uint32_t*)(hdr + 4), ret < 0 ? -ret : 0);
+    cpu_to_be64w((uint64_t*)(hdr + 8), req->request.handle);
 
-    TRACE("Sending response to client");
+    req->send_len = NBD_REPLY_SIZE;
+    if (req->request.type == NBD_CMD_READ && ret == 0) {
+        req->send_len += req->request.len;
+    }
 
-    if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
-        LOG("writing to socket failed");
-        errno = EINVAL;
-        return -1;
+    TRACE("Queueing reply for handle %" PRIu64 ", error %d",
+          req->request.handle, ret);
+
+    QSIMPLEQ_INSERT_TAIL(&client->replies, req, entry);
+    nbd_client_update_handlers(client);
+}
+
+static void nbd_aio_cb(void *opaque, int ret)
+{
+    nbd_request_complete(opaque, ret);
+}
+
+static void nbd_request_submit(NBDRequest *req)
+{
+    NBDExport *exp = req->client->exp;
+    struct nbd_request *request = &req->request;
+    int64_t sector_num = (request->from + exp->dev_offset) / BDRV_SECTOR_SIZE;
+    int nb_sectors = request->len / BDRV_SECTOR_SIZE;
+    BlockDriverAIOCB *acb;
+
+    req->start_time_ns = get_clock();
+
+    if (request->type == NBD_CMD_FLUSH) {
+        acb = bdrv_aio_flush(exp->bs, nbd_aio_cb, req);
+        if (!acb) {
+            nbd_request_complete(req, -EIO);
+        }
+        return;
+    }
+
+    if ((request->from | request->len) & (BDRV_SECTOR_SIZE - 1)) {
+        LOG("unaligned request: from %" PRIu64 ", len %u",
+            request->from, request->len);
+        nbd_request_complete(req, -EINVAL);
+        return;
+    }
+
+    req->iov.iov_base = req->data;
+    req->iov.iov_len = request->len;
+    qemu_iovec_init_external(&req->qiov, &req->iov, 1);
+
+    if (request->type == NBD_CMD_READ) {
+        TRACE("Reading %u byte(s)", request->len);
+        acb = bdrv_aio_readv(exp->bs, sector_num, &req->qiov, nb_sectors,
+                             nbd_aio_cb, req);
+    } else if (exp->readonly) {
+        TRACE("Server is read-only, return error");
+        nbd_request_complete(req, -EPERM);
+        return;
+    } else {
+        TRACE("Writing %u byte(s)", request->len);
+        acb = bdrv_aio_writev(exp->bs, sector_num, &req->qiov, nb_sectors,
+                              nbd_aio_cb, req);
+    }
+
+    if (!acb) {
+        nbd_request_complete(req, -EIO);
     }
-    return 0;
 }
 
-int nbd_trip(BlockDriverState *bs, int csock, off_t size, uint64_t dev_offset,
-             off_t *offset, bool readonly, uint8_t *data, int data_size)
+/* Returns 0 if the header was consumed, -1 if the client must go away */
+static int nbd_handle_request(NBDClient *client)
 {
+    NBDExport *exp = client->exp;
     struct nbd_request request;
-    struct nbd_reply reply;
+    NBDRequest *req;
 
-    TRACE("Reading request.");
+    if (nbd_decode_request(client->recv_hdr, &request) == -1) {
+        return -1;
+    }
 
-    if (nbd_receive_request(csock, &request) == -1)
+    switch (request.type) {
+    case NBD_CMD_READ:
+    case NBD_CMD_WRITE:
+        break;
+    case NBD_CMD_FLUSH:
+        TRACE("Request type is FLUSH");
+        nbd_request_submit(nbd_request_get(client, &request));
+        return 0;
+    case NBD_CMD_DISC:
+        TRACE("Request type is DISCONNECT");
+        client->closing = true;
+        return 0;
+    default:
+        LOG("invalid request type (%u) received", request.type);
         return -1;
+    }
 
-    if (request.len + NBD_REPLY_SIZE > data_size) {
+    if (request.len > NBD_MAX_BUFFER_SIZE) {
         LOG("len (%u) is larger than max len (%u)",
-            request.len + NBD_REPLY_SIZE, data_size);
-        errno = EINVAL;
+            request.len, NBD_MAX_BUFFER_SIZE);
         return -1;
     }
 
     if ((request.from + request.len) < request.from) {
         LOG("integer overflow detected! "
             "you're probably being attacked");
-        errno = EINVAL;
         return -1;
     }
 
-    if ((request.from + request.len) > size) {
-            LOG("From: %" PRIu64 ", Len: %u, Size: %" PRIu64
+    if ((request.from + request.len) > exp->size) {
+        LOG("From: %" PRIu64 ", Len: %u, Size: %" PRIu64
             ", Offset: %" PRIu64 "\n",
-                    request.from, request.len, (uint64_t)size, dev_offset);
+            request.from, request.len, (uint64_t)exp->size,
+            (uint64_t)exp->dev_offset);
         LOG("requested operation past EOF--bad client?");
-        errno = EINVAL;
         return -1;
     }
 
-    TRACE("Decoding type");
+    req = nbd_request_get(client, &request);
+    if (request.type == NBD_CMD_WRITE && request.len > 0) {
+        /* Submitted once the payload is in */
+        client->recv_req = req;
+    } else {
+        nbd_request_submit(req);
+    }
+    return 0;
+}
 
-    reply.handle = request.handle;
-    reply.error = 0;
+static void nbd_read(void *opaque)
+{
+    NBDClient *client = opaque;
 
-    switch (request.type) {
-    case NBD_CMD_READ:
-        TRACE("Request type is READ");
+    while (!client->closing && !client->dead &&
+           client->nb_requests < NBD_MAX_REQUESTS) {
+        NBDRequest *req = client->recv_req;
+        uint8_t *buf;
+        size_t size;
+        ssize_t len;
 
-        if (bdrv_read(bs, (request.from + dev_offset) / 512,
-                  data + NBD_REPLY_SIZE,
-                  request.len / 512) == -1) {
-            LOG("reading from file failed");
-            errno = EINVAL;
-            return -1;
+        if (req) {
+            buf = req->data;
+            size = req->request.len;
+        } else {
+            buf = client->recv_hdr;
+            size = sizeof(client->recv_hdr);
         }
-        *offset += request.len;
 
-        TRACE("Read %u byte(s)", request.len);
+        len = recv(client->sock, buf + client->recv_pos,
+                   size - client->recv_pos, 0);
+        if (len == -1) {
+            errno = socket_error();
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG("reading from socket failed");
+                client->dead = true;
+            }
+            break;
+        }
+        if (len == 0) {
+            TRACE("Client closed the connection");
+            client->dead = true;
+            break;
+        }
 
-        /* Reply
-           [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
-           [ 4 ..  7]    error   (0 == no error)
-           [ 7 .. 15]    handle
-         */
+        client->recv_pos += len;
+        if (client->recv_pos < size) {
+            continue;
+        }
+        client->recv_pos = 0;
 
-        cpu_to_be32w((uint32_t*)data, NBD_REPLY_MAGIC);
-        cpu_to_be32w((uint32_t*)(data + 4), reply.error);
-        cpu_to_be64w((uint64_t*)(data + 8), reply.handle);
+        if (req) {
+            client->recv_req = NULL;
+            nbd_request_submit(req);
+        } else if (nbd_handle_request(client) == -1) {
+            client->dead = true;
+        }
+    }
 
-        TRACE("Sending data to client");
+    nbd_client_update_handlers(client);
+}
 
-        if (write_sync(csock, data,
-                   request.len + NBD_REPLY_SIZE) !=
-                   request.len + NBD_REPLY_SIZE) {
-            LOG("writing to socket failed");
-            errno = EINVAL;
-            return -1;
-        }
-        break;
-    case NBD_CMD_WRITE:
-        TRACE("Request type is WRITE");
+static void nbd_write(void *opaque)
+{
+    NBDClient *client = opaque;
+    NBDRequest *req;
 
-        TRACE("Reading %u byte(s)", request.len);
+    while (!client->dead && (req = QSIMPLEQ_FIRST(&client->replies))) {
+        uint8_t *buf = req->data - NBD_REPLY_SIZE;
+        ssize_t len;
 
-        if (read_sync(csock, data, request.len) != request.len) {
-            LOG("reading from socket failed");
-            errno = EINVAL;
-            return -1;
+        len = send(client->sock, buf + client->send_pos,
+                   req->send_len - client->send_pos, 0);
+        if (len == -1) {
+            errno = socket_error();
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOG("writing to socket failed");
+                client->dead = true;
+            }
+            break;
         }
 
-        if (readonly) {
-            TRACE("Server is read-only, return error");
-            reply.error = 1;
-        } else {
-            TRACE("Writing to device");
+        client->send_pos += len;
+        if (client->send_pos == req->send_len) {
+            client->send_pos = 0;
+            QSIMPLEQ_REMOVE_HEAD(&client->replies, entry);
+            nbd_request_put(req);
+        }
+    }
 
-            if (bdrv_write(bs, (request.from + dev_offset) / 512,
-                       data, request.len / 512) == -1) {
-                LOG("writing to file failed");
-                errno = EINVAL;
-                return -1;
-            }
+    nbd_client_update_handlers(client);
+}
+
+static void nbd_client_free(NBDClient *client)
+{
+    TRACE("Closing client socket %d", client->sock);
 
-            *offset += request.len;
+    closesocket(client->sock);
+    if (client->close) {
+        client->close(client);
+    }
+    qemu_free(client);
+}
+
+static void nbd_client_update_handlers(NBDClient *client)
+{
+    IOHandler *io_read = NULL;
+    IOHandler *io_write = NULL;
+
+    if (client->dead) {
+        NBDRequest *req;
+
+        /* Nobody is listening anymore */
+        while ((req = QSIMPLEQ_FIRST(&client->replies))) {
+            QSIMPLEQ_REMOVE_HEAD(&client->replies, entry);
+            nbd_request_put(req);
         }
+        if (client->recv_req) {
+            nbd_request_put(client->recv_req);
+            client->recv_req = NULL;
+        }
+    } else {
+        if (!client->closing && client->nb_requests < NBD_MAX_REQUESTS) {
+            io_read = nbd_read;
+        }
+        if (!QSIMPLEQ_EMPTY(&client->replies)) {
+            io_write = nbd_write;
+        }
+    }
 
-        if (nbd_send_reply(csock, &reply) == -1)
-            return -1;
-        break;
-    case NBD_CMD_DISC:
-        TRACE("Request type is DISCONNECT");
-        errno = 0;
-        return 1;
-    default:
-        LOG("invalid request type (%u) received", request.type);
-        errno = EINVAL;
-        return -1;
+    qemu_aio_set_fd_handler(client->sock, io_read, io_write, NULL, NULL,
+                            client);
+
+    /* Requests still in the block layer hold a reference to the client */
+    if ((client->dead || client->closing) && client->nb_requests == 0) {
+        nbd_client_free(client);
+    }
+}
+
+NBDClient *nbd_client_new(NBDExport *exp, int csock,
+                          void (*close)(NBDClient *), void *opaque)
+{
+    NBDClient *client;
+    uint32_t flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH;
+
+    if (exp->readonly) {
+        flags |= NBD_FLAG_READ_ONLY;
     }
 
-    TRACE("Request/Reply complete");
+    if (nbd_negotiate(csock, exp->size, flags) == -1) {
+        return NULL;
+    }
 
-    return 0;
+    client = qemu_mallocz(sizeof(NBDClient));
+    client->exp = exp;
+    client->sock = csock;
+    client->close = close;
+    client->opaque = opaque;
+    client->stats.connect_time_ns = get_clock();
+    QSIMPLEQ_INIT(&client->replies);
+
+    socket_set_nonblock(csock);
+    nbd_client_update_handlers(client);
+    return client;
+}
+
+void *nbd_client_get_opaque(NBDClient *client)
+{
+    return client->opaque;
+}
+
+const NBDClientStats *nbd_client_get_stats(NBDClient *client)
+{
+    return &client->stats;
 }
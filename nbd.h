@@ -39,14 +39,26 @@ struct nbd_reply {
     uint64_t handle;
 } __attribute__ ((__packed__));
 
+#define NBD_FLAG_HAS_FLAGS      (1 << 0)        /* Flags are there */
+#define NBD_FLAG_READ_ONLY      (1 << 1)        /* Device is read-only */
+#define NBD_FLAG_SEND_FLUSH     (1 << 2)        /* Send FLUSH */
+
 enum {
     NBD_CMD_READ = 0,
     NBD_CMD_WRITE = 1,
-    NBD_CMD_DISC = 2
+    NBD_CMD_DISC = 2,
+    NBD_CMD_FLUSH = 3
 };
 
 #define NBD_DEFAULT_PORT	10809
 
+/* Size of the request and reply headers on the wire */
+#define NBD_REQUEST_SIZE        (4 + 4 + 8 + 8 + 4)
+#define NBD_REPLY_SIZE          (4 + 4 + 8)
+
+/* Largest request the server accepts, clients must split bigger ones */
+#define NBD_MAX_BUFFER_SIZE     (1024 * 1024)
+
 size_t nbd_wr_sync(int fd, void *buffer, size_t size, bool do_read);
 int tcp_socket_outgoing(const char *address, uint16_t port);
 int tcp_socket_incoming(const char *address, uint16_t port);
@@ -55,15 +67,37 @@ int tcp_socket_incoming_spec(const char *address_and_port);
 int unix_socket_outgoing(const char *path);
 int unix_socket_incoming(const char *path);
 
-int nbd_negotiate(int csock, off_t size);
+int nbd_negotiate(int csock, off_t size, uint32_t flags);
 int nbd_receive_negotiate(int csock, const char *name, uint32_t *flags,
                           off_t *size, size_t *blocksize);
 int nbd_init(int fd, int csock, off_t size, size_t blocksize);
+void nbd_encode_request(uint8_t *buf, const struct nbd_request *request);
 int nbd_send_request(int csock, struct nbd_request *request);
+int nbd_decode_reply(const uint8_t *buf, struct nbd_reply *reply);
 int nbd_receive_reply(int csock, struct nbd_reply *reply);
-int nbd_trip(BlockDriverState *bs, int csock, off_t size, uint64_t dev_offset,
-             off_t *offset, bool readonly, uint8_t *data, int data_size);
 int nbd_client(int fd);
 int nbd_disconnect(int fd);
 
+typedef struct NBDExport NBDExport;
+typedef struct NBDClient NBDClient;
+
+typedef struct NBDClientStats {
+    uint64_t rd_bytes;
+    uint64_t wr_bytes;
+    uint64_t rd_ops;
+    uint64_t wr_ops;
+    uint64_t total_time_ns;     /* sum of request latencies */
+    uint64_t max_time_ns;
+    int64_t connect_time_ns;
+} NBDClientStats;
+
+NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset, off_t size,
+                          bool readonly);
+void nbd_export_close(NBDExport *exp);
+
+NBDClient *nbd_client_new(NBDExport *exp, int csock,
+                          void (*close)(NBDClient *), void *opaque);
+void *nbd_client_get_opaque(NBDClient *client);
+const NBDClientStats *nbd_client_get_stats(NBDClient *client);
+
 #endif
@@ -0,0 +1,117 @@
+/*
+ * Page cache for live migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "page_cache.h"
+
+typedef struct CacheItem {
+    uint64_t addr;
+    uint8_t *data;      /* NULL if the slot is unused */
+} CacheItem;
+
+struct PageCache {
+    CacheItem *items;
+    unsigned int page_size;
+    int64_t num_items;
+};
+
+static int64_t pow2_floor(int64_t value)
+{
+    int64_t ret = 1;
+
+    while (ret <= value / 2) {
+        ret *= 2;
+    }
+    return ret;
+}
+
+PageCache *page_cache_init(int64_t num_pages, unsigned int page_size)
+{
+    PageCache *cache;
+
+    cache = qemu_mallocz(sizeof(*cache));
+    cache->page_size = page_size;
+    cache->num_items = pow2_floor(MAX(num_pages, 1));
+    cache->items = qemu_mallocz(cache->num_items * sizeof(CacheItem));
+
+    return cache;
+}
+
+void page_cache_fini(PageCache *cache)
+{
+    int64_t i;
+
+    for (i = 0; i < cache->num_items; i++) {
+        qemu_free(cache->items[i].data);
+    }
+    qemu_free(cache->items);
+    qemu_free(cache);
+}
+
+int64_t page_cache_size(const PageCache *cache)
+{
+    return cache->num_items * cache->page_size;
+}
+
+static CacheItem *page_cache_slot(const PageCache *cache, uint64_t addr)
+{
+    return &cache->items[(addr / cache->page_size) & (cache->num_items - 1)];
+}
+
+uint8_t *page_cache_lookup(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = page_cache_slot(cache, addr);
+
+    if (it->data && it->addr == addr) {
+        return it->data;
+    }
+    return NULL;
+}
+
+void page_cache_insert(PageCache *cache, uint64_t addr, const uint8_t *data)
+{
+    CacheItem *it = page_cache_slot(cache, addr);
+
+    if (!it->data) {
+        it->data = qemu_malloc(cache->page_size);
+    }
+    it->addr = addr;
+    memcpy(it->data, data, cache->page_size);
+}
+
+PageCache *page_cache_resize(PageCache *cache, int64_t num_pages)
+{
+    PageCache *new_cache;
+    int64_t i;
+
+    new_cache = page_cache_init(num_pages, cache->page_size);
+    if (new_cache->num_items == cache->num_items) {
+        page_cache_fini(new_cache);
+        return cache;
+    }
+
+    /* Move the pages over, the buffers can be reused as they are */
+    for (i = 0; i < cache->num_items; i++) {
+        CacheItem *old = &cache->items[i];
+        CacheItem *it;
+
+        if (!old->data) {
+            continue;
+        }
+        it = page_cache_slot(new_cache, old->addr);
+        if (it->data) {
+            qemu_free(old->data);
+        } else {
+            *it = *old;
+        }
+        old->data = NULL;
+    }
+
+    page_cache_fini(cache);
+    return new_cache;
+}
@@ -0,0 +1,34 @@
+/*
+ * Page cache for live migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef PAGE_CACHE_H
+#define PAGE_CACHE_H
+
+#include "qemu-common.h"
+
+typedef struct PageCache PageCache;
+
+/*
+ * A direct mapped cache of page contents, indexed by address.  num_pages is
+ * rounded down to a power of two.
+ */
+PageCache *page_cache_init(int64_t num_pages, unsigned int page_size);
+void page_cache_fini(PageCache *cache);
+
+int64_t page_cache_size(const PageCache *cache);
+
+/* Returns the cached contents of the page at addr, or NULL */
+uint8_t *page_cache_lookup(const PageCache *cache, uint64_t addr);
+
+/* Stores a copy of the page at addr, evicting the page in the same slot */
+void page_cache_insert(PageCache *cache, uint64_t addr, const uint8_t *data);
+
+/* Returns a cache of the new size that keeps as many pages as fit */
+PageCache *page_cache_resize(PageCache *cache, int64_t num_pages);
+
+#endif
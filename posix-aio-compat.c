@@ -25,6 +25,8 @@
 #include "osdep.h"
 #include "sysemu.h"
 #include "qemu-common.h"
+#include "qemu-timer.h"
+#include "monitor.h"
 #include "trace.h"
 #include "block_int.h"
 
@@ -41,10 +43,11 @@ struct qemu_paiocb {
     int aio_niov;
     size_t aio_nbytes;
 #define aio_ioctl_cmd   aio_nbytes /* for QEMU_AIO_IOCTL */
-    int ev_signo;
     off_t aio_offset;
 
     QTAILQ_ENTRY(qemu_paiocb) node;
+    struct PaioQueue *queue;
+    int64_t submit_time;
     int aio_type;
     ssize_t ret;
     int active;
@@ -53,20 +56,52 @@ struct qemu_paiocb {
     int async_context_id;
 };
 
+/*
+ * Pending requests are queued per BlockDriverState so that one slow device
+ * cannot starve the others.  Only queues with pending requests are kept in
+ * queue_list; the worker threads serve them round-robin.
+ */
+typedef struct PaioQueue {
+    BlockDriverState *bs;
+    QTAILQ_HEAD(, qemu_paiocb) requests;
+    QTAILQ_ENTRY(PaioQueue) next;
+} PaioQueue;
+
 typedef struct PosixAioState {
     int rfd, wfd;
     struct qemu_paiocb *first_aio;
 } PosixAioState;
 
+/* Latency histogram with power-of-two microsecond buckets */
+#define PAIO_HIST_BUCKETS 24
+
+typedef struct PaioHistogram {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t buckets[PAIO_HIST_BUCKETS];
+} PaioHistogram;
+
+/* Maximum number of requests a worker takes from a queue at once */
+#define PAIO_MAX_BATCH 16
 
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
 static pthread_t thread_id;
 static pthread_attr_t attr;
+static int min_threads = 0;
 static int max_threads = 64;
 static int cur_threads = 0;
 static int idle_threads = 0;
-static QTAILQ_HEAD(, qemu_paiocb) request_list;
+static QTAILQ_HEAD(, PaioQueue) queue_list;
+
+/* completion notification state and statistics, protected by lock */
+static int notify_pending;
+static uint64_t nr_notifications;
+static uint64_t nr_completions;
+static uint64_t nr_batches;
+static uint64_t nr_batched_requests;
+static PaioHistogram wait_hist;
+static PaioHistogram service_hist;
 
 #ifdef CONFIG_PREADV
 static int preadv_present = 1;
@@ -301,61 +336,181 @@ static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb)
     return nbytes;
 }
 
-static void *aio_thread(void *unused)
+/*
+ * Reading past the end of a growable image file returns zeroes, just like
+ * the synchronous bdrv_read() does.  This happens when an image format
+ * does a read-modify-write of the partial sector at the end of the file.
+ */
+static ssize_t handle_aiocb_read(struct qemu_paiocb *aiocb)
 {
+    ssize_t nbytes = handle_aiocb_rw(aiocb);
+    size_t skip;
+    int i;
+
+    if (nbytes < 0 || nbytes == aiocb->aio_nbytes ||
+        !aiocb->common.bs->growable) {
+        return nbytes;
+    }
+
+    skip = nbytes;
+    for (i = 0; i < aiocb->aio_niov; i++) {
+        struct iovec *iov = &aiocb->aio_iov[i];
+
+        if (skip >= iov->iov_len) {
+            skip -= iov->iov_len;
+            continue;
+        }
+        memset(iov->iov_base + skip, 0, iov->iov_len - skip);
+        skip = 0;
+    }
+    return aiocb->aio_nbytes;
+}
+
+static ssize_t handle_aiocb(struct qemu_paiocb *aiocb)
+{
+    switch (aiocb->aio_type & QEMU_AIO_TYPE_MASK) {
+    case QEMU_AIO_READ:
+        return handle_aiocb_read(aiocb);
+    case QEMU_AIO_WRITE:
+        return handle_aiocb_rw(aiocb);
+    case QEMU_AIO_FLUSH:
+        return handle_aiocb_flush(aiocb);
+    case QEMU_AIO_IOCTL:
+        return handle_aiocb_ioctl(aiocb);
+    default:
+        fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
+        return -EINVAL;
+    }
+}
+
+static void paio_hist_add(PaioHistogram *hist, int64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int i = 0;
+
+    while (us && i < PAIO_HIST_BUCKETS - 1) {
+        us >>= 1;
+        i++;
+    }
+    hist->count++;
+    hist->total_ns += ns;
+    hist->buckets[i]++;
+}
+
+/*
+ * Wake up the main loop.  The caller must have seen notify_pending clear,
+ * so there is at most one notification in flight no matter how many
+ * requests complete before posix_aio_read() gets to run.
+ */
+static void paio_notify(PosixAioState *s, pid_t pid)
+{
+    uint64_t value = 1;
+    ssize_t ret;
+
+    /* Write 8 bytes to be compatible with eventfd.  */
+    do {
+        ret = write(s->wfd, &value, sizeof(value));
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0 && errno != EAGAIN)
+        die("write()");
+
+    if (kill(pid, SIGUSR2)) die("kill failed");
+}
+
+static void idle_deadline(struct timespec *ts)
+{
+    qemu_timeval tv;
+
+    qemu_gettimeofday(&tv);
+    ts->tv_sec = tv.tv_sec + 10;
+    ts->tv_nsec = 0;
+}
+
+static void *aio_thread(void *opaque)
+{
+    PosixAioState *s = opaque;
     pid_t pid;
 
     pid = getpid();
 
     while (1) {
+        struct qemu_paiocb *batch[PAIO_MAX_BATCH];
         struct qemu_paiocb *aiocb;
+        PaioQueue *q;
         ssize_t ret = 0;
-        qemu_timeval tv;
         struct timespec ts;
+        int64_t now;
+        int i, n, notify;
 
-        qemu_gettimeofday(&tv);
-        ts.tv_sec = tv.tv_sec + 10;
-        ts.tv_nsec = 0;
+        idle_deadline(&ts);
 
         mutex_lock(&lock);
 
-        while (QTAILQ_EMPTY(&request_list) &&
-               !(ret == ETIMEDOUT)) {
+        while (QTAILQ_EMPTY(&queue_list)) {
+            if (ret == ETIMEDOUT) {
+                if (cur_threads > min_threads)
+                    break;
+                idle_deadline(&ts);
+            }
             idle_threads++;
             ret = cond_timedwait(&cond, &lock, &ts);
             idle_threads--;
         }
 
-        if (QTAILQ_EMPTY(&request_list))
+        if (QTAILQ_EMPTY(&queue_list))
             break;
 
-        aiocb = QTAILQ_FIRST(&request_list);
-        QTAILQ_REMOVE(&request_list, aiocb, node);
-        aiocb->active = 1;
-        mutex_unlock(&lock);
-
-        switch (aiocb->aio_type & QEMU_AIO_TYPE_MASK) {
-        case QEMU_AIO_READ:
-        case QEMU_AIO_WRITE:
-            ret = handle_aiocb_rw(aiocb);
-            break;
-        case QEMU_AIO_FLUSH:
-            ret = handle_aiocb_flush(aiocb);
-            break;
-        case QEMU_AIO_IOCTL:
-            ret = handle_aiocb_ioctl(aiocb);
-            break;
-        default:
-            fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
-            ret = -EINVAL;
-            break;
+        /*
+         * Take the next request from the queue at the head of the list.
+         * If no other thread is idle, take a batch of requests from the
+         * same queue instead of going back to the lock for each one.
+         */
+        q = QTAILQ_FIRST(&queue_list);
+        n = 0;
+        do {
+            aiocb = QTAILQ_FIRST(&q->requests);
+            QTAILQ_REMOVE(&q->requests, aiocb, node);
+            aiocb->active = 1;
+            batch[n++] = aiocb;
+        } while (n < PAIO_MAX_BATCH && idle_threads == 0 &&
+                 !QTAILQ_EMPTY(&q->requests));
+
+        QTAILQ_REMOVE(&queue_list, q, next);
+        if (QTAILQ_EMPTY(&q->requests)) {
+            qemu_free(q);
+        } else {
+            QTAILQ_INSERT_TAIL(&queue_list, q, next);
         }
 
-        mutex_lock(&lock);
-        aiocb->ret = ret;
+        now = get_clock();
+        for (i = 0; i < n; i++) {
+            paio_hist_add(&wait_hist, now - batch[i]->submit_time);
+        }
+        if (n > 1) {
+            nr_batches++;
+            nr_batched_requests += n;
+        }
         mutex_unlock(&lock);
 
-        if (kill(pid, aiocb->ev_signo)) die("kill failed");
+        for (i = 0; i < n; i++) {
+            aiocb = batch[i];
+            ret = handle_aiocb(aiocb);
+
+            mutex_lock(&lock);
+            aiocb->ret = ret;
+            paio_hist_add(&service_hist, get_clock() - now);
+            nr_completions++;
+            notify = !notify_pending;
+            if (notify) {
+                notify_pending = 1;
+                nr_notifications++;
+            }
+            mutex_unlock(&lock);
+
+            if (notify)
+                paio_notify(s, pid);
+            now = get_clock();
+        }
     }
 
     cur_threads--;
@@ -364,6 +519,8 @@ static void *aio_thread(void *unused)
     return NULL;
 }
 
+static PosixAioState *posix_aio_state;
+
 static void spawn_thread(void)
 {
     sigset_t set, oldset;
@@ -374,19 +531,38 @@ static void spawn_thread(void)
     if (sigfillset(&set)) die("sigfillset");
     if (sigprocmask(SIG_SETMASK, &set, &oldset)) die("sigprocmask");
 
-    thread_create(&thread_id, &attr, aio_thread, NULL);
+    thread_create(&thread_id, &attr, aio_thread, posix_aio_state);
 
     if (sigprocmask(SIG_SETMASK, &oldset, NULL)) die("sigprocmask restore");
 }
 
+static PaioQueue *paio_get_queue(BlockDriverState *bs)
+{
+    PaioQueue *q;
+
+    QTAILQ_FOREACH(q, &queue_list, next) {
+        if (q->bs == bs) {
+            return q;
+        }
+    }
+
+    q = qemu_mallocz(sizeof(*q));
+    q->bs = bs;
+    QTAILQ_INIT(&q->requests);
+    QTAILQ_INSERT_TAIL(&queue_list, q, next);
+    return q;
+}
+
 static void qemu_paio_submit(struct qemu_paiocb *aiocb)
 {
     aiocb->ret = -EINPROGRESS;
     aiocb->active = 0;
+    aiocb->submit_time = get_clock();
     mutex_lock(&lock);
     if (idle_threads == 0 && cur_threads < max_threads)
         spawn_thread();
-    QTAILQ_INSERT_TAIL(&request_list, aiocb, node);
+    aiocb->queue = paio_get_queue(aiocb->common.bs);
+    QTAILQ_INSERT_TAIL(&aiocb->queue->requests, aiocb, node);
     mutex_unlock(&lock);
     cond_signal(&cond);
 }
@@ -476,7 +652,7 @@ static void posix_aio_read(void *opaque)
     PosixAioState *s = opaque;
     ssize_t len;
 
-    /* read all bytes from signal pipe */
+    /* Drain the notify pipe.  For eventfd, only 8 bytes will be read.  */
     for (;;) {
         char bytes[16];
 
@@ -488,6 +664,12 @@ static void posix_aio_read(void *opaque)
         break;
     }
 
+    /* Re-arm notification before looking at the completed requests, so
+     * that anything completing from now on wakes us up again. */
+    mutex_lock(&lock);
+    notify_pending = 0;
+    mutex_unlock(&lock);
+
     posix_aio_process_queue(s);
 }
 
@@ -497,19 +679,8 @@ static int posix_aio_flush(void *opaque)
     return !!s->first_aio;
 }
 
-static PosixAioState *posix_aio_state;
-
 static void aio_signal_handler(int signum)
 {
-    if (posix_aio_state) {
-        char byte = 0;
-        ssize_t ret;
-
-        ret = write(posix_aio_state->wfd, &byte, sizeof(byte));
-        if (ret < 0 && errno != EAGAIN)
-            die("write()");
-    }
-
     qemu_service_io();
 }
 
@@ -541,7 +712,13 @@ static void paio_cancel(BlockDriverAIOCB *blockacb)
 
     mutex_lock(&lock);
     if (!acb->active) {
-        QTAILQ_REMOVE(&request_list, acb, node);
+        PaioQueue *q = acb->queue;
+
+        QTAILQ_REMOVE(&q->requests, acb, node);
+        if (QTAILQ_EMPTY(&q->requests)) {
+            QTAILQ_REMOVE(&queue_list, q, next);
+            qemu_free(q);
+        }
         acb->ret = -ECANCELED;
     } else if (acb->ret == -EINPROGRESS) {
         active = 1;
@@ -574,7 +751,6 @@ BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
         return NULL;
     acb->aio_type = type;
     acb->aio_fildes = fd;
-    acb->ev_signo = SIGUSR2;
     acb->async_context_id = get_async_context_id();
 
     if (qiov) {
@@ -603,7 +779,6 @@ BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
         return NULL;
     acb->aio_type = QEMU_AIO_IOCTL;
     acb->aio_fildes = fd;
-    acb->ev_signo = SIGUSR2;
     acb->async_context_id = get_async_context_id();
     acb->aio_offset = 0;
     acb->aio_ioctl_buf = buf;
@@ -634,8 +809,8 @@ int paio_init(void)
     sigaction(SIGUSR2, &act, NULL);
 
     s->first_aio = NULL;
-    if (qemu_pipe(fds) == -1) {
-        fprintf(stderr, "failed to create pipe\n");
+    if (qemu_eventfd(fds) == -1) {
+        fprintf(stderr, "failed to create notification pipe\n");
         return -1;
     }
 
@@ -656,8 +831,70 @@ int paio_init(void)
     if (ret)
         die2(ret, "pthread_attr_setdetachstate");
 
-    QTAILQ_INIT(&request_list);
+    QTAILQ_INIT(&queue_list);
 
     posix_aio_state = s;
     return 0;
 }
+
+int paio_set_thread_limits(int min, int max)
+{
+    if (min < 0 || max < 1 || min > max) {
+        return -EINVAL;
+    }
+
+    mutex_lock(&lock);
+    min_threads = min;
+    max_threads = max;
+    mutex_unlock(&lock);
+    return 0;
+}
+
+static void paio_hist_print(Monitor *mon, const char *name,
+                            PaioHistogram *hist)
+{
+    int i;
+
+    monitor_printf(mon, "%s: count=%" PRIu64 " avg_us=%" PRIu64 "\n", name,
+                   hist->count,
+                   hist->count ? hist->total_ns / hist->count / 1000 : 0);
+    for (i = 0; i < PAIO_HIST_BUCKETS; i++) {
+        if (!hist->buckets[i]) {
+            continue;
+        }
+        if (i == 0) {
+            monitor_printf(mon, "  <1 us");
+        } else if (i == PAIO_HIST_BUCKETS - 1) {
+            monitor_printf(mon, "  >=%" PRIu64 " us", (uint64_t)1 << (i - 1));
+        } else {
+            monitor_printf(mon, "  %" PRIu64 "-%" PRIu64 " us",
+                           (uint64_t)1 << (i - 1), ((uint64_t)1 << i) - 1);
+        }
+        monitor_printf(mon, ": %" PRIu64 "\n", hist->buckets[i]);
+    }
+}
+
+void paio_info(Monitor *mon)
+{
+    PaioHistogram wait, service;
+    PaioQueue *q;
+    int nr_queues = 0;
+
+    mutex_lock(&lock);
+    QTAILQ_FOREACH(q, &queue_list, next) {
+        nr_queues++;
+    }
+    monitor_printf(mon, "threads: cur=%d idle=%d min=%d max=%d\n",
+                   cur_threads, idle_threads, min_threads, max_threads);
+    monitor_printf(mon, "queues: %d busy\n", nr_queues);
+    monitor_printf(mon, "completions: %" PRIu64 " notifications=%" PRIu64
+                   " batches=%" PRIu64 " batched_requests=%" PRIu64 "\n",
+                   nr_completions, nr_notifications,
+                   nr_batches, nr_batched_requests);
+    wait = wait_hist;
+    service = service_hist;
+    mutex_unlock(&lock);
+
+    paio_hist_print(mon, "queue wait", &wait);
+    paio_hist_print(mon, "service time", &service);
+}
@@ -0,0 +1,532 @@
+/*
+ * Post-copy live migration of RAM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu-char.h"
+#include "qemu-thread.h"
+#include "bitmap.h"
+#include "migration.h"
+#include "postcopy-ram.h"
+
+#ifdef CONFIG_USERFAULTFD
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+//#define DEBUG_POSTCOPY
+
+#ifdef DEBUG_POSTCOPY
+#define DPRINTF(fmt, ...) \
+    do { printf("postcopy: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+/*
+ * Guest RAM is registered with a userfaultfd, so that accesses to missing
+ * pages are reported to the fault thread instead of being filled with zeroes
+ * by the kernel.
+ *
+ * needed has the pages that the source still has to send, indexed by
+ * ram_addr_t.  It is only written by whoever loads the stream, the fault
+ * thread reads it.  requested has the pages that the fault thread asked the
+ * source for already, and only the fault thread uses it.
+ */
+static struct {
+    int advised;
+    int active;
+    int load_ret;
+    int uffd;
+    int return_fd;
+    int quit_fds[2];
+    int done_fds[2];
+    RAMBlock **blocks;
+    int nr_blocks;
+    unsigned long *needed;
+    unsigned long *requested;
+    QemuThread fault_thread;
+    QemuThread listen_thread;
+    QEMUFile *file;
+} postcopy = {
+    .uffd = -1,
+    .quit_fds = { -1, -1 },
+    .done_fds = { -1, -1 },
+};
+
+static RAMBlock *postcopy_find_block(void *host, int *idx)
+{
+    int i;
+
+    for (i = 0; i < postcopy.nr_blocks; i++) {
+        RAMBlock *block = postcopy.blocks[i];
+
+        if ((uint8_t *)host >= block->host &&
+            (uint8_t *)host < block->host + block->length) {
+            *idx = i;
+            return block;
+        }
+    }
+    return NULL;
+}
+
+static int postcopy_zero_page(void *host)
+{
+    struct uffdio_zeropage zero = {
+        .range = { .start = (uintptr_t)host, .len = TARGET_PAGE_SIZE },
+    };
+    int ret;
+
+    do {
+        ret = ioctl(postcopy.uffd, UFFDIO_ZEROPAGE, &zero);
+    } while (ret < 0 && errno == EAGAIN);
+    return ret;
+}
+
+/* Asks the source to send a page ahead of the others */
+static void postcopy_request_page(int idx, ram_addr_t offset)
+{
+    uint32_t req[2];
+    size_t done = 0;
+    ssize_t ret;
+
+    req[0] = cpu_to_be32(idx);
+    req[1] = cpu_to_be32(offset >> TARGET_PAGE_BITS);
+
+    while (done < sizeof(req)) {
+        ret = send(postcopy.return_fd, (uint8_t *)req + done,
+                   sizeof(req) - done, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            /* The page still comes with the others, just later */
+            DPRINTF("failed to request page: %s\n", strerror(errno));
+            return;
+        }
+        done += ret;
+    }
+}
+
+static void *postcopy_fault_thread(void *opaque)
+{
+    struct pollfd pfd[2];
+    struct uffd_msg msg;
+    RAMBlock *block;
+    ram_addr_t offset;
+    unsigned long page;
+    uint8_t *host;
+    int idx;
+
+    pfd[0].fd = postcopy.uffd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = postcopy.quit_fds[0];
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "post-copy fault thread: %s\n", strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+
+        if (read(postcopy.uffd, &msg, sizeof(msg)) != sizeof(msg)) {
+            continue;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+
+        host = (uint8_t *)(uintptr_t)msg.arg.pagefault.address;
+        block = postcopy_find_block(host, &idx);
+        if (!block) {
+            continue;
+        }
+        offset = (host - block->host) & TARGET_PAGE_MASK;
+        page = (block->offset + offset) >> TARGET_PAGE_BITS;
+
+        if (test_bit(page, postcopy.needed)) {
+            /* The access waits until the page is put in place */
+            if (!test_and_set_bit(page, postcopy.requested)) {
+                DPRINTF("requesting %s:%" PRIx64 "\n", block->idstr,
+                        (uint64_t)offset);
+                postcopy_request_page(idx, offset);
+            }
+            continue;
+        }
+
+        /*
+         * The page was zero when it was sent, or it arrived since the
+         * fault was reported.
+         */
+        if (postcopy_zero_page(block->host + offset) < 0 && errno == EEXIST) {
+            struct uffdio_range range = {
+                .start = (uintptr_t)(block->host + offset),
+                .len = TARGET_PAGE_SIZE,
+            };
+
+            ioctl(postcopy.uffd, UFFDIO_WAKE, &range);
+        }
+    }
+
+    return NULL;
+}
+
+static void postcopy_ram_cleanup(void)
+{
+    if (postcopy.active) {
+        int ret;
+
+        do {
+            ret = write(postcopy.quit_fds[1], "", 1);
+        } while (ret < 0 && errno == EINTR);
+        qemu_thread_join(&postcopy.fault_thread);
+    }
+
+    if (postcopy.quit_fds[0] != -1) {
+        close(postcopy.quit_fds[0]);
+        close(postcopy.quit_fds[1]);
+        postcopy.quit_fds[0] = postcopy.quit_fds[1] = -1;
+    }
+
+    /* Unregisters the RAM, it behaves like any other memory from now on */
+    if (postcopy.uffd != -1) {
+        close(postcopy.uffd);
+        postcopy.uffd = -1;
+    }
+
+    qemu_free(postcopy.needed);
+    postcopy.needed = NULL;
+    qemu_free(postcopy.requested);
+    postcopy.requested = NULL;
+    qemu_free(postcopy.blocks);
+    postcopy.blocks = NULL;
+    postcopy.nr_blocks = 0;
+    postcopy.active = 0;
+    postcopy.advised = 0;
+}
+
+int postcopy_ram_incoming_advise(int return_fd)
+{
+    struct uffdio_api api = { .api = UFFD_API };
+    struct uffdio_register reg;
+    uint64_t ioctls = (1ULL << _UFFDIO_COPY) | (1ULL << _UFFDIO_ZEROPAGE);
+    void *test;
+    int uffd, ret = -1;
+
+    if (return_fd < 0) {
+        fprintf(stderr, "post-copy migration needs a socket connection\n");
+        return -1;
+    }
+    if (mem_path) {
+        fprintf(stderr, "post-copy migration doesn't support -mem-path\n");
+        return -1;
+    }
+    if (TARGET_PAGE_SIZE % getpagesize()) {
+        fprintf(stderr, "post-copy migration needs target pages that are "
+                "a multiple of the host page size\n");
+        return -1;
+    }
+
+    uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (uffd < 0) {
+        fprintf(stderr, "Failed to open userfaultfd: %s\n", strerror(errno));
+        return -1;
+    }
+    if (ioctl(uffd, UFFDIO_API, &api) < 0) {
+        fprintf(stderr, "Failed to set up userfaultfd: %s\n", strerror(errno));
+        goto out;
+    }
+
+    /* Guest RAM is only registered at the switch, try with a scratch page */
+    test = mmap(NULL, TARGET_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (test == MAP_FAILED) {
+        fprintf(stderr, "Failed to map a page: %s\n", strerror(errno));
+        goto out;
+    }
+    reg.range.start = (uintptr_t)test;
+    reg.range.len = TARGET_PAGE_SIZE;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+    if (ioctl(uffd, UFFDIO_REGISTER, &reg) < 0 ||
+        (reg.ioctls & ioctls) != ioctls) {
+        fprintf(stderr, "userfaultfd can't handle RAM for post-copy: %s\n",
+                strerror(errno));
+    } else {
+        postcopy.advised = 1;
+        ret = 0;
+    }
+    munmap(test, TARGET_PAGE_SIZE);
+
+out:
+    close(uffd);
+    return ret;
+}
+
+int postcopy_ram_incoming_advised(void)
+{
+    return postcopy.advised;
+}
+
+int postcopy_ram_incoming_init(RAMBlock **blocks, int nr_blocks,
+                               int return_fd)
+{
+    struct uffdio_api api = { .api = UFFD_API };
+    unsigned long pages = 0;
+    int i;
+
+    if (!postcopy.advised) {
+        fprintf(stderr, "Unexpected post-copy switch in migration stream\n");
+        return -1;
+    }
+
+    postcopy.uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (postcopy.uffd < 0) {
+        fprintf(stderr, "Failed to open userfaultfd: %s\n", strerror(errno));
+        return -1;
+    }
+    if (ioctl(postcopy.uffd, UFFDIO_API, &api) < 0) {
+        fprintf(stderr, "Failed to set up userfaultfd: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    postcopy.blocks = qemu_malloc(nr_blocks * sizeof(*blocks));
+    memcpy(postcopy.blocks, blocks, nr_blocks * sizeof(*blocks));
+    postcopy.nr_blocks = nr_blocks;
+
+    for (i = 0; i < nr_blocks; i++) {
+        struct uffdio_register reg = {
+            .range = {
+                .start = (uintptr_t)blocks[i]->host,
+                .len = blocks[i]->length,
+            },
+            .mode = UFFDIO_REGISTER_MODE_MISSING,
+        };
+        uint64_t ioctls = (1ULL << _UFFDIO_COPY) | (1ULL << _UFFDIO_ZEROPAGE);
+
+        if (ioctl(postcopy.uffd, UFFDIO_REGISTER, &reg) < 0 ||
+            (reg.ioctls & ioctls) != ioctls) {
+            fprintf(stderr, "Failed to register RAM block %s for post-copy: "
+                    "%s\n", blocks[i]->idstr, strerror(errno));
+            goto fail;
+        }
+        pages = MAX(pages, (blocks[i]->offset + blocks[i]->length) >>
+                           TARGET_PAGE_BITS);
+    }
+
+    postcopy.needed = bitmap_new(pages);
+    postcopy.requested = bitmap_new(pages);
+    postcopy.return_fd = return_fd;
+
+    if (qemu_pipe(postcopy.quit_fds) < 0) {
+        fprintf(stderr, "Failed to create pipe: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    qemu_thread_create(&postcopy.fault_thread, postcopy_fault_thread, NULL);
+    postcopy.active = 1;
+    return 0;
+
+fail:
+    postcopy_ram_cleanup();
+    return -1;
+}
+
+int postcopy_ram_incoming_active(void)
+{
+    return postcopy.active;
+}
+
+int postcopy_ram_discard_range(void *host, size_t length)
+{
+    RAMBlock *block;
+    ram_addr_t offset;
+    int idx;
+
+    block = postcopy_find_block(host, &idx);
+    if (!block) {
+        return -1;
+    }
+    offset = (uint8_t *)host - block->host;
+    if (offset & ~TARGET_PAGE_MASK || length & ~TARGET_PAGE_MASK ||
+        length > block->length - offset) {
+        return -1;
+    }
+
+    bitmap_set(postcopy.needed, (block->offset + offset) >> TARGET_PAGE_BITS,
+               length >> TARGET_PAGE_BITS);
+    if (qemu_madvise(host, length, QEMU_MADV_DONTNEED) < 0) {
+        fprintf(stderr, "Failed to discard RAM: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int postcopy_ram_place_page(void *host, const uint8_t *buf)
+{
+    RAMBlock *block;
+    ram_addr_t offset;
+    int idx, ret;
+
+    block = postcopy_find_block(host, &idx);
+    if (!block) {
+        return -1;
+    }
+    offset = (uint8_t *)host - block->host;
+
+    if (buf) {
+        struct uffdio_copy copy = {
+            .dst = (uintptr_t)host,
+            .src = (uintptr_t)buf,
+            .len = TARGET_PAGE_SIZE,
+        };
+
+        do {
+            ret = ioctl(postcopy.uffd, UFFDIO_COPY, &copy);
+        } while (ret < 0 && errno == EAGAIN);
+    } else {
+        ret = postcopy_zero_page(host);
+    }
+
+    /* Wakes up the accesses that were waiting for the page */
+    if (ret < 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to place page %s:%" PRIx64 ": %s\n",
+                block->idstr, (uint64_t)offset, strerror(errno));
+        return -1;
+    }
+
+    clear_bit((block->offset + offset) >> TARGET_PAGE_BITS, postcopy.needed);
+    return 0;
+}
+
+static void postcopy_listen_done(void *opaque)
+{
+    int ret;
+
+    qemu_thread_join(&postcopy.listen_thread);
+    ret = postcopy.load_ret;
+    DPRINTF("post-copy loading ended: %d\n", ret);
+
+    qemu_set_fd_handler(postcopy.done_fds[0], NULL, NULL, NULL);
+    close(postcopy.done_fds[0]);
+    close(postcopy.done_fds[1]);
+    postcopy.done_fds[0] = postcopy.done_fds[1] = -1;
+
+    qemu_fclose(postcopy.file);
+    postcopy.file = NULL;
+    close(postcopy.return_fd);
+
+    /* Accesses that wait for missing pages get zeroes from now on */
+    postcopy_ram_cleanup();
+
+    process_incoming_postcopy_done(ret);
+}
+
+/*
+ * Guest accesses wait for the pages that this thread loads, so it can't
+ * depend on the global mutex.
+ */
+static void *postcopy_listen_thread(void *opaque)
+{
+    int ret;
+
+    postcopy.load_ret = ram_load_postcopy(postcopy.file);
+    if (postcopy.load_ret < 0) {
+        int i;
+
+        /*
+         * The missing pages won't come anymore.  Accesses that wait for
+         * them, possibly in the main loop, get zeroes instead, so that the
+         * guest can be stopped.
+         */
+        for (i = 0; i < postcopy.nr_blocks; i++) {
+            struct uffdio_range range = {
+                .start = (uintptr_t)postcopy.blocks[i]->host,
+                .len = postcopy.blocks[i]->length,
+            };
+
+            ioctl(postcopy.uffd, UFFDIO_UNREGISTER, &range);
+        }
+    }
+
+    /* Cleaning up and reporting are left to the main loop */
+    do {
+        ret = write(postcopy.done_fds[1], "", 1);
+    } while (ret < 0 && errno == EINTR);
+
+    return NULL;
+}
+
+int postcopy_ram_incoming_listen(QEMUFile *f)
+{
+    if (!postcopy.active) {
+        fprintf(stderr, "Unexpected post-copy switch in migration stream\n");
+        return -1;
+    }
+
+    if (qemu_pipe(postcopy.done_fds) < 0) {
+        fprintf(stderr, "Failed to create pipe: %s\n", strerror(errno));
+        return -1;
+    }
+    qemu_set_fd_handler(postcopy.done_fds[0], postcopy_listen_done, NULL,
+                        NULL);
+
+    postcopy.file = f;
+    qemu_thread_create(&postcopy.listen_thread, postcopy_listen_thread, NULL);
+    return 0;
+}
+
+#else /* !CONFIG_USERFAULTFD */
+
+int postcopy_ram_incoming_advise(int return_fd)
+{
+    fprintf(stderr, "post-copy migration is not supported on this host\n");
+    return -1;
+}
+
+int postcopy_ram_incoming_advised(void)
+{
+    return 0;
+}
+
+int postcopy_ram_incoming_init(RAMBlock **blocks, int nr_blocks,
+                               int return_fd)
+{
+    return -1;
+}
+
+int postcopy_ram_incoming_active(void)
+{
+    return 0;
+}
+
+int postcopy_ram_discard_range(void *host, size_t length)
+{
+    return -1;
+}
+
+int postcopy_ram_place_page(void *host, const uint8_t *buf)
+{
+    return -1;
+}
+
+int postcopy_ram_incoming_listen(QEMUFile *f)
+{
+    fprintf(stderr, "post-copy migration is not supported on this host\n");
+    return -1;
+}
+
+#endif /* CONFIG_USERFAULTFD */
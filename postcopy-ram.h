@@ -0,0 +1,49 @@
+/*
+ * Post-copy live migration of RAM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef POSTCOPY_RAM_H
+#define POSTCOPY_RAM_H
+
+#include "hw/hw.h"
+
+struct RAMBlock;
+
+/*
+ * Checks in stage 1 that the host can do post-copy, so that the migration
+ * fails while the source still runs the guest if it can't.  The switch to
+ * post-copy is only accepted after it.
+ */
+int postcopy_ram_incoming_advise(int return_fd);
+int postcopy_ram_incoming_advised(void);
+
+/*
+ * Once the destination runs the guest, the pages that it doesn't have yet
+ * are missing from its RAM.  When the guest, a device or anything else
+ * touches one of them, the page is requested from the source over
+ * return_fd, which is the migration socket, and the access waits until the
+ * page arrives.  blocks are the RAM blocks in the order of the migration
+ * stream, requests identify a page by its block in that order.
+ */
+int postcopy_ram_incoming_init(struct RAMBlock **blocks, int nr_blocks,
+                               int return_fd);
+int postcopy_ram_incoming_active(void);
+
+/* Drops the current contents of a range, it must be sent again */
+int postcopy_ram_discard_range(void *host, size_t length);
+
+/* Puts a page in place atomically, buf NULL stands for a zero page */
+int postcopy_ram_place_page(void *host, const uint8_t *buf);
+
+/*
+ * Loads the rest of RAM from f in a thread of its own, and cleans up and
+ * calls process_incoming_postcopy_done() once it is done.  The post-copy
+ * phase takes ownership of f and of its socket.
+ */
+int postcopy_ram_incoming_listen(QEMUFile *f);
+
+#endif
@@ -28,6 +28,7 @@
 #include "sysemu.h"
 #include "block_int.h"
 #include <stdio.h>
+#include <getopt.h>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -38,6 +39,10 @@ typedef struct img_cmd_t {
     int (*handler)(int argc, char **argv);
 } img_cmd_t;
 
+enum {
+    OPTION_OUTPUT = 256,
+};
+
 /* Default to cache=writeback as data integrity is not important for qemu-tcg. */
 #define BDRV_O_FLAGS BDRV_O_CACHE_WB
 
@@ -78,6 +83,9 @@ static void help(void)
            "       rebasing in this case (useful for renaming the backing file)\n"
            "  '-h' with or without a command shows this help and lists the supported formats\n"
            "  '-p' show progress of command (only certain commands)\n"
+           "  '-m' number of parallel coroutines for convert (1 to 16, default 8)\n"
+           "  '-W' allow convert to write out of order\n"
+           "  '--output' takes the format in which the output must be done (human or json)\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -588,30 +596,388 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
 
+/* Default and maximum number of chunks that img_convert keeps in flight */
+#define CONVERT_COROUTINES      8
+#define CONVERT_MAX_COROUTINES  16
+
+enum ImgConvertBlockStatus {
+    BLK_DATA,
+    BLK_ZERO,
+    BLK_BACKING_FILE,
+};
+
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int64_t total_sectors;
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool compressed;
+    bool target_has_backing;
+    bool wr_in_order;
+    int cluster_sectors;
+    int buf_sectors;
+
+    /* Protected by lock: the next chunk to hand out and its status */
+    CoMutex lock;
+    int64_t sector_num;
+    enum ImgConvertBlockStatus status;
+    int64_t sector_next_status;
+
+    /* Next sector to be written when writes must stay in order */
+    int64_t wr_offs;
+
+    /* Sectors done so far, which needn't be the ones below wr_offs */
+    int64_t sectors_done;
+
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[CONVERT_MAX_COROUTINES];
+    int64_t wait_sector_num[CONVERT_MAX_COROUTINES];
+    int ret;
+} ImgConvertState;
+
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
+{
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
+    }
+}
+
+/*
+ * Returns the number of sectors to process starting at sector_num, and
+ * updates s->status with their allocation status.  Called with s->lock held.
+ */
+static int coroutine_fn convert_iteration_sectors(ImgConvertState *s,
+                                                  int64_t sector_num)
+{
+    int64_t src_cur_offset;
+    int src_cur, n, ret;
+
+    convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+    n = MIN(s->total_sectors - sector_num, INT_MAX / BDRV_SECTOR_SIZE);
+
+    if (s->sector_next_status <= sector_num) {
+        BlockDriverState *src = s->src[src_cur];
+
+        n = MIN(n, s->src_sectors[src_cur] - (sector_num - src_cur_offset));
+        if (s->target_has_backing && s->has_zero_init) {
+            /*
+             * The output's backing file has the same content as the input's,
+             * so only what the top image allocates needs to be copied.
+             */
+            ret = bdrv_co_get_block_status(src, sector_num - src_cur_offset,
+                                           n, &n);
+            if (ret & (BDRV_BLOCK_DATA | BDRV_BLOCK_ZERO)) {
+                s->status = BLK_DATA;
+            } else {
+                s->status = BLK_BACKING_FILE;
+            }
+        } else {
+            ret = bdrv_co_get_block_status_above(src, NULL,
+                                                 sector_num - src_cur_offset,
+                                                 n, &n);
+            s->status = (ret & BDRV_BLOCK_ZERO) ? BLK_ZERO : BLK_DATA;
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        if (n == 0) {
+            return -EIO;
+        }
+        s->sector_next_status = sector_num + n;
+    }
+
+    n = MIN(n, s->sector_next_status - sector_num);
+    if (s->status == BLK_DATA || (s->status == BLK_ZERO && !s->has_zero_init)) {
+        n = MIN(n, s->buf_sectors);
+    }
+
+    /*
+     * Compressed images are written a whole cluster at a time, so a cluster
+     * that is only partly unallocated must be read and written as data.
+     */
+    if (s->compressed) {
+        if (n < s->cluster_sectors) {
+            n = MIN(s->cluster_sectors, s->total_sectors - sector_num);
+            s->status = BLK_DATA;
+        } else {
+            n -= n % s->cluster_sectors;
+        }
+    }
+
+    return n;
+}
+
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
+{
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int ret;
+
+    /* A chunk may span several input images when they are concatenated */
+    while (nb_sectors > 0) {
+        int64_t src_cur_offset;
+        int src_cur, n;
+
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        n = MIN(nb_sectors, s->src_sectors[src_cur] -
+                            (sector_num - src_cur_offset));
+
+        iov.iov_base = buf;
+        iov.iov_len = n * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_readv(s->src[src_cur], sector_num - src_cur_offset,
+                            n, &qiov);
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s,
+                                         int64_t sector_num, int nb_sectors,
+                                         uint8_t *buf,
+                                         enum ImgConvertBlockStatus status)
+{
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int ret;
+
+    if (status == BLK_BACKING_FILE) {
+        /* Leave it unallocated so that the backing file shows through */
+        return 0;
+    }
+
+    if (s->compressed) {
+        /* The last cluster may be partial, pad it with zeroes */
+        if (nb_sectors < s->cluster_sectors) {
+            memset(buf + nb_sectors * BDRV_SECTOR_SIZE, 0,
+                   (s->cluster_sectors - nb_sectors) * BDRV_SECTOR_SIZE);
+        }
+        if (status == BLK_ZERO ||
+            !is_not_zero(buf, s->cluster_sectors * BDRV_SECTOR_SIZE)) {
+            return 0;
+        }
+        return bdrv_write_compressed(s->target, sector_num, buf,
+                                     s->cluster_sectors);
+    }
+
+    if (status == BLK_ZERO && s->has_zero_init) {
+        return 0;
+    }
+
+    while (nb_sectors > 0) {
+        int n = nb_sectors;
+
+        /*
+         * Zero sectors are skipped when the target reads as zeroes anyway.
+         * A copy on write target needs them in case the base image has data
+         * there, and a host device may contain garbage.
+         */
+        if (!s->has_zero_init || s->target_has_backing ||
+            is_allocated_sectors(buf, nb_sectors, &n)) {
+            iov.iov_base = buf;
+            iov.iov_len = n * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+
+            ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+/*
+ * Each coroutine repeatedly takes the next chunk of the input, reads it and
+ * writes it out.  Reads of several chunks overlap with each other and with
+ * the writes; the writes themselves are issued in order unless -W was given.
+ */
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf;
+    int index = -1;
+    int ret, i;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = qemu_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    for (;;) {
+        enum ImgConvertBlockStatus status;
+        int64_t sector_num;
+        int n;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            error_report("error while reading block status of sector %"
+                         PRId64 ": %s", s->sector_num, strerror(-n));
+            s->ret = n;
+            break;
+        }
+        sector_num = s->sector_num;
+        status = s->status;
+
+        /* Let the others go on with the following chunks meanwhile */
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA) {
+            ret = convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64 ": %s",
+                             sector_num, strerror(-ret));
+                s->ret = ret;
+            } else {
+                qemu_progress_add_bytes((uint64_t)n * BDRV_SECTOR_SIZE);
+            }
+        } else if (status == BLK_ZERO && !s->has_zero_init) {
+            memset(buf, 0, n * BDRV_SECTOR_SIZE);
+            status = BLK_DATA;
+        }
+
+        if (s->wr_in_order) {
+            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+        }
+
+        if (s->ret == -EINPROGRESS) {
+            ret = convert_co_write(s, sector_num, n, buf, status);
+            if (ret < 0) {
+                error_report("error while writing sector %" PRId64 ": %s",
+                             sector_num, strerror(-ret));
+                s->ret = ret;
+            }
+        }
+
+        /* With -W chunks finish out of order, count them instead */
+        s->sectors_done += n;
+        qemu_progress_print(100.0 * s->sectors_done / s->total_sectors, 0);
+
+        if (s->wr_in_order) {
+            /*
+             * Wake up whoever waits for this write.  The woken coroutine
+             * can't reenter us because our wait_sector_num is -1 here.  After
+             * an error, everybody must wake up to notice it and quit.
+             */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] != -1 &&
+                    (s->wait_sector_num[i] == s->wr_offs ||
+                     s->ret != -EINPROGRESS)) {
+                    qemu_coroutine_enter(s->co[i], NULL);
+                    if (s->ret == -EINPROGRESS) {
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int i;
+
+    s->ret = -EINPROGRESS;
+    s->sector_num = 0;
+    s->sector_next_status = 0;
+    s->wr_offs = 0;
+    s->sectors_done = 0;
+    qemu_co_mutex_init(&s->lock);
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+    }
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i]) {
+            qemu_coroutine_enter(s->co[i], s);
+        }
+    }
+
+    while (s->running_coroutines) {
+        qemu_aio_wait();
+    }
+
+    if (s->ret == 0 && s->compressed) {
+        /* signal EOF to align */
+        s->ret = bdrv_write_compressed(s->target, 0, NULL, 0);
+    }
+
+    return s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int c, ret = 0, bs_n, bs_i, compress, cluster_size;
     int progress = 0;
     const char *fmt, *out_fmt, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
+    int64_t total_sectors, *bs_sector_counts = NULL;
     uint64_t bs_sectors;
-    uint8_t * buf = NULL;
-    const uint8_t *buf1;
     BlockDriverInfo bdi;
+    ImgConvertState state;
+    int num_coroutines = CONVERT_COROUTINES;
+    bool wr_in_order = true;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
     char *options = NULL;
     const char *snapshot_name = NULL;
-    float local_progress;
+    char *end;
 
     fmt = NULL;
     out_fmt = "raw";
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:p");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pm:W");
         if (c == -1) {
             break;
         }
@@ -649,6 +1015,19 @@ static int img_convert(int argc, char **argv)
         case 'p':
             progress = 1;
             break;
+        case 'm':
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 ||
+                num_coroutines > CONVERT_MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d",
+                             CONVERT_MAX_COROUTINES);
+                return 1;
+            }
+            break;
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -675,6 +1054,7 @@ static int img_convert(int argc, char **argv)
     qemu_progress_print(0, 100);
 
     bs = qemu_mallocz(bs_n * sizeof(BlockDriverState *));
+    bs_sector_counts = qemu_mallocz(bs_n * sizeof(int64_t));
 
     total_sectors = 0;
     for (bs_i = 0; bs_i < bs_n; bs_i++) {
@@ -685,6 +1065,7 @@ static int img_convert(int argc, char **argv)
             goto out;
         }
         bdrv_get_geometry(bs[bs_i], &bs_sectors);
+        bs_sector_counts[bs_i] = bs_sectors;
         total_sectors += bs_sectors;
     }
 
@@ -786,10 +1167,19 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    bs_i = 0;
-    bs_offset = 0;
-    bdrv_get_geometry(bs[0], &bs_sectors);
-    buf = qemu_malloc(IO_BUF_SIZE);
+    state = (ImgConvertState) {
+        .src                = bs,
+        .src_sectors        = bs_sector_counts,
+        .src_num            = bs_n,
+        .total_sectors      = total_sectors,
+        .target             = out_bs,
+        .compressed         = compress,
+        .target_has_backing = !!out_baseimg,
+        .has_zero_init      = bdrv_has_zero_init(out_bs),
+        .wr_in_order        = wr_in_order,
+        .num_coroutines     = num_coroutines,
+        .buf_sectors        = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
+    };
 
     if (compress) {
         ret = bdrv_get_info(out_bs, &bdi);
@@ -803,165 +1193,19 @@ static int img_convert(int argc, char **argv)
             ret = -1;
             goto out;
         }
-        cluster_sectors = cluster_size >> 9;
-        sector_num = 0;
-
-        nb_sectors = total_sectors;
-        local_progress = (float)100 /
-            (nb_sectors / MIN(nb_sectors, cluster_sectors));
-
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
-
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors) {
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_offset += bs_sectors;
-                    bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%" PRId64 ", "
-                       "bs_i=%d, bs_offset=%" PRId64 ", bs_sectors=%" PRId64
-                       "\n", sector_num, bs_i, bs_offset, bs_sectors); */
-                }
-                assert (bs_num < bs_sectors);
-
-                nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
-
-                ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
-                if (ret < 0) {
-                    error_report("error while reading");
-                    goto out;
-                }
-
-                buf2 += nlow * 512;
-                bs_num += nlow;
-
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
-
-            if (n < cluster_sectors) {
-                memset(buf + n * 512, 0, cluster_size - n * 512);
-            }
-            if (is_not_zero(buf, cluster_size)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf,
-                                            cluster_sectors);
-                if (ret != 0) {
-                    error_report("error while compressing sector %" PRId64,
-                          sector_num);
-                    goto out;
-                }
-            }
-            sector_num += n;
-            qemu_progress_print(local_progress, 100);
-        }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
-    } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        local_progress = (float)100 /
-            (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
+        state.cluster_sectors = cluster_size >> 9;
+        state.buf_sectors = state.cluster_sectors;
+        /* Compressed clusters are appended to the image file */
+        state.wr_in_order = true;
+    }
 
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
+    ret = convert_do_copy(&state);
 
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading");
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors(buf1, n, &n1)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing");
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
-        }
-    }
 out:
     qemu_progress_end();
     free_option_parameters(create_options);
     free_option_parameters(param);
-    qemu_free(buf);
+    qemu_free(bs_sector_counts);
     if (out_bs) {
         bdrv_delete(out_bs);
     }
@@ -1102,6 +1346,178 @@ static int img_info(int argc, char **argv)
     return 0;
 }
 
+typedef struct MapEntry {
+    int64_t start;
+    int64_t length;
+    int depth;
+    int64_t flags;
+    int64_t offset;
+    BlockDriverState *bs;
+} MapEntry;
+
+enum {
+    OUTPUT_HUMAN,
+    OUTPUT_JSON,
+};
+
+static void dump_map_entry(int output_format, MapEntry *e, MapEntry *next)
+{
+    const char *filename;
+
+    switch (output_format) {
+    case OUTPUT_HUMAN:
+        if ((e->flags & (BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID)) !=
+            (BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID)) {
+            break;
+        }
+        /* Data comes from the image file of a format driver */
+        filename = e->bs->file ? e->bs->file->filename : e->bs->filename;
+        printf("%#-16" PRIx64 "%#-16" PRIx64 "%#-16" PRIx64 "%s\n",
+               e->start, e->length, e->offset, filename);
+        break;
+    case OUTPUT_JSON:
+        printf("%s{ \"start\": %" PRId64 ", \"length\": %" PRId64 ", "
+               "\"depth\": %d, \"zero\": %s, \"data\": %s",
+               e->start == 0 ? "[" : ",\n ",
+               e->start, e->length, e->depth,
+               (e->flags & BDRV_BLOCK_ZERO) ? "true" : "false",
+               (e->flags & BDRV_BLOCK_DATA) ? "true" : "false");
+        if (e->flags & BDRV_BLOCK_OFFSET_VALID) {
+            printf(", \"offset\": %" PRId64, e->offset);
+        }
+        printf(" }");
+        if (!next) {
+            printf("]\n");
+        }
+        break;
+    }
+}
+
+/*
+ * Looks up the image in the backing file chain that provides the sectors
+ * starting at sector_num, and fills in e accordingly.
+ */
+static int get_block_status(BlockDriverState *bs, int64_t sector_num,
+                            int nb_sectors, MapEntry *e)
+{
+    int64_t ret;
+    int depth = 0;
+
+    for (;;) {
+        ret = bdrv_get_block_status(bs, sector_num, nb_sectors, &nb_sectors);
+        if (ret < 0) {
+            return ret;
+        }
+        if ((ret & (BDRV_BLOCK_DATA | BDRV_BLOCK_ZERO)) || !bs->backing_hd) {
+            break;
+        }
+        bs = bs->backing_hd;
+        depth++;
+    }
+
+    e->start = sector_num * BDRV_SECTOR_SIZE;
+    e->length = (int64_t)nb_sectors * BDRV_SECTOR_SIZE;
+    e->depth = depth;
+    e->flags = ret & ~BDRV_BLOCK_OFFSET_MASK;
+    e->offset = ret & BDRV_BLOCK_OFFSET_MASK;
+    e->bs = bs;
+    return 0;
+}
+
+static int img_map(int argc, char **argv)
+{
+    int c;
+    const char *filename, *fmt;
+    const char *output = NULL;
+    int output_format = OUTPUT_HUMAN;
+    BlockDriverState *bs;
+    MapEntry curr = { .length = 0 }, next;
+    int64_t sector_num, total_sectors;
+    int n, ret = 0;
+
+    fmt = NULL;
+    for (;;) {
+        int option_index = 0;
+        static const struct option long_options[] = {
+            {"help", no_argument, 0, 'h'},
+            {"format", required_argument, 0, 'f'},
+            {"output", required_argument, 0, OPTION_OUTPUT},
+            {0, 0, 0, 0}
+        };
+        c = getopt_long(argc, argv, "f:h", long_options, &option_index);
+        if (c == -1) {
+            break;
+        }
+        switch (c) {
+        case '?':
+        case 'h':
+            help();
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case OPTION_OUTPUT:
+            output = optarg;
+            break;
+        }
+    }
+    if (optind >= argc) {
+        help();
+    }
+    filename = argv[optind++];
+
+    if (output && !strcmp(output, "json")) {
+        output_format = OUTPUT_JSON;
+    } else if (output && !strcmp(output, "human")) {
+        output_format = OUTPUT_HUMAN;
+    } else if (output) {
+        error_report("--output must be used with human or json as argument.");
+        return 1;
+    }
+
+    bs = bdrv_new_open(filename, fmt, BDRV_O_FLAGS);
+    if (!bs) {
+        return 1;
+    }
+
+    if (output_format == OUTPUT_HUMAN) {
+        printf("%-16s%-16s%-16s%s\n", "Offset", "Length", "Mapped to", "File");
+    }
+
+    total_sectors = bdrv_getlength(bs) / BDRV_SECTOR_SIZE;
+    for (sector_num = 0; sector_num < total_sectors; sector_num += n) {
+        n = MIN(total_sectors - sector_num, INT_MAX / BDRV_SECTOR_SIZE);
+        ret = get_block_status(bs, sector_num, n, &next);
+        if (ret < 0) {
+            error_report("Could not read file metadata: %s", strerror(-ret));
+            goto out;
+        }
+        n = next.length / BDRV_SECTOR_SIZE;
+
+        /* Merge with the previous extent if they continue each other */
+        if (curr.length != 0 && curr.flags == next.flags &&
+            curr.depth == next.depth && curr.bs == next.bs &&
+            (!(curr.flags & BDRV_BLOCK_OFFSET_VALID) ||
+             curr.offset + curr.length == next.offset)) {
+            curr.length += next.length;
+            continue;
+        }
+
+        if (curr.length > 0) {
+            dump_map_entry(output_format, &curr, &next);
+        }
+        curr = next;
+    }
+
+    if (curr.length > 0) {
+        dump_map_entry(output_format, &curr, NULL);
+    }
+
+out:
+    bdrv_delete(bs);
+    return ret < 0;
+}
+
 #define SNAPSHOT_LIST   1
 #define SNAPSHOT_CREATE 2
 #define SNAPSHOT_APPLY  3
@@ -1220,6 +1636,21 @@ static int img_snapshot(int argc, char **argv)
     return 0;
 }
 
+/*
+ * Returns the block status of a backing file for img_rebase().  Sectors
+ * beyond the end of the backing file read as zeroes.
+ */
+static int64_t rebase_backing_status(BlockDriverState *bs,
+                                     uint64_t total_sectors,
+                                     uint64_t sector_num, int n, int *pnum)
+{
+    if (sector_num >= total_sectors) {
+        *pnum = n;
+        return BDRV_BLOCK_ZERO;
+    }
+    return bdrv_get_block_status_above(bs, NULL, sector_num, n, pnum);
+}
+
 static int img_rebase(int argc, char **argv)
 {
     BlockDriverState *bs, *bs_old_backing = NULL, *bs_new_backing = NULL;
@@ -1342,19 +1773,20 @@ static int img_rebase(int argc, char **argv)
      */
     if (!unsafe) {
         uint64_t num_sectors;
+        uint64_t old_backing_sectors, new_backing_sectors;
         uint64_t sector;
         int n;
+        int64_t old_status, new_status;
         uint8_t * buf_old;
         uint8_t * buf_new;
-        float local_progress;
 
         buf_old = qemu_malloc(IO_BUF_SIZE);
         buf_new = qemu_malloc(IO_BUF_SIZE);
 
         bdrv_get_geometry(bs, &num_sectors);
+        bdrv_get_geometry(bs_old_backing, &old_backing_sectors);
+        bdrv_get_geometry(bs_new_backing, &new_backing_sectors);
 
-        local_progress = (float)100 /
-            (num_sectors / MIN(num_sectors, IO_BUF_SIZE / 512));
         for (sector = 0; sector < num_sectors; sector += n) {
 
             /* How many sectors can we handle with the next read? */
@@ -1367,20 +1799,57 @@ static int img_rebase(int argc, char **argv)
             /* If the cluster is allocated, we don't need to take action */
             ret = bdrv_is_allocated(bs, sector, n, &n);
             if (ret) {
+                qemu_progress_print((float)n * 100 / num_sectors, 100);
                 continue;
             }
 
-            /* Read old and new backing file */
-            ret = bdrv_read(bs_old_backing, sector, buf_old, n);
-            if (ret < 0) {
+            /*
+             * Find out how much of the old and new backing file is the same
+             * kind of extent, so that areas reading as zeroes don't need to
+             * be read at all.
+             */
+            old_status = rebase_backing_status(bs_old_backing,
+                                               old_backing_sectors,
+                                               sector, n, &n);
+            if (old_status < 0) {
+                ret = old_status;
                 error_report("error while reading from old backing file");
                 goto out;
             }
-            ret = bdrv_read(bs_new_backing, sector, buf_new, n);
-            if (ret < 0) {
+            new_status = rebase_backing_status(bs_new_backing,
+                                               new_backing_sectors,
+                                               sector, n, &n);
+            if (new_status < 0) {
+                ret = new_status;
                 error_report("error while reading from new backing file");
                 goto out;
             }
+            qemu_progress_print((float)n * 100 / num_sectors, 100);
+
+            if ((old_status & BDRV_BLOCK_ZERO) &&
+                (new_status & BDRV_BLOCK_ZERO)) {
+                continue;
+            }
+
+            /* Read old and new backing file */
+            if (old_status & BDRV_BLOCK_ZERO) {
+                memset(buf_old, 0, n * BDRV_SECTOR_SIZE);
+            } else {
+                ret = bdrv_read(bs_old_backing, sector, buf_old, n);
+                if (ret < 0) {
+                    error_report("error while reading from old backing file");
+                    goto out;
+                }
+            }
+            if (new_status & BDRV_BLOCK_ZERO) {
+                memset(buf_new, 0, n * BDRV_SECTOR_SIZE);
+            } else {
+                ret = bdrv_read(bs_new_backing, sector, buf_new, n);
+                if (ret < 0) {
+                    error_report("error while reading from new backing file");
+                    goto out;
+                }
+            }
 
             /* If they differ, we need to write to the COW file */
             uint64_t written = 0;
@@ -1402,7 +1871,6 @@ static int img_rebase(int argc, char **argv)
 
                 written += pnum;
             }
-            qemu_progress_print(local_progress, 100);
         }
 
         qemu_free(buf_old);
@@ -16,6 +16,7 @@
 
 #include "qemu-common.h"
 #include "block_int.h"
+#include "qemu-timer.h"
 #include "cmd.h"
 
 #define VERSION	"0.0.1"
@@ -1569,6 +1570,350 @@ static const cmdinfo_t map_cmd = {
 };
 
 
+/*
+ * Sustained workload: keeps a number of AIO requests in flight until the
+ * given time has passed or the given number of requests has been submitted.
+ */
+struct bench_ctx {
+	int64_t offset;		/* start of the benchmarked range */
+	int64_t nr_blocks;	/* size of the range in requests */
+	int64_t next;		/* next block for sequential requests */
+	int size;
+	int write;
+	int random;
+	int64_t end_time;	/* in ns, for runs that are limited by time */
+	int64_t count;		/* requests left to submit, or -1 */
+	int in_flight;
+	int error;
+
+	int64_t ops;
+	int64_t *latencies;	/* completion latency of each request in ns */
+	int64_t max_ops;
+};
+
+struct bench_req {
+	struct bench_ctx *ctx;
+	QEMUIOVector qiov;
+	struct iovec iov;
+	int64_t offset;
+	int64_t start;
+};
+
+static void bench_submit(struct bench_req *req);
+
+static void
+bench_done(void *opaque, int ret)
+{
+	struct bench_req *req = opaque;
+	struct bench_ctx *ctx = req->ctx;
+	int64_t now = get_clock();
+
+	ctx->in_flight--;
+
+	if (ret < 0) {
+		if (!ctx->error) {
+			printf("bench: %s failed at offset %" PRId64 ": %s\n",
+				ctx->write ? "write" : "read", req->offset,
+				strerror(-ret));
+			ctx->error = ret;
+		}
+		return;
+	}
+
+	if (ctx->ops == ctx->max_ops) {
+		ctx->max_ops = ctx->max_ops ? ctx->max_ops * 2 : 4096;
+		ctx->latencies = qemu_realloc(ctx->latencies,
+			ctx->max_ops * sizeof(ctx->latencies[0]));
+	}
+	ctx->latencies[ctx->ops++] = now - req->start;
+
+	if (ctx->error == 0 &&
+	    (ctx->count >= 0 ? ctx->count > 0 : now < ctx->end_time)) {
+		bench_submit(req);
+	}
+}
+
+static void
+bench_submit(struct bench_req *req)
+{
+	struct bench_ctx *ctx = req->ctx;
+	BlockDriverAIOCB *acb;
+	int64_t block;
+
+	if (ctx->random) {
+		block = (((uint64_t)random() << 31) ^ random()) % ctx->nr_blocks;
+	} else {
+		block = ctx->next++;
+		if (ctx->next == ctx->nr_blocks) {
+			ctx->next = 0;
+		}
+	}
+	req->offset = ctx->offset + block * ctx->size;
+
+	if (ctx->count > 0) {
+		ctx->count--;
+	}
+	ctx->in_flight++;
+	req->start = get_clock();
+
+	if (ctx->write) {
+		acb = bdrv_aio_writev(bs, req->offset >> 9, &req->qiov,
+				      ctx->size >> 9, bench_done, req);
+	} else {
+		acb = bdrv_aio_readv(bs, req->offset >> 9, &req->qiov,
+				     ctx->size >> 9, bench_done, req);
+	}
+	if (!acb) {
+		bench_done(req, -EIO);
+	}
+}
+
+static int
+compare_int64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Latency below which pct percent of the requests completed, in usec */
+static double
+bench_percentile(struct bench_ctx *ctx, double pct)
+{
+	int64_t i = (int64_t)(pct / 100 * (ctx->ops - 1) + 0.5);
+
+	return ctx->latencies[i] / 1000.0;
+}
+
+static void
+bench_report(struct bench_ctx *ctx, int depth, int64_t elapsed, int Cflag)
+{
+	char s1[64], s2[64], ts[64];
+	struct timeval t;
+	double avg = 0;
+	int64_t i, total = ctx->ops * ctx->size;
+
+	for (i = 0; i < ctx->ops; i++) {
+		avg += ctx->latencies[i];
+	}
+	avg /= ctx->ops * 1000.0;
+	qsort(ctx->latencies, ctx->ops, sizeof(ctx->latencies[0]),
+	      compare_int64);
+
+	t.tv_sec = elapsed / 1000000000LL;
+	t.tv_usec = (elapsed % 1000000000LL) / 1000;
+	timestr(&t, ts, sizeof(ts), Cflag ? VERBOSE_FIXED_TIME : 0);
+
+	if (!Cflag) {
+		cvtstr((double)total, s1, sizeof(s1));
+		cvtstr(tdiv((double)total, t), s2, sizeof(s2));
+		printf("%s %d bytes per request, queue depth %d, %s\n",
+			ctx->write ? "wrote" : "read", ctx->size, depth,
+			ctx->random ? "random" : "sequential");
+		printf("%s, %" PRId64 " ops; %s (%s/sec and %.4f ops/sec)\n",
+			s1, ctx->ops, ts, s2, tdiv((double)ctx->ops, t));
+		printf("latency (usec): min %.1f, avg %.1f, max %.1f\n",
+			ctx->latencies[0] / 1000.0, avg,
+			ctx->latencies[ctx->ops - 1] / 1000.0);
+		printf("percentiles (usec): 50%% %.1f, 90%% %.1f, 99%% %.1f, "
+			"99.9%% %.1f\n",
+			bench_percentile(ctx, 50), bench_percentile(ctx, 90),
+			bench_percentile(ctx, 99), bench_percentile(ctx, 99.9));
+	} else {
+		/* bytes,ops,time,bytes/sec,ops/sec,min,avg,max,p50,p90,p99,p99.9 */
+		printf("%" PRId64 ",%" PRId64 ",%s,%.3f,%.3f,"
+			"%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+			total, ctx->ops, ts,
+			tdiv((double)total, t), tdiv((double)ctx->ops, t),
+			ctx->latencies[0] / 1000.0, avg,
+			ctx->latencies[ctx->ops - 1] / 1000.0,
+			bench_percentile(ctx, 50), bench_percentile(ctx, 90),
+			bench_percentile(ctx, 99), bench_percentile(ctx, 99.9));
+	}
+}
+
+static void
+bench_help(void)
+{
+	printf(
+"\n"
+" runs a sustained read or write workload and reports its performance\n"
+"\n"
+" Example:\n"
+" 'bench -r -d 32 -s 4k -t 10' - random 4k reads at queue depth 32 for\n"
+"                                 10 seconds\n"
+"\n"
+" Keeps the given number of asynchronous requests in flight over a range of\n"
+" the currently open file, submitting a new request whenever one completes,\n"
+" and reports throughput, IOPS and the distribution of request latencies.\n"
+" -C, -- report statistics in a machine parsable format\n"
+" -d, -- number of requests in flight (default 1)\n"
+" -l, -- length of the range that is accessed (default: up to end of file)\n"
+" -n, -- stop after this many requests instead of after a time\n"
+" -o, -- start of the range that is accessed (default 0)\n"
+" -P, -- use different pattern to fill file (for writes)\n"
+" -r, -- access random blocks of the range instead of sequential ones\n"
+" -s, -- size of each request (default 4k)\n"
+" -t, -- run for this many seconds (default 5)\n"
+" -w, -- write instead of read\n"
+"\n");
+}
+
+static int bench_f(int argc, char **argv);
+
+static const cmdinfo_t bench_cmd = {
+	.name		= "bench",
+	.cfunc		= bench_f,
+	.argmin		= 0,
+	.argmax		= -1,
+	.args		= "[-Crw] [-d depth] [-s size] [-t secs | -n count] "
+			  "[-o off] [-l len] [-P pattern]",
+	.oneline	= "runs a sustained I/O workload",
+	.help		= bench_help,
+};
+
+static int
+bench_f(int argc, char **argv)
+{
+	struct bench_ctx ctx;
+	struct bench_req *reqs;
+	int Cflag = 0, depth = 1, pattern = 0xcd;
+	int64_t length = -1, size = 4096, seconds = 5, start, elapsed;
+	int64_t image_size;
+	int c, i;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.count = -1;
+
+	while ((c = getopt(argc, argv, "Cd:l:n:o:P:rs:t:w")) != EOF) {
+		switch (c) {
+		case 'C':
+			Cflag = 1;
+			break;
+		case 'd':
+			depth = cvtnum(optarg);
+			if (depth <= 0) {
+				printf("invalid queue depth -- %s\n", optarg);
+				return 0;
+			}
+			break;
+		case 'l':
+			length = cvtnum(optarg);
+			if (length < 0) {
+				printf("non-numeric length argument -- %s\n",
+					optarg);
+				return 0;
+			}
+			break;
+		case 'n':
+			ctx.count = cvtnum(optarg);
+			if (ctx.count <= 0) {
+				printf("invalid request count -- %s\n", optarg);
+				return 0;
+			}
+			break;
+		case 'o':
+			ctx.offset = cvtnum(optarg);
+			if (ctx.offset < 0) {
+				printf("non-numeric offset argument -- %s\n",
+					optarg);
+				return 0;
+			}
+			break;
+		case 'P':
+			pattern = parse_pattern(optarg);
+			if (pattern < 0)
+				return 0;
+			break;
+		case 'r':
+			ctx.random = 1;
+			break;
+		case 's':
+			size = cvtnum(optarg);
+			if (size <= 0 || size > INT_MAX) {
+				printf("invalid request size -- %s\n", optarg);
+				return 0;
+			}
+			break;
+		case 't':
+			seconds = cvtnum(optarg);
+			if (seconds <= 0) {
+				printf("invalid duration -- %s\n", optarg);
+				return 0;
+			}
+			break;
+		case 'w':
+			ctx.write = 1;
+			break;
+		default:
+			return command_usage(&bench_cmd);
+		}
+	}
+
+	if (optind != argc) {
+		return command_usage(&bench_cmd);
+	}
+
+	if ((ctx.offset | size) & 0x1ff) {
+		printf("offset %" PRId64 " or size %" PRId64
+		       " is not sector aligned\n", ctx.offset, size);
+		return 0;
+	}
+
+	image_size = bdrv_getlength(bs);
+	if (image_size < 0) {
+		printf("could not get the image size: %s\n",
+			strerror(-image_size));
+		return 0;
+	}
+	if (length < 0) {
+		length = image_size - ctx.offset;
+	}
+	if (ctx.offset + length > image_size) {
+		printf("range exceeds the image size %" PRId64 "\n",
+			image_size);
+		return 0;
+	}
+	ctx.size = size;
+	ctx.nr_blocks = length / size;
+	if (ctx.nr_blocks == 0) {
+		printf("range is smaller than one request\n");
+		return 0;
+	}
+
+	reqs = qemu_mallocz(depth * sizeof(reqs[0]));
+	for (i = 0; i < depth; i++) {
+		reqs[i].ctx = &ctx;
+		reqs[i].iov.iov_base = qemu_io_alloc(size, pattern);
+		reqs[i].iov.iov_len = size;
+		qemu_iovec_init_external(&reqs[i].qiov, &reqs[i].iov, 1);
+	}
+
+	/* The same sequence of random offsets for each run */
+	srandom(1);
+
+	start = get_clock();
+	ctx.end_time = start + seconds * 1000000000LL;
+	for (i = 0; i < depth && ctx.count != 0 && !ctx.error; i++) {
+		bench_submit(&reqs[i]);
+	}
+	while (ctx.in_flight > 0) {
+		qemu_aio_wait();
+	}
+	elapsed = get_clock() - start;
+
+	if (ctx.ops > 0) {
+		bench_report(&ctx, depth, elapsed, Cflag);
+	}
+
+	for (i = 0; i < depth; i++) {
+		qemu_io_free(reqs[i].iov.iov_base);
+	}
+	qemu_free(reqs);
+	qemu_free(ctx.latencies);
+	return 0;
+}
+
 static int
 close_f(int argc, char **argv)
 {
@@ -1714,6 +2059,7 @@ static void usage(const char *name)
 "  -g, --growable       allow file to grow (only applies to protocols)\n"
 "  -m, --misalign       misalign allocations for O_DIRECT\n"
 "  -k, --native-aio     use kernel AIO implementation (on Linux only)\n"
+"  -C, --copy-on-read   enable copy-on-read from the backing file\n"
 "  -h, --help           display this help and exit\n"
 "  -V, --version        output version information and exit\n"
 "\n",
@@ -1725,7 +2071,7 @@ int main(int argc, char **argv)
 {
 	int readonly = 0;
 	int growable = 0;
-	const char *sopt = "hVc:rsnmgk";
+	const char *sopt = "hVc:rsnmgkC";
         const struct option lopt[] = {
 		{ "help", 0, NULL, 'h' },
 		{ "version", 0, NULL, 'V' },
@@ -1737,6 +2083,7 @@ int main(int argc, char **argv)
 		{ "misalign", 0, NULL, 'm' },
 		{ "growable", 0, NULL, 'g' },
 		{ "native-aio", 0, NULL, 'k' },
+		{ "copy-on-read", 0, NULL, 'C' },
 		{ NULL, 0, NULL, 0 }
 	};
 	int c;
@@ -1768,6 +2115,9 @@ int main(int argc, char **argv)
 		case 'k':
 			flags |= BDRV_O_NATIVE_AIO;
 			break;
+		case 'C':
+			flags |= BDRV_O_COPY_ON_READ;
+			break;
 		case 'V':
 			printf("%s version %s\n", progname, VERSION);
 			exit(0);
@@ -1807,6 +2157,7 @@ int main(int argc, char **argv)
 	add_command(&discard_cmd);
 	add_command(&alloc_cmd);
 	add_command(&map_cmd);
+	add_command(&bench_cmd);
 
 	add_args_command(init_args_command);
 	add_check_command(init_check_command);
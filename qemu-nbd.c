@@ -19,6 +19,7 @@
 #include <qemu-common.h>
 #include "block_int.h"
 #include "nbd.h"
+#include "qemu-timer.h"
 
 #include <stdarg.h>
 #include <stdio.h>
@@ -34,9 +35,10 @@
 
 #define SOCKET_PATH    "/var/lock/qemu-nbd-%s"
 
-#define NBD_BUFFER_SIZE (1024*1024)
-
 static int verbose;
+static int shared = 1;
+static int nb_fds;
+static int server_fd;
 
 static void usage(const char *name)
 {
@@ -180,17 +182,74 @@ static void show_parts(const char *device)
     }
 }
 
+static void nbd_accept(void *opaque);
+
+static void nbd_update_server_fd_handler(NBDExport *exp)
+{
+    /* Leave further connections in the backlog while we are full */
+    if (nb_fds < shared) {
+        qemu_aio_set_fd_handler(server_fd, nbd_accept, NULL, NULL, NULL, exp);
+    } else {
+        qemu_aio_set_fd_handler(server_fd, NULL, NULL, NULL, NULL, NULL);
+    }
+}
+
+static void nbd_client_closed(NBDClient *client)
+{
+    const NBDClientStats *stats = nbd_client_get_stats(client);
+
+    if (verbose) {
+        int64_t elapsed_ns = get_clock() - stats->connect_time_ns;
+        uint64_t ops = stats->rd_ops + stats->wr_ops;
+        uint64_t bytes = stats->rd_bytes + stats->wr_bytes;
+
+        fprintf(stderr,
+                "client disconnected: %" PRIu64 " reads (%" PRIu64 " bytes), "
+                "%" PRIu64 " writes (%" PRIu64 " bytes)\n",
+                stats->rd_ops, stats->rd_bytes,
+                stats->wr_ops, stats->wr_bytes);
+        fprintf(stderr,
+                "  %.1f KB/s over %.3f s, latency avg %" PRIu64 " us, "
+                "max %" PRIu64 " us\n",
+                elapsed_ns ? bytes * 1e9 / 1024 / elapsed_ns : 0.0,
+                elapsed_ns / 1e9,
+                ops ? stats->total_time_ns / ops / 1000 : 0,
+                stats->max_time_ns / 1000);
+    }
+
+    nb_fds--;
+    nbd_update_server_fd_handler(nbd_client_get_opaque(client));
+}
+
+static void nbd_accept(void *opaque)
+{
+    NBDExport *exp = opaque;
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd;
+
+    fd = accept(server_fd, (struct sockaddr *)&addr, &addr_len);
+    if (fd == -1) {
+        return;
+    }
+
+    if (nbd_client_new(exp, fd, nbd_client_closed, exp) == NULL) {
+        close(fd);
+        return;
+    }
+
+    nb_fds++;
+    nbd_update_server_fd_handler(exp);
+}
+
 int main(int argc, char **argv)
 {
     BlockDriverState *bs;
     off_t dev_offset = 0;
-    off_t offset = 0;
     bool readonly = false;
     bool disconnect = false;
     const char *bindto = "0.0.0.0";
     int port = NBD_DEFAULT_PORT;
-    struct sockaddr_in addr;
-    socklen_t addr_len = sizeof(addr);
     off_t fd_size;
     char *device = NULL;
     char *socket = NULL;
@@ -221,15 +280,9 @@ int main(int argc, char **argv)
     int flags = BDRV_O_RDWR;
     int partition = -1;
     int ret;
-    int shared = 1;
-    uint8_t *data;
-    fd_set fds;
-    int *sharing_fds;
     int fd;
-    int i;
-    int nb_fds = 0;
-    int max_fd;
     int persistent = 0;
+    NBDExport *exp;
     uint32_t nbdflags;
 
     while ((ch = getopt_long(argc, argv, sopt, lopt, &opt_ind)) != -1) {
@@ -431,67 +484,33 @@ int main(int argc, char **argv)
         /* children */
     }
 
-    sharing_fds = qemu_malloc((shared + 1) * sizeof(int));
-
     if (socket) {
-        sharing_fds[0] = unix_socket_incoming(socket);
+        server_fd = unix_socket_incoming(socket);
     } else {
-        sharing_fds[0] = tcp_socket_incoming(bindto, port);
+        server_fd = tcp_socket_incoming(bindto, port);
     }
 
-    if (sharing_fds[0] == -1)
+    if (server_fd == -1)
         return 1;
-    max_fd = sharing_fds[0];
-    nb_fds++;
 
-    data = qemu_blockalign(bs, NBD_BUFFER_SIZE);
-    if (data == NULL)
-        errx(EXIT_FAILURE, "Cannot allocate data buffer");
+    exp = nbd_export_new(bs, dev_offset, fd_size, readonly);
+    nbd_update_server_fd_handler(exp);
 
+    /* Clients, their requests and new connections are all dispatched from
+     * the AIO fd handlers.
+     */
     do {
+        qemu_aio_wait();
+    } while (persistent || nb_fds > 0);
 
-        FD_ZERO(&fds);
-        for (i = 0; i < nb_fds; i++)
-            FD_SET(sharing_fds[i], &fds);
-
-        ret = select(max_fd + 1, &fds, NULL, NULL, NULL);
-        if (ret == -1)
-            break;
-
-        if (FD_ISSET(sharing_fds[0], &fds))
-            ret--;
-        for (i = 1; i < nb_fds && ret; i++) {
-            if (FD_ISSET(sharing_fds[i], &fds)) {
-                if (nbd_trip(bs, sharing_fds[i], fd_size, dev_offset,
-                    &offset, readonly, data, NBD_BUFFER_SIZE) != 0) {
-                    close(sharing_fds[i]);
-                    nb_fds--;
-                    sharing_fds[i] = sharing_fds[nb_fds];
-                    i--;
-                }
-                ret--;
-            }
-        }
-        /* new connection ? */
-        if (FD_ISSET(sharing_fds[0], &fds)) {
-            if (nb_fds < shared + 1) {
-                sharing_fds[nb_fds] = accept(sharing_fds[0],
-                                             (struct sockaddr *)&addr,
-                                             &addr_len);
-                if (sharing_fds[nb_fds] != -1 &&
-                    nbd_negotiate(sharing_fds[nb_fds], fd_size) != -1) {
-                        if (sharing_fds[nb_fds] > max_fd)
-                            max_fd = sharing_fds[nb_fds];
-                        nb_fds++;
-                }
-            }
-        }
-    } while (persistent || nb_fds > 1);
-    qemu_vfree(data);
+    /* The listening socket is always polled, qemu_aio_flush() would wait
+     * for it forever.
+     */
+    qemu_aio_set_fd_handler(server_fd, NULL, NULL, NULL, NULL, NULL);
+    nbd_export_close(exp);
 
-    close(sharing_fds[0]);
+    close(server_fd);
     bdrv_close(bs);
-    qemu_free(sharing_fds);
     if (socket)
         unlink(socket);
 
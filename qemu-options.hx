@@ -120,7 +120,8 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
-    "       [,readonly=on|off]\n"
+    "       [,readonly=on|off][[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
+    "       [[,iops=i]|[[,iops_rd=r][,iops_wr=w]]][,copy-on-read=on|off]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -160,6 +161,18 @@ an untrusted format header.
 This option specifies the serial number to assign to the device.
 @item addr=@var{addr}
 Specify the controller's PCI address (if=virtio only).
+@item bps=@var{b},bps_rd=@var{r},bps_wr=@var{w}
+Limit the throughput of the drive to @var{b} bytes per second in total, or
+to @var{r} bytes per second for reads and @var{w} bytes per second for writes.
+@item iops=@var{i},iops_rd=@var{r},iops_wr=@var{w}
+Limit the drive to @var{i} I/O operations per second in total, or to @var{r}
+read and @var{w} write operations per second.  Requests exceeding a limit are
+delayed, not failed.
+@item copy-on-read=@var{copy-on-read}
+@var{copy-on-read} is "on" or "off" and enables whether to copy read backing
+file sectors into the image file.  This avoids fetching the same data from
+a slow or remote backing file again; see also the @code{block_stream}
+monitor command.
 @end table
 
 By default, writethrough caching is used for all block device.  This means that
@@ -233,6 +246,21 @@ qemu -hda a -hdb b
 @end example
 ETEXI
 
+DEF("aio-pool", HAS_ARG, QEMU_OPTION_aio_pool,
+    "-aio-pool [min=n][,max=n]\n"
+    "                set the size of the thread pool used for aio=threads\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -aio-pool [min=@var{n}][,max=@var{n}]
+@findex -aio-pool
+Set the number of worker threads used by drives with @option{aio=threads}.
+Up to @option{max} threads (default 64) are started on demand; @option{min}
+threads (default 0) are kept alive while the pool is idle.  Requests are
+queued per drive and served round-robin, so one slow drive does not delay
+the others.  Use @code{info aio} in the monitor to see queue wait and
+service time histograms.
+ETEXI
+
 DEF("set", HAS_ARG, QEMU_OPTION_set,
     "-set group.id.arg=value\n"
     "                set <arg> parameter for item <id> of type <group>\n"
@@ -2317,7 +2345,8 @@ DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
 STEXI
 @item -incoming @var{port}
 @findex -incoming
-Prepare for incoming migration, listen on @var{port}.
+Prepare for incoming migration, listen on @var{port}.  With file:@var{path},
+the state that a migration to that file saved is loaded.
 ETEXI
 
 DEF("nodefaults", 0, QEMU_OPTION_nodefaults, \
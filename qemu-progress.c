@@ -25,12 +25,15 @@
 #include "qemu-common.h"
 #include "osdep.h"
 #include "sysemu.h"
+#include "qemu-timer.h"
 #include <stdio.h>
 
 struct progress_state {
     float current;
     float last_print;
     float min_skip;
+    uint64_t bytes;
+    int64_t start_time;
     void (*print)(void);
     void (*end)(void);
 };
@@ -38,6 +41,17 @@ struct progress_state {
 static struct progress_state state;
 static volatile sig_atomic_t print_pending;
 
+/* Average throughput since qemu_progress_init(), in MB (2^20 bytes) per s */
+static double progress_rate(void)
+{
+    int64_t elapsed = get_clock() - state.start_time;
+
+    if (elapsed <= 0) {
+        return 0;
+    }
+    return (double)state.bytes * 1000000000 / elapsed / (1 << 20);
+}
+
 /*
  * Simple progress print function.
  * @percent relative percent of current operation
@@ -45,12 +59,22 @@ static volatile sig_atomic_t print_pending;
  */
 static void progress_simple_print(void)
 {
-    printf("    (%3.2f/100%%)\r", state.current);
+    if (state.bytes) {
+        printf("    (%3.2f/100%%) %.1f MB/s\r", state.current,
+               progress_rate());
+    } else {
+        printf("    (%3.2f/100%%)\r", state.current);
+    }
     fflush(stdout);
 }
 
 static void progress_simple_end(void)
 {
+    if (state.bytes) {
+        printf("\n    %" PRIu64 " MB in %.2f s (%.1f MB/s)",
+               state.bytes >> 20,
+               (get_clock() - state.start_time) / 1e9, progress_rate());
+    }
     printf("\n");
 }
 
@@ -105,6 +129,8 @@ static void progress_dummy_init(void)
 void qemu_progress_init(int enabled, float min_skip)
 {
     state.min_skip = min_skip;
+    state.bytes = 0;
+    state.start_time = get_clock();
     if (enabled) {
         progress_simple_init();
     } else {
@@ -148,3 +174,12 @@ void qemu_progress_print(float delta, int max)
         state.print();
     }
 }
+
+/*
+ * Account @bytes of I/O done by the operation; once any has been accounted,
+ * the average throughput is reported along with the progress.
+ */
+void qemu_progress_add_bytes(uint64_t bytes)
+{
+    state.bytes += bytes;
+}
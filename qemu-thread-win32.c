@@ -259,7 +259,17 @@ void qemu_thread_create(QemuThread *thread,
     if (!hThread) {
         error_exit(GetLastError(), __func__);
     }
-    CloseHandle(hThread);
+    thread->handle = hThread;
+}
+
+void *qemu_thread_join(QemuThread *thread)
+{
+    if (WaitForSingleObject(thread->handle, INFINITE) == WAIT_FAILED) {
+        error_exit(GetLastError(), __func__);
+    }
+    CloseHandle(thread->handle);
+    thread->handle = NULL;
+    return thread->ret;
 }
 
 void qemu_thread_get_self(QemuThread *thread)
@@ -15,6 +15,7 @@ struct QemuCond {
 
 struct QemuThread {
     HANDLE thread;
+    HANDLE handle;  /* for qemu_thread_join */
     void *ret;
 };
 
@@ -493,6 +493,9 @@ Notes:
 (2) All boolean arguments default to false
 (3) The user Monitor's "detach" argument is invalid in QMP and should not
     be used
+(4) With a "file:path" URI, the state is saved to a file while the guest runs,
+    and the guest keeps running once the migration completed.  The file is
+    loaded with -incoming file:path
 
 EQMP
 
@@ -570,6 +573,105 @@ Example:
 -> { "execute": "migrate_set_downtime", "arguments": { "value": 0.1 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "migrate_set_cache_size",
+        .args_type  = "value:o",
+        .params     = "value",
+        .help       = "set cache size (in bytes) for XBZRLE migrations",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_cache_size,
+    },
+
+SQMP
+migrate_set_cache_size
+----------------------
+
+Set the size of the cache of sent pages that the "xbzrle" migration
+capability uses.  The size is rounded down to a power of 2 pages, and can be
+changed while a migration is running.
+
+Arguments:
+
+- "value": cache size, in bytes (json-int)
+
+Example:
+
+-> { "execute": "migrate_set_cache_size", "arguments": { "value": 536870912 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate_set_capability",
+        .args_type  = "capability:s,state:b",
+        .params     = "capability state",
+        .help       = "Enable/Disable the usage of a capability for migration",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_capability,
+    },
+
+SQMP
+migrate_set_capability
+----------------------
+
+Enable/Disable migration capabilities.  This is only allowed while no
+migration is in progress.
+
+Arguments:
+
+- "capability": capability name (json-string)
+     - Possible values: "block-compress", "xbzrle", "compress",
+       "auto-converge", "postcopy-ram", "multifd"
+- "state": new state of the capability (json-bool)
+
+Example:
+
+-> { "execute": "migrate_set_capability",
+     "arguments": { "capability": "block-compress", "state": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate_set_parameter",
+        .args_type  = "parameter:s,value:i",
+        .params     = "parameter value",
+        .help       = "Set a parameter of the migration capabilities",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_parameter,
+    },
+
+SQMP
+migrate_set_parameter
+---------------------
+
+Set a parameter of the migration capabilities.  This is only allowed while no
+migration is in progress.
+
+Arguments:
+
+- "parameter": parameter name (json-string)
+     - "compress-level": zlib level of the "compress" capability, 0 to 9
+     - "compress-threads": number of threads compressing pages on the
+       source, 1 to 255
+     - "decompress-threads": number of threads decompressing pages on the
+       destination, 1 to 255
+     - "cpu-throttle-initial": percentage of the time the vCPUs don't run
+       when "auto-converge" first throttles them, 1 to 99
+     - "cpu-throttle-increment": percentage added when "auto-converge"
+       throttles them more, 1 to 99
+     - "multifd-channels": number of connections the "multifd" capability
+       sends RAM pages over, 1 to 16
+- "value": new value of the parameter (json-int)
+
+Example:
+
+-> { "execute": "migrate_set_parameter",
+     "arguments": { "parameter": "compress-threads", "value": 4 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -691,6 +793,191 @@ Example:
 -> { "execute": "block_resize", "arguments": { "device": "scratch", "size": 1073741824 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block_set_io_throttle",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l",
+        .params     = "device bps bps_rd bps_wr iops iops_rd iops_wr",
+        .help       = "change I/O throttle limits for a block drive",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_set_io_throttle,
+    },
+
+SQMP
+block_set_io_throttle
+------------
+
+Change I/O throttle limits for a block drive.  Requests exceeding the limits
+are queued and submitted once the drive is back within its limits.
+
+Arguments:
+
+- "device": device name (json-string)
+- "bps":  total throughput limit in bytes per second (json-int)
+- "bps_rd":  read throughput limit in bytes per second (json-int)
+- "bps_wr":  write throughput limit in bytes per second (json-int)
+- "iops":  total I/O operations per second (json-int)
+- "iops_rd":  read I/O operations per second (json-int)
+- "iops_wr":  write I/O operations per second (json-int)
+
+A value of 0 disables the corresponding limit.  A total limit can't be
+combined with a read or write limit of the same kind.
+
+Example:
+
+-> { "execute": "block_set_io_throttle", "arguments": { "device": "virtio0",
+                                               "bps": 1000000,
+                                               "bps_rd": 0,
+                                               "bps_wr": 0,
+                                               "iops": 0,
+                                               "iops_rd": 0,
+                                               "iops_wr": 0 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_stream",
+        .args_type  = "device:B",
+        .params     = "device",
+        .help       = "copy data from a backing file into a block device",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_stream,
+    },
+
+SQMP
+block_stream
+------------
+
+Copy data from the backing file chain into the image of a block device, then
+drop the backing file.  The copy runs in the background while the guest keeps
+using the device; its progress is reported by query-block-jobs and its end by
+a BLOCK_JOB_COMPLETED or BLOCK_JOB_CANCELLED event.
+
+Guest reads are served with copy-on-read while the job runs, so that guest
+writes never race with the data being copied.
+
+Arguments:
+
+- "device": device name (json-string)
+
+Errors:
+
+- DeviceInUse if the device already has an active block job
+- DeviceIsReadOnly if the device is read-only
+
+Example:
+
+-> { "execute": "block_stream", "arguments": { "device": "virtio0" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "drive_mirror",
+        .args_type  = "device:B,target:s,format:s?",
+        .params     = "device target [format]",
+        .help       = "copy a block device to a new image and switch to it",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_drive_mirror,
+    },
+
+SQMP
+drive_mirror
+------------
+
+Create a new image and copy the contents of a block device to it in the
+background.  Writes of the guest are tracked in a dirty bitmap and copied as
+well; once the new image has caught up with the device, the device switches
+over to it without the guest noticing.  Progress is reported by
+query-block-jobs and the end of the job by a BLOCK_JOB_COMPLETED event, which
+carries an "error" member if the copy or the switch failed.
+
+If the job is cancelled or fails, the device keeps using its original image.
+
+Arguments:
+
+- "device": device name (json-string)
+- "target": name of the new image file (json-string)
+- "format": format of the new image, defaults to the format of the current
+            image (json-string, optional)
+
+Errors:
+
+- DeviceInUse if the device already has an active block job
+- DeviceIsReadOnly if the device is read-only
+- InvalidBlockFormat if the format is unknown
+- OpenFileFailed if the new image can't be opened
+
+Example:
+
+-> { "execute": "drive_mirror", "arguments": { "device": "virtio0",
+                                               "target": "/new/disk.qcow2",
+                                               "format": "qcow2" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_job_set_speed",
+        .args_type  = "device:B,value:o",
+        .params     = "device value",
+        .help       = "set maximum speed for a background block operation",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_set_speed,
+    },
+
+SQMP
+block_job_set_speed
+-------------------
+
+Set the maximum speed of the active block job on a device.
+
+Arguments:
+
+- "device": device name (json-string)
+- "value": maximum speed in bytes per second, 0 for unlimited (json-int)
+
+Example:
+
+-> { "execute": "block_job_set_speed",
+     "arguments": { "device": "virtio0", "value": 1048576 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_job_cancel",
+        .args_type  = "device:B",
+        .params     = "device",
+        .help       = "stop an active background block operation",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_cancel,
+    },
+
+SQMP
+block_job_cancel
+----------------
+
+Stop the active block job on a device.  The command returns immediately, the
+BLOCK_JOB_CANCELLED event is emitted once the job has stopped.  Data that was
+already copied stays in the image.  A cancelled drive_mirror job leaves the
+device on its original image.
+
+Arguments:
+
+- "device": device name (json-string)
+
+Errors:
+
+- DeviceNotActive if there is no block job on the device
+
+Example:
+
+-> { "execute": "block_job_cancel", "arguments": { "device": "virtio0" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1082,6 +1369,12 @@ Each json-object contain the following:
                                 "tftp", "vdi", "vmdk", "vpc", "vvfat"
          - "backing_file": backing file name (json-string, optional)
          - "encrypted": true if encrypted, false otherwise (json-bool)
+         - "bps": limit total bytes per second (json-int)
+         - "bps_rd": limit read bytes per second (json-int)
+         - "bps_wr": limit write bytes per second (json-int)
+         - "iops": limit total I/O operations per second (json-int)
+         - "iops_rd": limit read operations per second (json-int)
+         - "iops_wr": limit write operations per second (json-int)
 
 Example:
 
@@ -1096,7 +1389,13 @@ Example:
                "ro":false,
                "drv":"qcow2",
                "encrypted":false,
-               "file":"disks/test.img"
+               "file":"disks/test.img",
+               "bps":1000000,
+               "bps_rd":0,
+               "bps_wr":0,
+               "iops":1000000,
+               "iops_rd":0,
+               "iops_wr":0
             },
             "type":"unknown"
          },
@@ -1206,6 +1505,32 @@ Example:
 
 EQMP
 
+SQMP
+query-block-jobs
+----------------
+
+Show progress of ongoing block device operations.
+
+Return a json-array of all active block jobs, each a json-object containing:
+
+- "type": the operation, "stream" or "mirror" (json-string)
+- "device": device name (json-string)
+- "len": amount of work to do, in bytes (json-int)
+- "offset": amount of work done, in bytes (json-int)
+- "speed": speed limit in bytes per second, 0 for unlimited (json-int)
+
+Example:
+
+-> { "execute": "query-block-jobs" }
+<- { "return":[
+        { "type": "stream", "device": "virtio0",
+          "len": 10737418240, "offset": 134217728,
+          "speed": 0 }
+     ]
+   }
+
+EQMP
+
 SQMP
 query-cpus
 ----------
@@ -1706,7 +2031,11 @@ block migration status.
 The main json-object contains the following:
 
 - "status": migration status (json-string)
-     - Possible values: "active", "completed", "failed", "cancelled"
+     - Possible values: "active", "postcopy-active", "completed", "failed",
+       "cancelled"
+     - "postcopy-active" means the guest already runs on the destination and
+       the rest of RAM is being sent, the members that are present when
+       "status" is "active" are present then too
 - "ram": only present if "status" is "active", it is a json-object with the
   following RAM information (in bytes):
          - "transferred": amount transferred (json-int)
@@ -1717,6 +2046,71 @@ The main json-object contains the following:
          - "transferred": amount transferred (json-int)
          - "remaining": amount remaining (json-int)
          - "total": total (json-int)
+         - "zero-blocks": number of all-zero blocks that were sent without
+           their data (json-int)
+         - "sent": amount of disk data actually put on the wire, after zero
+           block elision and compression (json-int)
+- "xbzrle-cache": only present if "status" is "active" and the "xbzrle"
+  capability is enabled, it is a json-object with the following information:
+         - "cache-size": size of the cache of sent pages, in bytes (json-int)
+         - "bytes": amount of delta encoded data sent, in bytes (json-int)
+         - "pages": number of pages sent as a delta (json-int)
+         - "cache-miss": number of pages that were sent in full because they
+           weren't cached (json-int)
+         - "overflow": number of pages that were sent in full because their
+           delta was too large (json-int)
+- "compression": only present if "status" is "active" and the "compress"
+  capability is enabled, it is a json-object with the following information:
+         - "pages": number of pages sent compressed (json-int)
+         - "bytes": amount of compressed data sent, in bytes (json-int)
+- "multifd": only present if "status" is "active" and the "multifd"
+  capability is enabled, it is a json-object with the following information:
+         - "channels": number of connections for RAM pages (json-int)
+         - "pages": number of pages queued to them (json-int)
+         - "bytes": amount of page data queued to them, in bytes (json-int)
+- "cpu-throttle-percentage": only present if "status" is "active" and the
+  "auto-converge" capability is enabled, percentage of the time the vCPUs
+  are currently kept from running (json-int)
+- "iterations": only present if "status" is "active", it is a json-object
+  with the following information about the iterations over the live state
+  (times in milliseconds):
+         - "count": number of iterations so far (json-int)
+         - "last-time": duration of the last iteration (json-int)
+         - "max-time": duration of the longest iteration (json-int)
+         - "locked-time": total time the global mutex was held by the
+           migration thread while iterating (json-int)
+         - "max-locked-time": longest time the global mutex was held at once
+           (json-int)
+- "zero-copy": only present if "status" is "active", it is a json-object
+  with the following information about the copies that were avoided:
+         - "pages": number of RAM pages that were put to the stream without
+           copying them (json-int)
+         - "direct-bytes": bytes written straight from the memory that was
+           put to the stream (json-int)
+         - "buffered-bytes": bytes that had to be copied to a buffer first,
+           because the connection couldn't take them right away (json-int)
+- "dirty-sync": only present if "status" is "active", it is a json-object
+  with the following information about the passes over the dirty memory map
+  that pick up the pages dirtied since the last one (times in microseconds):
+         - "count": number of passes so far (json-int)
+         - "last-time": duration of the last pass (json-int)
+         - "max-time": duration of the longest pass (json-int)
+         - "pages-per-sec": pages of guest RAM the last pass went over per
+           second (json-int)
+- "incoming": only present on the destination of a migration, when no
+  migration was started from it, it is a json-object with the following
+  information about loading the incoming migration:
+         - "status": "completed", "postcopy-active" while the rest of RAM is
+           loaded after the switch to post-copy, or "failed" if that failed
+           and the guest was stopped (json-string)
+         - "total-time": time until the guest could start, in milliseconds
+           (json-int)
+         - "bytes": size of the migration stream that was read (json-int)
+         - "pages": number of RAM pages that were loaded (json-int)
+         - "zero-pages": number of those pages that were zero (json-int)
+         - "zero-pages-skipped": number of zero pages that were already zero
+           on the destination and weren't written (json-int)
+         - "restore-rate": guest RAM loaded per second, in bytes (json-int)
 
 Examples:
 
@@ -1745,6 +2139,13 @@ Examples:
             "transferred":123,
             "remaining":123,
             "total":246
+         },
+         "iterations":{
+            "count":12,
+            "last-time":98,
+            "max-time":103,
+            "locked-time":6,
+            "max-locked-time":1
          }
       }
    }
@@ -1763,13 +2164,65 @@ Examples:
          "disk":{
             "total":20971520,
             "remaining":20880384,
-            "transferred":91136
+            "transferred":91136,
+            "zero-blocks":12,
+            "sent":60432
+         },
+         "iterations":{
+            "count":3,
+            "last-time":100,
+            "max-time":101,
+            "locked-time":240,
+            "max-locked-time":97
          }
       }
    }
 
 EQMP
 
+SQMP
+query-migrate-capabilities
+--------------------------
+
+Show the state of the migration capabilities.
+
+Return a json-array of json-objects, one per capability, with the following
+members:
+
+- "capability": capability name (json-string)
+- "state": whether the capability is enabled (json-bool)
+
+Example:
+
+-> { "execute": "query-migrate-capabilities" }
+<- { "return": [ { "capability": "block-compress", "state": false } ] }
+
+EQMP
+
+SQMP
+query-migrate-parameters
+------------------------
+
+Show the values of the migration parameters.
+
+Return a json-array of json-objects, one per parameter, with the following
+members:
+
+- "parameter": parameter name (json-string)
+- "value": current value (json-int)
+
+Example:
+
+-> { "execute": "query-migrate-parameters" }
+<- { "return": [ { "parameter": "compress-level", "value": 1 },
+                 { "parameter": "compress-threads", "value": 8 },
+                 { "parameter": "decompress-threads", "value": 2 },
+                 { "parameter": "cpu-throttle-initial", "value": 20 },
+                 { "parameter": "cpu-throttle-increment", "value": 10 },
+                 { "parameter": "multifd-channels", "value": 2 } ] }
+
+EQMP
+
 SQMP
 query-balloon
 -------------
@@ -0,0 +1,62 @@
+/*
+ * Ratelimiting calculations
+ *
+ * Copyright IBM, Corp. 2011
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_RATELIMIT_H
+#define QEMU_RATELIMIT_H
+
+#include "qemu-timer.h"
+
+/*
+ * Throughput is accounted in time slices.  Once the quota of a slice is
+ * used up, the caller is told how long to wait; a request that overruns
+ * the quota extends the slice accordingly, so large requests are allowed
+ * but still averaged out to the configured speed.
+ */
+typedef struct {
+    int64_t slice_start_time;
+    int64_t slice_end_time;
+    uint64_t slice_quota;
+    uint64_t slice_ns;
+    uint64_t dispatched;
+} RateLimit;
+
+/* Account for n units and return the delay in ns before the next request */
+static inline int64_t ratelimit_calculate_delay(RateLimit *limit, uint64_t n)
+{
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    double delay_slices;
+
+    if (limit->slice_end_time < now) {
+        /* Previous, possibly extended, time slice finished */
+        limit->slice_start_time = now;
+        limit->slice_end_time = now + limit->slice_ns;
+        limit->dispatched = 0;
+    }
+
+    limit->dispatched += n;
+    if (limit->dispatched < limit->slice_quota) {
+        return 0;
+    }
+
+    /* Quota exceeded, wait for the excess to be paid off */
+    delay_slices = (double)limit->dispatched / limit->slice_quota;
+    limit->slice_end_time = limit->slice_start_time +
+        (int64_t)(delay_slices * limit->slice_ns);
+    return limit->slice_end_time - now;
+}
+
+static inline void ratelimit_set_speed(RateLimit *limit, uint64_t speed,
+                                       uint64_t slice_ns)
+{
+    limit->slice_ns = slice_ns;
+    limit->slice_quota = MAX(((double)speed * slice_ns) / 1000000000ULL, 1);
+}
+
+#endif
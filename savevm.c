@@ -82,6 +82,7 @@
 #include "qemu_socket.h"
 #include "qemu-queue.h"
 #include "cpus.h"
+#include "postcopy-ram.h"
 
 #define SELF_ANNOUNCE_ROUNDS 5
 
@@ -156,14 +157,17 @@ void qemu_announce_self(void)
 /* savevm/loadvm support */
 
 #define IO_BUF_SIZE 32768
+#define MAX_IOV_SIZE MIN(IOV_MAX, 64)
 
 struct QEMUFile {
     QEMUFilePutBufferFunc *put_buffer;
+    QEMUFileWritevBufferFunc *writev_buffer;
     QEMUFileGetBufferFunc *get_buffer;
     QEMUFileCloseFunc *close;
     QEMUFileRateLimit *rate_limit;
     QEMUFileSetRateLimit *set_rate_limit;
     QEMUFileGetRateLimit *get_rate_limit;
+    QEMUFileCreditTransferFunc *credit_transfer;
     void *opaque;
     int is_write;
 
@@ -173,6 +177,13 @@ struct QEMUFile {
     int buf_size; /* 0 when writing */
     uint8_t buf[IO_BUF_SIZE];
 
+    /*
+     * With writev_buffer, what is written is queued here in order, both
+     * what was copied to buf and what qemu_put_buffer_async() points to.
+     */
+    struct iovec iov[MAX_IOV_SIZE];
+    int iovcnt;
+
     int has_error;
 };
 
@@ -332,6 +343,62 @@ QEMUFile *qemu_fopen_socket(int fd)
     return s->file;
 }
 
+/* Returns the socket behind f, or -1 if f doesn't read from a socket */
+int qemu_socket_fd(QEMUFile *f)
+{
+    QEMUFileSocket *s;
+
+    if (f->get_buffer != socket_get_buffer) {
+        return -1;
+    }
+
+    s = f->opaque;
+    return s->fd;
+}
+
+/* A file in memory, used to send device state in one piece */
+typedef struct QEMUFileBuffer
+{
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} QEMUFileBuffer;
+
+static int buffer_put_buffer(void *opaque, const uint8_t *buf,
+                             int64_t pos, int size)
+{
+    QEMUFileBuffer *s = opaque;
+
+    if (s->size + size > s->capacity) {
+        s->capacity = MAX(s->capacity * 2, s->size + size);
+        s->data = qemu_realloc(s->data, s->capacity);
+    }
+    memcpy(s->data + s->size, buf, size);
+    s->size += size;
+    return size;
+}
+
+static int buffer_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    QEMUFileBuffer *s = opaque;
+
+    if (pos >= s->size) {
+        return 0;
+    }
+    size = MIN(size, s->size - pos);
+    memcpy(buf, s->data + pos, size);
+    return size;
+}
+
+static int buffer_close(void *opaque)
+{
+    QEMUFileBuffer *s = opaque;
+
+    qemu_free(s->data);
+    qemu_free(s);
+    return 0;
+}
+
 static int file_put_buffer(void *opaque, const uint8_t *buf,
                             int64_t pos, int size)
 {
@@ -435,8 +502,45 @@ void qemu_file_set_error(QEMUFile *f)
     f->has_error = 1;
 }
 
+/*
+ * Lets f queue what is written as an iovec array and write it with
+ * writev_buffer, so that qemu_put_buffer_async() doesn't need to copy.
+ */
+void qemu_file_set_writev_buffer(QEMUFile *f,
+                                 QEMUFileWritevBufferFunc *writev_buffer)
+{
+    f->writev_buffer = writev_buffer;
+}
+
+/* Lets data that doesn't go through f count against its rate limit */
+void qemu_file_set_credit_transfer(QEMUFile *f,
+                                   QEMUFileCreditTransferFunc *credit_transfer)
+{
+    f->credit_transfer = credit_transfer;
+}
+
+static void qemu_fflush_iov(QEMUFile *f)
+{
+    ssize_t len;
+
+    if (f->iovcnt > 0) {
+        len = f->writev_buffer(f->opaque, f->iov, f->iovcnt, f->buf_offset);
+        if (len >= 0)
+            f->buf_offset += len;
+        else
+            f->has_error = 1;
+    }
+    f->buf_index = 0;
+    f->iovcnt = 0;
+}
+
 void qemu_fflush(QEMUFile *f)
 {
+    if (f->writev_buffer) {
+        qemu_fflush_iov(f);
+        return;
+    }
+
     if (!f->put_buffer)
         return;
 
@@ -455,6 +559,7 @@ void qemu_fflush(QEMUFile *f)
 static void qemu_fill_buffer(QEMUFile *f)
 {
     int len;
+    int pending;
 
     if (!f->get_buffer)
         return;
@@ -462,10 +567,18 @@ static void qemu_fill_buffer(QEMUFile *f)
     if (f->is_write)
         abort();
 
-    len = f->get_buffer(f->opaque, f->buf, f->buf_offset, IO_BUF_SIZE);
+    /* What wasn't read yet stays in front of what is read now */
+    pending = f->buf_size - f->buf_index;
+    if (pending > 0 && f->buf_index > 0) {
+        memmove(f->buf, f->buf + f->buf_index, pending);
+    }
+    f->buf_index = 0;
+    f->buf_size = pending;
+
+    len = f->get_buffer(f->opaque, f->buf + pending, f->buf_offset,
+                        IO_BUF_SIZE - pending);
     if (len > 0) {
-        f->buf_index = 0;
-        f->buf_size = len;
+        f->buf_size += len;
         f->buf_offset += len;
     } else if (len != -EAGAIN)
         f->has_error = 1;
@@ -486,6 +599,24 @@ void qemu_file_put_notify(QEMUFile *f)
     f->put_buffer(f->opaque, NULL, 0, 0);
 }
 
+static void add_to_iovec(QEMUFile *f, const uint8_t *buf, int size)
+{
+    struct iovec *last = f->iovcnt > 0 ? &f->iov[f->iovcnt - 1] : NULL;
+
+    /* Data copied to buf one piece after the other goes out as one */
+    if (last && (uint8_t *)last->iov_base + last->iov_len == buf) {
+        last->iov_len += size;
+    } else {
+        f->iov[f->iovcnt].iov_base = (uint8_t *)buf;
+        f->iov[f->iovcnt].iov_len = size;
+        f->iovcnt++;
+    }
+
+    if (f->iovcnt >= MAX_IOV_SIZE) {
+        qemu_fflush_iov(f);
+    }
+}
+
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
 {
     int l;
@@ -503,6 +634,9 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
         memcpy(f->buf + f->buf_index, buf, l);
         f->is_write = 1;
         f->buf_index += l;
+        if (f->writev_buffer) {
+            add_to_iovec(f, f->buf + f->buf_index - l, l);
+        }
         buf += l;
         size -= l;
         if (f->buf_index >= IO_BUF_SIZE)
@@ -510,6 +644,33 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
     }
 }
 
+/*
+ * Writes buf without copying it when f can, in which case buf must stay
+ * valid until f is flushed.  Its contents may only change meanwhile if
+ * the stream is fine with either version, like guest RAM pages that are
+ * sent again once they are dirtied.
+ */
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size)
+{
+    if (!f->writev_buffer) {
+        qemu_put_buffer(f, buf, size);
+        return;
+    }
+
+    if (!f->has_error && f->is_write == 0 && f->buf_index > 0) {
+        fprintf(stderr,
+                "Attempted to write to buffer while read buffer is not empty\n");
+        abort();
+    }
+
+    if (f->has_error || size <= 0) {
+        return;
+    }
+
+    f->is_write = 1;
+    add_to_iovec(f, buf, size);
+}
+
 void qemu_put_byte(QEMUFile *f, int v)
 {
     if (!f->has_error && f->is_write == 0 && f->buf_index > 0) {
@@ -520,6 +681,9 @@ void qemu_put_byte(QEMUFile *f, int v)
 
     f->buf[f->buf_index++] = v;
     f->is_write = 1;
+    if (f->writev_buffer) {
+        add_to_iovec(f, f->buf + f->buf_index - 1, 1);
+    }
     if (f->buf_index >= IO_BUF_SIZE)
         qemu_fflush(f);
 }
@@ -534,6 +698,20 @@ int qemu_get_buffer(QEMUFile *f, uint8_t *buf, int size1)
     size = size1;
     while (size > 0) {
         l = f->buf_size - f->buf_index;
+        if (l == 0 && size >= IO_BUF_SIZE && f->get_buffer) {
+            /* Large reads go straight to the caller's buffer */
+            l = f->get_buffer(f->opaque, buf, f->buf_offset, size);
+            if (l <= 0) {
+                if (l != -EAGAIN) {
+                    f->has_error = 1;
+                }
+                break;
+            }
+            f->buf_offset += l;
+            buf += l;
+            size -= l;
+            continue;
+        }
         if (l == 0) {
             qemu_fill_buffer(f);
             l = f->buf_size - f->buf_index;
@@ -550,6 +728,37 @@ int qemu_get_buffer(QEMUFile *f, uint8_t *buf, int size1)
     return size1 - size;
 }
 
+/*
+ * Reads size bytes like qemu_get_buffer(), but when they can be made
+ * contiguous in the buffer of f, *buf is pointed at them instead of copying
+ * them to it.  They are only valid until the next read from f.
+ */
+int qemu_get_buffer_in_place(QEMUFile *f, uint8_t **buf, int size)
+{
+    int avail;
+
+    if (f->is_write)
+        abort();
+
+    if (size <= IO_BUF_SIZE) {
+        avail = f->buf_size - f->buf_index;
+        while (avail < size) {
+            qemu_fill_buffer(f);
+            if (f->buf_size - f->buf_index == avail) {
+                break;
+            }
+            avail = f->buf_size - f->buf_index;
+        }
+        if (avail >= size) {
+            *buf = f->buf + f->buf_index;
+            f->buf_index += size;
+            return size;
+        }
+    }
+
+    return qemu_get_buffer(f, *buf, size);
+}
+
 static int qemu_peek_byte(QEMUFile *f)
 {
     if (f->is_write)
@@ -578,6 +787,15 @@ int qemu_get_byte(QEMUFile *f)
 
 int64_t qemu_ftell(QEMUFile *f)
 {
+    int64_t queued = 0;
+    int i;
+
+    if (f->writev_buffer) {
+        for (i = 0; i < f->iovcnt; i++) {
+            queued += f->iov[i].iov_len;
+        }
+        return f->buf_offset + queued;
+    }
     return f->buf_offset - f->buf_size + f->buf_index;
 }
 
@@ -618,6 +836,13 @@ int64_t qemu_file_get_rate_limit(QEMUFile *f)
     return 0;
 }
 
+void qemu_file_credit_transfer(QEMUFile *f, int64_t size)
+{
+    if (f->credit_transfer) {
+        f->credit_transfer(f->opaque, size);
+    }
+}
+
 int64_t qemu_file_set_rate_limit(QEMUFile *f, int64_t new_rate)
 {
     /* any failed or completed migration keeps its state to allow probing of
@@ -1446,6 +1671,7 @@ static void vmstate_save(QEMUFile *f, SaveStateEntry *se)
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
+#define QEMU_VM_POSTCOPY_PACKAGE     0x06
 
 bool qemu_savevm_state_blocked(Monitor *mon)
 {
@@ -1532,30 +1758,17 @@ int qemu_savevm_state_iterate(Monitor *mon, QEMUFile *f)
         return 1;
 
     if (qemu_file_has_error(f)) {
-        qemu_savevm_state_cancel(mon, f);
         return -EIO;
     }
 
     return 0;
 }
 
-int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
+/* Writes the state of the devices, which ends the migration stream */
+static void qemu_savevm_state_devices(QEMUFile *f)
 {
     SaveStateEntry *se;
 
-    cpu_synchronize_all_states();
-
-    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
-        if (se->save_live_state == NULL)
-            continue;
-
-        /* Section type */
-        qemu_put_byte(f, QEMU_VM_SECTION_END);
-        qemu_put_be32(f, se->section_id);
-
-        se->save_live_state(mon, f, QEMU_VM_SECTION_END, se->opaque);
-    }
-
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
 
@@ -1578,6 +1791,49 @@ int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
     }
 
     qemu_put_byte(f, QEMU_VM_EOF);
+}
+
+int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
+{
+    SaveStateEntry *se;
+
+    cpu_synchronize_all_states();
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        if (se->save_live_state == NULL)
+            continue;
+
+        /* Section type */
+        qemu_put_byte(f, QEMU_VM_SECTION_END);
+        qemu_put_be32(f, se->section_id);
+
+        se->save_live_state(mon, f, QEMU_VM_SECTION_END, se->opaque);
+    }
+
+    if (migrate_postcopy_switching()) {
+        QEMUFileBuffer *b = qemu_mallocz(sizeof(*b));
+        QEMUFile *devf;
+
+        /*
+         * The destination reads the rest of RAM from f while it loads the
+         * devices, because loading them may touch pages that it doesn't
+         * have yet.  So the devices are sent in one piece.
+         */
+        devf = qemu_fopen_ops(b, buffer_put_buffer, NULL, buffer_close,
+                              NULL, NULL, NULL);
+        qemu_savevm_state_devices(devf);
+        qemu_fflush(devf);
+
+        qemu_put_byte(f, QEMU_VM_POSTCOPY_PACKAGE);
+        qemu_put_be32(f, b->size);
+        qemu_put_buffer(f, b->data, b->size);
+        qemu_fclose(devf);
+    } else {
+        qemu_savevm_state_devices(f);
+    }
+
+    /* Nothing that is queued may point to guest RAM once the guest runs */
+    qemu_fflush(f);
 
     if (qemu_file_has_error(f))
         return -EIO;
@@ -1615,8 +1871,10 @@ static int qemu_savevm_state(Monitor *mon, QEMUFile *f)
 
     do {
         ret = qemu_savevm_state_iterate(mon, f);
-        if (ret < 0)
+        if (ret < 0) {
+            qemu_savevm_state_cancel(mon, f);
             goto out;
+        }
     } while (ret == 0);
 
     ret = qemu_savevm_state_complete(mon, f);
@@ -1725,30 +1983,54 @@ typedef struct LoadStateEntry {
     int version_id;
 } LoadStateEntry;
 
-int qemu_loadvm_state(QEMUFile *f)
+typedef QLIST_HEAD(, LoadStateEntry) LoadStateEntryList;
+
+static int qemu_loadvm_state_main(QEMUFile *f,
+                                  LoadStateEntryList *loadvm_handlers);
+
+/*
+ * The rest of RAM follows the package in f, and is loaded while the devices
+ * are loaded from the package.
+ */
+static int loadvm_postcopy_package(QEMUFile *f,
+                                   LoadStateEntryList *loadvm_handlers)
 {
-    QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
-        QLIST_HEAD_INITIALIZER(loadvm_handlers);
-    LoadStateEntry *le, *new_le;
-    uint8_t section_type;
-    unsigned int v;
+    QEMUFileBuffer *b = qemu_mallocz(sizeof(*b));
+    QEMUFile *devf;
     int ret;
 
-    if (qemu_savevm_state_blocked(default_mon)) {
-        return -EINVAL;
+    b->size = qemu_get_be32(f);
+    b->data = qemu_malloc(b->size);
+    qemu_get_buffer(f, b->data, b->size);
+    devf = qemu_fopen_ops(b, NULL, buffer_get_buffer, buffer_close,
+                          NULL, NULL, NULL);
+
+    if (qemu_file_has_error(f)) {
+        ret = -EIO;
+    } else {
+        ret = postcopy_ram_incoming_listen(f);
+    }
+    if (ret == 0) {
+        ret = qemu_loadvm_state_main(devf, loadvm_handlers);
+    }
+    if (ret == 0 && qemu_file_has_error(devf)) {
+        ret = -EIO;
     }
 
-    v = qemu_get_be32(f);
-    if (v != QEMU_VM_FILE_MAGIC)
-        return -EINVAL;
+    qemu_fclose(devf);
+    return ret;
+}
 
-    v = qemu_get_be32(f);
-    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
-        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
-        return -ENOTSUP;
-    }
-    if (v != QEMU_VM_FILE_VERSION)
-        return -ENOTSUP;
+/*
+ * Returns 1 if the migration was switched to post-copy, the rest of f is
+ * loaded in the background then.
+ */
+static int qemu_loadvm_state_main(QEMUFile *f,
+                                  LoadStateEntryList *loadvm_handlers)
+{
+    LoadStateEntry *le;
+    uint8_t section_type;
+    int ret;
 
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
@@ -1771,16 +2053,14 @@ int qemu_loadvm_state(QEMUFile *f)
             se = find_se(idstr, instance_id);
             if (se == NULL) {
                 fprintf(stderr, "Unknown savevm section or instance '%s' %d\n", idstr, instance_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Validate version */
             if (version_id > se->version_id) {
                 fprintf(stderr, "savevm: unsupported version %d for '%s' v%d\n",
                         version_id, idstr, se->version_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Add entry */
@@ -1789,55 +2069,86 @@ int qemu_loadvm_state(QEMUFile *f)
             le->se = se;
             le->section_id = section_id;
             le->version_id = version_id;
-            QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
+            QLIST_INSERT_HEAD(loadvm_handlers, le, entry);
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state for instance 0x%x of device '%s'\n",
                         instance_id, idstr);
-                goto out;
+                return ret;
             }
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
             section_id = qemu_get_be32(f);
 
-            QLIST_FOREACH(le, &loadvm_handlers, entry) {
+            QLIST_FOREACH(le, loadvm_handlers, entry) {
                 if (le->section_id == section_id) {
                     break;
                 }
             }
             if (le == NULL) {
                 fprintf(stderr, "Unknown savevm section %d\n", section_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state section id %d\n",
                         section_id);
-                goto out;
+                return ret;
             }
             break;
+        case QEMU_VM_POSTCOPY_PACKAGE:
+            ret = loadvm_postcopy_package(f, loadvm_handlers);
+            return ret < 0 ? ret : 1;
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
         }
     }
 
-    cpu_synchronize_all_post_init();
+    return 0;
+}
 
-    ret = 0;
+int qemu_loadvm_state(QEMUFile *f)
+{
+    LoadStateEntryList loadvm_handlers =
+        QLIST_HEAD_INITIALIZER(loadvm_handlers);
+    LoadStateEntry *le, *new_le;
+    unsigned int v;
+    int ret;
+
+    if (qemu_savevm_state_blocked(default_mon)) {
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v != QEMU_VM_FILE_MAGIC)
+        return -EINVAL;
+
+    v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
+        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
+        return -ENOTSUP;
+    }
+    if (v != QEMU_VM_FILE_VERSION)
+        return -ENOTSUP;
+
+    ret = qemu_loadvm_state_main(f, &loadvm_handlers);
+    if (ret >= 0) {
+        cpu_synchronize_all_post_init();
+    }
 
-out:
     QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
         QLIST_REMOVE(le, entry);
         qemu_free(le);
     }
 
-    if (qemu_file_has_error(f))
+    ram_load_cleanup();
+
+    /* After a switch to post-copy, f belongs to the thread that loads RAM */
+    if (ret != 1 && qemu_file_has_error(f))
         ret = -EIO;
 
     return ret;
@@ -2052,7 +2363,7 @@ int load_vmstate(const char *name)
     }
 
     /* Flush all IO requests so they don't interfere with the new state.  */
-    qemu_aio_flush();
+    bdrv_drain_all();
 
     bs = NULL;
     while ((bs = bdrv_next(bs))) {
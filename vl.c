@@ -137,6 +137,10 @@ int main(int argc, char **argv)
 #include "block.h"
 #include "blockdev.h"
 #include "block-migration.h"
+#ifdef CONFIG_POSIX
+#include "block_int.h"
+#include "block/raw-posix-aio.h"
+#endif
 #include "dma.h"
 #include "audio/audio.h"
 #include "migration.h"
@@ -434,6 +438,23 @@ static void configure_rtc(QemuOpts *opts)
     }
 }
 
+static void configure_aio_pool(QemuOpts *opts)
+{
+#ifdef CONFIG_POSIX
+    int min = qemu_opt_get_number(opts, "min", 0);
+    int max = qemu_opt_get_number(opts, "max", 64);
+
+    if (paio_set_thread_limits(min, max) < 0) {
+        fprintf(stderr, "qemu: invalid aio-pool limits min=%d max=%d\n",
+                min, max);
+        exit(1);
+    }
+#else
+    fprintf(stderr, "qemu: -aio-pool is not supported on this host\n");
+    exit(1);
+#endif
+}
+
 /***********************************************************/
 /* Bluetooth support */
 static int nb_hcis;
@@ -2826,6 +2847,13 @@ int main(int argc, char **argv, char **envp)
                 }
                 configure_rtc(opts);
                 break;
+            case QEMU_OPTION_aio_pool:
+                opts = qemu_opts_parse(qemu_find_opts("aio-pool"), optarg, 0);
+                if (!opts) {
+                    exit(1);
+                }
+                configure_aio_pool(opts);
+                break;
             case QEMU_OPTION_tb_size:
                 tb_size = strtol(optarg, NULL, 0);
                 if (tb_size < 0)
@@ -0,0 +1,111 @@
+/*
+ * Delta encoding of pages for live migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "xbzrle.h"
+
+/* Lengths are at most a page, so they take at most three bytes */
+#define ULEB128_MAX_LEN 3
+
+static int uleb128_encode(uint8_t *out, uint32_t n)
+{
+    int len = 0;
+
+    do {
+        out[len] = n & 0x7f;
+        n >>= 7;
+        if (n) {
+            out[len] |= 0x80;
+        }
+        len++;
+    } while (n);
+
+    return len;
+}
+
+static int uleb128_decode(const uint8_t *in, int len, uint32_t *n)
+{
+    int i;
+
+    *n = 0;
+    for (i = 0; i < len && i < ULEB128_MAX_LEN; i++) {
+        *n |= (uint32_t)(in[i] & 0x7f) << (7 * i);
+        if (!(in[i] & 0x80)) {
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+int xbzrle_encode_buffer(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int slen, uint8_t *dst, int dlen)
+{
+    int i = 0, d = 0;
+
+    while (i < slen) {
+        int zrun_start = i, nzrun_start;
+
+        /* Unchanged bytes, compared a word at a time once aligned */
+        while (i < slen && old_buf[i] == new_buf[i]) {
+            i++;
+            if ((i & (sizeof(long) - 1)) == 0) {
+                while (i + sizeof(long) <= slen &&
+                       *(long *)(old_buf + i) == *(long *)(new_buf + i)) {
+                    i += sizeof(long);
+                }
+            }
+        }
+        if (i == slen) {
+            break;
+        }
+
+        nzrun_start = i;
+        while (i < slen && old_buf[i] != new_buf[i]) {
+            i++;
+        }
+
+        if (d + 2 * ULEB128_MAX_LEN + (i - nzrun_start) > dlen) {
+            return -1;
+        }
+        d += uleb128_encode(dst + d, nzrun_start - zrun_start);
+        d += uleb128_encode(dst + d, i - nzrun_start);
+        memcpy(dst + d, new_buf + nzrun_start, i - nzrun_start);
+        d += i - nzrun_start;
+    }
+
+    return d;
+}
+
+int xbzrle_decode_buffer(const uint8_t *src, int slen, uint8_t *dst, int dlen)
+{
+    int i = 0, d = 0;
+
+    while (i < slen) {
+        uint32_t count;
+        int ret;
+
+        ret = uleb128_decode(src + i, slen - i, &count);
+        if (ret < 0 || d + count > dlen) {
+            return -1;
+        }
+        i += ret;
+        d += count;
+
+        ret = uleb128_decode(src + i, slen - i, &count);
+        if (ret < 0 || count == 0 || d + count > dlen ||
+            i + ret + count > slen) {
+            return -1;
+        }
+        i += ret;
+        memcpy(dst + d, src + i, count);
+        i += count;
+        d += count;
+    }
+
+    return d;
+}
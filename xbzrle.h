@@ -0,0 +1,35 @@
+/*
+ * Delta encoding of pages for live migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef XBZRLE_H
+#define XBZRLE_H
+
+#include "qemu-common.h"
+
+/*
+ * The delta between two buffers of the same length is a sequence of
+ *
+ *   zrun length, nzrun length, nzrun bytes
+ *
+ * where a zrun is a run of unchanged bytes (zero in old ^ new) and a nzrun a
+ * run of changed bytes, which are sent as they are in the new buffer.  The
+ * lengths are encoded as ULEB128.  Trailing unchanged bytes are omitted.
+ *
+ * Returns the length of the delta, 0 if the buffers are equal or -1 if the
+ * delta doesn't fit in dlen bytes.
+ */
+int xbzrle_encode_buffer(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int slen, uint8_t *dst, int dlen);
+
+/*
+ * Applies a delta to dst, which must hold the old buffer.  Returns the
+ * number of bytes that the delta covers or -1 if it is invalid.
+ */
+int xbzrle_decode_buffer(const uint8_t *src, int slen, uint8_t *dst, int dlen);
+
+#endif